@@ -0,0 +1,313 @@
+#!/usr/bin/env python3
+"""
+Performance regression check for chirouter.
+
+Builds chirouter (Release) and runs:
+
+  - The data path microbenchmarks (chirouter_bench)
+  - A replay throughput scenario: chirouter_replay feeding a capture
+    through the routers of a topology as fast as it can, several times
+
+The results are written to a JSON file, and compared against a baseline
+(by default, scripts/perf_baseline.json, which is checked in). For each
+benchmark, the best (minimum) time per operation is compared:
+
+  - A benchmark regresses if it got slower by more than its threshold.
+    The threshold is the larger of --threshold and --noise-factor times
+    the noise of the benchmark (how much slower its median repetition
+    is than its fastest one, in the baseline or in this run, whichever
+    is larger), but never more than --max-threshold. Differences under
+    --min-delta-ns are ignored.
+  - Benchmarks that look like they regressed are run again (up to
+    --retries times), keeping their best result, before failing them.
+  - Allocations per operation, and the number of expected frames that
+    the replay produces, are deterministic, so any increase in the
+    former (or any change in the latter) is a failure.
+  - A benchmark that is in the baseline but not in the results (e.g.,
+    because it was renamed or removed) is a failure too, until the
+    baseline is recorded again.
+
+Exits with 0 if there are no regressions, 1 if there are, and 2 if the
+benchmarks could not be built or run.
+
+The baseline only makes sense on the machine it was recorded on. To
+record a baseline for your machine:
+
+  scripts/perf_check.py --update-baseline
+
+Everything runs locally (no network access is needed).
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import re
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+DEFAULT_BASELINE = os.path.join(ROOT, "scripts", "perf_baseline.json")
+
+REPLAY_SCENARIOS = [
+    # (name, topology, capture)
+    ("replay_3router", "topologies/3router.json", "src/finalized pcap tests/3router.pcap"),
+]
+
+
+class PerfError(Exception):
+    pass
+
+
+def run(cmd, **kwargs):
+    try:
+        return subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                              universal_newlines=True, **kwargs)
+    except OSError as e:
+        raise PerfError("Could not run {}: {}".format(cmd[0], e))
+
+
+def build(build_dir):
+    for cmd in (["cmake", "-S", ROOT, "-B", build_dir, "-DCMAKE_BUILD_TYPE=Release"],
+                ["cmake", "--build", build_dir, "-j{}".format(os.cpu_count() or 1),
+                 "--target", "chirouter_bench", "chirouter_replay"]):
+        p = run(cmd)
+        if p.returncode != 0:
+            raise PerfError("{} failed:\n{}".format(" ".join(cmd), p.stdout))
+
+
+def host_info():
+    model = platform.processor()
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    model = line.split(":", 1)[1].strip()
+                    break
+    except OSError:
+        pass
+
+    return {"machine": platform.machine(), "cpu": model, "cpus": os.cpu_count(),
+            "system": platform.system(), "release": platform.release()}
+
+
+def run_microbenchmarks(build_dir, args, names=None):
+    """Runs chirouter_bench (only the given benchmarks, if names is not
+    None), and returns its results, keyed by benchmark name"""
+    with tempfile.NamedTemporaryFile(suffix=".json") as tmp:
+        cmd = [os.path.join(build_dir, "chirouter_bench"), "-t", str(args.bench_time),
+               "-R", str(args.repetitions), "-j", tmp.name] + (names or [])
+        p = run(cmd)
+        if p.returncode != 0:
+            raise PerfError("chirouter_bench failed:\n{}".format(p.stdout))
+        with open(tmp.name) as f:
+            data = json.load(f)
+
+    results = {}
+    for b in data["benchmarks"]:
+        if names and b["name"] not in names:
+            continue
+        results[b["name"]] = {"ns_min": b["ns_min"], "ns_median": b["ns_median"], "ns_max": b["ns_max"],
+                              "allocs": b["allocs"], "unit": "ns/op"}
+    return results
+
+
+def run_replay(build_dir, args, scenario):
+    """Runs a replay scenario --repetitions times, and returns its results
+    (time per frame, and number of expected frames that were sent)"""
+    name, topology, capture = scenario
+    times = []
+    matching = None
+
+    for _ in range(args.repetitions):
+        cmd = [os.path.join(build_dir, "chirouter_replay"), "-t", os.path.join(ROOT, topology),
+               "-i", os.path.join(ROOT, capture), "-n", str(args.replay_loops)]
+        p = run(cmd)
+
+        # chirouter_replay exits with 2 if some expected frames were not
+        # sent, which is also checked against the baseline (see below)
+        m = re.search(r"([\d.]+) ns/frame", p.stdout)
+        e = re.search(r"expected frames:\s+(\d+) of", p.stdout)
+        if p.returncode not in (0, 2) or not m or not e:
+            raise PerfError("chirouter_replay failed:\n{}".format(p.stdout))
+
+        times.append(float(m.group(1)))
+        matching = int(e.group(1))
+
+    times.sort()
+    return {name: {"ns_min": times[0], "ns_median": times[len(times) // 2], "ns_max": times[-1],
+                   "expected_frames": matching, "unit": "ns/frame"}}
+
+
+def run_all(build_dir, args, names=None):
+    results = {}
+    bench_names = None if names is None else [n for n in names if not n.startswith("replay_")]
+
+    if bench_names is None or bench_names:
+        results.update(run_microbenchmarks(build_dir, args, bench_names))
+
+    for scenario in REPLAY_SCENARIOS:
+        if names is None or scenario[0] in names:
+            results.update(run_replay(build_dir, args, scenario))
+
+    return results
+
+
+def noise(result):
+    # The median, unlike the slowest repetition, is not thrown off by a
+    # single repetition that was interrupted
+    return (result["ns_median"] - result["ns_min"]) / result["ns_min"] if result["ns_min"] > 0 else 0
+
+
+def compare(name, base, cur, args):
+    """Compares a result against its baseline. Returns the status
+    ("ok", "faster", or "FAIL"), the relative change in time,
+    the allowed change, and a note explaining a failure."""
+    delta = cur["ns_min"] / base["ns_min"] - 1 if base["ns_min"] > 0 else 0
+    allowed = max(args.threshold, min(args.max_threshold, args.noise_factor * max(noise(base), noise(cur))))
+    abs_delta = cur["ns_min"] - base["ns_min"]
+
+    if cur.get("allocs", 0) > base.get("allocs", 0) + 0.005:
+        return "FAIL", delta, allowed, "allocs/op {:.2f} -> {:.2f}".format(base["allocs"], cur["allocs"])
+
+    if "expected_frames" in base and cur.get("expected_frames") != base["expected_frames"]:
+        return "FAIL", delta, allowed, "expected frames {} -> {}".format(base["expected_frames"],
+                                                                          cur.get("expected_frames"))
+
+    if delta > allowed and abs_delta > args.min_delta_ns:
+        return "FAIL", delta, allowed, "slower"
+
+    if delta < -allowed and -abs_delta > args.min_delta_ns:
+        return "faster", delta, allowed, ""
+
+    return "ok", delta, allowed, ""
+
+
+def report(baseline, results, args):
+    """Prints the comparison, and returns the number of regressions"""
+    failures = 0
+
+    print("{:<20} {:>12} {:>12} {:>9} {:>9}  {}".format("benchmark", "baseline", "current",
+                                                         "delta", "allowed", "status"))
+
+    for name in sorted(set(baseline) | set(results)):
+        if name not in results:
+            failures += 1
+            print("{:<20} {:>12.1f} {:>12} {:>9} {:>9}  {}".format(name, baseline[name]["ns_min"], "-",
+                                                                     "-", "-", "FAIL (missing)"))
+            continue
+        cur = results[name]
+        if name not in baseline:
+            print("{:<20} {:>12} {:>12.1f} {:>9} {:>9}  {}".format(name, "-", cur["ns_min"], "-", "-", "new"))
+            continue
+
+        status, delta, allowed, note = compare(name, baseline[name], cur, args)
+        if status == "FAIL":
+            failures += 1
+
+        print("{:<20} {:>12.1f} {:>12.1f} {:>+8.1f}% {:>8.1f}%  {}{}".format(
+            name, baseline[name]["ns_min"], cur["ns_min"], 100 * delta, 100 * allowed,
+            status, " (" + note + ")" if note else ""))
+
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Check chirouter for performance regressions.",
+                                     formatter_class=argparse.RawDescriptionHelpFormatter,
+                                     epilog=__doc__)
+    parser.add_argument("--build-dir", default=os.path.join(ROOT, "build-perf"),
+                        help="Where to build chirouter (default: build-perf)")
+    parser.add_argument("--no-build", action="store_true",
+                        help="Don't build chirouter (use the binaries already in --build-dir)")
+    parser.add_argument("--baseline", default=DEFAULT_BASELINE,
+                        help="Baseline to compare against (default: scripts/perf_baseline.json)")
+    parser.add_argument("--output", default="perf_results.json",
+                        help="Where to write the results (default: perf_results.json)")
+    parser.add_argument("--update-baseline", action="store_true",
+                        help="Write the results to the baseline instead of comparing them")
+    parser.add_argument("--threshold", type=float, default=0.10,
+                        help="Minimum relative slowdown that is a regression (default: 0.10)")
+    parser.add_argument("--noise-factor", type=float, default=2.0,
+                        help="The threshold is at least this many times the noise of a benchmark (default: 2)")
+    parser.add_argument("--max-threshold", type=float, default=0.30,
+                        help="Maximum relative slowdown that is allowed because of noise (default: 0.30)")
+    parser.add_argument("--min-delta-ns", type=float, default=2.0,
+                        help="Ignore differences smaller than this, in ns (default: 2)")
+    parser.add_argument("--retries", type=int, default=2,
+                        help="Times that apparently regressed benchmarks are run again (default: 2)")
+    parser.add_argument("--repetitions", type=int, default=5,
+                        help="Repetitions of each benchmark (default: 5)")
+    parser.add_argument("--bench-time", type=int, default=50,
+                        help="Time of each repetition of the microbenchmarks, in ms (default: 50)")
+    parser.add_argument("--replay-loops", type=int, default=2000,
+                        help="Times the capture is replayed in each repetition of a replay scenario (default: 2000)")
+    args = parser.parse_args()
+
+    try:
+        if not args.no_build:
+            print("Building in {}...".format(args.build_dir))
+            build(args.build_dir)
+
+        print("Running benchmarks...")
+        results = run_all(args.build_dir, args)
+
+        baseline = None
+        if not args.update_baseline:
+            try:
+                with open(args.baseline) as f:
+                    baseline = json.load(f)
+            except (OSError, ValueError) as e:
+                raise PerfError("Could not read the baseline {}: {}".format(args.baseline, e))
+
+            # Give benchmarks that look like they regressed another chance,
+            # keeping their best result (noise only ever makes things slower)
+            for _ in range(args.retries):
+                suspects = [name for name in results if name in baseline["results"] and
+                            compare(name, baseline["results"][name], results[name], args)[0] == "FAIL"]
+                if not suspects:
+                    break
+                print("Running again: {}".format(", ".join(suspects)))
+                for name, result in run_all(args.build_dir, args, suspects).items():
+                    if result["ns_min"] < results[name]["ns_min"]:
+                        results[name] = result
+    except PerfError as e:
+        print("ERROR: {}".format(e), file=sys.stderr)
+        return 2
+
+    data = {"created": datetime.datetime.now().isoformat(timespec="seconds"),
+            "host": host_info(),
+            "settings": {"repetitions": args.repetitions, "bench_time_ms": args.bench_time,
+                         "replay_loops": args.replay_loops},
+            "results": results}
+
+    path = args.baseline if args.update_baseline else args.output
+    with open(path, "w") as f:
+        json.dump(data, f, indent=2, sort_keys=True)
+        f.write("\n")
+    print("Results written to {}".format(path))
+
+    if args.update_baseline:
+        return 0
+
+    if baseline.get("host") != data["host"]:
+        print("WARNING: The baseline was recorded on a different machine ({}, {} CPUs)"
+              .format(baseline.get("host", {}).get("cpu"), baseline.get("host", {}).get("cpus")))
+
+    print()
+    failures = report(baseline["results"], results, args)
+    print()
+
+    if failures:
+        print("FAIL: {} benchmark(s) regressed".format(failures))
+        return 1
+
+    print("PASS: no regressions against {}".format(os.path.relpath(args.baseline)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
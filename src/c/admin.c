@@ -0,0 +1,647 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Admin socket
+ *
+ *  see admin.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "admin.h"
+#include "arp.h"
+#include "log.h"
+
+typedef void (*admin_cmd_fn)(FILE *out, chirouter_ctx_t *r, bool json);
+
+static void admin_cmd_routers(FILE *out, chirouter_ctx_t *r, bool json);
+static void admin_cmd_interfaces(FILE *out, chirouter_ctx_t *r, bool json);
+static void admin_cmd_routes(FILE *out, chirouter_ctx_t *r, bool json);
+static void admin_cmd_arp(FILE *out, chirouter_ctx_t *r, bool json);
+static void admin_cmd_pending(FILE *out, chirouter_ctx_t *r, bool json);
+static void admin_cmd_stats(FILE *out, chirouter_ctx_t *r, bool json);
+static void admin_cmd_latency(FILE *out, chirouter_ctx_t *r, bool json);
+
+static const struct
+{
+    const char *name;
+    admin_cmd_fn fn;
+    const char *help;
+} admin_cmds[] =
+{
+    {"routers", admin_cmd_routers, "Summary of each router"},
+    {"interfaces", admin_cmd_interfaces, "Interfaces of each router"},
+    {"routes", admin_cmd_routes, "Routing table of each router"},
+    {"arp", admin_cmd_arp, "ARP cache of each router"},
+    {"pending", admin_cmd_pending, "Pending ARP requests of each router"},
+    {"stats", admin_cmd_stats, "Statistics counters of each router"},
+    {"latency", admin_cmd_latency, "Latency percentiles of each router"},
+};
+
+#define NUM_ADMIN_CMDS (sizeof(admin_cmds) / sizeof(admin_cmds[0]))
+
+
+/* Writes a string as a JSON string literal */
+static void admin_json_str(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for(; *s; s++)
+    {
+        if(*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if((unsigned char) *s < 0x20)
+            fprintf(out, "\\u%04x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+
+/* Writes the start of a router's object (JSON) or section (text) */
+static void admin_router_begin(FILE *out, chirouter_ctx_t *r, bool json)
+{
+    if(json)
+    {
+        fprintf(out, "{\"router\":");
+        admin_json_str(out, r->name);
+    }
+    else
+        fprintf(out, "ROUTER %s\n", r->name);
+}
+
+
+/* Formats a MAC address */
+static char *admin_mac(const uint8_t *mac, char *buf)
+{
+    sprintf(buf, "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return buf;
+}
+
+
+/* Formats an IP address */
+static char *admin_ip(struct in_addr ip, char *buf)
+{
+    inet_ntop(AF_INET, &ip, buf, INET_ADDRSTRLEN);
+    return buf;
+}
+
+
+static void admin_cmd_routers(FILE *out, chirouter_ctx_t *r, bool json)
+{
+    chirouter_arpcache_entry_t arp[ARPCACHE_SIZE];
+    chirouter_pending_arp_info_t *pending;
+    int num_arp, num_pending;
+
+    num_arp = chirouter_arp_cache_snapshot(r, arp);
+    num_pending = chirouter_arp_pending_req_snapshot(r, &pending);
+    if(num_pending >= 0)
+        free(pending);
+
+    if(json)
+    {
+        admin_router_begin(out, r, json);
+        fprintf(out, ",\"interfaces\":%u,\"routes\":%u,\"arp_entries\":%d,\"pending_arp_requests\":%d,\"rss_queues\":%u}",
+                     r->num_interfaces, r->num_rtable_entries, num_arp, num_pending, r->num_rss_queues);
+    }
+    else
+        fprintf(out, "%-10s interfaces %-4u routes %-6u arp entries %-4d pending ARP requests %-4d RSS queues %u\n",
+                     r->name, r->num_interfaces, r->num_rtable_entries, num_arp, num_pending, r->num_rss_queues);
+}
+
+
+static void admin_cmd_interfaces(FILE *out, chirouter_ctx_t *r, bool json)
+{
+    char mac[18], ip[INET_ADDRSTRLEN];
+
+    admin_router_begin(out, r, json);
+    if(json)
+        fprintf(out, ",\"interfaces\":[");
+    else
+        fprintf(out, "%-16s%-20s%-16s\n", "Iface", "MAC", "IP");
+
+    for(int i=0; i < r->num_interfaces; i++)
+    {
+        chirouter_interface_t *iface = &r->interfaces[i];
+
+        if(json)
+        {
+            fprintf(out, "%s{\"name\":", i ? "," : "");
+            admin_json_str(out, iface->name);
+            fprintf(out, ",\"mac\":\"%s\",\"ip\":\"%s\"}", admin_mac(iface->mac, mac), admin_ip(iface->ip, ip));
+        }
+        else
+            fprintf(out, "%-16s%-20s%-16s\n", iface->name, admin_mac(iface->mac, mac), admin_ip(iface->ip, ip));
+    }
+
+    if(json)
+        fprintf(out, "]}");
+}
+
+
+static void admin_cmd_routes(FILE *out, chirouter_ctx_t *r, bool json)
+{
+    char dest[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN], mask[INET_ADDRSTRLEN];
+
+    admin_router_begin(out, r, json);
+    if(json)
+        fprintf(out, ",\"routes\":[");
+    else
+        fprintf(out, "%-16s%-16s%-16s%-16s\n", "Destination", "Gateway", "Mask", "Iface");
+
+    /* The routing table is not modified while the router is running */
+    for(uint32_t i=0; i < r->num_rtable_entries; i++)
+    {
+        chirouter_rtable_entry_t *entry = &r->routing_table[i];
+
+        admin_ip(entry->dest, dest);
+        admin_ip(entry->gw, gw);
+        admin_ip(entry->mask, mask);
+
+        if(json)
+        {
+            fprintf(out, "%s{\"dest\":\"%s\",\"gw\":\"%s\",\"mask\":\"%s\",\"iface\":", i ? "," : "", dest, gw, mask);
+            admin_json_str(out, entry->interface->name);
+            fprintf(out, "}");
+        }
+        else
+            fprintf(out, "%-16s%-16s%-16s%-16s\n", dest, gw, mask, entry->interface->name);
+    }
+
+    if(json)
+        fprintf(out, "]}");
+}
+
+
+static void admin_cmd_arp(FILE *out, chirouter_ctx_t *r, bool json)
+{
+    chirouter_arpcache_entry_t arp[ARPCACHE_SIZE];
+    char mac[18], ip[INET_ADDRSTRLEN];
+    uint64_t now = chirouter_clock_now(r->clock);
+    int n;
+
+    n = chirouter_arp_cache_snapshot(r, arp);
+
+    admin_router_begin(out, r, json);
+    if(json)
+        fprintf(out, ",\"arp\":[");
+    else
+        fprintf(out, "%-16s%-20s%s\n", "IP", "MAC", "Age (s)");
+
+    for(int i=0; i < n; i++)
+    {
+        if(json)
+            fprintf(out, "%s{\"ip\":\"%s\",\"mac\":\"%s\",\"age\":%.0f}", i ? "," : "",
+                         admin_ip(arp[i].ip, ip), admin_mac(arp[i].mac, mac), (now - arp[i].time_added) / 1e9);
+        else
+            fprintf(out, "%-16s%-20s%.0f\n", admin_ip(arp[i].ip, ip), admin_mac(arp[i].mac, mac), (now - arp[i].time_added) / 1e9);
+    }
+
+    if(json)
+        fprintf(out, "]}");
+}
+
+
+static void admin_cmd_pending(FILE *out, chirouter_ctx_t *r, bool json)
+{
+    chirouter_pending_arp_info_t *pending;
+    char ip[INET_ADDRSTRLEN];
+    uint64_t now = chirouter_clock_now(r->clock);
+    int n;
+
+    n = chirouter_arp_pending_req_snapshot(r, &pending);
+    if(n < 0)
+        n = 0;
+
+    admin_router_begin(out, r, json);
+    if(json)
+        fprintf(out, ",\"pending\":[");
+    else
+        fprintf(out, "%-16s%-16s%-12s%-16s%s\n", "IP", "Iface", "Times sent", "Last sent (s)", "Withheld frames");
+
+    for(int i=0; i < n; i++)
+    {
+        if(json)
+        {
+            fprintf(out, "%s{\"ip\":\"%s\",\"iface\":", i ? "," : "", admin_ip(pending[i].ip, ip));
+            admin_json_str(out, pending[i].out_interface->name);
+            fprintf(out, ",\"times_sent\":%u,\"last_sent\":%.0f,\"withheld_frames\":%u}",
+                         pending[i].times_sent, (now - pending[i].last_sent) / 1e9, pending[i].num_withheld);
+        }
+        else
+            fprintf(out, "%-16s%-16s%-12u%-16.0f%u\n", admin_ip(pending[i].ip, ip), pending[i].out_interface->name,
+                         pending[i].times_sent, (now - pending[i].last_sent) / 1e9, pending[i].num_withheld);
+    }
+
+    if(n > 0)
+        free(pending);
+
+    if(json)
+        fprintf(out, "]}");
+}
+
+
+/* Writes a set of counters. Interfaces only use a few of the
+ * counters, so only the non-zero ones are written for them. */
+static void admin_counters(FILE *out, chirouter_stats_t *stats, bool json, bool skip_zero, const char *indent)
+{
+    uint64_t values[CHIROUTER_STAT_MAX];
+    bool first = true;
+
+    chirouter_stats_read(stats, values);
+
+    for(int i=0; i < CHIROUTER_STAT_MAX; i++)
+    {
+        if(skip_zero && values[i] == 0)
+            continue;
+
+        if(json)
+            fprintf(out, "%s\"%s\":%lu", first ? "" : ",", chirouter_stat_name(i), values[i]);
+        else
+            fprintf(out, "%s%-24s %lu\n", indent, chirouter_stat_name(i), values[i]);
+        first = false;
+    }
+}
+
+
+static void admin_cmd_stats(FILE *out, chirouter_ctx_t *r, bool json)
+{
+    admin_router_begin(out, r, json);
+    if(json)
+        fprintf(out, ",\"counters\":{");
+    admin_counters(out, &r->stats, json, false, "  ");
+    if(json)
+        fprintf(out, "},\"interfaces\":[");
+
+    for(int i=0; i < r->num_interfaces; i++)
+    {
+        chirouter_interface_t *iface = &r->interfaces[i];
+
+        if(json)
+        {
+            fprintf(out, "%s{\"name\":", i ? "," : "");
+            admin_json_str(out, iface->name);
+            fprintf(out, ",\"counters\":{");
+        }
+        else
+            fprintf(out, "  %s\n", iface->name);
+
+        admin_counters(out, &iface->stats, json, true, "    ");
+
+        if(json)
+            fprintf(out, "}}");
+    }
+
+    if(json)
+        fprintf(out, "]}");
+}
+
+
+static void admin_cmd_latency(FILE *out, chirouter_ctx_t *r, bool json)
+{
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    static const char *percentile_names[] = {"p50", "p90", "p99", "p99.9"};
+    chirouter_hist_t *hist;
+    bool first = true;
+
+    if(!json)
+    {
+        chirouter_latency_dump(out, r->name, &r->latency);
+        return;
+    }
+
+    admin_router_begin(out, r, json);
+    fprintf(out, ",\"sample_rate\":%u,\"stages\":{", chirouter_latency_sample_rate);
+
+    hist = malloc(sizeof(chirouter_hist_t));
+    if(hist != NULL && r->latency.stages != NULL)
+    {
+        for(int s=0; s < CHIROUTER_STAGE_MAX; s++)
+        {
+            chirouter_latency_snapshot(&r->latency, s, hist);
+
+            fprintf(out, "%s\"%s\":{\"count\":%lu", first ? "" : ",", chirouter_stage_name(s), hist->count);
+            for(int p=0; p < 4; p++)
+                fprintf(out, ",\"%s\":%lu", percentile_names[p], chirouter_latency_percentile(hist, percentiles[p]));
+            fprintf(out, ",\"max\":%lu}", hist->max);
+            first = false;
+        }
+    }
+    free(hist);
+
+    fprintf(out, "}}");
+}
+
+
+/* Writes an error message as the response */
+static int admin_error(FILE *out, bool json, const char *msg, const char *arg)
+{
+    if(json)
+    {
+        char buf[ADMIN_MAX_REQUEST_LEN + 64];
+
+        snprintf(buf, sizeof(buf), "%s%s", msg, arg);
+        fprintf(out, "{\"error\":");
+        admin_json_str(out, buf);
+        fprintf(out, "}\n");
+    }
+    else
+        fprintf(out, "ERROR: %s%s\n", msg, arg);
+
+    return -1;
+}
+
+
+/* See admin.h */
+int chirouter_admin_process_request(server_ctx_t *server, char *request, FILE *out)
+{
+    char *saveptr, *cmd, *router;
+    bool json = false, found = false, first = true;
+    admin_cmd_fn fn = NULL;
+    const char *cmd_name = NULL;
+
+    cmd = strtok_r(request, " \t\r\n", &saveptr);
+    if(cmd && !strcmp(cmd, "json"))
+    {
+        json = true;
+        cmd = strtok_r(NULL, " \t\r\n", &saveptr);
+    }
+    router = strtok_r(NULL, " \t\r\n", &saveptr);
+
+    if(!cmd || !strcmp(cmd, "help"))
+    {
+        for(size_t i=0; i < NUM_ADMIN_CMDS; i++)
+            fprintf(out, "%-12s %s\n", admin_cmds[i].name, admin_cmds[i].help);
+        return 0;
+    }
+
+    for(size_t i=0; i < NUM_ADMIN_CMDS; i++)
+        if(!strcmp(cmd, admin_cmds[i].name))
+        {
+            fn = admin_cmds[i].fn;
+            cmd_name = admin_cmds[i].name;
+        }
+
+    if(!fn)
+        return admin_error(out, json, "Unknown command: ", cmd);
+
+    pthread_mutex_lock(&server->lock_routers);
+
+    if(server->state != RUNNING)
+    {
+        pthread_mutex_unlock(&server->lock_routers);
+        return admin_error(out, json, "Routers are not running", "");
+    }
+
+    /* The router is looked up before anything is written, so an
+     * unknown router gets an error instead of an empty response */
+    for(int i=0; router && !found && i < server->num_routers; i++)
+        found = !strcmp(router, server->routers[i].name);
+
+    if(router && !found)
+    {
+        pthread_mutex_unlock(&server->lock_routers);
+        return admin_error(out, json, "No such router: ", router);
+    }
+
+    if(json)
+        fprintf(out, "{\"%s\":[", cmd_name);
+
+    for(int i=0; i < server->num_routers; i++)
+    {
+        chirouter_ctx_t *r = &server->routers[i];
+
+        if(router && strcmp(router, r->name))
+            continue;
+
+        if(json && !first)
+            fprintf(out, ",");
+        else if(!json && !first && fn != admin_cmd_routers)
+            fprintf(out, "\n");
+
+        fn(out, r, json);
+        first = false;
+    }
+
+    pthread_mutex_unlock(&server->lock_routers);
+
+    if(json)
+        fprintf(out, "]}\n");
+
+    return 0;
+}
+
+
+/* Reads a request from a client (up to the first newline, or until the
+ * client shuts down its end of the connection) */
+static int admin_read_request(int client, char *request)
+{
+    size_t len = 0;
+    ssize_t nbytes;
+
+    while(len < ADMIN_MAX_REQUEST_LEN)
+    {
+        nbytes = recv(client, request + len, ADMIN_MAX_REQUEST_LEN - len, 0);
+        if(nbytes == -1 && errno == EINTR)
+            continue;
+        if(nbytes <= 0)
+            break;
+
+        len += nbytes;
+        if(memchr(request, '\n', len))
+            break;
+    }
+
+    request[len] = '\0';
+    return len > 0 ? 0 : -1;
+}
+
+
+/* Sends a whole buffer to a client */
+static void admin_send(int client, const char *buf, size_t len)
+{
+    ssize_t nbytes;
+
+    while(len > 0)
+    {
+        nbytes = send(client, buf, len, MSG_NOSIGNAL);
+        if(nbytes == -1 && errno == EINTR)
+            continue;
+        if(nbytes <= 0)
+            return;
+
+        buf += nbytes;
+        len -= nbytes;
+    }
+}
+
+
+/* Admin thread function. Serves one client at a time. */
+static void* chirouter_admin_thread(void *args)
+{
+    chirouter_admin_t *admin = (chirouter_admin_t *) args;
+    struct timeval timeout = { .tv_sec = ADMIN_CLIENT_TIMEOUT, .tv_usec = 0 };
+    char request[ADMIN_MAX_REQUEST_LEN + 1];
+    char *response;
+    size_t response_len;
+    FILE *out;
+    int client;
+
+    while(1)
+    {
+        client = accept(admin->socket, NULL, NULL);
+        if(client == -1)
+        {
+            if(__atomic_load_n(&admin->stop, __ATOMIC_ACQUIRE))
+                break;
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            chilog(ERROR, "Could not accept() connection on admin socket");
+            break;
+        }
+
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        if(admin_read_request(client, request) == 0)
+        {
+            /* Build the whole response before sending it, so that
+             * no locks are held while waiting for the client */
+            out = open_memstream(&response, &response_len);
+            if(out)
+            {
+                chilog(DEBUG, "Admin request: %.*s", (int) strcspn(request, "\r\n"), request);
+                chirouter_admin_process_request(admin->server, request, out);
+                fclose(out);
+                admin_send(client, response, response_len);
+                free(response);
+            }
+        }
+
+        close(client);
+    }
+
+    return NULL;
+}
+
+
+/* See admin.h */
+chirouter_admin_t *chirouter_admin_start(server_ctx_t *server, const char *path)
+{
+    struct sockaddr_un addr;
+    chirouter_admin_t *admin;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        chilog(ERROR, "Admin socket path is too long: %s", path);
+        return NULL;
+    }
+
+    admin = calloc(1, sizeof(chirouter_admin_t));
+    if(!admin)
+        return NULL;
+
+    admin->server = server;
+    admin->path = strdup(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if((admin->socket = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        chilog(ERROR, "Could not create admin socket");
+        free(admin->path);
+        free(admin);
+        return NULL;
+    }
+
+    unlink(path);
+
+    if(bind(admin->socket, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(admin->socket, 5) == -1)
+    {
+        chilog(ERROR, "Could not bind admin socket to %s", path);
+        close(admin->socket);
+        free(admin->path);
+        free(admin);
+        return NULL;
+    }
+
+    if(pthread_create(&admin->thread, NULL, chirouter_admin_thread, admin) != 0)
+    {
+        chilog(ERROR, "Could not create admin thread");
+        close(admin->socket);
+        unlink(path);
+        free(admin->path);
+        free(admin);
+        return NULL;
+    }
+
+    chilog(INFO, "Admin socket listening on %s", path);
+
+    return admin;
+}
+
+
+/* See admin.h */
+int chirouter_admin_stop(chirouter_admin_t *admin)
+{
+    if(!admin)
+        return 0;
+
+    /* Shutting down the socket makes accept() return */
+    __atomic_store_n(&admin->stop, true, __ATOMIC_RELEASE);
+    shutdown(admin->socket, SHUT_RDWR);
+
+    if(pthread_join(admin->thread, NULL) != 0)
+        return -1;
+
+    close(admin->socket);
+    unlink(admin->path);
+    free(admin->path);
+    free(admin);
+
+    return 0;
+}
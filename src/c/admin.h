@@ -0,0 +1,140 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Admin socket
+ *
+ *  If enabled, chirouter listens on a Unix socket for administrative
+ *  requests, which are served by a separate thread. A request is a
+ *  single line with a command, optionally followed by the name of a
+ *  router (if omitted, the command applies to all the routers):
+ *
+ *    [json] COMMAND [ROUTER]
+ *
+ *  The response is written back as plain text (or as a single JSON
+ *  object, if the request starts with "json"), and the connection is
+ *  then closed. The commands are:
+ *
+ *  - routers: Summary of each router.
+ *  - interfaces: Interfaces of each router.
+ *  - routes: Routing table of each router.
+ *  - arp: ARP cache of each router.
+ *  - pending: Pending ARP requests (and number of withheld frames).
+ *  - stats: Statistics counters of each router, and its interfaces.
+ *  - latency: Latency percentiles of each router, by stage.
+ *  - help: List of commands.
+ *
+ *  Responses are built from copies of the router data structures that
+ *  are taken without pausing the processing of frames: the routing
+ *  table doesn't change while the router is running, the ARP cache is
+ *  copied through its sequence counter, and the pending ARP requests
+ *  are copied with lock_arp held only for as long as the copy takes.
+ *  The response is fully built before it is sent, so a slow client
+ *  never holds any lock.
+ *
+ *  The chirouter_admin tool can be used to send requests.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef ADMIN_H_
+#define ADMIN_H_
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "server.h"
+
+/* Socket the chirouter_admin tool connects to by default */
+#define ADMIN_DEFAULT_SOCKET "/tmp/chirouter.sock"
+
+/* Maximum length of a request */
+#define ADMIN_MAX_REQUEST_LEN (256)
+
+/* Time (in seconds) that a client has to send its request,
+ * and to read the response */
+#define ADMIN_CLIENT_TIMEOUT (5)
+
+
+/* The admin socket, and the thread serving it */
+typedef struct chirouter_admin
+{
+    server_ctx_t *server;
+    char *path;
+    int socket;
+    bool stop;
+    pthread_t thread;
+} chirouter_admin_t;
+
+
+/*
+ * chirouter_admin_start - Listen on the admin socket and start serving requests
+ *
+ * If a socket already exists at the given path, it is replaced.
+ *
+ * server: Server context
+ *
+ * path: Path of the Unix socket
+ *
+ * Returns: The admin socket, or NULL if an error happens.
+ */
+chirouter_admin_t *chirouter_admin_start(server_ctx_t *server, const char *path);
+
+
+/*
+ * chirouter_admin_stop - Stop serving requests, and remove the admin socket
+ *
+ * admin: Admin socket (can be NULL, in which case nothing is done)
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_admin_stop(chirouter_admin_t *admin);
+
+
+/*
+ * chirouter_admin_process_request - Process a single request
+ *
+ * Can be called from any thread.
+ *
+ * server: Server context
+ *
+ * request: Request (a NULL-terminated string, without the newline)
+ *
+ * out: File where the response will be written
+ *
+ * Returns: 0 on success, -1 if the request is invalid (in which case
+ *          an error message is written as the response).
+ */
+int chirouter_admin_process_request(server_ctx_t *server, char *request, FILE *out);
+
+#endif /* ADMIN_H_ */
@@ -74,10 +74,20 @@
 #include "chirouter.h"
 #include "utils.h"
 #include "utlist.h"
+#include "probes.h"
 
 #define ARP_REQ_KEEP (0)
 #define ARP_REQ_REMOVE (1)
 
+/* Start/end a modification of the ARP cache (see arpcache_seq in chirouter.h).
+ * The lock_arp mutex must be held. */
+#define ARPCACHE_WRITE_BEGIN(ctx) do { \
+        __atomic_store_n(&(ctx)->arpcache_seq, (ctx)->arpcache_seq + 1, __ATOMIC_RELAXED); \
+        __atomic_thread_fence(__ATOMIC_RELEASE); \
+    } while(0)
+#define ARPCACHE_WRITE_END(ctx) \
+        __atomic_store_n(&(ctx)->arpcache_seq, (ctx)->arpcache_seq + 1, __ATOMIC_RELEASE)
+
 /* ICMP send frame function */
 void chirouter_send_icmp(chirouter_ctx_t *ctx, uint8_t type, uint8_t code, 
                                                 ethernet_frame_t *frame);
@@ -107,8 +117,10 @@ void chirouter_send_arp_message(chirouter_ctx_t *ctx,
         arp_packet->spa = in_addr_to_uint32(out_interface->ip);
         memcpy(arp_packet->tha, "\x00\x00\x00\x00\x00\x00", ETHER_ADDR_LEN);
         arp_packet->tpa = dst_ip;
+        CHIROUTER_PROBE3(arp__request, ctx->name, out_interface->name, dst_ip);
         chirouter_send_frame(ctx, out_interface, raw, 
                     ((sizeof (ethhdr_t)) + (sizeof (arp_packet_t))));
+        chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_ARP_REQUESTS_SENT);
         chilog(DEBUG, "[ARP MESSAGE]: ARP REQUEST SENT");
     }
     else if (type == ARP_OP_REPLY)
@@ -122,6 +134,7 @@ void chirouter_send_arp_message(chirouter_ctx_t *ctx,
         arp_packet->tpa = dst_ip;
         chirouter_send_frame(ctx, out_interface, raw, 
                     ((sizeof (ethhdr_t)) + (sizeof (arp_packet_t))));
+        chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_ARP_REPLIES_SENT);
         chilog(DEBUG, "[ARP MESSAGE]: ARP REPLY SENT");
     }
     else
@@ -161,16 +174,20 @@ int chirouter_arp_process_pending_req(chirouter_ctx_t *ctx,
                                     NULL, in_addr_to_uint32(pending_req->ip), 
                                     ARP_OP_REQUEST);
         pending_req->times_sent++;
-        pending_req->last_sent = time(NULL);
+        pending_req->last_sent = chirouter_clock_now(ctx->clock);
         return ARP_REQ_KEEP;
     }
     else 
     {
         // send ICMP Host Unreachable for each of withheld frames
         withheld_frame_t *elt;
+        int num_frames;
+        DL_COUNT(pending_req->withheld_frames, elt, num_frames);
+        CHIROUTER_PROBE3(arp__timeout, ctx->name, in_addr_to_uint32(pending_req->ip), num_frames);
         DL_FOREACH(pending_req->withheld_frames, elt)
         {
             if (elt != NULL) {
+                chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_DROP_HOST_UNREACHABLE);
                 chirouter_send_icmp(ctx, ICMPTYPE_DEST_UNREACHABLE, 
                                     ICMPCODE_DEST_HOST_UNREACHABLE, 
                                     elt->frame);
@@ -200,17 +217,82 @@ chirouter_arpcache_entry_t* chirouter_arp_cache_lookup(chirouter_ctx_t *ctx, str
 }
 
 
+/* See arp.h */
+bool chirouter_arp_cache_lookup_mac(chirouter_ctx_t *ctx, uint32_t ip, uint8_t *mac)
+{
+    uint32_t seq;
+    bool found;
+
+    do
+    {
+        seq = __atomic_load_n(&ctx->arpcache_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        found = false;
+        for(int i=0; i < ARPCACHE_SIZE; i++)
+        {
+            if(ctx->arpcache[i].valid && ctx->arpcache[i].ip.s_addr == ip)
+            {
+                memcpy(mac, ctx->arpcache[i].mac, ETHER_ADDR_LEN);
+                found = true;
+                break;
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&ctx->arpcache_seq, __ATOMIC_RELAXED));
+
+    return found;
+}
+
+
+/* See arp.h */
+int chirouter_arp_cache_snapshot(chirouter_ctx_t *ctx, chirouter_arpcache_entry_t *entries)
+{
+    uint32_t seq;
+    int n;
+
+    do
+    {
+        seq = __atomic_load_n(&ctx->arpcache_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        n = 0;
+        for(int i=0; i < ARPCACHE_SIZE; i++)
+            if(ctx->arpcache[i].valid)
+                entries[n++] = ctx->arpcache[i];
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&ctx->arpcache_seq, __ATOMIC_RELAXED));
+
+    return n;
+}
+
+
 /* See arp.h */
 int chirouter_arp_cache_add(chirouter_ctx_t *ctx, struct in_addr *ip, uint8_t *mac)
 {
+    /* Read before the write section, so readers retry as little as possible */
+    uint64_t now = chirouter_clock_now(ctx->clock);
+
     for(int i=0; i < ARPCACHE_SIZE; i++)
     {
         if(!ctx->arpcache[i].valid)
         {
-            ctx->arpcache[i].valid = true;
+            ARPCACHE_WRITE_BEGIN(ctx);
             memcpy(&ctx->arpcache[i].ip, ip, sizeof(struct in_addr));
             memcpy(ctx->arpcache[i].mac, mac, ETHER_ADDR_LEN);
-            ctx->arpcache[i].time_added = time(NULL);
+            ctx->arpcache[i].time_added = now;
+            ctx->arpcache[i].valid = true;
+            ARPCACHE_WRITE_END(ctx);
 
             return 0;
         }
@@ -220,6 +302,29 @@ int chirouter_arp_cache_add(chirouter_ctx_t *ctx, struct in_addr *ip, uint8_t *m
 }
 
 
+/* See arp.h */
+void chirouter_arp_flush(chirouter_ctx_t *ctx)
+{
+    chirouter_pending_arp_req_t *elt, *tmp;
+
+    /* Writers of the cache (and of the pending requests) must hold
+     * lock_arp, so they can't race with the forwarding path */
+    pthread_mutex_lock(&ctx->lock_arp);
+
+    ARPCACHE_WRITE_BEGIN(ctx);
+    for(int i=0; i < ARPCACHE_SIZE; i++)
+        ctx->arpcache[i].valid = false;
+    ARPCACHE_WRITE_END(ctx);
+
+    DL_FOREACH_SAFE(ctx->pending_arp_reqs, elt, tmp)
+    {
+        chirouter_arp_pending_req_remove(ctx, elt);
+    }
+
+    pthread_mutex_unlock(&ctx->lock_arp);
+}
+
+
 /* See arp.h */
 chirouter_pending_arp_req_t* chirouter_arp_pending_req_lookup(chirouter_ctx_t *ctx, struct in_addr *ip)
 {
@@ -243,11 +348,12 @@ chirouter_pending_arp_req_t* chirouter_arp_pending_req_add(chirouter_ctx_t *ctx,
 
     memcpy(&pending_req->ip, ip, sizeof(struct in_addr));
     pending_req->times_sent = 0;
-    pending_req->last_sent = time(NULL);
+    pending_req->last_sent = chirouter_clock_now(ctx->clock);
     pending_req->out_interface = iface;
     pending_req->withheld_frames = NULL;
 
     DL_APPEND(ctx->pending_arp_reqs, pending_req);
+    __atomic_store_n(&ctx->num_pending_arp_reqs, ctx->num_pending_arp_reqs + 1, __ATOMIC_RELAXED);
 
     return pending_req;
 }
@@ -265,6 +371,7 @@ int chirouter_arp_pending_req_add_frame(chirouter_ctx_t *ctx, chirouter_pending_
     withheld->frame->in_interface = frame->in_interface;
 
     DL_APPEND(pending_req->withheld_frames, withheld);
+    __atomic_store_n(&ctx->num_withheld_frames, ctx->num_withheld_frames + 1, __ATOMIC_RELAXED);
 
     return 0;
 }
@@ -288,44 +395,132 @@ int chirouter_arp_pending_req_free_frames(chirouter_pending_arp_req_t *pending_r
 
 
 /* See arp.h */
-void* chirouter_arp_process(void *args)
+int chirouter_arp_pending_req_remove(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req)
 {
-    chirouter_ctx_t *ctx = (chirouter_ctx_t *) args;
+    withheld_frame_t *elt;
+    uint32_t num_withheld;
 
-    while (1) {
-        sleep(1.0);
+    DL_COUNT(pending_req->withheld_frames, elt, num_withheld);
 
-        pthread_mutex_lock(&(ctx->lock_arp));
+    chirouter_arp_pending_req_free_frames(pending_req);
+    DL_DELETE(ctx->pending_arp_reqs, pending_req);
+    free(pending_req);
 
-        /* Purge the cache */
-        time_t curtime = time(NULL);
-        for(int i = 0; i < ARPCACHE_SIZE; i++)
-        {
-            chirouter_arpcache_entry_t *cache_entry = &ctx->arpcache[i];
-            double entry_age = difftime(curtime, cache_entry->time_added);
+    __atomic_store_n(&ctx->num_pending_arp_reqs, ctx->num_pending_arp_reqs - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&ctx->num_withheld_frames, ctx->num_withheld_frames - num_withheld, __ATOMIC_RELAXED);
 
-            if ((cache_entry->valid) && (entry_age > ARPCACHE_ENTRY_TIMEOUT)) {
-                cache_entry->valid = false;
-            }
+    return 0;
+}
+
+
+/* See arp.h */
+int chirouter_arp_pending_req_snapshot(chirouter_ctx_t *ctx, chirouter_pending_arp_info_t **reqs)
+{
+    chirouter_pending_arp_req_t *elt;
+    withheld_frame_t *withheld;
+    int n, i = 0;
+
+    pthread_mutex_lock(&(ctx->lock_arp));
+
+    DL_COUNT(ctx->pending_arp_reqs, elt, n);
+
+    *reqs = calloc(n > 0 ? n : 1, sizeof(chirouter_pending_arp_info_t));
+    if(*reqs == NULL)
+    {
+        pthread_mutex_unlock(&(ctx->lock_arp));
+        return -1;
+    }
+
+    DL_FOREACH(ctx->pending_arp_reqs, elt)
+    {
+        chirouter_pending_arp_info_t *info = &(*reqs)[i++];
+
+        info->ip = elt->ip;
+        info->out_interface = elt->out_interface;
+        info->times_sent = elt->times_sent;
+        info->last_sent = elt->last_sent;
+        DL_COUNT(elt->withheld_frames, withheld, info->num_withheld);
+    }
+
+    pthread_mutex_unlock(&(ctx->lock_arp));
+
+    return n;
+}
+
+
+/* See arp.h */
+void chirouter_arp_tick(chirouter_ctx_t *ctx)
+{
+    pthread_mutex_lock(&(ctx->lock_arp));
+
+    /* Purge the cache */
+    uint64_t curtime = chirouter_clock_now(ctx->clock);
+    for(int i = 0; i < ARPCACHE_SIZE; i++)
+    {
+        chirouter_arpcache_entry_t *cache_entry = &ctx->arpcache[i];
+        uint64_t entry_age = curtime - cache_entry->time_added;
+
+        if ((cache_entry->valid) && (entry_age > ARPCACHE_ENTRY_TIMEOUT * 1000000000ull)) {
+            ARPCACHE_WRITE_BEGIN(ctx);
+            cache_entry->valid = false;
+            ARPCACHE_WRITE_END(ctx);
         }
+    }
 
-        /* Process pending ARP requests */
-        if (ctx->pending_arp_reqs != NULL)
-        {
-            chirouter_pending_arp_req_t *elt, *tmp;
+    /* Process pending ARP requests */
+    if (ctx->pending_arp_reqs != NULL)
+    {
+        chirouter_pending_arp_req_t *elt, *tmp;
 
-            DL_FOREACH_SAFE(ctx->pending_arp_reqs, elt, tmp)
-            {
-                if(chirouter_arp_process_pending_req(ctx, elt) == ARP_REQ_REMOVE)
-                {
-                    chirouter_arp_pending_req_free_frames(elt);
-                    DL_DELETE(ctx->pending_arp_reqs, elt);
-                    free(elt);
-                }
-            }
+        DL_FOREACH_SAFE(ctx->pending_arp_reqs, elt, tmp)
+        {
+            if(chirouter_arp_process_pending_req(ctx, elt) == ARP_REQ_REMOVE)
+                chirouter_arp_pending_req_remove(ctx, elt);
         }
+    }
 
-        pthread_mutex_unlock(&(ctx->lock_arp));
+    pthread_mutex_unlock(&(ctx->lock_arp));
+}
+
+
+/* See arp.h */
+int chirouter_arp_start(chirouter_ctx_t *ctx)
+{
+    ctx->arp_stop = false;
+
+    if (pthread_create(&ctx->arp_thread, NULL, chirouter_arp_process, ctx) != 0)
+        return -1;
+
+    ctx->arp_running = true;
+
+    return 0;
+}
+
+
+/* See arp.h */
+void chirouter_arp_stop(chirouter_ctx_t *ctx)
+{
+    if (!ctx->arp_running)
+        return;
+
+    chirouter_clock_interrupt(ctx->clock, &ctx->arp_stop);
+    pthread_join(ctx->arp_thread, NULL);
+    ctx->arp_running = false;
+}
+
+
+/* See arp.h */
+void* chirouter_arp_process(void *args)
+{
+    chirouter_ctx_t *ctx = (chirouter_ctx_t *) args;
+    uint64_t next_tick = chirouter_clock_now(ctx->clock) + ARP_TICK_INTERVAL;
+
+    /* With a virtual clock, the thread runs a tick for every
+     * ARP_TICK_INTERVAL that the clock is advanced by */
+    while (chirouter_clock_wait(ctx->clock, next_tick, &ctx->arp_stop) == 0)
+    {
+        chirouter_arp_tick(ctx);
+        next_tick += ARP_TICK_INTERVAL;
     }
 
     return NULL;
@@ -68,6 +68,9 @@
 #include <pthread.h>
 #include "chirouter.h"
 
+/* Interval between runs of chirouter_arp_tick in the ARP thread (1 s, in ns) */
+#define ARP_TICK_INTERVAL (1000000000ull)
+
 void chirouter_send_arp_message(chirouter_ctx_t *ctx, chirouter_interface_t *out_interface, 
                                                 uint8_t *dst_mac, uint32_t dst_ip, int type);
 
@@ -89,6 +92,43 @@ void chirouter_send_arp_message(chirouter_ctx_t *ctx, chirouter_interface_t *out
 chirouter_arpcache_entry_t* chirouter_arp_cache_lookup(chirouter_ctx_t *ctx, struct in_addr *ip);
 
 
+/*
+ * chirouter_arp_cache_lookup_mac - Look up an IP in the ARP cache without locking
+ *
+ * Unlike chirouter_arp_cache_lookup, this function does not require
+ * the lock_arp mutex, and can be called concurrently from several
+ * threads (and concurrently with updates to the ARP cache). Since
+ * the entry could be modified as soon as this function returns, the
+ * MAC address is copied instead of returning a pointer to the entry.
+ *
+ * ctx: Router context
+ *
+ * ip: IP address being looked up (in network order).
+ *
+ * mac: Buffer (of size ETHER_ADDR_LEN) where the MAC address will be stored.
+ *
+ * Returns: true if the cache contains a valid entry for the IP address,
+ *          false otherwise.
+ */
+bool chirouter_arp_cache_lookup_mac(chirouter_ctx_t *ctx, uint32_t ip, uint8_t *mac);
+
+
+/*
+ * chirouter_arp_cache_snapshot - Copy the valid entries of the ARP cache
+ *
+ * Like chirouter_arp_cache_lookup_mac, this function does not require
+ * the lock_arp mutex. The copy is a consistent snapshot of the cache.
+ *
+ * ctx: Router context
+ *
+ * entries: Array of ARPCACHE_SIZE entries, where the valid entries
+ *          of the cache will be copied to.
+ *
+ * Returns: The number of entries copied.
+ */
+int chirouter_arp_cache_snapshot(chirouter_ctx_t *ctx, chirouter_arpcache_entry_t *entries);
+
+
 /*
  * chirouter_arp_cache_add - Add an entry to the ARP cache
  *
@@ -105,6 +145,22 @@ chirouter_arpcache_entry_t* chirouter_arp_cache_lookup(chirouter_ctx_t *ctx, str
 int chirouter_arp_cache_add(chirouter_ctx_t *ctx, struct in_addr *ip, uint8_t *mac);
 
 
+/*
+ * chirouter_arp_flush - Remove all the entries of the ARP cache,
+ *                       and all the pending ARP requests
+ *
+ * Frames withheld in the pending ARP requests are dropped.
+ *
+ * Note: This function locks the lock_arp mutex in the router context
+ *       itself, so it must not be held when calling this function
+ *
+ * ctx: Router context
+ *
+ * Returns: nothing.
+ */
+void chirouter_arp_flush(chirouter_ctx_t *ctx);
+
+
 /*
  * chirouter_arp_pending_req_lookup - Look up a pending ARP request by IP
  *
@@ -175,9 +231,100 @@ int chirouter_arp_pending_req_add_frame(chirouter_ctx_t *ctx, chirouter_pending_
 int chirouter_arp_pending_req_free_frames(chirouter_pending_arp_req_t *pending_req);
 
 
+/*
+ * chirouter_arp_pending_req_remove - Remove a pending ARP request from the pending ARP request list
+ *
+ * Note: The lock_arp mutex in the router context must be locked before
+ *       calling this function.
+ *
+ * ctx: Router context
+ *
+ * pending_req: Pending request to remove. The request, and all its
+ *              withheld frames, are freed.
+ *
+ * Returns: 0 on success, 1 on error.
+ */
+int chirouter_arp_pending_req_remove(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req);
+
+
+/* A copy of a pending ARP request (see chirouter_arp_pending_req_snapshot) */
+typedef struct chirouter_pending_arp_info
+{
+    /* IP address being queried */
+    struct in_addr ip;
+
+    /* Interface on which the ARP request was sent */
+    chirouter_interface_t *out_interface;
+
+    /* The number of times the ARP request has been sent,
+     * and the last time it was sent (on the router's clock) */
+    uint32_t times_sent;
+    uint64_t last_sent;
+
+    /* Number of frames withheld until the ARP reply arrives */
+    uint32_t num_withheld;
+} chirouter_pending_arp_info_t;
+
+
+/*
+ * chirouter_arp_pending_req_snapshot - Copy the list of pending ARP requests
+ *
+ * Note: This function locks the lock_arp mutex (only while copying
+ *       the list), so the mutex must NOT be locked when calling it.
+ *
+ * ctx: Router context
+ *
+ * reqs: Pointer to where an array with the copies of the pending
+ *       requests will be stored. The array must be freed by the caller.
+ *
+ * Returns: The number of pending requests, or -1 on error.
+ */
+int chirouter_arp_pending_req_snapshot(chirouter_ctx_t *ctx, chirouter_pending_arp_info_t **reqs);
+
+
+/*
+ * chirouter_arp_tick - Purge the ARP cache and process the pending ARP requests
+ *
+ * This is what the ARP thread does every ARP_TICK_INTERVAL. It can also
+ * be called directly by tools that don't start the ARP thread (e.g., to
+ * run ARP timeouts deterministically with a virtual clock).
+ *
+ * Note: This function locks the lock_arp mutex, so the mutex must
+ *       NOT be locked when calling it.
+ *
+ * ctx: Router context
+ *
+ * Returns: nothing.
+ */
+void chirouter_arp_tick(chirouter_ctx_t *ctx);
+
+
+/*
+ * chirouter_arp_start - Start the ARP thread of a router
+ *
+ * ctx: Router context
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_arp_start(chirouter_ctx_t *ctx);
+
+
+/*
+ * chirouter_arp_stop - Stop the ARP thread of a router
+ *
+ * Waits for the thread to finish. Does nothing if the thread
+ * was not started.
+ *
+ * ctx: Router context
+ *
+ * Returns: nothing.
+ */
+void chirouter_arp_stop(chirouter_ctx_t *ctx);
+
+
 /* DO NOT USE THIS FUNCTION */
-/* This is the thread function that periodically purges the ARP cache
- * and processes the pending ARP requests. The thread is created in server.c */
+/* This is the thread function that runs chirouter_arp_tick every
+ * ARP_TICK_INTERVAL. The thread is created by chirouter_arp_start */
 void* chirouter_arp_process(void *args);
 
 #endif
@@ -0,0 +1,786 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Microbenchmarks of the data path
+ *
+ *  Measures the cost of the building blocks of the data path, one at a
+ *  time, on a router built in-process (no controller is involved):
+ *
+ *    rtable_lookup:      chirouter_get_matching_entry (ROUTES entries)
+ *    arp_lookup:         chirouter_arp_cache_lookup (with lock_arp)
+ *    arp_lookup_mac:     chirouter_arp_cache_lookup_mac (lockless)
+ *    arp_add:            chirouter_arp_cache_add
+ *    pending_lookup:     chirouter_arp_pending_req_lookup
+ *    cksum_hdr:          cksum of an IP header
+ *    cksum_1500:         cksum of a full-size IP datagram
+ *    forward:            forward_ip_datagram
+ *    icmp_echo_reply:    chirouter_send_icmp (echo reply)
+ *    icmp_time_exceeded: chirouter_send_icmp (time exceeded)
+ *    send_msg:           chirouter_send_frame to the controller socket
+ *                        (message framing, and the send() itself)
+ *    pcapng_epb:         chirouter_pcapng_write_epb to /dev/null
+ *    pcap_write:         chirouter_pcap_write_frame (not including the
+ *                        time the writer thread takes to write the frames)
+ *
+ *  Outbound frames (other than in send_msg) are handed to a frame sink
+ *  that discards them.
+ *
+ *  Each benchmark is run in repetitions of (at least) TIME milliseconds,
+ *  after working out how many operations fit in that time, and after
+ *  WARMUP repetitions that are not measured. The benchmark thread is
+ *  pinned to a CPU (the one it starts on, unless -c is given), so it
+ *  doesn't migrate between repetitions. The minimum and median time per
+ *  operation over the repetitions are reported, along with the spread
+ *  between the slowest and fastest repetition, and the number of heap
+ *  allocations (malloc, calloc, realloc, aligned_alloc) per operation.
+ *
+ *  Allocations are counted by wrapping the allocation functions at link
+ *  time (see CMakeLists.txt), so allocations made inside libc itself
+ *  (e.g., by strdup) are not counted.
+ *
+ *  With -j, the results are also written to a JSON file (which is what
+ *  scripts/perf_check.py uses to compare them against a baseline):
+ *
+ *    {"repetitions": 5, "time_ms": 50, "routes": 64, "cpu": 0,
+ *     "benchmarks": [{"name": "rtable_lookup", "ops": 140195,
+ *                     "ns_min": 392.0, "ns_median": 421.5, "ns_max": 446.1,
+ *                     "allocs": 0.0}, ...]}
+ *
+ *  Usage: chirouter_bench [-t TIME] [-R REPETITIONS] [-W WARMUP] [-c CPU | -P]
+ *                         [-r ROUTES] [-f RTABLE_FILE] [-b FIB_FILE] [-j JSON_FILE] [-l] [BENCHMARK...]
+ *
+ *  -t TIME: Minimum time of each repetition, in milliseconds (default: 50)
+ *  -R REPETITIONS: Measured repetitions (default: 5)
+ *  -W WARMUP: Repetitions that are not measured (default: 1)
+ *  -c CPU: Pin the benchmark thread to this CPU
+ *  -P: Don't pin the benchmark thread
+ *  -r ROUTES: Entries in the routing table (default: 64)
+ *  -f RTABLE_FILE: Also add the entries in this file to the routing table
+ *                  (see chirouter_ctx_load_rtable; the interfaces are
+ *                  eth0 to eth3), e.g., to look up routes in a full table
+ *  -b FIB_FILE: Also add the routes in this FIB snapshot to the routing
+ *               table (after the ones in RTABLE_FILE), and look them up
+ *               with the snapshot (see fib.h)
+ *  -j JSON_FILE: Also write the results to this file
+ *  -l: List the benchmarks
+ *  BENCHMARK: Only run the benchmarks whose name contains this string
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* For sched_setaffinity and sched_getcpu */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "chirouter.h"
+#include "server.h"
+#include "arp.h"
+#include "pcap.h"
+#include "latency.h"
+#include "utils.h"
+#include "fib.h"
+
+#define USAGE "Usage: chirouter_bench [-t TIME] [-R REPETITIONS] [-W WARMUP] [-c CPU | -P]\n" \
+              "                       [-r ROUTES] [-f RTABLE_FILE] [-b FIB_FILE] [-j JSON_FILE] [-l] [BENCHMARK...]\n"
+
+#define MAX_REPETITIONS (100)
+#define NUM_IFACES (4)
+#define NUM_FLOWS (256)
+#define NUM_HOSTS (64)
+#define NUM_PENDING (32)
+#define FRAME_LEN (128)
+
+/* Defined in router.c */
+chirouter_rtable_entry_t* chirouter_get_matching_entry(chirouter_ctx_t *ctx, ethernet_frame_t *frame);
+void forward_ip_datagram(chirouter_ctx_t *ctx, ethernet_frame_t *frame, uint8_t *dst_mac);
+void chirouter_send_icmp(chirouter_ctx_t *ctx, uint8_t type, uint8_t code, ethernet_frame_t *frame);
+
+
+/* Allocation counting. The linker turns calls to malloc (etc.) into
+ * calls to __wrap_malloc, and __real_malloc is the actual malloc. */
+static uint64_t num_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_aligned_alloc(size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size)
+{
+    __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+    return __real_aligned_alloc(alignment, size);
+}
+
+
+/* State shared by the benchmarks */
+static server_ctx_t *server;
+static chirouter_ctx_t router;
+
+/* Inbound UDP frames (to hosts reachable through each of the routes)
+ * and ICMP echo requests (to the router's interfaces) */
+static uint8_t udp_raw[NUM_FLOWS][FRAME_LEN];
+static uint8_t ping_raw[NUM_FLOWS][FRAME_LEN];
+static ethernet_frame_t udp_frames[NUM_FLOWS];
+static ethernet_frame_t ping_frames[NUM_FLOWS];
+
+static struct in_addr host_ips[NUM_HOSTS];
+static struct in_addr pending_ips[NUM_PENDING];
+static uint8_t datagram[ETHER_FRAME_MAX_LEN];
+
+/* Controller socket (whose other end is read by drain_thread) */
+static int msg_sockets[2];
+static pthread_t drain_thread;
+
+static chirouter_pcap_writer_t *pcap_writer;
+static FILE *dev_null;
+
+/* Results are stored here, so the compiler can't optimize the
+ * operations away */
+static volatile uintptr_t result;
+
+/* Time during which a benchmark paused the clock (see bench_pause) */
+static uint64_t paused_ns;
+static uint64_t pause_start;
+
+
+/* Stops counting time while a benchmark does work that is not part of
+ * the operation being measured, until bench_resume is called */
+static void bench_pause()
+{
+    pause_start = chirouter_latency_now();
+}
+
+static void bench_resume()
+{
+    paused_ns += chirouter_latency_now() - pause_start;
+}
+
+
+static int null_sink(chirouter_ctx_t *ctx, chirouter_interface_t *iface,
+                     uint8_t *frame, size_t len, void *arg)
+{
+    result += len;
+    return 0;
+}
+
+
+/* Reads (and discards) everything sent to the controller socket */
+static void *drain_func(void *arg)
+{
+    uint8_t buf[64 * 1024];
+
+    while (read(msg_sockets[1], buf, sizeof(buf)) > 0)
+        ;
+
+    return NULL;
+}
+
+
+/* Builds an inbound frame: a UDP datagram, or an ICMP echo request */
+static void build_frame(uint8_t *raw, ethernet_frame_t *frame, chirouter_interface_t *in_iface,
+                        uint32_t src, uint32_t dst, bool ping)
+{
+    ethhdr_t *eth = (ethhdr_t *) raw;
+    iphdr_t *ip = (iphdr_t *) (raw + sizeof(ethhdr_t));
+    uint8_t *l4 = raw + sizeof(ethhdr_t) + sizeof(iphdr_t);
+
+    memset(raw, 0, FRAME_LEN);
+    memcpy(eth->dst, in_iface->mac, ETHER_ADDR_LEN);
+    memcpy(eth->src, "\x02\xBB\x00\x00\x00\x01", ETHER_ADDR_LEN);
+    eth->type = htons(ETHERTYPE_IP);
+
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->len = htons(FRAME_LEN - sizeof(ethhdr_t));
+    ip->ttl = 64;
+    ip->proto = ping ? IPPROTO_ICMP : IPPROTO_UDP;
+    ip->src = src;
+    ip->dst = dst;
+    ip->cksum = cksum(ip, sizeof(iphdr_t));
+
+    if (ping)
+    {
+        icmp_packet_t *icmp = (icmp_packet_t *) l4;
+
+        icmp->type = ICMPTYPE_ECHO_REQUEST;
+        icmp->echo.identifier = htons(1);
+        icmp->echo.seq_num = htons(dst);
+        icmp->chksum = cksum(icmp, FRAME_LEN - sizeof(ethhdr_t) - sizeof(iphdr_t));
+    }
+    else
+    {
+        uint16_t *ports = (uint16_t *) l4;
+
+        ports[0] = htons(1024);
+        ports[1] = htons(9);
+    }
+
+    frame->raw = raw;
+    frame->length = FRAME_LEN;
+    frame->in_interface = in_iface;
+}
+
+
+/* Builds a router with NUM_IFACES interfaces (eth<i>, 10.<i>.0.1/16)
+ * and a routing table with num_routes entries: the directly connected
+ * networks, /24 networks in 172.16.0.0/12 (through a gateway on one of
+ * the interfaces), and a default route. The ARP cache has NUM_HOSTS
+ * entries, and there are NUM_PENDING pending ARP requests. */
+static void build_router(int num_routes)
+{
+    chirouter_ctx_init(&router);
+    snprintf(router.name, sizeof(router.name), "r1");
+    router.server = server;
+    server->routers = &router;
+    server->num_routers = server->max_routers = 1;
+
+    router.num_interfaces = router.max_interfaces = NUM_IFACES;
+    router.interfaces = calloc(NUM_IFACES, sizeof(chirouter_interface_t));
+    for (int i = 0; i < NUM_IFACES; i++)
+    {
+        chirouter_interface_t *iface = &router.interfaces[i];
+        uint8_t mac[ETHER_ADDR_LEN] = {0x02, 0, 0, 0, 0, i + 1};
+
+        snprintf(iface->name, sizeof(iface->name), "eth%i", i);
+        memcpy(iface->mac, mac, ETHER_ADDR_LEN);
+        iface->ip.s_addr = htonl(0x0A000001 | (i << 16));
+        iface->pox_iface_id = i;
+    }
+
+    router.num_rtable_entries = router.max_rtable_entries = num_routes;
+    router.routing_table = calloc(num_routes, sizeof(chirouter_rtable_entry_t));
+    for (int i = 0; i < num_routes; i++)
+    {
+        chirouter_rtable_entry_t *entry = &router.routing_table[i];
+        int iface = i % NUM_IFACES;
+
+        if (i == num_routes - 1)
+        {
+            entry->dest.s_addr = 0;
+            entry->mask.s_addr = 0;
+            entry->gw.s_addr = htonl(0x0A000002);
+            iface = 0;
+        }
+        else if (i < NUM_IFACES)
+        {
+            entry->dest.s_addr = htonl(0x0A000000 | (i << 16));
+            entry->mask.s_addr = htonl(0xFFFF0000);
+        }
+        else
+        {
+            entry->dest.s_addr = htonl(0xAC100000 | (i << 8));
+            entry->mask.s_addr = htonl(0xFFFFFF00);
+            entry->gw.s_addr = htonl(0x0A000002 | (iface << 16));
+        }
+        entry->metric = 100;
+        entry->interface = &router.interfaces[iface];
+    }
+
+    for (int i = 0; i < NUM_HOSTS; i++)
+    {
+        uint8_t mac[ETHER_ADDR_LEN] = {0x02, 0xAA, 0, 0, 0, i};
+
+        host_ips[i].s_addr = htonl(0x0A000002 + ((i % NUM_IFACES) << 16) + i);
+        chirouter_arp_cache_add(&router, &host_ips[i], mac);
+    }
+
+    for (int i = 0; i < NUM_PENDING; i++)
+    {
+        pending_ips[i].s_addr = htonl(0x0A000080 + ((i % NUM_IFACES) << 16) + i);
+        chirouter_arp_pending_req_add(&router, &pending_ips[i], &router.interfaces[i % NUM_IFACES]);
+    }
+
+    /* Flows go to every route (and to the directly connected networks) */
+    for (int i = 0; i < NUM_FLOWS; i++)
+    {
+        chirouter_rtable_entry_t *entry = &router.routing_table[i % (num_routes > 1 ? num_routes - 1 : 1)];
+        chirouter_interface_t *in_iface = &router.interfaces[i % NUM_IFACES];
+        uint32_t src = htonl(ntohl(in_iface->ip.s_addr) + 1);
+
+        build_frame(udp_raw[i], &udp_frames[i], in_iface, src, entry->dest.s_addr | htonl(2 + i), false);
+        build_frame(ping_raw[i], &ping_frames[i], in_iface, src, in_iface->ip.s_addr, true);
+    }
+
+    for (size_t i = 0; i < sizeof(datagram); i++)
+        datagram[i] = i * 7;
+}
+
+
+/* The benchmarks. Each one does its operation iters times. */
+
+static void bench_rtable_lookup(uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; i++)
+        result += (uintptr_t) chirouter_get_matching_entry(&router, &udp_frames[i % NUM_FLOWS]);
+}
+
+static void bench_arp_lookup(uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        pthread_mutex_lock(&router.lock_arp);
+        result += (uintptr_t) chirouter_arp_cache_lookup(&router, &host_ips[i % NUM_HOSTS]);
+        pthread_mutex_unlock(&router.lock_arp);
+    }
+}
+
+static void bench_arp_lookup_mac(uint64_t iters)
+{
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    for (uint64_t i = 0; i < iters; i++)
+        result += chirouter_arp_cache_lookup_mac(&router, host_ips[i % NUM_HOSTS].s_addr, mac);
+}
+
+/* Adds an entry after the NUM_HOSTS valid entries, and then invalidates
+ * it, so the cache never fills up */
+static void bench_arp_add(uint64_t iters)
+{
+    uint8_t mac[ETHER_ADDR_LEN] = {0x02, 0xCC, 0, 0, 0, 0};
+    struct in_addr ip = { .s_addr = htonl(0x0A0000FE) };
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        result += chirouter_arp_cache_add(&router, &ip, mac);
+        router.arpcache[NUM_HOSTS].valid = false;
+    }
+}
+
+static void bench_pending_lookup(uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; i++)
+        result += (uintptr_t) chirouter_arp_pending_req_lookup(&router, &pending_ips[i % NUM_PENDING]);
+}
+
+static void bench_cksum_hdr(uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; i++)
+        result += cksum(udp_raw[i % NUM_FLOWS] + sizeof(ethhdr_t), sizeof(iphdr_t));
+}
+
+static void bench_cksum_1500(uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; i++)
+        result += cksum(datagram, ETHER_FRAME_MAX_LEN - sizeof(ethhdr_t));
+}
+
+static void bench_forward(uint64_t iters)
+{
+    uint8_t mac[ETHER_ADDR_LEN] = {0x02, 0xAA, 0, 0, 0, 0};
+
+    for (uint64_t i = 0; i < iters; i++)
+        forward_ip_datagram(&router, &udp_frames[i % NUM_FLOWS], mac);
+}
+
+static void bench_icmp_echo_reply(uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; i++)
+        chirouter_send_icmp(&router, ICMPTYPE_ECHO_REPLY, 0, &ping_frames[i % NUM_FLOWS]);
+}
+
+static void bench_icmp_time_exceeded(uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; i++)
+        chirouter_send_icmp(&router, ICMPTYPE_TIME_EXCEEDED, 0, &udp_frames[i % NUM_FLOWS]);
+}
+
+static void send_msg_setup()
+{
+    server->frame_sink = NULL;
+}
+
+static void send_msg_teardown()
+{
+    server->frame_sink = null_sink;
+}
+
+static void bench_send_msg(uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        ethernet_frame_t *frame = &ping_frames[i % NUM_FLOWS];
+        ethhdr_t *eth = (ethhdr_t *) frame->raw;
+
+        /* The source address must be that of the outbound interface */
+        memcpy(eth->src, frame->in_interface->mac, ETHER_ADDR_LEN);
+        result += chirouter_send_frame(&router, frame->in_interface, frame->raw, frame->length);
+        memcpy(eth->src, "\x02\xBB\x00\x00\x00\x01", ETHER_ADDR_LEN);
+    }
+}
+
+static void bench_pcapng_epb(uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; i++)
+        result += chirouter_pcapng_write_epb(dev_null, i % NUM_IFACES, i, udp_raw[i % NUM_FLOWS],
+                                             FRAME_LEN, FRAME_LEN, PCAP_INBOUND, NULL);
+}
+
+static void pcap_write_setup()
+{
+    server->pcap_writer = pcap_writer;
+}
+
+static void pcap_write_teardown()
+{
+    server->pcap_writer = NULL;
+}
+
+/* Frames are written in rounds of half the ring, waiting (with the
+ * clock paused) for the writer thread to write each round, so that
+ * no frames are dropped */
+static void bench_pcap_write(uint64_t iters)
+{
+    for (uint64_t i = 0; i < iters; )
+    {
+        uint64_t end = i + PCAP_RING_SIZE / 2;
+
+        for (; i < iters && i < end; i++)
+            chirouter_pcap_write_frame(&router, udp_frames[i % NUM_FLOWS].in_interface,
+                                       udp_raw[i % NUM_FLOWS], FRAME_LEN, PCAP_INBOUND);
+
+        bench_pause();
+        while (__atomic_load_n(&pcap_writer->num_written, __ATOMIC_RELAXED) +
+               __atomic_load_n(&pcap_writer->num_dropped, __ATOMIC_RELAXED) <
+               __atomic_load_n(&pcap_writer->head, __ATOMIC_RELAXED))
+            sched_yield();
+        bench_resume();
+    }
+}
+
+
+typedef struct
+{
+    const char *name;
+    void (*run)(uint64_t iters);
+
+    /* Called before and after the benchmark (can be NULL) */
+    void (*setup)();
+    void (*teardown)();
+} bench_t;
+
+static const bench_t benchmarks[] =
+{
+    { "rtable_lookup", bench_rtable_lookup, NULL, NULL },
+    { "arp_lookup", bench_arp_lookup, NULL, NULL },
+    { "arp_lookup_mac", bench_arp_lookup_mac, NULL, NULL },
+    { "arp_add", bench_arp_add, NULL, NULL },
+    { "pending_lookup", bench_pending_lookup, NULL, NULL },
+    { "cksum_hdr", bench_cksum_hdr, NULL, NULL },
+    { "cksum_1500", bench_cksum_1500, NULL, NULL },
+    { "forward", bench_forward, NULL, NULL },
+    { "icmp_echo_reply", bench_icmp_echo_reply, NULL, NULL },
+    { "icmp_time_exceeded", bench_icmp_time_exceeded, NULL, NULL },
+    { "send_msg", bench_send_msg, send_msg_setup, send_msg_teardown },
+    { "pcapng_epb", bench_pcapng_epb, NULL, NULL },
+    { "pcap_write", bench_pcap_write, pcap_write_setup, pcap_write_teardown },
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(bench_t))
+
+
+/* Results of a benchmark */
+typedef struct
+{
+    uint64_t iters;
+    double ns_min;
+    double ns_median;
+    double ns_max;
+    double allocs;
+} bench_result_t;
+
+
+/* Runs a benchmark iters times, and returns the elapsed nanoseconds
+ * (not counting the time during which the clock was paused) */
+static uint64_t bench_time(const bench_t *bench, uint64_t iters)
+{
+    uint64_t start;
+
+    paused_ns = 0;
+    start = chirouter_latency_now();
+
+    bench->run(iters);
+
+    return chirouter_latency_now() - start - paused_ns;
+}
+
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+
+/* Works out how many operations take time_ns, and then runs the
+ * warmup and measured repetitions */
+static void bench_run(const bench_t *bench, uint64_t time_ns, int reps, int warmup, bench_result_t *res)
+{
+    double ns_per_op[MAX_REPETITIONS];
+    uint64_t iters = 1, elapsed, allocs;
+
+    if (bench->setup)
+        bench->setup();
+
+    /* Grow the number of operations until they take at least a tenth
+     * of the target time, and then scale it up to the target time */
+    while ((elapsed = bench_time(bench, iters)) < time_ns / 10)
+        iters *= 10;
+    if (elapsed < time_ns)
+        iters = iters * time_ns / (elapsed ? elapsed : 1) + 1;
+
+    for (int i = 0; i < warmup; i++)
+        bench_time(bench, iters);
+
+    allocs = __atomic_load_n(&num_allocs, __ATOMIC_RELAXED);
+    for (int i = 0; i < reps; i++)
+        ns_per_op[i] = (double) bench_time(bench, iters) / iters;
+    allocs = __atomic_load_n(&num_allocs, __ATOMIC_RELAXED) - allocs;
+
+    if (bench->teardown)
+        bench->teardown();
+
+    qsort(ns_per_op, reps, sizeof(double), cmp_double);
+
+    res->iters = iters;
+    res->ns_min = ns_per_op[0];
+    res->ns_median = (reps % 2) ? ns_per_op[reps / 2] : (ns_per_op[reps / 2 - 1] + ns_per_op[reps / 2]) / 2;
+    res->ns_max = ns_per_op[reps - 1];
+    res->allocs = (double) allocs / ((uint64_t) reps * iters);
+}
+
+
+static bool bench_selected(const bench_t *bench, int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+
+    for (int i = 0; i < argc; i++)
+        if (strstr(bench->name, argv[i]))
+            return true;
+
+    return false;
+}
+
+
+int main(int argc, char *argv[])
+{
+    long time_ms = 50;
+    int reps = 5, warmup = 1, cpu = -1, num_routes = 64;
+    bool pin = true;
+    char *json_file = NULL, *rtable_file = NULL, *fib_file = NULL;
+    chirouter_fib_t *fib;
+    FILE *json = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:R:W:c:Pr:f:b:j:lh")) != -1)
+        switch (opt)
+        {
+        case 't':
+            time_ms = atol(optarg);
+            break;
+        case 'R':
+            reps = atoi(optarg);
+            break;
+        case 'W':
+            warmup = atoi(optarg);
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        case 'P':
+            pin = false;
+            break;
+        case 'r':
+            num_routes = atoi(optarg);
+            break;
+        case 'f':
+            rtable_file = optarg;
+            break;
+        case 'b':
+            fib_file = optarg;
+            break;
+        case 'j':
+            json_file = optarg;
+            break;
+        case 'l':
+            for (size_t i = 0; i < NUM_BENCHMARKS; i++)
+                printf("%s\n", benchmarks[i].name);
+            return EXIT_SUCCESS;
+        case 'h':
+            printf(USAGE);
+            return EXIT_SUCCESS;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+        }
+
+    if (time_ms < 1 || reps < 1 || reps > MAX_REPETITIONS || warmup < 0)
+    {
+        fprintf(stderr, "ERROR: Invalid time, repetitions, or warmup repetitions\n");
+        return EXIT_FAILURE;
+    }
+
+    if (num_routes < NUM_IFACES + 1 || num_routes > 4096)
+    {
+        fprintf(stderr, "ERROR: The routing table must have between %i and 4096 entries\n", NUM_IFACES + 1);
+        return EXIT_FAILURE;
+    }
+
+    if (json_file && (json = fopen(json_file, "w")) == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not create %s\n", json_file);
+        return EXIT_FAILURE;
+    }
+
+    chirouter_setloglevel(ERROR);
+    chirouter_server_ctx_init(&server);
+    server->frame_sink = null_sink;
+    build_router(num_routes);
+    if (rtable_file && chirouter_ctx_load_rtable(&router, rtable_file) != 0)
+    {
+        fprintf(stderr, "ERROR: Could not load the routing table in %s\n", rtable_file);
+        return EXIT_FAILURE;
+    }
+    if (fib_file && ((fib = chirouter_fib_open(fib_file)) == NULL || chirouter_fib_attach(&router, fib) != 0))
+    {
+        fprintf(stderr, "ERROR: Could not load the FIB in %s\n", fib_file);
+        return EXIT_FAILURE;
+    }
+
+    /* The helper threads are created before the benchmark thread is
+     * pinned, so they don't inherit its CPU affinity */
+    dev_null = fopen("/dev/null", "w");
+    pcap_writer = chirouter_pcap_writer_start("/dev/null", 0, 0, ETHER_FRAME_MAX_LEN, NULL, false);
+    if (dev_null == NULL || pcap_writer == NULL || chirouter_pcap_writer_set_interfaces(pcap_writer, server) != 0)
+    {
+        fprintf(stderr, "ERROR: Could not open /dev/null\n");
+        return EXIT_FAILURE;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, msg_sockets) != 0 ||
+        pthread_create(&drain_thread, NULL, drain_func, NULL) != 0)
+    {
+        fprintf(stderr, "ERROR: Could not create the controller socket\n");
+        return EXIT_FAILURE;
+    }
+    server->client_socket = msg_sockets[0];
+
+    if (pin)
+    {
+        cpu_set_t set;
+
+        if (cpu < 0)
+            cpu = sched_getcpu();
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        {
+            fprintf(stderr, "ERROR: Could not pin the benchmark thread to CPU %i\n", cpu);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("# %i repetitions of %li ms (after %i warmup), %u routes, ", reps, time_ms, warmup, router.num_rtable_entries);
+    if (pin)
+        printf("pinned to CPU %i\n", cpu);
+    else
+        printf("not pinned\n");
+    printf("%-20s %12s %10s %10s %8s %10s\n", "benchmark", "ops/rep", "min ns/op", "ns/op", "spread", "allocs/op");
+
+    if (json)
+        fprintf(json, "{\"repetitions\": %i, \"time_ms\": %li, \"routes\": %u, \"cpu\": %i,\n \"benchmarks\": [",
+                reps, time_ms, router.num_rtable_entries, pin ? cpu : -1);
+
+    for (size_t i = 0, n = 0; i < NUM_BENCHMARKS; i++)
+    {
+        bench_result_t res;
+
+        if (!bench_selected(&benchmarks[i], argc - optind, argv + optind))
+            continue;
+
+        bench_run(&benchmarks[i], time_ms * 1000000ull, reps, warmup, &res);
+
+        printf("%-20s %12lu %10.1f %10.1f %7.1f%% %10.2f\n", benchmarks[i].name, res.iters,
+               res.ns_min, res.ns_median, 100 * (res.ns_max - res.ns_min) / res.ns_median, res.allocs);
+        fflush(stdout);
+
+        if (json)
+            fprintf(json, "%s\n  {\"name\": \"%s\", \"ops\": %lu, \"ns_min\": %.2f, \"ns_median\": %.2f, "
+                    "\"ns_max\": %.2f, \"allocs\": %.4f}", n++ ? "," : "", benchmarks[i].name, res.iters,
+                    res.ns_min, res.ns_median, res.ns_max, res.allocs);
+    }
+
+    if (json)
+    {
+        fprintf(json, "\n ]}\n");
+        fclose(json);
+    }
+
+    shutdown(msg_sockets[0], SHUT_RDWR);
+    pthread_join(drain_thread, NULL);
+    close(msg_sockets[0]);
+    close(msg_sockets[1]);
+    chirouter_pcap_writer_stop(pcap_writer);
+    fclose(dev_null);
+
+    return EXIT_SUCCESS;
+}
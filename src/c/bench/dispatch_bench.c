@@ -0,0 +1,443 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  RSS dispatch benchmark
+ *
+ *  Measures how forwarding throughput of a single router scales with
+ *  the number of RSS queues. A single router with two interfaces is
+ *  built in-process (no controller is involved). The main thread plays
+ *  the role of the server thread: it builds inbound UDP frames for a
+ *  configurable number of flows and dispatches them to the router's
+ *  RSS queues. Outbound frames are counted and discarded.
+ *
+ *  With -r, the benchmark instead builds several routers (each with a
+ *  single RSS queue) and sends a skewed share of the frames (-k percent)
+ *  to the first router, spreading the rest evenly. The same load is run
+ *  with one worker thread per router and with a work-stealing pool of
+ *  -w workers, and the latency of each frame (from dispatch to the
+ *  frame sink) is reported as percentiles. -i paces the frames.
+ *
+ *  Usage: chirouter_dispatch_bench [-n FRAMES] [-f FLOWS] [-m MAX_QUEUES]
+ *                                  [-r ROUTERS [-w WORKERS] [-k SKEW] [-i GAP_NS]]
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include "chirouter.h"
+#include "server.h"
+#include "dispatch.h"
+#include "arp.h"
+#include "utils.h"
+
+#define NUM_HOSTS (64)
+#define FRAME_LEN (128)
+#define MAX_SINK_THREADS (MAX_RSS_QUEUES + 1)
+#define MAX_ROUTERS (64)
+
+/* Offset of the sequence number and dispatch timestamp in the frame
+ * (right after the UDP header) */
+#define STAMP_OFFSET (sizeof(ethhdr_t) + sizeof(iphdr_t) + 8)
+
+/* Per-thread count of frames handed to the sink */
+typedef struct
+{
+    uint64_t count;
+} __attribute__((aligned(64))) sink_counter_t;
+
+static sink_counter_t sink_counters[MAX_SINK_THREADS];
+static uint32_t sink_next_id;
+static __thread int sink_id = -1;
+
+/* Per-frame latencies (indexed by sequence number), if measured */
+static uint64_t *latencies;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bench_sink(chirouter_ctx_t *ctx, chirouter_interface_t *iface,
+                      uint8_t *frame, size_t len, void *arg)
+{
+    if (sink_id == -1)
+        sink_id = __atomic_fetch_add(&sink_next_id, 1, __ATOMIC_RELAXED) % MAX_SINK_THREADS;
+
+    if (latencies != NULL)
+    {
+        uint32_t seq;
+        uint64_t stamp;
+
+        memcpy(&seq, frame + STAMP_OFFSET, sizeof(seq));
+        memcpy(&stamp, frame + STAMP_OFFSET + sizeof(seq), sizeof(stamp));
+        latencies[seq] = now_ns() - stamp;
+    }
+
+    __atomic_store_n(&sink_counters[sink_id].count, sink_counters[sink_id].count + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static uint64_t sink_total()
+{
+    uint64_t total = 0;
+
+    for (int i = 0; i < MAX_SINK_THREADS; i++)
+        total += __atomic_load_n(&sink_counters[i].count, __ATOMIC_ACQUIRE);
+
+    return total;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Builds a router with two interfaces: eth0 (10.0.0.1/24), where the
+ * frames arrive, and eth1 (10.1.0.1/24), where they are forwarded to.
+ * The ARP cache contains NUM_HOSTS hosts in 10.1.0.0/24. The ID is a
+ * uint8_t (there are at most MAX_ROUTERS), so the name always fits. */
+static void build_router(server_ctx_t *server, chirouter_ctx_t *r, uint8_t id)
+{
+    memset(r, 0, sizeof(chirouter_ctx_t));
+    chirouter_ctx_init(r);
+    snprintf(r->name, sizeof(r->name), "r%i", id + 1);
+    r->server = server;
+
+    r->num_interfaces = r->max_interfaces = 2;
+    r->interfaces = calloc(2, sizeof(chirouter_interface_t));
+    for (int i = 0; i < 2; i++)
+    {
+        chirouter_interface_t *iface = &r->interfaces[i];
+        uint8_t mac[ETHER_ADDR_LEN] = {0x02, 0, 0, 0, 0, i + 1};
+
+        snprintf(iface->name, sizeof(iface->name), "eth%i", i);
+        memcpy(iface->mac, mac, ETHER_ADDR_LEN);
+        iface->ip.s_addr = htonl(0x0A000001 | (i << 16));
+        iface->pox_iface_id = i;
+    }
+
+    r->num_rtable_entries = r->max_rtable_entries = 2;
+    r->routing_table = calloc(2, sizeof(chirouter_rtable_entry_t));
+    for (int i = 0; i < 2; i++)
+    {
+        chirouter_rtable_entry_t *entry = &r->routing_table[i];
+
+        entry->dest.s_addr = htonl(0x0A000000 | (i << 16));
+        entry->mask.s_addr = htonl(0xFFFFFF00);
+        entry->gw.s_addr = 0;
+        entry->metric = 100;
+        entry->interface = &r->interfaces[i];
+    }
+
+    for (int i = 0; i < NUM_HOSTS; i++)
+    {
+        struct in_addr ip = { .s_addr = htonl(0x0A010002 + i) };
+        uint8_t mac[ETHER_ADDR_LEN] = {0x02, 0xAA, 0, 0, 0, i};
+
+        chirouter_arp_cache_add(r, &ip, mac);
+    }
+}
+
+
+/* Builds an inbound UDP frame for the given flow */
+static void build_frame(chirouter_ctx_t *r, uint8_t *raw, int flow)
+{
+    ethhdr_t *eth = (ethhdr_t *) raw;
+    iphdr_t *ip = (iphdr_t *) (raw + sizeof(ethhdr_t));
+    uint16_t *ports = (uint16_t *) (raw + sizeof(ethhdr_t) + sizeof(iphdr_t));
+
+    memset(raw, 0, FRAME_LEN);
+    memcpy(eth->dst, r->interfaces[0].mac, ETHER_ADDR_LEN);
+    memcpy(eth->src, "\x02\xBB\x00\x00\x00\x01", ETHER_ADDR_LEN);
+    eth->type = htons(ETHERTYPE_IP);
+
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->len = htons(FRAME_LEN - sizeof(ethhdr_t));
+    ip->ttl = 64;
+    ip->proto = IPPROTO_UDP;
+    ip->src = htonl(0x0A000002 + (flow % 200));
+    ip->dst = htonl(0x0A010002 + (flow % NUM_HOSTS));
+    ip->cksum = cksum(ip, sizeof(iphdr_t));
+
+    ports[0] = htons(1024 + flow);
+    ports[1] = htons(9);
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+
+/* Sends num_frames frames to the routers (a "skew" percent of them to
+ * the first router) with the given gap between them, and prints the
+ * throughput and latency percentiles. Each router must already have
+ * its RSS queue running. */
+static void run_skewed(const char *label, chirouter_ctx_t *routers, int num_routers,
+                       uint8_t (*templates)[FRAME_LEN], int num_flows,
+                       long num_frames, int skew, long gap_ns)
+{
+    uint64_t start_count = sink_total();
+    uint32_t rand = 12345;
+
+    memset(latencies, 0, num_frames * sizeof(uint64_t));
+
+    double start = now();
+    uint64_t next = now_ns();
+    for (long i = 0; i < num_frames; i++)
+    {
+        ethernet_frame_t *frame = malloc(sizeof(ethernet_frame_t));
+        chirouter_ctx_t *r;
+        uint32_t seq = i;
+
+        rand = rand * 1103515245 + 12345;
+        if ((rand >> 8) % 100 < (uint32_t) skew)
+            r = &routers[0];
+        else
+            r = &routers[(rand >> 16) % num_routers];
+
+        if (gap_ns > 0)
+        {
+            while (now_ns() < next)
+                ;
+            next += gap_ns;
+        }
+
+        frame->raw = malloc(FRAME_LEN);
+        memcpy(frame->raw, templates[i % num_flows], FRAME_LEN);
+        memcpy(frame->raw + STAMP_OFFSET, &seq, sizeof(seq));
+        uint64_t stamp = now_ns();
+        memcpy(frame->raw + STAMP_OFFSET + sizeof(seq), &stamp, sizeof(stamp));
+        frame->length = FRAME_LEN;
+        frame->in_interface = &r->interfaces[0];
+
+        chirouter_rss_dispatch(r, frame);
+    }
+
+    while (sink_total() - start_count < (uint64_t) num_frames)
+        usleep(100);
+    double elapsed = now() - start;
+
+    qsort(latencies, num_frames, sizeof(uint64_t), cmp_u64);
+
+    printf("%-10s %12.0f %10.1f %10.1f %10.1f %10.1f\n", label, num_frames / elapsed,
+           latencies[num_frames / 2] / 1e3,
+           latencies[(long) (num_frames * 0.99)] / 1e3,
+           latencies[(long) (num_frames * 0.999)] / 1e3,
+           latencies[num_frames - 1] / 1e3);
+}
+
+
+/* Compares one thread per router against the work-stealing scheduler */
+static int bench_skewed(server_ctx_t *server, int num_routers, int num_workers,
+                        int num_flows, long num_frames, int skew, long gap_ns)
+{
+    chirouter_ctx_t *routers = calloc(num_routers, sizeof(chirouter_ctx_t));
+
+    for (int i = 0; i < num_routers; i++)
+        build_router(server, &routers[i], i);
+
+    uint8_t (*templates)[FRAME_LEN] = calloc(num_flows, FRAME_LEN);
+    for (int i = 0; i < num_flows; i++)
+        build_frame(&routers[0], templates[i], i);
+
+    latencies = calloc(num_frames, sizeof(uint64_t));
+
+    printf("# %li frames, %i routers, %i%% of frames to r1, %li ns gap, %li online CPUs\n",
+           num_frames, num_routers, skew, gap_ns, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-10s %12s %10s %10s %10s %10s\n", "threads", "frames/s", "p50 us", "p99 us", "p99.9 us", "max us");
+
+    for (int i = 0; i < num_routers; i++)
+        if (chirouter_rss_start(&routers[i], 1) != 0)
+            return EXIT_FAILURE;
+    run_skewed("per-router", routers, num_routers, templates, num_flows, num_frames, skew, gap_ns);
+    for (int i = 0; i < num_routers; i++)
+        chirouter_rss_stop(&routers[i]);
+
+    server->sched = chirouter_sched_start(num_workers);
+    if (server->sched == NULL)
+        return EXIT_FAILURE;
+    for (int i = 0; i < num_routers; i++)
+        if (chirouter_rss_start(&routers[i], 1) != 0)
+            return EXIT_FAILURE;
+
+    char label[32];
+    snprintf(label, sizeof(label), "stealing/%i", num_workers);
+    run_skewed(label, routers, num_routers, templates, num_flows, num_frames, skew, gap_ns);
+
+    for (int i = 0; i < num_routers; i++)
+        chirouter_rss_stop(&routers[i]);
+    chirouter_sched_stop(server->sched);
+    server->sched = NULL;
+
+    for (int i = 0; i < num_routers; i++)
+        chirouter_ctx_destroy(&routers[i]);
+    free(routers);
+    free(templates);
+    free(latencies);
+    latencies = NULL;
+
+    return EXIT_SUCCESS;
+}
+
+
+int main(int argc, char *argv[])
+{
+    server_ctx_t *server;
+    chirouter_ctx_t router;
+    long num_frames = 1000000;
+    int num_flows = 1024;
+    int max_queues = 16;
+    int num_routers = 0;
+    int num_workers = 0;
+    int skew = 50;
+    long gap_ns = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:f:m:r:w:k:i:h")) != -1)
+        switch (opt)
+        {
+        case 'n':
+            num_frames = atol(optarg);
+            break;
+        case 'f':
+            num_flows = atoi(optarg);
+            break;
+        case 'm':
+            max_queues = atoi(optarg);
+            break;
+        case 'r':
+            num_routers = atoi(optarg);
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            break;
+        case 'k':
+            skew = atoi(optarg);
+            break;
+        case 'i':
+            gap_ns = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: chirouter_dispatch_bench [-n FRAMES] [-f FLOWS] [-m MAX_QUEUES]\n"
+                            "                                [-r ROUTERS [-w WORKERS] [-k SKEW] [-i GAP_NS]]\n");
+            return EXIT_FAILURE;
+        }
+
+    if (num_flows < 1 || max_queues < 1 || max_queues > MAX_RSS_QUEUES)
+    {
+        fprintf(stderr, "ERROR: Invalid number of flows or queues\n");
+        return EXIT_FAILURE;
+    }
+
+    if (num_routers < 0 || num_routers > MAX_ROUTERS || skew < 0 || skew > 100 || num_frames < 1)
+    {
+        fprintf(stderr, "ERROR: Invalid number of routers, skew, or frames\n");
+        return EXIT_FAILURE;
+    }
+
+    chirouter_setloglevel(ERROR);
+    chirouter_server_ctx_init(&server);
+    server->frame_sink = bench_sink;
+
+    if (num_routers > 0)
+    {
+        if (num_workers < 1 || num_workers > MAX_SCHED_WORKERS)
+            num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        return bench_skewed(server, num_routers, num_workers, num_flows, num_frames, skew, gap_ns);
+    }
+
+    build_router(server, &router, 0);
+
+    uint8_t (*templates)[FRAME_LEN] = calloc(num_flows, FRAME_LEN);
+    for (int i = 0; i < num_flows; i++)
+        build_frame(&router, templates[i], i);
+
+    printf("# %li frames, %i flows, %li online CPUs\n", num_frames, num_flows, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %12s %10s %8s\n", "queues", "frames/s", "ns/frame", "speedup");
+
+    double base_rate = 0;
+    for (int nqueues = 1; nqueues <= max_queues; nqueues *= 2)
+    {
+        uint64_t start_count = sink_total();
+
+        if (chirouter_rss_start(&router, nqueues) != 0)
+            return EXIT_FAILURE;
+
+        double start = now();
+        for (long i = 0; i < num_frames; i++)
+        {
+            ethernet_frame_t *frame = malloc(sizeof(ethernet_frame_t));
+
+            frame->raw = malloc(FRAME_LEN);
+            memcpy(frame->raw, templates[i % num_flows], FRAME_LEN);
+            frame->length = FRAME_LEN;
+            frame->in_interface = &router.interfaces[0];
+
+            chirouter_rss_dispatch(&router, frame);
+        }
+
+        while (sink_total() - start_count < (uint64_t) num_frames)
+            usleep(100);
+        double elapsed = now() - start;
+
+        chirouter_rss_stop(&router);
+
+        double rate = num_frames / elapsed;
+        if (nqueues == 1)
+            base_rate = rate;
+
+        printf("%8i %12.0f %10.1f %7.2fx\n", nqueues, rate, 1e9 / rate, rate / base_rate);
+    }
+
+    free(templates);
+    chirouter_ctx_destroy(&router);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,464 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Checkpoints
+ *
+ *  (see checkpoint.h for descriptions of functions, parameters, and return values)
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+#include "arp.h"
+#include "fib.h"
+#include "pcap.h"
+#include "utils.h"
+#include "log.h"
+
+#define ARPCACHE_ENTRY_TIMEOUT_NS (ARPCACHE_ENTRY_TIMEOUT * 1000000000ull)
+
+/* Routes are read in chunks of this many routes */
+#define CHECKPOINT_ROUTES_CHUNK (4096)
+
+
+static uint64_t checkpoint_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/* Hashes the routing table files that are loaded into the routers.
+ * The files are identified by their names, sizes and modification
+ * times (instead of their contents, which could be large). */
+static uint64_t checkpoint_files_hash(server_ctx_t *ctx)
+{
+    uint64_t hash = HASH64_INIT;
+    struct stat st;
+
+    for (int i = 0; i < ctx->num_rtable_files; i++)
+    {
+        chirouter_rtable_file_t *rf = &ctx->rtable_files[i];
+
+        hash = hash64(hash, rf->router, strlen(rf->router) + 1);
+        hash = hash64(hash, rf->filename, strlen(rf->filename) + 1);
+        hash = hash64(hash, &rf->is_fib, sizeof(rf->is_fib));
+
+        if (stat(rf->filename, &st) == 0)
+        {
+            hash = hash64(hash, &st.st_size, sizeof(st.st_size));
+            hash = hash64(hash, &st.st_mtim, sizeof(st.st_mtim));
+        }
+    }
+
+    return hash;
+}
+
+
+/* Writes a router to a checkpoint */
+static int checkpoint_write_router(chirouter_ctx_t *r, FILE *f)
+{
+    static const uint8_t padding[8];
+    chirouter_checkpoint_router_t rec;
+    chirouter_arpcache_entry_t arp[ARPCACHE_SIZE];
+    chirouter_checkpoint_arp_t arp_rec[ARPCACHE_SIZE];
+    uint64_t now = chirouter_clock_now(r->clock);
+    uint32_t num_routes = r->fib ? r->fib_base : r->num_rtable_entries;
+    int num_arp, n = 0;
+
+    /* Entries that are about to expire are left out */
+    num_arp = chirouter_arp_cache_snapshot(r, arp);
+    memset(arp_rec, 0, sizeof(arp_rec));
+    for (int i = 0; i < num_arp; i++)
+    {
+        uint64_t age = now - arp[i].time_added;
+
+        if (age >= ARPCACHE_ENTRY_TIMEOUT_NS)
+            continue;
+
+        arp_rec[n].ip = arp[i].ip.s_addr;
+        memcpy(arp_rec[n].mac, arp[i].mac, ETHER_ADDR_LEN);
+        arp_rec[n].lifetime = ARPCACHE_ENTRY_TIMEOUT_NS - age;
+        n++;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    memcpy(rec.name, r->name, strnlen(r->name, MAX_ROUTER_NAMELEN));
+    rec.r_id = r->r_id;
+    rec.num_interfaces = r->num_interfaces;
+    rec.num_routes = num_routes;
+    rec.num_arp_entries = n;
+    rec.fib_size = r->fib ? r->fib->size : 0;
+
+    if (fwrite(&rec, sizeof(rec), 1, f) != 1)
+        return -1;
+
+    for (int i = 0; i < r->num_interfaces; i++)
+    {
+        chirouter_interface_t *iface = &r->interfaces[i];
+        chirouter_checkpoint_iface_t iface_rec;
+
+        memset(&iface_rec, 0, sizeof(iface_rec));
+        memcpy(iface_rec.name, iface->name, strnlen(iface->name, MAX_IFACE_NAMELEN));
+        memcpy(iface_rec.mac, iface->mac, ETHER_ADDR_LEN);
+        iface_rec.pox_iface_id = iface->pox_iface_id;
+        iface_rec.ip = iface->ip.s_addr;
+
+        if (fwrite(&iface_rec, sizeof(iface_rec), 1, f) != 1)
+            return -1;
+    }
+
+    for (uint32_t i = 0; i < num_routes; i++)
+    {
+        chirouter_rtable_entry_t *entry = &r->routing_table[i];
+        chirouter_fib_route_t route;
+
+        memset(&route, 0, sizeof(route));
+        route.dest = entry->dest.s_addr;
+        route.mask = entry->mask.s_addr;
+        route.gw = entry->gw.s_addr;
+        route.metric = entry->metric;
+        route.iface = entry->interface - r->interfaces;
+
+        if (fwrite(&route, sizeof(route), 1, f) != 1)
+            return -1;
+    }
+
+    if (r->fib && (fwrite(r->fib->data, 1, r->fib->size, f) != r->fib->size ||
+                   fwrite(padding, 1, -r->fib->size % 8, f) != -r->fib->size % 8))
+        return -1;
+
+    if (n > 0 && fwrite(arp_rec, sizeof(arp_rec[0]), n, f) != (size_t) n)
+        return -1;
+
+    return 0;
+}
+
+
+/* See checkpoint.h */
+int chirouter_checkpoint_write(server_ctx_t *ctx, const char *filename)
+{
+    size_t len = strlen(filename);
+    char *tmp = malloc(len + sizeof(".XXXXXX"));
+    chirouter_checkpoint_header_t hdr;
+    FILE *f = NULL;
+    bool ok;
+    int fd;
+
+    if (tmp == NULL)
+        return -1;
+
+    /* The routers are not modified while they are running (except
+     * for their ARP caches, which are copied consistently) */
+    pthread_mutex_lock(&ctx->lock_routers);
+
+    if ((ctx->state != RUNNING && !ctx->routers_kept) || ctx->num_routers == 0)
+    {
+        pthread_mutex_unlock(&ctx->lock_routers);
+        free(tmp);
+        return 1;
+    }
+
+    sprintf(tmp, "%s.XXXXXX", filename);
+    if ((fd = mkstemp(tmp)) == -1 || (f = fdopen(fd, "w")) == NULL)
+    {
+        chilog(ERROR, "Could not create %s: %s", tmp, strerror(errno));
+        if (fd != -1)
+        {
+            close(fd);
+            unlink(tmp);
+        }
+        pthread_mutex_unlock(&ctx->lock_routers);
+        free(tmp);
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    hdr.version = CHECKPOINT_VERSION;
+    hdr.byte_order = CHECKPOINT_BYTE_ORDER;
+    hdr.config_hash = ctx->config_hash;
+    hdr.files_hash = checkpoint_files_hash(ctx);
+    hdr.time = checkpoint_now();
+    hdr.num_routers = ctx->num_routers;
+
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    for (int i = 0; ok && i < ctx->num_routers; i++)
+        ok = checkpoint_write_router(&ctx->routers[i], f) == 0;
+
+    pthread_mutex_unlock(&ctx->lock_routers);
+
+    ok = ok && fflush(f) == 0 && fchmod(fd, 0644) == 0 && fsync(fd) == 0;
+
+    if (fclose(f) != 0 || !ok || rename(tmp, filename) != 0)
+    {
+        chilog(ERROR, "Could not write %s: %s", filename, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    free(tmp);
+    return 0;
+}
+
+
+/* Reads a router from a checkpoint into r (which has been initialized
+ * with chirouter_ctx_init). elapsed is the time since the checkpoint
+ * was written. */
+static int checkpoint_read_router(chirouter_ctx_t *r, FILE *f, const char *filename, uint64_t elapsed)
+{
+    chirouter_checkpoint_router_t rec;
+    chirouter_fib_route_t *routes;
+    uint64_t now = chirouter_clock_now(r->clock);
+    int n = 0;
+
+    if (fread(&rec, sizeof(rec), 1, f) != 1)
+        return -1;
+
+    if (rec.num_interfaces == 0 || rec.num_routes > MAX_NUM_RTABLE_ENTRIES ||
+        rec.num_arp_entries > ARPCACHE_SIZE)
+    {
+        chilog(ERROR, "Checkpoint %s is corrupted", filename);
+        return -1;
+    }
+
+    memcpy(r->name, rec.name, MAX_ROUTER_NAMELEN);
+    r->name[MAX_ROUTER_NAMELEN] = '\0';
+    r->r_id = rec.r_id;
+
+    r->interfaces = calloc(rec.num_interfaces, sizeof(chirouter_interface_t));
+    if (r->interfaces == NULL)
+        return -1;
+    r->max_interfaces = rec.num_interfaces;
+
+    for (int i = 0; i < rec.num_interfaces; i++)
+    {
+        chirouter_interface_t *iface = &r->interfaces[i];
+        chirouter_checkpoint_iface_t iface_rec;
+
+        if (fread(&iface_rec, sizeof(iface_rec), 1, f) != 1)
+            return -1;
+
+        memcpy(iface->name, iface_rec.name, MAX_IFACE_NAMELEN);
+        iface->name[MAX_IFACE_NAMELEN] = '\0';
+        memcpy(iface->mac, iface_rec.mac, ETHER_ADDR_LEN);
+        iface->pox_iface_id = iface_rec.pox_iface_id;
+        iface->ip.s_addr = iface_rec.ip;
+
+        if (chirouter_stats_init(&iface->stats) != 0)
+            return -1;
+        r->num_interfaces++;
+    }
+
+    r->routing_table = calloc(rec.num_routes ? rec.num_routes : 1, sizeof(chirouter_rtable_entry_t));
+    routes = calloc(CHECKPOINT_ROUTES_CHUNK, sizeof(chirouter_fib_route_t));
+    if (r->routing_table == NULL || routes == NULL)
+    {
+        free(routes);
+        return -1;
+    }
+    r->max_rtable_entries = rec.num_routes;
+
+    while (r->num_rtable_entries < rec.num_routes)
+    {
+        uint32_t chunk = rec.num_routes - r->num_rtable_entries;
+
+        if (chunk > CHECKPOINT_ROUTES_CHUNK)
+            chunk = CHECKPOINT_ROUTES_CHUNK;
+
+        if (fread(routes, sizeof(chirouter_fib_route_t), chunk, f) != chunk)
+        {
+            free(routes);
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < chunk; i++)
+        {
+            chirouter_rtable_entry_t *entry = &r->routing_table[r->num_rtable_entries];
+
+            if (routes[i].iface >= r->num_interfaces)
+            {
+                chilog(ERROR, "Checkpoint %s is corrupted", filename);
+                free(routes);
+                return -1;
+            }
+
+            entry->dest.s_addr = routes[i].dest;
+            entry->mask.s_addr = routes[i].mask;
+            entry->gw.s_addr = routes[i].gw;
+            entry->metric = routes[i].metric;
+            entry->interface = &r->interfaces[routes[i].iface];
+            r->num_rtable_entries++;
+        }
+    }
+    free(routes);
+
+    if (rec.fib_size > 0)
+    {
+        chirouter_fib_t *fib;
+        void *data = malloc(rec.fib_size);
+
+        if (data == NULL || fread(data, 1, rec.fib_size, f) != rec.fib_size ||
+            fseek(f, -rec.fib_size % 8, SEEK_CUR) != 0)
+        {
+            free(data);
+            return -1;
+        }
+
+        if ((fib = chirouter_fib_from_buffer(data, rec.fib_size, filename)) == NULL)
+            return -1;
+
+        if (chirouter_fib_attach(r, fib) != 0)
+        {
+            chirouter_fib_free(fib);
+            return -1;
+        }
+    }
+
+    /* The router isn't running, so the cache can be written directly */
+    for (uint32_t i = 0; i < rec.num_arp_entries; i++)
+    {
+        chirouter_checkpoint_arp_t arp_rec;
+        uint64_t age;
+
+        if (fread(&arp_rec, sizeof(arp_rec), 1, f) != 1)
+            return -1;
+
+        if (arp_rec.lifetime <= elapsed || arp_rec.lifetime > ARPCACHE_ENTRY_TIMEOUT_NS)
+            continue;
+
+        age = ARPCACHE_ENTRY_TIMEOUT_NS - (arp_rec.lifetime - elapsed);
+        r->arpcache[n].ip.s_addr = arp_rec.ip;
+        memcpy(r->arpcache[n].mac, arp_rec.mac, ETHER_ADDR_LEN);
+        r->arpcache[n].time_added = now > age ? now - age : 0;
+        r->arpcache[n].valid = true;
+        n++;
+    }
+
+    return 0;
+}
+
+
+/* See checkpoint.h */
+int chirouter_checkpoint_restore(server_ctx_t *ctx, const char *filename)
+{
+    chirouter_checkpoint_header_t hdr;
+    uint64_t now = checkpoint_now(), elapsed;
+    FILE *f;
+
+    if ((f = fopen(filename, "r")) == NULL)
+    {
+        chilog(ERROR, "Could not open checkpoint %s: %s", filename, strerror(errno));
+        return -1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0)
+    {
+        chilog(ERROR, "%s is not a checkpoint", filename);
+        fclose(f);
+        return -1;
+    }
+
+    if (hdr.version != CHECKPOINT_VERSION || hdr.byte_order != CHECKPOINT_BYTE_ORDER)
+    {
+        chilog(ERROR, "Checkpoint %s has an unsupported version or byte order", filename);
+        fclose(f);
+        return -1;
+    }
+
+    if (hdr.num_routers == 0 || hdr.num_routers > UINT8_MAX)
+    {
+        chilog(ERROR, "Checkpoint %s is corrupted", filename);
+        fclose(f);
+        return -1;
+    }
+
+    if (hdr.files_hash != checkpoint_files_hash(ctx))
+    {
+        chilog(WARNING, "Checkpoint %s was written with other routing table files. Not restoring it.", filename);
+        fclose(f);
+        return 1;
+    }
+
+    elapsed = now > hdr.time ? now - hdr.time : 0;
+
+    ctx->routers = calloc(hdr.num_routers, sizeof(chirouter_ctx_t));
+    if (ctx->routers == NULL)
+    {
+        fclose(f);
+        return -1;
+    }
+    ctx->max_routers = hdr.num_routers;
+    ctx->routers_kept = true;
+
+    for (uint32_t i = 0; i < hdr.num_routers; i++)
+    {
+        chirouter_ctx_t *r = &ctx->routers[i];
+
+        ctx->num_routers++;
+        r->server = ctx;
+
+        if (chirouter_ctx_init(r) != 0 || checkpoint_read_router(r, f, filename, elapsed) != 0)
+        {
+            chilog(ERROR, "Could not restore router %u from checkpoint %s", i, filename);
+            fclose(f);
+            chirouter_server_ctx_free_routers(ctx);
+            return -1;
+        }
+    }
+
+    fclose(f);
+
+    if (ctx->pcap_writer && chirouter_pcap_writer_set_interfaces(ctx->pcap_writer, ctx) != 0)
+    {
+        chilog(ERROR, "Could not write the headers of the capture file");
+        chirouter_server_ctx_free_routers(ctx);
+        return -1;
+    }
+
+    ctx->config_hash = hdr.config_hash;
+
+    return 0;
+}
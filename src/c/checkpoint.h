@@ -0,0 +1,163 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Checkpoints
+ *
+ *  A checkpoint has the state of all the routers: their interfaces,
+ *  routing tables (including their FIB snapshots, see fib.h) and ARP
+ *  caches, so chirouter can be restarted without losing it. It is
+ *  written when chirouter is asked to exit (with SIGTERM), and read
+ *  when it starts again.
+ *
+ *  The restored routers are kept just like the routers of a controller
+ *  that disconnected (see HELLO in server.h): if the controller connects
+ *  with the same configuration they were configured with, they resume
+ *  with their ARP caches (so the first frames don't have to wait for
+ *  ARP requests), and otherwise they are discarded.
+ *
+ *  The file has a header (chirouter_checkpoint_header_t), followed by
+ *  the routers. Each router (chirouter_checkpoint_router_t) is followed
+ *  by its interfaces (chirouter_checkpoint_iface_t), the routes that are
+ *  not in its FIB (chirouter_fib_route_t), its FIB (a whole FIB snapshot
+ *  file, padded to a multiple of 8 bytes), and its ARP cache entries
+ *  (chirouter_checkpoint_arp_t). Like in a FIB snapshot, the integers
+ *  are in the byte order of the machine that wrote the file, except the
+ *  addresses, which are in network order.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stdint.h>
+
+#include "chirouter.h"
+#include "server.h"
+
+#define CHECKPOINT_MAGIC "CHIRCKP"
+#define CHECKPOINT_VERSION (1)
+#define CHECKPOINT_BYTE_ORDER (0x01020304u)
+
+typedef struct chirouter_checkpoint_header
+{
+    char magic[8];             /* CHECKPOINT_MAGIC (with the terminating zero) */
+    uint32_t version;          /* CHECKPOINT_VERSION */
+    uint32_t byte_order;       /* CHECKPOINT_BYTE_ORDER */
+
+    /* Hash of the configuration messages (see HELLO in server.h) */
+    uint64_t config_hash;
+
+    /* Hash of the routing table files that were loaded into the
+     * routers (their names, sizes and modification times) */
+    uint64_t files_hash;
+
+    /* When the checkpoint was written (CLOCK_REALTIME, in ns) */
+    uint64_t time;
+
+    uint32_t num_routers;
+    uint32_t reserved;
+} chirouter_checkpoint_header_t;
+
+typedef struct chirouter_checkpoint_router
+{
+    char name[MAX_ROUTER_NAMELEN + 1];
+    uint8_t r_id;
+    uint16_t num_interfaces;
+    uint32_t num_routes;
+    uint32_t num_arp_entries;
+
+    /* Size of the FIB snapshot (0 if the router has none) */
+    uint64_t fib_size;
+} chirouter_checkpoint_router_t;
+
+typedef struct chirouter_checkpoint_iface
+{
+    char name[MAX_IFACE_NAMELEN + 1];
+    uint8_t mac[ETHER_ADDR_LEN];
+    uint8_t pox_iface_id;
+    uint8_t reserved[4];
+    uint32_t ip;
+} chirouter_checkpoint_iface_t;
+
+typedef struct chirouter_checkpoint_arp
+{
+    uint32_t ip;
+    uint8_t mac[ETHER_ADDR_LEN];
+    uint8_t reserved[6];
+
+    /* How long the entry had left in the cache (in ns) */
+    uint64_t lifetime;
+} chirouter_checkpoint_arp_t;
+
+
+/*
+ * chirouter_checkpoint_write - Write a checkpoint of the routers
+ *
+ * The routers must be configured (either running, or kept after the
+ * controller disconnected). The checkpoint is written to a temporary
+ * file, which is then renamed, so the file is replaced atomically.
+ *
+ * ctx: Server context
+ *
+ * filename: File
+ *
+ * Returns: 0 on success, 1 if there are no routers to checkpoint,
+ *          -1 if an error happens.
+ */
+int chirouter_checkpoint_write(server_ctx_t *ctx, const char *filename);
+
+
+/*
+ * chirouter_checkpoint_restore - Restore the routers from a checkpoint
+ *
+ * The routers are restored as kept routers (see HELLO in server.h).
+ * The remaining lifetimes of the ARP cache entries are reduced by the
+ * time that has passed since the checkpoint was written (and the ones
+ * that have expired are not restored).
+ *
+ * This function must be called after the routing table files are
+ * set (since the checkpoint is not restored if they have changed),
+ * and before the server starts running.
+ *
+ * ctx: Server context (without routers)
+ *
+ * filename: File
+ *
+ * Returns: 0 on success, 1 if the checkpoint is for other routing
+ *          table files, -1 if an error happens.
+ */
+int chirouter_checkpoint_restore(server_ctx_t *ctx, const char *filename);
+
+#endif /* CHECKPOINT_H_ */
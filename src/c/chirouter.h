@@ -65,16 +65,20 @@
 #include "protocols/ipv4.h"
 #include "protocols/icmp.h"
 #include "log.h"
+#include "stats.h"
+#include "latency.h"
+#include "clock.h"
 
 #define MAX_ROUTER_NAMELEN (8u)
 #define MAX_IFACE_NAMELEN (32u)
 #define MAX_NUM_INTERFACES (65536u)
-#define MAX_NUM_RTABLE_ENTRIES (65536u)
+#define MAX_NUM_RTABLE_ENTRIES (16777216u)
 #define ARPCACHE_SIZE (100u)
 #define ARPCACHE_ENTRY_TIMEOUT (15u)
 
 
 typedef struct server_ctx server_ctx_t;
+typedef struct chirouter_rss_queue chirouter_rss_queue_t;
 
 
 /* Represents a single Ethernet interface */
@@ -97,6 +101,9 @@ typedef struct chirouter_interface
     /* Interface ID for capture file */
     uint32_t pcap_iface_id;
 
+    /* Statistics counters (see stats.h) */
+    chirouter_stats_t stats;
+
 } chirouter_interface_t;
 
 
@@ -111,6 +118,14 @@ typedef struct ethernet_frame
 
     /* Interface on which the frame arrived */
     chirouter_interface_t *in_interface;
+
+    /*** NOTE: You should NOT use or modify the fields below ***/
+
+    /* Latency sample, while the frame is waiting in an RSS queue */
+    chirouter_lat_sample_t lat;
+
+    /* Flight recorder event for the frame (see flightrec.h) */
+    uint64_t fr_event;
 } ethernet_frame_t;
 
 
@@ -143,8 +158,8 @@ typedef struct chirouter_arpcache_entry
     /* IP address */
     struct in_addr ip;
 
-    /* Time when this entry was created */
-    time_t time_added;
+    /* Time when this entry was created (on the router's clock, in ns) */
+    uint64_t time_added;
 
     /* Is this a valid entry?
      * If an entry is not valid, this means
@@ -177,9 +192,10 @@ typedef struct chirouter_pending_arp_req
     chirouter_interface_t *out_interface;
 
     /* The number of times this ARP request has been sent,
-     * and the last time we sent the request */
+     * and the last time we sent the request (on the
+     * router's clock, in ns; see chirouter_clock_now) */
     uint32_t times_sent;
-    time_t last_sent;
+    uint64_t last_sent;
 
     /* List of Ethernet frames containing IP datagrams destined
      * to "ip", but which we cannot yet send because we do not
@@ -206,10 +222,12 @@ typedef struct chirouter_ctx
     chirouter_interface_t* interfaces;
 
     /* Number of routing table entries */
-    uint16_t num_rtable_entries;
+    uint32_t num_rtable_entries;
 
     /* Pointer to array of routing table entries. Array is
-     * guaranteed to be of size "num_rtable_entries" */
+     * guaranteed to be of size "num_rtable_entries".
+     * The routing table is not modified once the router starts
+     * running, so it can be read concurrently without locking. */
     chirouter_rtable_entry_t* routing_table;
 
     /* ARP cache */
@@ -227,16 +245,51 @@ typedef struct chirouter_ctx
 
     /*** NOTE: You should NOT use or modify the fields below ***/
 
-    /* ARP thread */
+    /* Sequence counter for the ARP cache. It is odd while the
+     * cache is being modified (with lock_arp held), which allows
+     * chirouter_arp_cache_lookup_mac to read the cache without
+     * taking the lock. */
+    uint32_t arpcache_seq;
+
+    /* Number of pending ARP requests, and of frames withheld in
+     * them. Only modified with lock_arp held, but can be read
+     * at any time (e.g., to export them as metrics). */
+    uint32_t num_pending_arp_reqs;
+    uint32_t num_withheld_frames;
+
+    /* Clock used for all ARP timing (the monotonic clock,
+     * unless a tool sets a virtual clock before starting) */
+    chirouter_clock_t *clock;
+
+    /* ARP thread (see chirouter_arp_start), and the flag
+     * that tells it to stop (set through the clock) */
     pthread_t arp_thread;
+    bool arp_running;
+    bool arp_stop;
+
+    /* RSS queues (and their worker threads). If there are
+     * no RSS queues, frames are processed by the server thread. */
+    chirouter_rss_queue_t *rss_queues;
+    uint16_t num_rss_queues;
 
     /* Used during configuration of router */
     uint16_t max_interfaces;
-    uint16_t max_rtable_entries;
+    uint32_t max_rtable_entries;
+
+    /* If set, the routing table entries from fib_base on are
+     * looked up with this FIB snapshot (see fib.h) */
+    struct chirouter_fib *fib;
+    uint32_t fib_base;
 
     /* Router ID for POX controller */
     uint8_t r_id;
 
+    /* Statistics counters (see stats.h) */
+    chirouter_stats_t stats;
+
+    /* Latency histograms (see latency.h) */
+    chirouter_latency_t latency;
+
     /* Server context */
     server_ctx_t *server;
 } chirouter_ctx_t;
@@ -270,6 +323,7 @@ int chirouter_ctx_init(chirouter_ctx_t *ctx);
 int chirouter_ctx_load_rtable(chirouter_ctx_t *ctx, const char* rtable_filename);
 int chirouter_ctx_add_iface(chirouter_ctx_t *ctx, const char* iface, uint8_t mac[ETHER_ADDR_LEN], struct in_addr *ip);
 void chirouter_ctx_log(chirouter_ctx_t *ctx, loglevel_t loglevel);
+void chirouter_ctx_log_stats(chirouter_ctx_t *ctx, loglevel_t loglevel);
 int chirouter_ctx_destroy(chirouter_ctx_t *ctx);
 
 int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *frame);
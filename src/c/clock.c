@@ -0,0 +1,162 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Clocks
+ *
+ *  see clock.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "clock.h"
+
+#define BILLION (1000000000ull)
+
+static chirouter_clock_t monotonic_clock;
+static pthread_once_t monotonic_clock_once = PTHREAD_ONCE_INIT;
+
+
+/* The coarse clock is read without a system call, but only
+ * moves every few milliseconds (see clock.h) */
+static uint64_t monotonic_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+
+/* See clock.h */
+int chirouter_clock_init(chirouter_clock_t *clock, bool is_virtual)
+{
+    pthread_condattr_t attr;
+
+    clock->is_virtual = is_virtual;
+    clock->now = 0;
+
+    if (pthread_mutex_init(&clock->lock, NULL) != 0)
+        return -1;
+
+    /* Waits on a monotonic clock have CLOCK_MONOTONIC deadlines
+     * (which CLOCK_MONOTONIC_COARSE lags slightly behind) */
+    if (pthread_condattr_init(&attr) != 0 ||
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+        pthread_cond_init(&clock->cond, &attr) != 0)
+    {
+        pthread_mutex_destroy(&clock->lock);
+        return -1;
+    }
+
+    pthread_condattr_destroy(&attr);
+
+    return 0;
+}
+
+
+/* See clock.h */
+void chirouter_clock_destroy(chirouter_clock_t *clock)
+{
+    pthread_cond_destroy(&clock->cond);
+    pthread_mutex_destroy(&clock->lock);
+}
+
+
+static void monotonic_clock_init()
+{
+    chirouter_clock_init(&monotonic_clock, false);
+}
+
+
+/* See clock.h */
+chirouter_clock_t *chirouter_clock_monotonic()
+{
+    pthread_once(&monotonic_clock_once, monotonic_clock_init);
+    return &monotonic_clock;
+}
+
+
+/* See clock.h */
+uint64_t chirouter_clock_now(chirouter_clock_t *clock)
+{
+    if (!clock->is_virtual)
+        return monotonic_now();
+
+    return __atomic_load_n(&clock->now, __ATOMIC_ACQUIRE);
+}
+
+
+/* See clock.h */
+void chirouter_clock_advance(chirouter_clock_t *clock, uint64_t ns)
+{
+    pthread_mutex_lock(&clock->lock);
+    __atomic_store_n(&clock->now, clock->now + ns, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&clock->cond);
+    pthread_mutex_unlock(&clock->lock);
+}
+
+
+/* See clock.h */
+int chirouter_clock_wait(chirouter_clock_t *clock, uint64_t deadline, bool *stop)
+{
+    struct timespec ts = { .tv_sec = deadline / BILLION, .tv_nsec = deadline % BILLION };
+    int rc;
+
+    pthread_mutex_lock(&clock->lock);
+
+    while (!*stop && chirouter_clock_now(clock) < deadline)
+    {
+        if (clock->is_virtual)
+            pthread_cond_wait(&clock->cond, &clock->lock);
+        else if (pthread_cond_timedwait(&clock->cond, &clock->lock, &ts) == ETIMEDOUT)
+            break;  /* The coarse clock may not have reached the deadline yet */
+    }
+    rc = *stop ? 1 : 0;
+
+    pthread_mutex_unlock(&clock->lock);
+
+    return rc;
+}
+
+
+/* See clock.h */
+void chirouter_clock_interrupt(chirouter_clock_t *clock, bool *stop)
+{
+    pthread_mutex_lock(&clock->lock);
+    *stop = true;
+    pthread_cond_broadcast(&clock->cond);
+    pthread_mutex_unlock(&clock->lock);
+}
@@ -0,0 +1,170 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Clocks
+ *
+ *  All the ARP timing (the age of ARP cache entries, when pending ARP
+ *  requests were sent, and the ticks of the ARP thread) is measured
+ *  with the clock of the router, in nanoseconds. A clock can be:
+ *
+ *  - A monotonic clock (the default, shared by all routers), which
+ *    follows CLOCK_MONOTONIC_COARSE (ARP timing is in whole seconds,
+ *    so its resolution of a few milliseconds is enough).
+ *
+ *  - A virtual clock, which only moves when chirouter_clock_advance is
+ *    called. This allows tools to run ARP timeouts (e.g., five retries
+ *    of an ARP request, or the expiry of an ARP cache entry) in a
+ *    fraction of the time they take in real time. Tools that want them
+ *    to be deterministic too can run chirouter_arp_tick themselves
+ *    instead of starting ARP threads.
+ *
+ *  Threads can wait on a clock until a given time, or until they are
+ *  told to stop (see chirouter_clock_wait and chirouter_clock_interrupt).
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef struct chirouter_clock
+{
+    bool is_virtual;
+
+    /* Current time of a virtual clock, in nanoseconds */
+    uint64_t now;
+
+    /* Protects now, and the stop flags of the threads waiting on the
+     * clock. The condition is signaled when the time of a virtual clock
+     * changes, and when a thread is told to stop. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} chirouter_clock_t;
+
+
+/*
+ * chirouter_clock_init - Initialize a clock
+ *
+ * clock: Clock
+ *
+ * is_virtual: true for a virtual clock (which starts at zero),
+ *             false for a monotonic clock
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_clock_init(chirouter_clock_t *clock, bool is_virtual);
+
+
+/*
+ * chirouter_clock_destroy - Free the resources of a clock
+ *
+ * No thread can be waiting on the clock.
+ *
+ * clock: Clock
+ *
+ * Returns: nothing.
+ */
+void chirouter_clock_destroy(chirouter_clock_t *clock);
+
+
+/*
+ * chirouter_clock_monotonic - Get the default clock
+ *
+ * Returns: The monotonic clock that routers use by default (which
+ *          is never destroyed).
+ */
+chirouter_clock_t *chirouter_clock_monotonic();
+
+
+/*
+ * chirouter_clock_now - Get the current time of a clock
+ *
+ * Can be called from any thread.
+ *
+ * clock: Clock
+ *
+ * Returns: Current time, in nanoseconds.
+ */
+uint64_t chirouter_clock_now(chirouter_clock_t *clock);
+
+
+/*
+ * chirouter_clock_advance - Advance a virtual clock
+ *
+ * Wakes up the threads that wait until a time that has been reached.
+ *
+ * clock: Virtual clock
+ *
+ * ns: Nanoseconds to advance the clock by
+ *
+ * Returns: nothing.
+ */
+void chirouter_clock_advance(chirouter_clock_t *clock, uint64_t ns);
+
+
+/*
+ * chirouter_clock_wait - Wait until a clock reaches a given time
+ *
+ * clock: Clock
+ *
+ * deadline: Time to wait until, in nanoseconds
+ *
+ * stop: Flag that tells the thread to stop waiting. It must only be
+ *       set with chirouter_clock_interrupt.
+ *
+ * Returns: 0 if the deadline was reached, 1 if the thread was told to stop.
+ */
+int chirouter_clock_wait(chirouter_clock_t *clock, uint64_t deadline, bool *stop);
+
+
+/*
+ * chirouter_clock_interrupt - Tell a thread to stop waiting on a clock
+ *
+ * Sets a stop flag passed to chirouter_clock_wait, and wakes up the
+ * threads that wait on the clock. Waits that start after this return
+ * immediately, until the flag is cleared.
+ *
+ * clock: Clock
+ *
+ * stop: Stop flag
+ *
+ * Returns: nothing.
+ */
+void chirouter_clock_interrupt(chirouter_clock_t *clock, bool *stop);
+
+#endif /* CLOCK_H_ */
@@ -54,10 +54,19 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 #include "utlist.h"
 #include "chirouter.h"
 #include "log.h"
 #include "arp.h"
+#include "fib.h"
+
+/* Large routing tables are only partially logged */
+#define CTX_LOG_MAX_RTABLE_ENTRIES (256u)
+
 
 /*
  * chirouter_ctx_init - Initializes a router context
@@ -71,8 +80,292 @@ int chirouter_ctx_init(chirouter_ctx_t *ctx)
     pthread_mutex_init(&ctx->lock_arp, NULL);
 
     ctx->pending_arp_reqs = NULL;
+    ctx->clock = chirouter_clock_monotonic();
+
+    if(chirouter_stats_init(&ctx->stats) != 0)
+        return -1;
+
+    if(chirouter_latency_init(&ctx->latency) != 0)
+        return -1;
+
+    return 0;
+}
+
+
+/* Blanks that separate the fields of a routing table file */
+static inline bool rtable_is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+
+/* Parses a dotted-quad IPv4 address at *p, and advances *p past it.
+ * Returns false if there isn't one. The address is in network order. */
+static bool rtable_parse_ip(const char **p, const char *end, uint32_t *ip)
+{
+    const char *s = *p;
+    uint32_t addr = 0;
+
+    for(int i = 0; i < 4; i++)
+    {
+        uint32_t octet = 0;
+        int digits = 0;
+
+        if(i > 0)
+        {
+            if(s == end || *s != '.')
+                return false;
+            s++;
+        }
+
+        while(s < end && *s >= '0' && *s <= '9' && digits < 3)
+        {
+            octet = octet * 10 + (*s++ - '0');
+            digits++;
+        }
+
+        if(digits == 0 || octet > 255)
+            return false;
+        addr = (addr << 8) | octet;
+    }
+
+    *ip = htonl(addr);
+    *p = s;
+    return true;
+}
+
+
+/* Parses an unsigned decimal number (of at most max) at *p,
+ * and advances *p past it. Returns false if there isn't one. */
+static bool rtable_parse_uint(const char **p, const char *end, uint32_t max, uint32_t *value)
+{
+    const char *s = *p;
+    uint64_t v = 0;
+
+    if(s == end || *s < '0' || *s > '9')
+        return false;
+
+    while(s < end && *s >= '0' && *s <= '9')
+    {
+        v = v * 10 + (*s++ - '0');
+        if(v > max)
+            return false;
+    }
+
+    *value = v;
+    *p = s;
+    return true;
+}
+
+
+/* Skips the blanks at *p. Returns false if the field (at *p)
+ * wasn't followed by a blank or by the end of the line. */
+static bool rtable_next_field(const char **p, const char *end)
+{
+    const char *s = *p;
+
+    if(s < end && !rtable_is_blank(*s))
+        return false;
+
+    while(s < end && rtable_is_blank(*s))
+        s++;
+
+    *p = s;
+    return true;
+}
+
+
+/*
+ * chirouter_ctx_load_rtable - Load routing table entries from a file
+ *
+ * The file has one entry per line, in one of the following formats:
+ *
+ *     <destination> <gateway> <mask> <interface> [<metric>]
+ *     <destination>/<prefix length> <gateway> <interface> [<metric>]
+ *
+ * Where the interface is given by its name, and the gateway is 0.0.0.0
+ * for networks that are directly connected. Blank lines, and everything
+ * after a '#', are ignored. The entries are added after the ones that
+ * the router already has.
+ *
+ * This function must be called before the router starts running
+ * (the routing table can't be modified while it is running).
+ *
+ * ctx: Router context
+ *
+ * rtable_filename: Routing table file
+ *
+ * Returns: 0 on success, -1 if an error happens (in which case
+ *          the routing table is left as it was).
+ */
+int chirouter_ctx_load_rtable(chirouter_ctx_t *ctx, const char* rtable_filename)
+{
+    struct stat st;
+    const char *data, *line, *end;
+    chirouter_interface_t *iface = NULL;
+    chirouter_rtable_entry_t *table;
+    uint32_t num_entries = ctx->num_rtable_entries;
+    size_t max_lines = 1;
+    unsigned int lineno = 0;
+    int fd;
+
+    if((fd = open(rtable_filename, O_RDONLY)) == -1 || fstat(fd, &st) != 0)
+    {
+        chilog(ERROR, "Could not open routing table file %s", rtable_filename);
+        if(fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    if(st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        chilog(ERROR, "Could not read routing table file %s", rtable_filename);
+        return -1;
+    }
+    madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+    end = data + st.st_size;
+
+    /* The number of lines bounds the number of entries, so the
+     * table only has to be allocated once (and trimmed at the end) */
+    for(line = data; (line = memchr(line, '\n', end - line)) != NULL; line++)
+        max_lines++;
+
+    if(num_entries + max_lines > MAX_NUM_RTABLE_ENTRIES)
+        max_lines = MAX_NUM_RTABLE_ENTRIES - num_entries;
+
+    table = realloc(ctx->routing_table, (num_entries + max_lines) * sizeof(chirouter_rtable_entry_t));
+    if(table == NULL)
+    {
+        chilog(ERROR, "Not enough memory for the routing table in %s", rtable_filename);
+        munmap((void *) data, st.st_size);
+        return -1;
+    }
+    ctx->routing_table = table;
+
+    for(line = data; line < end; )
+    {
+        const char *eol = memchr(line, '\n', end - line);
+        const char *p = line, *name;
+        uint32_t dest, gw, mask, prefix, metric = 0;
+        size_t name_len;
+
+        if(eol == NULL)
+            eol = end;
+        lineno++;
+
+        /* Comments end the line */
+        const char *hash = memchr(line, '#', eol - line);
+        const char *lend = hash ? hash : eol;
+
+        line = eol + 1;
+
+        while(p < lend && rtable_is_blank(*p))
+            p++;
+        if(p == lend)
+            continue;
+
+        if(num_entries == MAX_NUM_RTABLE_ENTRIES)
+        {
+            chilog(ERROR, "%s:%u: The routing table can't have more than %u entries", rtable_filename, lineno, MAX_NUM_RTABLE_ENTRIES);
+            goto error;
+        }
+
+        if(!rtable_parse_ip(&p, lend, &dest))
+        {
+            chilog(ERROR, "%s:%u: Invalid destination network", rtable_filename, lineno);
+            goto error;
+        }
+
+        if(p < lend && *p == '/')
+        {
+            p++;
+            if(!rtable_parse_uint(&p, lend, 32, &prefix) || !rtable_next_field(&p, lend) ||
+               !rtable_parse_ip(&p, lend, &gw) || !rtable_next_field(&p, lend))
+            {
+                chilog(ERROR, "%s:%u: Invalid prefix length or gateway", rtable_filename, lineno);
+                goto error;
+            }
+            mask = prefix ? htonl(0xFFFFFFFFu << (32 - prefix)) : 0;
+        }
+        else if(!rtable_next_field(&p, lend) ||
+                !rtable_parse_ip(&p, lend, &gw) || !rtable_next_field(&p, lend) ||
+                !rtable_parse_ip(&p, lend, &mask) || !rtable_next_field(&p, lend))
+        {
+            chilog(ERROR, "%s:%u: Invalid gateway or mask", rtable_filename, lineno);
+            goto error;
+        }
+
+        name = p;
+        while(p < lend && !rtable_is_blank(*p))
+            p++;
+        name_len = p - name;
+
+        /* Routing tables only use a few interfaces, so
+         * consecutive entries are likely to use the same one */
+        if(iface == NULL || strncmp(iface->name, name, name_len) || iface->name[name_len] != '\0')
+        {
+            iface = NULL;
+            for(int i = 0; i < ctx->num_interfaces; i++)
+                if(!strncmp(ctx->interfaces[i].name, name, name_len) && ctx->interfaces[i].name[name_len] == '\0')
+                {
+                    iface = &ctx->interfaces[i];
+                    break;
+                }
+        }
+
+        if(iface == NULL)
+        {
+            chilog(ERROR, "%s:%u: Router %s has no interface %.*s", rtable_filename, lineno, ctx->name, (int) name_len, name);
+            goto error;
+        }
+
+        if(!rtable_next_field(&p, lend) || (p < lend && (!rtable_parse_uint(&p, lend, UINT16_MAX, &metric) ||
+                                                         !rtable_next_field(&p, lend) || p != lend)))
+        {
+            chilog(ERROR, "%s:%u: Invalid metric", rtable_filename, lineno);
+            goto error;
+        }
+
+        if((dest & mask) != dest)
+        {
+            chilog(ERROR, "%s:%u: Destination network has bits set outside of the mask", rtable_filename, lineno);
+            goto error;
+        }
+
+        chirouter_rtable_entry_t *entry = &table[num_entries++];
+
+        entry->dest.s_addr = dest;
+        entry->mask.s_addr = mask;
+        entry->gw.s_addr = gw;
+        entry->metric = metric;
+        entry->interface = iface;
+    }
+
+    munmap((void *) data, st.st_size);
+
+    /* Give back the space reserved for blank lines and comments */
+    if(num_entries > 0 && (table = realloc(ctx->routing_table, num_entries * sizeof(chirouter_rtable_entry_t))) != NULL)
+        ctx->routing_table = table;
+
+    chilog(DEBUG, "Loaded %u routing table entries from %s", num_entries - ctx->num_rtable_entries, rtable_filename);
+
+    ctx->num_rtable_entries = num_entries;
+    if(ctx->max_rtable_entries < num_entries)
+        ctx->max_rtable_entries = num_entries;
 
     return 0;
+
+error:
+    munmap((void *) data, st.st_size);
+    return -1;
 }
 
 
@@ -120,20 +413,54 @@ void chirouter_ctx_log(chirouter_ctx_t *ctx, loglevel_t loglevel)
     {
         chilog(loglevel, "%-16s%-16s%-16s%-16s", "Destination", "Gateway", "Mask", "Iface");
 
-        for(int i=0; i < ctx->num_rtable_entries; i++)
+        for(uint32_t i=0; i < ctx->num_rtable_entries && i < CTX_LOG_MAX_RTABLE_ENTRIES; i++)
         {
             chirouter_rtable_entry_t *entry = &ctx->routing_table[i];
+            char dest[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN], mask[INET_ADDRSTRLEN];
 
-            char* dest = strdup(inet_ntoa(entry->dest));
-            char* gw = strdup(inet_ntoa(entry->gw));
-            char* mask = strdup(inet_ntoa(entry->mask));
+            inet_ntop(AF_INET, &entry->dest, dest, sizeof(dest));
+            inet_ntop(AF_INET, &entry->gw, gw, sizeof(gw));
+            inet_ntop(AF_INET, &entry->mask, mask, sizeof(mask));
 
             chilog(loglevel, "%-16s%-16s%-16s%-16s", dest, gw, mask, entry->interface->name);
-
-            free(dest);
-            free(gw);
-            free(mask);
         }
+
+        if(ctx->num_rtable_entries > CTX_LOG_MAX_RTABLE_ENTRIES)
+            chilog(loglevel, "(%u more entries not shown)", ctx->num_rtable_entries - CTX_LOG_MAX_RTABLE_ENTRIES);
+    }
+}
+
+
+/*
+ * chirouter_ctx_log_stats - Log the (non-zero) statistics counters of a router
+ *
+ * ctx: Router context
+ *
+ * loglevel: Log level
+ *
+ * Returns: nothing.
+ */
+void chirouter_ctx_log_stats(chirouter_ctx_t *ctx, loglevel_t loglevel)
+{
+    uint64_t values[CHIROUTER_STAT_MAX];
+
+    if(!chilog_enabled(loglevel))
+        return;
+
+    chirouter_stats_read(&ctx->stats, values);
+    chilog(loglevel, "STATISTICS FOR ROUTER %s", ctx->name);
+    for(int i=0; i < CHIROUTER_STAT_MAX; i++)
+        if(values[i] > 0)
+            chilog(loglevel, "  %-24s %lu", chirouter_stat_name(i), values[i]);
+
+    for(int i=0; i < ctx->num_interfaces; i++)
+    {
+        chirouter_interface_t *iface = &ctx->interfaces[i];
+
+        chirouter_stats_read(&iface->stats, values);
+        chilog(loglevel, "  %s: rx %lu packets (%lu bytes), tx %lu packets (%lu bytes)", iface->name,
+                         values[CHIROUTER_STAT_RX_PACKETS], values[CHIROUTER_STAT_RX_BYTES],
+                         values[CHIROUTER_STAT_TX_PACKETS], values[CHIROUTER_STAT_TX_BYTES]);
     }
 }
 
@@ -154,10 +481,16 @@ int chirouter_ctx_destroy(chirouter_ctx_t *ctx)
 
     DL_FOREACH_SAFE(ctx->pending_arp_reqs, elt, tmp)
     {
-        chirouter_arp_pending_req_free_frames(elt);
-        DL_DELETE(ctx->pending_arp_reqs, elt);
-        free(elt);
+        chirouter_arp_pending_req_remove(ctx, elt);
     }
 
+    for(int i = 0; i < ctx->num_interfaces; i++)
+        chirouter_stats_free(&ctx->interfaces[i].stats);
+    chirouter_stats_free(&ctx->stats);
+    chirouter_latency_free(&ctx->latency);
+
+    chirouter_fib_free(ctx->fib);
+    ctx->fib = NULL;
+
     return 0;
 }
@@ -0,0 +1,611 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Receive-side scaling (RSS) dispatch of inbound frames
+ *
+ *  see dispatch.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <arpa/inet.h>
+
+#include "dispatch.h"
+#include "server.h"
+#include "log.h"
+#include "flightrec.h"
+
+/* Number of times an idle worker polls its queue before going to sleep */
+#define RSS_SPIN_COUNT (2048)
+
+#define IP_OFFMASK (0x1FFF)
+#define IP_MF (0x2000)
+
+#define RSS_QUEUE_EMPTY(q) (__atomic_load_n(&(q)->head, __ATOMIC_ACQUIRE) == (q)->tail)
+
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+
+/* Murmur3 mixing steps */
+static inline uint32_t rss_mix(uint32_t h, uint32_t k)
+{
+    k *= 0xcc9e2d51;
+    k = (k << 15) | (k >> 17);
+    k *= 0x1b873593;
+    h ^= k;
+    h = (h << 13) | (h >> 19);
+    return h * 5 + 0xe6546b64;
+}
+
+static inline uint32_t rss_fmix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+
+/* See dispatch.h */
+uint32_t chirouter_rss_hash(const uint8_t *raw, size_t len)
+{
+    const ethhdr_t *hdr = (const ethhdr_t *) raw;
+
+    if (len < sizeof(ethhdr_t) + sizeof(iphdr_t) || ntohs(hdr->type) != ETHERTYPE_IP)
+        return 0;
+
+    const iphdr_t *ip_hdr = (const iphdr_t *) (raw + sizeof(ethhdr_t));
+    uint32_t h = 0;
+
+    h = rss_mix(h, ip_hdr->src);
+    h = rss_mix(h, ip_hdr->dst);
+    h = rss_mix(h, ip_hdr->proto);
+
+    /* Only use the ports if every fragment of the datagram would
+     * carry them. Otherwise, the fragments of a single datagram
+     * could end up in different queues. */
+    size_t l4_offset = sizeof(ethhdr_t) + ip_hdr->ihl * 4;
+    bool is_fragment = (ntohs(ip_hdr->off) & (IP_MF | IP_OFFMASK)) != 0;
+
+    if ((ip_hdr->proto == IPPROTO_TCP || ip_hdr->proto == IPPROTO_UDP) &&
+        !is_fragment && len >= l4_offset + 4)
+    {
+        uint32_t ports;
+        memcpy(&ports, raw + l4_offset, sizeof(ports));
+        h = rss_mix(h, ports);
+    }
+
+    return rss_fmix(h);
+}
+
+
+/* Removes the oldest frame from the queue. Must only be called
+ * from the thread that is running the queue. Returns NULL if the
+ * queue is empty. */
+static ethernet_frame_t *chirouter_rss_queue_pop(chirouter_rss_queue_t *q)
+{
+    uint32_t tail = q->tail;
+
+    if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail)
+        return NULL;
+
+    ethernet_frame_t *frame = q->frames[tail & (RSS_QUEUE_SIZE - 1)];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return frame;
+}
+
+
+/* Waits until the queue is non-empty. Returns false if the
+ * worker has been asked to stop. */
+static bool chirouter_rss_queue_wait(chirouter_rss_queue_t *q)
+{
+    for (int i = 0; i < RSS_SPIN_COUNT; i++)
+    {
+        if (__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE))
+            return false;
+        if (!RSS_QUEUE_EMPTY(q))
+            return true;
+        cpu_relax();
+    }
+
+    pthread_mutex_lock(&q->lock);
+    __atomic_store_n(&q->sleeping, true, __ATOMIC_RELAXED);
+
+    /* Pairs with the fence in chirouter_rss_dispatch, so that either
+     * we see the new frame or the producer sees that we're asleep */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    while (RSS_QUEUE_EMPTY(q) && !q->stop)
+        pthread_cond_wait(&q->wakeup, &q->lock);
+
+    __atomic_store_n(&q->sleeping, false, __ATOMIC_RELAXED);
+    bool stop = q->stop;
+    pthread_mutex_unlock(&q->lock);
+
+    return !stop;
+}
+
+
+/* Processes (and frees) a single frame taken from an RSS queue */
+static void chirouter_rss_process_frame(chirouter_rss_queue_t *q, ethernet_frame_t *frame)
+{
+    chirouter_ctx_t *ctx = q->router;
+    int rc;
+
+    chirouter_lat_cur = frame->lat;
+    chirouter_latency_mark(&ctx->latency, CHIROUTER_STAGE_QUEUE);
+    chirouter_stats_last = 0;
+
+    rc = chirouter_process_ethernet_frame(ctx, frame);
+
+    chirouter_latency_end(&ctx->latency);
+
+    if(ctx->server->flightrec)
+        chirouter_flightrec_decide(ctx->server->flightrec, frame->fr_event, chirouter_stats_last);
+
+    free(frame->raw);
+    free(frame);
+
+    if (rc == -1)
+    {
+        chilog(CRITICAL, "Critical error while processing Ethernet frame in router %s", ctx->name);
+        if(ctx->server->flightrec)
+            chirouter_flightrec_dump(ctx->server->flightrec, "critical error");
+        __atomic_store_n(&ctx->server->fatal_error, true, __ATOMIC_RELEASE);
+    }
+}
+
+
+/* Worker thread function. Processes the frames in a single queue */
+static void* chirouter_rss_worker(void *args)
+{
+    chirouter_rss_queue_t *q = (chirouter_rss_queue_t *) args;
+    ethernet_frame_t *frame;
+
+    while (1)
+    {
+        frame = chirouter_rss_queue_pop(q);
+
+        if (frame == NULL)
+        {
+            if (!chirouter_rss_queue_wait(q))
+                break;
+            continue;
+        }
+
+        chirouter_rss_process_frame(q, frame);
+    }
+
+    return NULL;
+}
+
+
+/* Adds an RSS queue to the end of a worker's run queue. */
+static void chirouter_sched_runq_push(chirouter_sched_worker_t *w, chirouter_rss_queue_t *q)
+{
+    pthread_mutex_lock(&w->lock);
+    w->runq[w->tail & (SCHED_RUNQ_SIZE - 1)] = q;
+    __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&w->lock);
+}
+
+
+/* Removes the RSS queue at the front of a worker's run queue (this is
+ * used both by the worker itself and by thieves). Returns NULL if the
+ * run queue is empty. */
+static chirouter_rss_queue_t *chirouter_sched_runq_pop(chirouter_sched_worker_t *w)
+{
+    chirouter_rss_queue_t *q = NULL;
+
+    /* Avoid taking the lock when the run queue is empty */
+    if (__atomic_load_n(&w->head, __ATOMIC_RELAXED) == __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->head != w->tail)
+    {
+        q = w->runq[w->head & (SCHED_RUNQ_SIZE - 1)];
+        __atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return q;
+}
+
+
+/* Finds an RSS queue to run: first in the worker's own run queue and,
+ * if it is empty, in the run queues of the other workers. */
+static chirouter_rss_queue_t *chirouter_sched_find_work(chirouter_sched_worker_t *w)
+{
+    chirouter_sched_t *sched = w->sched;
+    chirouter_rss_queue_t *q;
+
+    if ((q = chirouter_sched_runq_pop(w)) == NULL)
+    {
+        for (int i = 1; q == NULL && i < sched->num_workers; i++)
+            q = chirouter_sched_runq_pop(&sched->workers[(w->id + i) % sched->num_workers]);
+    }
+
+    if (q != NULL)
+        __atomic_store_n(&w->current, q, __ATOMIC_SEQ_CST);
+
+    return q;
+}
+
+
+/* Submits an RSS queue that has become runnable to the run queue of
+ * its home worker, and wakes up an idle worker if there is one. */
+static void chirouter_sched_submit(chirouter_sched_t *sched, chirouter_rss_queue_t *q)
+{
+    chirouter_sched_runq_push(&sched->workers[q->home], q);
+
+    /* Pairs with the fence in chirouter_sched_worker */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sched->num_sleeping, __ATOMIC_RELAXED) > 0)
+    {
+        pthread_mutex_lock(&sched->lock);
+        pthread_cond_signal(&sched->wakeup);
+        pthread_mutex_unlock(&sched->lock);
+    }
+}
+
+
+/* Runs an RSS queue for (at most) SCHED_BATCH frames. If there are
+ * still frames in the queue afterwards, it goes back in the worker's
+ * run queue, behind any other queues that are waiting to run. */
+static void chirouter_sched_run(chirouter_sched_worker_t *w, chirouter_rss_queue_t *q)
+{
+    ethernet_frame_t *frame;
+    bool stop = __atomic_load_n(&q->stop, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < SCHED_BATCH && !stop; i++)
+    {
+        if ((frame = chirouter_rss_queue_pop(q)) == NULL)
+            break;
+        chirouter_rss_process_frame(q, frame);
+    }
+
+    __atomic_store_n(&q->scheduled, false, __ATOMIC_RELEASE);
+
+    /* Pairs with the fence in chirouter_rss_dispatch, so that either
+     * we see a frame that was just added, or the dispatcher sees that
+     * the queue is no longer scheduled (and submits it again) */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!stop && !RSS_QUEUE_EMPTY(q) &&
+        !__atomic_exchange_n(&q->scheduled, true, __ATOMIC_ACQ_REL))
+    {
+        chirouter_sched_runq_push(w, q);
+    }
+}
+
+
+/* Scheduler worker thread function */
+static void* chirouter_sched_worker(void *args)
+{
+    chirouter_sched_worker_t *w = (chirouter_sched_worker_t *) args;
+    chirouter_sched_t *sched = w->sched;
+    chirouter_rss_queue_t *q;
+
+    while (!__atomic_load_n(&sched->stop, __ATOMIC_ACQUIRE))
+    {
+        q = chirouter_sched_find_work(w);
+
+        for (int i = 0; q == NULL && i < RSS_SPIN_COUNT; i++)
+        {
+            cpu_relax();
+            q = chirouter_sched_find_work(w);
+        }
+
+        if (q != NULL)
+        {
+            chirouter_sched_run(w, q);
+            __atomic_store_n(&w->current, NULL, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        /* Nothing to run anywhere. Go to sleep until a queue is submitted */
+        pthread_mutex_lock(&sched->lock);
+        __atomic_add_fetch(&sched->num_sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        q = chirouter_sched_find_work(w);
+        if (q == NULL && !sched->stop)
+            pthread_cond_wait(&sched->wakeup, &sched->lock);
+
+        __atomic_sub_fetch(&sched->num_sleeping, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sched->lock);
+
+        if (q != NULL)
+        {
+            chirouter_sched_run(w, q);
+            __atomic_store_n(&w->current, NULL, __ATOMIC_RELEASE);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* See dispatch.h */
+chirouter_sched_t *chirouter_sched_start(uint16_t num_workers)
+{
+    if (num_workers == 0 || num_workers > MAX_SCHED_WORKERS)
+    {
+        chilog(CRITICAL, "Invalid number of scheduler workers: %i", num_workers);
+        return NULL;
+    }
+
+    chirouter_sched_t *sched = calloc(1, sizeof(chirouter_sched_t));
+    if (sched == NULL)
+        return NULL;
+
+    sched->workers = calloc(num_workers, sizeof(chirouter_sched_worker_t));
+    if (sched->workers == NULL)
+    {
+        free(sched);
+        return NULL;
+    }
+
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->wakeup, NULL);
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        chirouter_sched_worker_t *w = &sched->workers[i];
+
+        w->id = i;
+        w->sched = sched;
+        w->runq = calloc(SCHED_RUNQ_SIZE, sizeof(chirouter_rss_queue_t *));
+        pthread_mutex_init(&w->lock, NULL);
+    }
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        chirouter_sched_worker_t *w = &sched->workers[i];
+
+        if (w->runq == NULL || pthread_create(&w->thread, NULL, chirouter_sched_worker, w) != 0)
+        {
+            chilog(CRITICAL, "Could not create scheduler worker %i", i);
+            sched->num_workers = i;
+            chirouter_sched_stop(sched);
+            return NULL;
+        }
+        sched->num_workers++;
+    }
+
+    return sched;
+}
+
+
+/* See dispatch.h */
+int chirouter_sched_stop(chirouter_sched_t *sched)
+{
+    if (sched == NULL)
+        return 0;
+
+    pthread_mutex_lock(&sched->lock);
+    __atomic_store_n(&sched->stop, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&sched->wakeup);
+    pthread_mutex_unlock(&sched->lock);
+
+    for (int i = 0; i < sched->num_workers; i++)
+        pthread_join(sched->workers[i].thread, NULL);
+
+    for (int i = 0; i < sched->num_workers; i++)
+    {
+        pthread_mutex_destroy(&sched->workers[i].lock);
+        free(sched->workers[i].runq);
+    }
+
+    pthread_mutex_destroy(&sched->lock);
+    pthread_cond_destroy(&sched->wakeup);
+    free(sched->workers);
+    free(sched);
+
+    return 0;
+}
+
+
+/* See dispatch.h */
+int chirouter_rss_start(chirouter_ctx_t *ctx, uint16_t num_queues)
+{
+    chirouter_sched_t *sched = ctx->server->sched;
+
+    if (num_queues == 0 || num_queues > MAX_RSS_QUEUES)
+    {
+        chilog(CRITICAL, "Invalid number of RSS queues: %i", num_queues);
+        return -1;
+    }
+
+    if (sched != NULL && sched->num_queues + num_queues > SCHED_RUNQ_SIZE)
+    {
+        chilog(CRITICAL, "The scheduler cannot run more than %u RSS queues", SCHED_RUNQ_SIZE);
+        return -1;
+    }
+
+    ctx->rss_queues = calloc(num_queues, sizeof(chirouter_rss_queue_t));
+    if (ctx->rss_queues == NULL)
+        return -1;
+
+    for (int i = 0; i < num_queues; i++)
+    {
+        chirouter_rss_queue_t *q = &ctx->rss_queues[i];
+
+        q->frames = calloc(RSS_QUEUE_SIZE, sizeof(ethernet_frame_t *));
+        q->router = ctx;
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->wakeup, NULL);
+
+        if (q->frames == NULL)
+        {
+            /* Queue i is not stopped by chirouter_rss_stop */
+            pthread_mutex_destroy(&q->lock);
+            pthread_cond_destroy(&q->wakeup);
+            ctx->num_rss_queues = i;
+            chirouter_rss_stop(ctx);
+            return -1;
+        }
+
+        if (sched != NULL)
+        {
+            /* Spread the queues of all the routers across the workers */
+            q->home = sched->num_queues++ % sched->num_workers;
+        }
+        else if (pthread_create(&q->thread, NULL, chirouter_rss_worker, q) != 0)
+        {
+            chilog(CRITICAL, "Could not create RSS worker %i for router %s", i, ctx->name);
+            free(q->frames);
+            pthread_mutex_destroy(&q->lock);
+            pthread_cond_destroy(&q->wakeup);
+            ctx->num_rss_queues = i;
+            chirouter_rss_stop(ctx);
+            return -1;
+        }
+    }
+
+    ctx->num_rss_queues = num_queues;
+
+    return 0;
+}
+
+
+/* See dispatch.h */
+void chirouter_rss_dispatch(chirouter_ctx_t *ctx, ethernet_frame_t *frame)
+{
+    uint32_t hash = chirouter_rss_hash(frame->raw, frame->length);
+    chirouter_rss_queue_t *q = &ctx->rss_queues[((uint64_t) hash * ctx->num_rss_queues) >> 32];
+    chirouter_sched_t *sched = ctx->server->sched;
+    uint32_t head = q->head;
+
+    /* Wait for room in the queue. This pushes back on the controller
+     * connection instead of dropping frames. */
+    while (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == RSS_QUEUE_SIZE)
+        sched_yield();
+
+    q->frames[head & (RSS_QUEUE_SIZE - 1)] = frame;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (sched != NULL)
+    {
+        if (!__atomic_load_n(&q->scheduled, __ATOMIC_RELAXED) &&
+            !__atomic_exchange_n(&q->scheduled, true, __ATOMIC_ACQ_REL))
+        {
+            chirouter_sched_submit(sched, q);
+        }
+    }
+    else if (__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->wakeup);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+
+/* See dispatch.h */
+int chirouter_rss_stop(chirouter_ctx_t *ctx)
+{
+    chirouter_sched_t *sched = ctx->server->sched;
+    ethernet_frame_t *frame;
+
+    if (ctx->rss_queues == NULL)
+        return 0;
+
+    for (int i = 0; i < ctx->num_rss_queues; i++)
+    {
+        chirouter_rss_queue_t *q = &ctx->rss_queues[i];
+
+        pthread_mutex_lock(&q->lock);
+        __atomic_store_n(&q->stop, true, __ATOMIC_RELEASE);
+        pthread_cond_signal(&q->wakeup);
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    for (int i = 0; i < ctx->num_rss_queues; i++)
+    {
+        chirouter_rss_queue_t *q = &ctx->rss_queues[i];
+
+        if (sched != NULL)
+        {
+            /* Take the queue away from the scheduler (so it can't be
+             * submitted again), and wait until no worker is running it */
+            while (__atomic_exchange_n(&q->scheduled, true, __ATOMIC_ACQ_REL))
+                sched_yield();
+
+            for (int j = 0; j < sched->num_workers; j++)
+                while (__atomic_load_n(&sched->workers[j].current, __ATOMIC_ACQUIRE) == q)
+                    sched_yield();
+        }
+        else
+        {
+            pthread_join(q->thread, NULL);
+        }
+
+        while ((frame = chirouter_rss_queue_pop(q)) != NULL)
+        {
+            free(frame->raw);
+            free(frame);
+        }
+
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->wakeup);
+        free(q->frames);
+    }
+
+    /* The queues can be started again (when the routers are resumed) */
+    if (sched != NULL)
+        sched->num_queues -= ctx->num_rss_queues;
+
+    free(ctx->rss_queues);
+    ctx->rss_queues = NULL;
+    ctx->num_rss_queues = 0;
+
+    return 0;
+}
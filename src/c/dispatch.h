@@ -0,0 +1,238 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Receive-side scaling (RSS) dispatch of inbound frames
+ *
+ *  When RSS is enabled, each router gets a fixed number of worker
+ *  queues. Inbound IPv4 frames are steered to a queue by hashing their
+ *  5-tuple (source/destination address, protocol and, for TCP/UDP,
+ *  source/destination port), so that all the frames of a given flow
+ *  are always processed, in order, by the same worker. Any other
+ *  frames (ARP, IPv6, ...) are steered to queue 0.
+ *
+ *  By default, each RSS queue is drained by its own worker thread.
+ *  Alternatively, the RSS queues of all the routers can be run by a
+ *  shared pool of worker threads (a "scheduler"). When a queue becomes
+ *  non-empty, it is submitted to the run queue of its "home" worker.
+ *  An idle worker will first look in its own run queue and, if it is
+ *  empty, will steal a whole RSS queue from the run queue of another
+ *  worker. An RSS queue is only ever in one run queue, or being run
+ *  by one worker, at a time so, in particular, a router with a single
+ *  RSS queue is never run by two workers at the same time.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef DISPATCH_H_
+#define DISPATCH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "chirouter.h"
+
+/* Maximum number of RSS queues per router */
+#define MAX_RSS_QUEUES (64u)
+
+/* Number of frames that can be waiting in a single RSS queue */
+#define RSS_QUEUE_SIZE (1024u)
+
+/* Maximum number of threads in the scheduler's worker pool */
+#define MAX_SCHED_WORKERS (64u)
+
+/* Capacity of a worker's run queue. Since an RSS queue can only be in
+ * one run queue at a time, this is also the maximum number of RSS queues
+ * (across all routers) that the scheduler can run */
+#define SCHED_RUNQ_SIZE (16384u)
+
+/* Maximum number of frames a worker processes from an RSS queue before
+ * putting it back in its run queue (so other routers get a turn) */
+#define SCHED_BATCH (64u)
+
+typedef struct chirouter_sched chirouter_sched_t;
+
+
+/* A single-producer/single-consumer queue of inbound frames, and the
+ * worker thread that drains it. The producer is always the server
+ * thread, and the consumer is always the worker thread. */
+typedef struct chirouter_rss_queue
+{
+    /* Ring of frame pointers (RSS_QUEUE_SIZE entries) */
+    ethernet_frame_t **frames;
+
+    /* Producer and consumer positions. Each is only written by
+     * its owner, and kept on separate cache lines */
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+
+    /* Set by the worker when it is about to block on "wakeup" */
+    bool sleeping __attribute__((aligned(64)));
+    bool stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+
+    /* Router this queue belongs to */
+    chirouter_ctx_t *router;
+
+    /* Worker thread (if the queue is not run by the scheduler) */
+    pthread_t thread;
+
+    /* If the queue is run by the scheduler: whether the queue is
+     * currently in a run queue (or being run by a worker), and the
+     * worker whose run queue it is submitted to */
+    bool scheduled __attribute__((aligned(64)));
+    uint16_t home;
+} chirouter_rss_queue_t;
+
+
+/* A worker thread in the scheduler */
+typedef struct chirouter_sched_worker
+{
+    /* Run queue: a ring of RSS queues (SCHED_RUNQ_SIZE entries),
+     * protected by "lock" since other workers can steal from it */
+    chirouter_rss_queue_t **runq;
+    uint32_t head;
+    uint32_t tail;
+    pthread_mutex_t lock;
+
+    /* RSS queue the worker is currently running (if any) */
+    chirouter_rss_queue_t *current;
+
+    uint16_t id;
+    chirouter_sched_t *sched;
+    pthread_t thread;
+} __attribute__((aligned(64))) chirouter_sched_worker_t;
+
+
+/* A pool of worker threads that runs RSS queues */
+struct chirouter_sched
+{
+    chirouter_sched_worker_t *workers;
+    uint16_t num_workers;
+
+    /* Number of RSS queues that have been assigned a home worker */
+    uint32_t num_queues;
+
+    bool stop;
+
+    /* Idle workers sleep on "wakeup" */
+    uint32_t num_sleeping __attribute__((aligned(64)));
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+};
+
+
+/*
+ * chirouter_rss_hash - Compute the flow hash of an Ethernet frame
+ *
+ * raw: Pointer to the raw Ethernet frame
+ *
+ * len: Length of the frame
+ *
+ * Returns: The flow hash of the frame. All frames with the same
+ *          5-tuple produce the same hash. Frames that do not carry
+ *          an IPv4 datagram have a hash of zero.
+ */
+uint32_t chirouter_rss_hash(const uint8_t *raw, size_t len);
+
+
+/*
+ * chirouter_sched_start - Create a scheduler and its worker threads
+ *
+ * num_workers: Number of worker threads
+ *
+ * Returns: The scheduler, or NULL if an error happens.
+ */
+chirouter_sched_t *chirouter_sched_start(uint16_t num_workers);
+
+
+/*
+ * chirouter_sched_stop - Stop the scheduler's worker threads and free the scheduler
+ *
+ * The RSS queues of all the routers must have been stopped before
+ * calling this function.
+ *
+ * sched: Scheduler
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_sched_stop(chirouter_sched_t *sched);
+
+
+/*
+ * chirouter_rss_start - Create the RSS queues of a router
+ *
+ * If the server context has a scheduler, the queues will be run by the
+ * scheduler's workers. Otherwise, a worker thread is created for each queue.
+ *
+ * ctx: Router context
+ *
+ * num_queues: Number of queues (and worker threads) to create
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_rss_start(chirouter_ctx_t *ctx, uint16_t num_queues);
+
+
+/*
+ * chirouter_rss_dispatch - Steer an inbound frame to one of the router's queues
+ *
+ * If the selected queue is full, this function waits until the worker
+ * makes room for the frame (frames are never dropped by the dispatcher).
+ *
+ * ctx: Router context
+ *
+ * frame: Inbound frame. The worker thread takes ownership of the frame,
+ *        and will free it once it has been processed.
+ *
+ * Returns: nothing.
+ */
+void chirouter_rss_dispatch(chirouter_ctx_t *ctx, ethernet_frame_t *frame);
+
+
+/*
+ * chirouter_rss_stop - Stop running the RSS queues of a router and free them
+ *
+ * Frames that are still in the queues when this function is called are
+ * discarded.
+ *
+ * ctx: Router context
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_rss_stop(chirouter_ctx_t *ctx);
+
+#endif /* DISPATCH_H_ */
@@ -0,0 +1,546 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  FIB snapshots (see fib.h for descriptions of functions, parameters,
+ *  and return values)
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "fib.h"
+#include "log.h"
+
+/* Sections start at offsets that are a multiple of this */
+#define FIB_ALIGN (8)
+
+/* A route, as a prefix (in host order) */
+typedef struct
+{
+    uint32_t start;
+    uint32_t len;
+    uint32_t route;
+} fib_prefix_t;
+
+/* A prefix that contains the prefix being added */
+typedef struct
+{
+    uint64_t end;
+    uint32_t route;
+} fib_open_prefix_t;
+
+
+static inline uint64_t fib_align(uint64_t offset)
+{
+    return (offset + FIB_ALIGN - 1) & ~((uint64_t) FIB_ALIGN - 1);
+}
+
+
+/* Orders prefixes by start, then by length (so prefixes come before
+ * the prefixes they contain), then by their position in the table */
+static int fib_cmp_prefix(const void *a, const void *b)
+{
+    const fib_prefix_t *pa = a, *pb = b;
+
+    if (pa->start != pb->start)
+        return pa->start < pb->start ? -1 : 1;
+    if (pa->len != pb->len)
+        return pa->len < pb->len ? -1 : 1;
+    return pa->route < pb->route ? -1 : (pa->route > pb->route);
+}
+
+
+/* Adds a range that starts at start (replacing the last range if it
+ * starts at the same address, and merging it with the last range if
+ * they have the same target) */
+static void fib_add_range(uint32_t *starts, uint32_t *targets, uint32_t *num_ranges, uint32_t start, uint32_t target)
+{
+    uint32_t n = *num_ranges;
+
+    if (n > 0 && starts[n - 1] == start)
+        n--;
+
+    if (n == 0 || targets[n - 1] != target)
+    {
+        starts[n] = start;
+        targets[n] = target;
+        n++;
+    }
+
+    *num_ranges = n;
+}
+
+
+/* Points the fields of a snapshot to the sections in its data */
+static void fib_set_sections(chirouter_fib_t *fib)
+{
+    const uint8_t *data = fib->data;
+
+    fib->hdr = fib->data;
+    fib->ifaces = (const void *) (data + fib->hdr->ifaces_offset);
+    fib->routes = (const void *) (data + fib->hdr->routes_offset);
+    fib->starts = (const void *) (data + fib->hdr->starts_offset);
+    fib->targets = (const void *) (data + fib->hdr->targets_offset);
+    fib->index = (const void *) (data + fib->hdr->index_offset);
+}
+
+
+/* See fib.h */
+chirouter_fib_t *chirouter_fib_build(chirouter_ctx_t *ctx)
+{
+    uint32_t n = ctx->num_rtable_entries, num_prefixes = 0, num_ranges = 0;
+    fib_prefix_t *prefixes = malloc((n ? n : 1) * sizeof(fib_prefix_t));
+    uint32_t *starts = malloc((2 * (uint64_t) n + 1) * sizeof(uint32_t));
+    uint32_t *targets = malloc((2 * (uint64_t) n + 1) * sizeof(uint32_t));
+    fib_open_prefix_t outer[33];
+    int depth = 0;
+    chirouter_fib_t *fib = NULL;
+
+    if (prefixes == NULL || starts == NULL || targets == NULL)
+    {
+        chilog(ERROR, "Router %s: Not enough memory to build the FIB", ctx->name);
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        chirouter_rtable_entry_t *entry = &ctx->routing_table[i];
+        uint32_t mask = ntohl(entry->mask.s_addr), dest = ntohl(entry->dest.s_addr);
+
+        if ((~mask & (~mask + 1)) != 0)
+        {
+            chilog(ERROR, "Router %s: Route %u has a mask that is not contiguous", ctx->name, i);
+            goto out;
+        }
+
+        /* These routes never match any address */
+        if ((dest & ~mask) != 0)
+            continue;
+
+        prefixes[num_prefixes].start = dest;
+        prefixes[num_prefixes].len = __builtin_popcount(mask);
+        prefixes[num_prefixes].route = i;
+        num_prefixes++;
+    }
+
+    qsort(prefixes, num_prefixes, sizeof(fib_prefix_t), fib_cmp_prefix);
+
+    /* Prefixes are either disjoint or nested, so they are visited in
+     * order, keeping the prefixes that contain the current one. When a
+     * prefix ends, the addresses after it go back to the route of the
+     * prefix that contains it. */
+    fib_add_range(starts, targets, &num_ranges, 0, FIB_NO_ROUTE);
+    for (uint32_t i = 0; i < num_prefixes; i++)
+    {
+        fib_prefix_t *p = &prefixes[i];
+
+        /* Only the first of several identical prefixes is used */
+        if (i > 0 && p->start == p[-1].start && p->len == p[-1].len)
+            continue;
+
+        while (depth > 0 && outer[depth - 1].end <= p->start)
+        {
+            depth--;
+            fib_add_range(starts, targets, &num_ranges, outer[depth].end,
+                          depth > 0 ? outer[depth - 1].route : FIB_NO_ROUTE);
+        }
+
+        fib_add_range(starts, targets, &num_ranges, p->start, p->route);
+        outer[depth].end = (uint64_t) p->start + (1ull << (32 - p->len));
+        outer[depth].route = p->route;
+        depth++;
+    }
+
+    while (depth > 0)
+    {
+        depth--;
+        if (outer[depth].end <= UINT32_MAX)
+            fib_add_range(starts, targets, &num_ranges, outer[depth].end,
+                          depth > 0 ? outer[depth - 1].route : FIB_NO_ROUTE);
+    }
+
+    chirouter_fib_header_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, FIB_MAGIC, sizeof(FIB_MAGIC));
+    hdr.version = FIB_VERSION;
+    hdr.byte_order = FIB_BYTE_ORDER;
+    hdr.num_ifaces = ctx->num_interfaces;
+    hdr.num_routes = n;
+    hdr.num_ranges = num_ranges;
+    hdr.ifaces_offset = fib_align(sizeof(hdr));
+    hdr.routes_offset = fib_align(hdr.ifaces_offset + (uint64_t) hdr.num_ifaces * (MAX_IFACE_NAMELEN + 1));
+    hdr.starts_offset = fib_align(hdr.routes_offset + (uint64_t) n * sizeof(chirouter_fib_route_t));
+    hdr.targets_offset = fib_align(hdr.starts_offset + (uint64_t) num_ranges * sizeof(uint32_t));
+    hdr.index_offset = fib_align(hdr.targets_offset + (uint64_t) num_ranges * sizeof(uint32_t));
+    hdr.size = hdr.index_offset + FIB_INDEX_SIZE * sizeof(uint32_t);
+
+    fib = calloc(1, sizeof(chirouter_fib_t));
+    if (fib == NULL || (fib->data = calloc(1, hdr.size)) == NULL)
+    {
+        chilog(ERROR, "Router %s: Not enough memory to build the FIB", ctx->name);
+        free(fib);
+        fib = NULL;
+        goto out;
+    }
+    fib->size = hdr.size;
+
+    uint8_t *data = fib->data;
+
+    memcpy(data, &hdr, sizeof(hdr));
+
+    for (int i = 0; i < ctx->num_interfaces; i++)
+        strcpy((char *) data + hdr.ifaces_offset + i * (MAX_IFACE_NAMELEN + 1), ctx->interfaces[i].name);
+
+    chirouter_fib_route_t *routes = (chirouter_fib_route_t *) (data + hdr.routes_offset);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        chirouter_rtable_entry_t *entry = &ctx->routing_table[i];
+
+        routes[i].dest = entry->dest.s_addr;
+        routes[i].mask = entry->mask.s_addr;
+        routes[i].gw = entry->gw.s_addr;
+        routes[i].metric = entry->metric;
+        routes[i].iface = entry->interface - ctx->interfaces;
+    }
+
+    memcpy(data + hdr.starts_offset, starts, num_ranges * sizeof(uint32_t));
+    memcpy(data + hdr.targets_offset, targets, num_ranges * sizeof(uint32_t));
+
+    uint32_t *index = (uint32_t *) (data + hdr.index_offset);
+    for (uint32_t block = 0, k = 0; block < FIB_INDEX_SIZE; block++)
+    {
+        while (k < num_ranges && starts[k] < ((uint64_t) block << 16))
+            k++;
+        index[block] = k;
+    }
+
+    fib_set_sections(fib);
+
+out:
+    free(prefixes);
+    free(starts);
+    free(targets);
+    return fib;
+}
+
+
+/* See fib.h */
+int chirouter_fib_write(chirouter_fib_t *fib, const char *filename)
+{
+    size_t len = strlen(filename);
+    char *tmp = malloc(len + sizeof(".XXXXXX"));
+    const uint8_t *p = fib->data;
+    size_t left = fib->size;
+    int fd;
+
+    if (tmp == NULL)
+        return -1;
+
+    sprintf(tmp, "%s.XXXXXX", filename);
+    if ((fd = mkstemp(tmp)) == -1)
+    {
+        chilog(ERROR, "Could not create %s: %s", tmp, strerror(errno));
+        free(tmp);
+        return -1;
+    }
+
+    while (left > 0)
+    {
+        ssize_t nbytes = write(fd, p, left);
+
+        if (nbytes == -1 && errno == EINTR)
+            continue;
+        if (nbytes <= 0)
+            break;
+        p += nbytes;
+        left -= nbytes;
+    }
+
+    bool ok = left == 0 && fchmod(fd, 0644) == 0 && fsync(fd) == 0;
+
+    if (close(fd) != 0 || !ok || rename(tmp, filename) != 0)
+    {
+        chilog(ERROR, "Could not write %s: %s", filename, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    free(tmp);
+    return 0;
+}
+
+
+/* Checks that a section (of num elements of the given size) is within the file */
+static bool fib_check_section(const chirouter_fib_header_t *hdr, uint64_t offset, uint64_t num, uint64_t size)
+{
+    return offset % sizeof(uint32_t) == 0 && offset >= sizeof(*hdr) &&
+           offset <= hdr->size && num * size <= hdr->size - offset;
+}
+
+
+/* Checks the header and the index of a FIB snapshot (whose data and
+ * size are set), and sets its sections. name is used in the errors. */
+static int fib_check(chirouter_fib_t *fib, const char *name)
+{
+    const chirouter_fib_header_t *hdr = fib->data;
+
+    if (memcmp(hdr->magic, FIB_MAGIC, sizeof(FIB_MAGIC)) != 0)
+    {
+        chilog(ERROR, "%s is not a FIB", name);
+        return -1;
+    }
+
+    if (hdr->version != FIB_VERSION || hdr->byte_order != FIB_BYTE_ORDER)
+    {
+        chilog(ERROR, "FIB %s has an unsupported version or byte order", name);
+        return -1;
+    }
+
+    if (hdr->size != fib->size || hdr->num_ranges == 0 ||
+        !fib_check_section(hdr, hdr->ifaces_offset, hdr->num_ifaces, MAX_IFACE_NAMELEN + 1) ||
+        !fib_check_section(hdr, hdr->routes_offset, hdr->num_routes, sizeof(chirouter_fib_route_t)) ||
+        !fib_check_section(hdr, hdr->starts_offset, hdr->num_ranges, sizeof(uint32_t)) ||
+        !fib_check_section(hdr, hdr->targets_offset, hdr->num_ranges, sizeof(uint32_t)) ||
+        !fib_check_section(hdr, hdr->index_offset, FIB_INDEX_SIZE, sizeof(uint32_t)))
+    {
+        chilog(ERROR, "FIB %s is truncated or corrupted", name);
+        return -1;
+    }
+
+    fib_set_sections(fib);
+
+    /* Lookups stay within the ranges as long as the index is consistent
+     * (the targets are checked in every lookup) */
+    for (uint32_t block = 0; block < FIB_INDEX_SIZE; block++)
+        if (fib->index[block] > hdr->num_ranges || (block > 0 && fib->index[block] < fib->index[block - 1]))
+        {
+            chilog(ERROR, "FIB %s has an invalid index", name);
+            return -1;
+        }
+
+    if (fib->index[FIB_INDEX_SIZE - 1] != hdr->num_ranges || fib->starts[0] != 0)
+    {
+        chilog(ERROR, "FIB %s has an invalid index", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* See fib.h */
+chirouter_fib_t *chirouter_fib_open(const char *filename)
+{
+    struct stat st;
+    chirouter_fib_t *fib;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &st) != 0)
+    {
+        chilog(ERROR, "Could not open FIB %s: %s", filename, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+
+    if ((size_t) st.st_size < sizeof(chirouter_fib_header_t))
+    {
+        chilog(ERROR, "%s is not a FIB", filename);
+        close(fd);
+        return NULL;
+    }
+
+    fib = calloc(1, sizeof(chirouter_fib_t));
+    if (fib == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    fib->size = st.st_size;
+    fib->data = mmap(NULL, fib->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (fib->data == MAP_FAILED)
+    {
+        chilog(ERROR, "Could not map FIB %s: %s", filename, strerror(errno));
+        free(fib);
+        return NULL;
+    }
+    fib->mapped = true;
+
+    if (fib_check(fib, filename) != 0)
+    {
+        chirouter_fib_free(fib);
+        return NULL;
+    }
+
+    return fib;
+}
+
+
+/* See fib.h */
+chirouter_fib_t *chirouter_fib_from_buffer(void *data, size_t size, const char *name)
+{
+    chirouter_fib_t *fib;
+
+    if (size < sizeof(chirouter_fib_header_t))
+    {
+        chilog(ERROR, "%s is not a FIB", name);
+        free(data);
+        return NULL;
+    }
+
+    fib = calloc(1, sizeof(chirouter_fib_t));
+    if (fib == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+
+    fib->data = data;
+    fib->size = size;
+    fib->mapped = false;
+
+    if (fib_check(fib, name) != 0)
+    {
+        chirouter_fib_free(fib);
+        return NULL;
+    }
+
+    return fib;
+}
+
+
+/* See fib.h */
+void chirouter_fib_free(chirouter_fib_t *fib)
+{
+    if (fib == NULL)
+        return;
+
+    if (fib->mapped)
+        munmap(fib->data, fib->size);
+    else
+        free(fib->data);
+    free(fib);
+}
+
+
+/* See fib.h */
+int chirouter_fib_attach(chirouter_ctx_t *ctx, chirouter_fib_t *fib)
+{
+    const chirouter_fib_header_t *hdr = fib->hdr;
+    chirouter_interface_t **ifaces;
+    chirouter_rtable_entry_t *table;
+    uint32_t base = ctx->num_rtable_entries;
+
+    if (ctx->fib != NULL)
+    {
+        chilog(ERROR, "Router %s already has a FIB", ctx->name);
+        return -1;
+    }
+
+    if (hdr->num_routes > MAX_NUM_RTABLE_ENTRIES - base)
+    {
+        chilog(ERROR, "Router %s: The routing table can't have more than %u entries", ctx->name, MAX_NUM_RTABLE_ENTRIES);
+        return -1;
+    }
+
+    ifaces = calloc(hdr->num_ifaces ? hdr->num_ifaces : 1, sizeof(chirouter_interface_t *));
+    if (ifaces == NULL)
+        return -1;
+
+    for (uint32_t i = 0; i < hdr->num_ifaces; i++)
+    {
+        const char *name = fib->ifaces[i];
+
+        for (int j = 0; j < ctx->num_interfaces; j++)
+            if (strncmp(ctx->interfaces[j].name, name, MAX_IFACE_NAMELEN + 1) == 0)
+                ifaces[i] = &ctx->interfaces[j];
+
+        if (ifaces[i] == NULL)
+        {
+            chilog(ERROR, "Router %s has no interface %.*s (used by its FIB)", ctx->name, (int) MAX_IFACE_NAMELEN, name);
+            free(ifaces);
+            return -1;
+        }
+    }
+
+    table = realloc(ctx->routing_table, ((uint64_t) base + hdr->num_routes) * sizeof(chirouter_rtable_entry_t));
+    if (table == NULL && base + hdr->num_routes > 0)
+    {
+        chilog(ERROR, "Router %s: Not enough memory for the routing table", ctx->name);
+        free(ifaces);
+        return -1;
+    }
+    ctx->routing_table = table;
+
+    for (uint32_t i = 0; i < hdr->num_routes; i++)
+    {
+        const chirouter_fib_route_t *route = &fib->routes[i];
+        chirouter_rtable_entry_t *entry = &table[base + i];
+
+        if (route->iface >= hdr->num_ifaces)
+        {
+            chilog(ERROR, "Router %s: Route %u of the FIB has an invalid interface", ctx->name, i);
+            free(ifaces);
+            return -1;
+        }
+
+        entry->dest.s_addr = route->dest;
+        entry->mask.s_addr = route->mask;
+        entry->gw.s_addr = route->gw;
+        entry->metric = route->metric;
+        entry->interface = ifaces[route->iface];
+    }
+    free(ifaces);
+
+    ctx->fib = fib;
+    ctx->fib_base = base;
+    ctx->num_rtable_entries = base + hdr->num_routes;
+    if (ctx->max_rtable_entries < ctx->num_rtable_entries)
+        ctx->max_rtable_entries = ctx->num_rtable_entries;
+
+    return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  FIB snapshots
+ *
+ *  A FIB snapshot is a routing table in a binary format that can be
+ *  mapped into memory and used as is, so large routing tables can be
+ *  loaded in a few milliseconds (instead of being sent by the controller,
+ *  or parsed from a text file, every time chirouter starts). They are
+ *  created with chirouter_fib, from topology files or routing table files.
+ *
+ *  Besides the routes, a snapshot has a lookup structure, so routes are
+ *  not looked up with a linear scan: the address space is divided into
+ *  ranges, each one with the route (if any) that matches the addresses
+ *  in the range. The ranges are found with a binary search, narrowed
+ *  down by an index of the first range of each /16 block.
+ *
+ *  The file has a header (chirouter_fib_header_t), followed by these
+ *  sections (each one starting at an offset that is a multiple of 8):
+ *
+ *    ifaces:  num_ifaces interface names (MAX_IFACE_NAMELEN + 1 bytes
+ *             each, padded with zeros)
+ *    routes:  num_routes routes (chirouter_fib_route_t)
+ *    starts:  num_ranges uint32_t, the first address of each range
+ *             (in increasing order, starting with 0.0.0.0)
+ *    targets: num_ranges uint32_t, the index of the route that
+ *             matches each range, or FIB_NO_ROUTE
+ *    index:   FIB_INDEX_SIZE uint32_t. index[b] is the number of
+ *             ranges that start before the /16 block b (i.e.,
+ *             before address b << 16)
+ *
+ *  All the integers are in the byte order of the machine that created
+ *  the file (which is checked when it is opened), except the addresses
+ *  in the routes, which are in network order. Routes are matched like
+ *  in the routing table: the longest prefix wins, and the first route
+ *  wins among routes with the same prefix.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef FIB_H_
+#define FIB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "chirouter.h"
+
+#define FIB_MAGIC "CHIRFIB"
+#define FIB_VERSION (1)
+#define FIB_BYTE_ORDER (0x01020304u)
+
+/* Number of entries in the index (one per /16 block, plus one) */
+#define FIB_INDEX_SIZE (65536 + 1)
+
+/* Target of the ranges that no route matches */
+#define FIB_NO_ROUTE (UINT32_MAX)
+
+typedef struct chirouter_fib_header
+{
+    char magic[8];             /* FIB_MAGIC (with the terminating zero) */
+    uint32_t version;          /* FIB_VERSION */
+    uint32_t byte_order;       /* FIB_BYTE_ORDER */
+    uint32_t num_ifaces;
+    uint32_t num_routes;
+    uint32_t num_ranges;
+    uint32_t reserved;
+
+    /* Offsets of the sections, from the start of the file */
+    uint64_t ifaces_offset;
+    uint64_t routes_offset;
+    uint64_t starts_offset;
+    uint64_t targets_offset;
+    uint64_t index_offset;
+
+    /* Size of the file */
+    uint64_t size;
+} chirouter_fib_header_t;
+
+typedef struct chirouter_fib_route
+{
+    /* Network order */
+    uint32_t dest;
+    uint32_t mask;
+    uint32_t gw;
+
+    uint16_t metric;
+
+    /* Index of the interface in the interface names */
+    uint16_t iface;
+} chirouter_fib_route_t;
+
+/* A FIB snapshot, either mapped from a file or built in memory.
+ * The pointers point into the snapshot itself (data). */
+typedef struct chirouter_fib
+{
+    const chirouter_fib_header_t *hdr;
+    const char (*ifaces)[MAX_IFACE_NAMELEN + 1];
+    const chirouter_fib_route_t *routes;
+    const uint32_t *starts;
+    const uint32_t *targets;
+    const uint32_t *index;
+
+    void *data;
+    size_t size;
+    bool mapped;
+} chirouter_fib_t;
+
+
+/*
+ * chirouter_fib_build - Build a FIB snapshot from a routing table
+ *
+ * All the routes must have contiguous masks. Routes that can never
+ * match (because their destination has bits set outside their mask)
+ * are kept, but no range points to them.
+ *
+ * ctx: Router context, with its interfaces and routing table
+ *
+ * Returns: The snapshot, or NULL if an error happens.
+ */
+chirouter_fib_t *chirouter_fib_build(chirouter_ctx_t *ctx);
+
+
+/*
+ * chirouter_fib_write - Write a FIB snapshot to a file
+ *
+ * The snapshot is written to a temporary file, which is then
+ * renamed, so the file is replaced atomically.
+ *
+ * fib: FIB snapshot
+ *
+ * filename: File
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_fib_write(chirouter_fib_t *fib, const char *filename);
+
+
+/*
+ * chirouter_fib_open - Map a FIB snapshot file into memory
+ *
+ * The header and the index are checked, but the rest of the file
+ * is only read as it is used.
+ *
+ * filename: File
+ *
+ * Returns: The snapshot, or NULL if an error happens.
+ */
+chirouter_fib_t *chirouter_fib_open(const char *filename);
+
+
+/*
+ * chirouter_fib_from_buffer - Use a FIB snapshot that is in memory
+ *
+ * Like chirouter_fib_open, but with the contents of a FIB snapshot
+ * file that have already been read into memory (e.g., from a
+ * checkpoint, see checkpoint.h).
+ *
+ * data: Contents of the file, allocated with malloc. The snapshot
+ *       takes ownership of them (they are freed if an error happens)
+ *
+ * size: Size of the contents
+ *
+ * name: Name of the snapshot (used in the error messages)
+ *
+ * Returns: The snapshot, or NULL if an error happens.
+ */
+chirouter_fib_t *chirouter_fib_from_buffer(void *data, size_t size, const char *name);
+
+
+/*
+ * chirouter_fib_free - Free (or unmap) a FIB snapshot
+ *
+ * fib: FIB snapshot (can be NULL)
+ *
+ * Returns: nothing.
+ */
+void chirouter_fib_free(chirouter_fib_t *fib);
+
+
+/*
+ * chirouter_fib_attach - Add the routes of a FIB snapshot to a router
+ *
+ * The routes are added after the ones the router already has, and
+ * are looked up with the snapshot from then on (the ones it already
+ * had are still looked up one by one). A router can only have one
+ * snapshot, and the router takes ownership of it (it is freed in
+ * chirouter_ctx_destroy).
+ *
+ * This function must be called before the router starts running.
+ *
+ * ctx: Router context
+ *
+ * fib: FIB snapshot (whose interface names must all be interfaces
+ *      of the router)
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_fib_attach(chirouter_ctx_t *ctx, chirouter_fib_t *fib);
+
+
+/*
+ * chirouter_fib_lookup - Look up an address in a FIB snapshot
+ *
+ * fib: FIB snapshot
+ *
+ * addr: IPv4 address, in host order
+ *
+ * Returns: The index of the matching route, or FIB_NO_ROUTE.
+ */
+static inline uint32_t chirouter_fib_lookup(const chirouter_fib_t *fib, uint32_t addr)
+{
+    uint32_t block = addr >> 16;
+    uint32_t lo = fib->index[block], hi = fib->index[block + 1];
+    uint32_t target;
+
+    /* The range of addr is the last one that starts at or before it:
+     * either the last range that starts before the block, or one of
+     * the ranges that start within the block */
+    if (lo > 0)
+        lo--;
+
+    while (hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (fib->starts[mid] <= addr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    target = fib->targets[lo];
+    return target < fib->hdr->num_routes ? target : FIB_NO_ROUTE;
+}
+
+#endif /* FIB_H_ */
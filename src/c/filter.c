@@ -0,0 +1,469 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Capture filters
+ *
+ *  see filter.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "filter.h"
+#include "pcap.h"
+
+/* Maximum length of a token */
+#define FILTER_MAX_TOKEN (64)
+
+/* State of the parser */
+typedef struct
+{
+    const char *p;
+    char tok[FILTER_MAX_TOKEN];
+    char *error;
+} filter_parser_t;
+
+
+/* Reads the next token into parser->tok (which is empty at the end
+ * of the expression). Returns false if the token is too long. */
+static bool filter_next(filter_parser_t *parser)
+{
+    const char *start;
+    size_t len;
+
+    while (isspace((unsigned char) *parser->p))
+        parser->p++;
+
+    start = parser->p;
+
+    if (*start == '(' || *start == ')' || *start == '!')
+        len = 1;
+    else if ((start[0] == '&' && start[1] == '&') || (start[0] == '|' && start[1] == '|'))
+        len = 2;
+    else
+    {
+        len = 0;
+        while (start[len] && !isspace((unsigned char) start[len]) && !strchr("()!&|", start[len]))
+            len++;
+    }
+
+    if (len >= FILTER_MAX_TOKEN)
+    {
+        snprintf(parser->error, FILTER_MAX_ERROR_LEN, "Token too long: %.16s...", start);
+        return false;
+    }
+
+    memcpy(parser->tok, start, len);
+    parser->tok[len] = '\0';
+    parser->p += len;
+
+    /* A lone '&' or '|' would otherwise be an empty token */
+    if (len == 0 && *start)
+    {
+        snprintf(parser->error, FILTER_MAX_ERROR_LEN, "Unexpected character: '%c'", *start);
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Returns true if the current token is any of the given words */
+static inline bool filter_is(filter_parser_t *parser, const char *a, const char *b)
+{
+    return !strcmp(parser->tok, a) || (b && !strcmp(parser->tok, b));
+}
+
+
+/* Allocates a node */
+static chirouter_filter_t *filter_node(filter_parser_t *parser, chirouter_filter_type_t type)
+{
+    chirouter_filter_t *node = calloc(1, sizeof(chirouter_filter_t));
+
+    if (node == NULL)
+        snprintf(parser->error, FILTER_MAX_ERROR_LEN, "Out of memory");
+    else
+        node->type = type;
+
+    return node;
+}
+
+
+/* Allocates an AND/OR/NOT node. Frees the operands if it can't. */
+static chirouter_filter_t *filter_op(filter_parser_t *parser, chirouter_filter_type_t type,
+                                     chirouter_filter_t *left, chirouter_filter_t *right)
+{
+    chirouter_filter_t *node = filter_node(parser, type);
+
+    if (node == NULL)
+    {
+        chirouter_filter_free(left);
+        chirouter_filter_free(right);
+        return NULL;
+    }
+
+    node->left = left;
+    node->right = right;
+
+    return node;
+}
+
+
+/* Parses the argument of "host" or "net" into node->addr and node->mask */
+static bool filter_parse_net(filter_parser_t *parser, chirouter_filter_t *node, bool is_net)
+{
+    char addr[FILTER_MAX_TOKEN];
+    char *slash, *end;
+    struct in_addr in;
+    long prefix_len = 32;
+
+    strcpy(addr, parser->tok);
+
+    slash = strchr(addr, '/');
+    if (slash && is_net)
+    {
+        *slash = '\0';
+        prefix_len = strtol(slash + 1, &end, 10);
+        if (*end != '\0' || end == slash + 1 || prefix_len < 0 || prefix_len > 32)
+        {
+            snprintf(parser->error, FILTER_MAX_ERROR_LEN, "Invalid prefix length: %s", parser->tok);
+            return false;
+        }
+    }
+
+    if (inet_pton(AF_INET, addr, &in) != 1)
+    {
+        snprintf(parser->error, FILTER_MAX_ERROR_LEN, "Invalid IPv4 %s: %s", is_net ? "network" : "address", parser->tok);
+        return false;
+    }
+
+    node->mask = prefix_len == 0 ? 0 : htonl(0xFFFFFFFFu << (32 - prefix_len));
+    node->addr = in.s_addr & node->mask;
+
+    return true;
+}
+
+
+static chirouter_filter_t *filter_parse_expr(filter_parser_t *parser);
+
+
+/* Parses a primitive */
+static chirouter_filter_t *filter_parse_primitive(filter_parser_t *parser)
+{
+    chirouter_filter_t *node;
+    uint8_t which = FILTER_SRC | FILTER_DST;
+
+    if (parser->tok[0] == '\0')
+    {
+        snprintf(parser->error, FILTER_MAX_ERROR_LEN, "Unexpected end of filter");
+        return NULL;
+    }
+
+    /* Keywords that take no arguments */
+    static const struct
+    {
+        const char *word;
+        chirouter_filter_type_t type;
+        uint16_t value;
+    } keywords[] = {
+        { "arp", FILTER_ETHERTYPE, ETHERTYPE_ARP },
+        { "ip", FILTER_ETHERTYPE, ETHERTYPE_IP },
+        { "icmp", FILTER_IP_PROTO, IPPROTO_ICMP },
+        { "tcp", FILTER_IP_PROTO, IPPROTO_TCP },
+        { "udp", FILTER_IP_PROTO, IPPROTO_UDP },
+        { "inbound", FILTER_DIRECTION, PCAP_INBOUND },
+        { "outbound", FILTER_DIRECTION, PCAP_OUTBOUND },
+    };
+
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++)
+        if (filter_is(parser, keywords[i].word, NULL))
+        {
+            node = filter_node(parser, keywords[i].type);
+            if (node == NULL)
+                return NULL;
+            node->value = keywords[i].value;
+            if (!filter_next(parser))
+            {
+                chirouter_filter_free(node);
+                return NULL;
+            }
+            return node;
+        }
+
+    if (filter_is(parser, "router", "iface"))
+    {
+        bool is_router = filter_is(parser, "router", NULL);
+        size_t max_len = is_router ? MAX_ROUTER_NAMELEN : MAX_IFACE_NAMELEN;
+
+        if (!filter_next(parser))
+            return NULL;
+        if (parser->tok[0] == '\0' || strlen(parser->tok) > max_len)
+        {
+            snprintf(parser->error, FILTER_MAX_ERROR_LEN, "Invalid %s name: '%s'", is_router ? "router" : "interface",
+                     parser->tok);
+            return NULL;
+        }
+
+        node = filter_node(parser, is_router ? FILTER_ROUTER : FILTER_IFACE);
+        if (node == NULL)
+            return NULL;
+        strcpy(node->name, parser->tok);
+    }
+    else
+    {
+        bool is_net;
+
+        if (filter_is(parser, "src", "dst"))
+        {
+            which = filter_is(parser, "src", NULL) ? FILTER_SRC : FILTER_DST;
+            if (!filter_next(parser))
+                return NULL;
+        }
+
+        if (!filter_is(parser, "host", "net"))
+        {
+            snprintf(parser->error, FILTER_MAX_ERROR_LEN, "Unknown primitive: '%s'", parser->tok);
+            return NULL;
+        }
+        is_net = filter_is(parser, "net", NULL);
+
+        if (!filter_next(parser))
+            return NULL;
+
+        node = filter_node(parser, FILTER_NET);
+        if (node == NULL)
+            return NULL;
+        node->which = which;
+        if (!filter_parse_net(parser, node, is_net))
+        {
+            chirouter_filter_free(node);
+            return NULL;
+        }
+    }
+
+    if (!filter_next(parser))
+    {
+        chirouter_filter_free(node);
+        return NULL;
+    }
+
+    return node;
+}
+
+
+/* Parses a factor */
+static chirouter_filter_t *filter_parse_factor(filter_parser_t *parser)
+{
+    chirouter_filter_t *node;
+
+    if (filter_is(parser, "not", "!"))
+    {
+        if (!filter_next(parser))
+            return NULL;
+        node = filter_parse_factor(parser);
+        if (node == NULL)
+            return NULL;
+        return filter_op(parser, FILTER_NOT, node, NULL);
+    }
+
+    if (filter_is(parser, "(", NULL))
+    {
+        if (!filter_next(parser))
+            return NULL;
+        node = filter_parse_expr(parser);
+        if (node == NULL)
+            return NULL;
+        if (!filter_is(parser, ")", NULL))
+        {
+            snprintf(parser->error, FILTER_MAX_ERROR_LEN, "Expected ')'");
+            chirouter_filter_free(node);
+            return NULL;
+        }
+        if (!filter_next(parser))
+        {
+            chirouter_filter_free(node);
+            return NULL;
+        }
+        return node;
+    }
+
+    return filter_parse_primitive(parser);
+}
+
+
+/* Parses a term */
+static chirouter_filter_t *filter_parse_term(filter_parser_t *parser)
+{
+    chirouter_filter_t *node, *right;
+
+    node = filter_parse_factor(parser);
+
+    while (node && filter_is(parser, "and", "&&"))
+    {
+        if (!filter_next(parser) || (right = filter_parse_factor(parser)) == NULL)
+        {
+            chirouter_filter_free(node);
+            return NULL;
+        }
+        node = filter_op(parser, FILTER_AND, node, right);
+    }
+
+    return node;
+}
+
+
+/* Parses an expression */
+static chirouter_filter_t *filter_parse_expr(filter_parser_t *parser)
+{
+    chirouter_filter_t *node, *right;
+
+    node = filter_parse_term(parser);
+
+    while (node && filter_is(parser, "or", "||"))
+    {
+        if (!filter_next(parser) || (right = filter_parse_term(parser)) == NULL)
+        {
+            chirouter_filter_free(node);
+            return NULL;
+        }
+        node = filter_op(parser, FILTER_OR, node, right);
+    }
+
+    return node;
+}
+
+
+/* See filter.h */
+chirouter_filter_t *chirouter_filter_compile(const char *expr, char *error)
+{
+    filter_parser_t parser = { .p = expr, .error = error };
+    chirouter_filter_t *filter;
+
+    error[0] = '\0';
+
+    if (!filter_next(&parser))
+        return NULL;
+
+    filter = filter_parse_expr(&parser);
+
+    if (filter && parser.tok[0] != '\0')
+    {
+        snprintf(error, FILTER_MAX_ERROR_LEN, "Unexpected '%s'", parser.tok);
+        chirouter_filter_free(filter);
+        return NULL;
+    }
+
+    return filter;
+}
+
+
+/* See filter.h */
+void chirouter_filter_free(chirouter_filter_t *filter)
+{
+    if (filter == NULL)
+        return;
+
+    chirouter_filter_free(filter->left);
+    chirouter_filter_free(filter->right);
+    free(filter);
+}
+
+
+/* Gets the addresses of an IPv4 or ARP packet. Returns false
+ * if the frame is neither (or is too short). */
+static inline bool filter_addrs(const uint8_t *frame, size_t len, uint32_t *src, uint32_t *dst)
+{
+    uint16_t type = ntohs(((const ethhdr_t *) frame)->type);
+
+    if (type == ETHERTYPE_IP && len >= sizeof(ethhdr_t) + sizeof(iphdr_t))
+    {
+        const iphdr_t *ip = (const iphdr_t *) (frame + sizeof(ethhdr_t));
+        *src = ip->src;
+        *dst = ip->dst;
+        return true;
+    }
+    else if (type == ETHERTYPE_ARP && len >= sizeof(ethhdr_t) + sizeof(arp_packet_t))
+    {
+        const arp_packet_t *arp = (const arp_packet_t *) (frame + sizeof(ethhdr_t));
+        *src = arp->spa;
+        *dst = arp->tpa;
+        return true;
+    }
+
+    return false;
+}
+
+
+/* See filter.h */
+bool chirouter_filter_match(const chirouter_filter_t *filter, chirouter_ctx_t *ctx, chirouter_interface_t *iface,
+                            const uint8_t *frame, size_t len, int dir)
+{
+    uint32_t src, dst;
+
+    switch (filter->type)
+    {
+    case FILTER_AND:
+        return chirouter_filter_match(filter->left, ctx, iface, frame, len, dir) &&
+               chirouter_filter_match(filter->right, ctx, iface, frame, len, dir);
+    case FILTER_OR:
+        return chirouter_filter_match(filter->left, ctx, iface, frame, len, dir) ||
+               chirouter_filter_match(filter->right, ctx, iface, frame, len, dir);
+    case FILTER_NOT:
+        return !chirouter_filter_match(filter->left, ctx, iface, frame, len, dir);
+    case FILTER_ETHERTYPE:
+        return len >= sizeof(ethhdr_t) && ntohs(((const ethhdr_t *) frame)->type) == filter->value;
+    case FILTER_IP_PROTO:
+        return len >= sizeof(ethhdr_t) + sizeof(iphdr_t) &&
+               ntohs(((const ethhdr_t *) frame)->type) == ETHERTYPE_IP &&
+               ((const iphdr_t *) (frame + sizeof(ethhdr_t)))->proto == filter->value;
+    case FILTER_DIRECTION:
+        return dir == filter->value;
+    case FILTER_ROUTER:
+        return !strcmp(ctx->name, filter->name);
+    case FILTER_IFACE:
+        return !strcmp(iface->name, filter->name);
+    case FILTER_NET:
+        if (len < sizeof(ethhdr_t) || !filter_addrs(frame, len, &src, &dst))
+            return false;
+        return ((filter->which & FILTER_SRC) && (src & filter->mask) == filter->addr) ||
+               ((filter->which & FILTER_DST) && (dst & filter->mask) == filter->addr);
+    }
+
+    return false;
+}
@@ -0,0 +1,163 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Capture filters
+ *
+ *  A capture filter selects which frames are written to the capture
+ *  file. Filters are written in a small subset of the tcpdump/pcap
+ *  filter language:
+ *
+ *    expr      := term [ "or" term ]...
+ *    term      := factor [ "and" factor ]...
+ *    factor    := "not" factor | "(" expr ")" | primitive
+ *    primitive := "arp" | "ip" | "icmp" | "tcp" | "udp"
+ *               | "inbound" | "outbound"
+ *               | "router" NAME | "iface" NAME
+ *               | [ "src" | "dst" ] "host" ADDRESS
+ *               | [ "src" | "dst" ] "net" ADDRESS/PREFIX_LEN
+ *
+ *  "host" and "net" match IPv4 packets (and ARP packets, using the
+ *  sender and target protocol addresses). Without "src" or "dst",
+ *  they match either address. "&&", "||" and "!" can be used instead
+ *  of "and", "or" and "not". For example:
+ *
+ *    arp or icmp
+ *    router r1 and not iface eth0
+ *    inbound and dst net 10.0.1.0/24
+ *
+ *  A filter is compiled once into a tree, which is evaluated against
+ *  the frame in place (without copying it), so frames that don't
+ *  match cost only the evaluation of the filter.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chirouter.h"
+
+/* Maximum length of the error message of chirouter_filter_compile */
+#define FILTER_MAX_ERROR_LEN (128)
+
+/* Kinds of filter nodes */
+typedef enum
+{
+    FILTER_AND,
+    FILTER_OR,
+    FILTER_NOT,
+    FILTER_ETHERTYPE,   /* arp, ip */
+    FILTER_IP_PROTO,    /* icmp, tcp, udp */
+    FILTER_DIRECTION,   /* inbound, outbound */
+    FILTER_ROUTER,
+    FILTER_IFACE,
+    FILTER_NET,         /* host and net */
+} chirouter_filter_type_t;
+
+/* Which address "host" and "net" match */
+#define FILTER_SRC (1)
+#define FILTER_DST (2)
+
+/* A node of a compiled filter */
+typedef struct chirouter_filter
+{
+    chirouter_filter_type_t type;
+
+    /* Operands of FILTER_AND and FILTER_OR (FILTER_NOT only uses left) */
+    struct chirouter_filter *left;
+    struct chirouter_filter *right;
+
+    /* Ethertype, IP protocol, or pcap_packet_direction_t */
+    uint16_t value;
+
+    /* FILTER_NET: Address and mask (in network order),
+     * and which addresses to match (FILTER_SRC/FILTER_DST) */
+    uint32_t addr;
+    uint32_t mask;
+    uint8_t which;
+
+    /* FILTER_ROUTER and FILTER_IFACE */
+    char name[MAX_IFACE_NAMELEN + 1];
+} chirouter_filter_t;
+
+
+/*
+ * chirouter_filter_compile - Compile a capture filter
+ *
+ * expr: Filter expression (see above)
+ *
+ * error: Buffer of FILTER_MAX_ERROR_LEN bytes where an error message
+ *        is written if the expression is not valid
+ *
+ * Returns: The compiled filter, or NULL if the expression is not valid
+ *          (or if memory could not be allocated).
+ */
+chirouter_filter_t *chirouter_filter_compile(const char *expr, char *error);
+
+
+/*
+ * chirouter_filter_free - Free a compiled filter
+ *
+ * filter: Compiled filter (can be NULL)
+ *
+ * Returns: nothing.
+ */
+void chirouter_filter_free(chirouter_filter_t *filter);
+
+
+/*
+ * chirouter_filter_match - Check whether a frame matches a filter
+ *
+ * filter: Compiled filter
+ *
+ * ctx: Router that received or is sending the frame
+ *
+ * iface: Interface the frame was received or sent on
+ *
+ * frame: Pointer to the frame
+ *
+ * len: Length of the frame
+ *
+ * dir: Direction of the frame (a pcap_packet_direction_t)
+ *
+ * Returns: true if the frame matches the filter, false otherwise.
+ */
+bool chirouter_filter_match(const chirouter_filter_t *filter, chirouter_ctx_t *ctx, chirouter_interface_t *iface,
+                            const uint8_t *frame, size_t len, int dir);
+
+#endif /* FILTER_H_ */
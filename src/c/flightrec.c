@@ -0,0 +1,234 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Flight recorder
+ *
+ *  see flightrec.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flightrec.h"
+#include "log.h"
+
+
+/* See flightrec.h */
+chirouter_flightrec_t *chirouter_flightrec_create(uint32_t size)
+{
+    chirouter_flightrec_t *fr;
+    uint32_t rounded = 1;
+
+    while (rounded < size)
+        rounded <<= 1;
+
+    fr = calloc(1, sizeof(chirouter_flightrec_t));
+    if (fr == NULL)
+        return NULL;
+
+    fr->events = aligned_alloc(64, rounded * sizeof(chirouter_flightrec_event_t));
+    if (fr->events == NULL)
+    {
+        free(fr);
+        return NULL;
+    }
+    memset(fr->events, 0, rounded * sizeof(chirouter_flightrec_event_t));
+
+    fr->size = rounded;
+    pthread_mutex_init(&fr->lock_dump, NULL);
+
+    return fr;
+}
+
+
+/* See flightrec.h */
+void chirouter_flightrec_free(chirouter_flightrec_t *fr)
+{
+    if (fr == NULL)
+        return;
+
+    pthread_mutex_destroy(&fr->lock_dump);
+    free(fr->events);
+    free(fr);
+}
+
+
+/* See flightrec.h */
+uint64_t chirouter_flightrec_record(chirouter_flightrec_t *fr, chirouter_ctx_t *ctx, chirouter_interface_t *iface,
+                                    const uint8_t *data, size_t len, pcap_packet_direction_t dir)
+{
+    uint64_t seq = __atomic_add_fetch(&fr->pos, 1, __ATOMIC_RELAXED);
+    chirouter_flightrec_event_t *ev = &fr->events[seq & (fr->size - 1)];
+    struct timespec ts;
+
+    /* Mark the slot as being written */
+    __atomic_store_n(&ev->state, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ev->ts = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    ev->len = len;
+    ev->caplen = len < FLIGHTREC_SNAPLEN ? len : FLIGHTREC_SNAPLEN;
+    ev->dir = dir;
+    memcpy(ev->router, ctx->name, sizeof(ev->router));
+    memcpy(ev->iface, iface->name, sizeof(ev->iface));
+    memcpy(ev->data, data, ev->caplen);
+
+    __atomic_store_n(&ev->state, (seq << 8) | chirouter_stats_last, __ATOMIC_RELEASE);
+
+    return seq;
+}
+
+
+/* See flightrec.h */
+void chirouter_flightrec_decide(chirouter_flightrec_t *fr, uint64_t event, uint8_t decision)
+{
+    chirouter_flightrec_event_t *ev = &fr->events[event & (fr->size - 1)];
+    uint64_t state = __atomic_load_n(&ev->state, __ATOMIC_RELAXED);
+
+    /* If the slot has been reused (or is being reused), its
+     * sequence number won't match, and the CAS will fail */
+    while ((state >> 8) == event)
+        if (__atomic_compare_exchange_n(&ev->state, &state, (event << 8) | decision, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+}
+
+
+/* Returns the pcapng interface ID for an event's interface, writing its
+ * interface description block if this is the first event on it */
+static int flightrec_iface_id(FILE *f, chirouter_flightrec_event_t *ev, char (*names)[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2],
+                              uint32_t *num_names)
+{
+    char name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+
+    snprintf(name, sizeof(name), "%s-%s", ev->router, ev->iface);
+
+    for (uint32_t i = 0; i < *num_names; i++)
+        if (!strcmp(names[i], name))
+            return i;
+
+    if (chirouter_pcapng_write_idb(f, name, NULL, FLIGHTREC_SNAPLEN))
+        return -1;
+
+    strcpy(names[*num_names], name);
+    return (*num_names)++;
+}
+
+
+/* See flightrec.h */
+int chirouter_flightrec_dump(chirouter_flightrec_t *fr, const char *reason)
+{
+    chirouter_flightrec_event_t *ev;
+    char (*names)[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+    char filename[64];
+    uint32_t num_names = 0, num_events = 0;
+    uint64_t end, start, state;
+    FILE *f;
+    int rc = 0;
+
+    ev = malloc(sizeof(chirouter_flightrec_event_t));
+    names = malloc(fr->size * sizeof(*names));
+    if (ev == NULL || names == NULL)
+    {
+        free(ev);
+        free(names);
+        return -1;
+    }
+
+    pthread_mutex_lock(&fr->lock_dump);
+
+    snprintf(filename, sizeof(filename), "chirouter-flightrec-%d-%u.pcapng", getpid(), fr->num_dumps++);
+    f = fopen(filename, "w");
+    if (f == NULL)
+    {
+        chilog(ERROR, "Could not create flight recorder dump %s", filename);
+        pthread_mutex_unlock(&fr->lock_dump);
+        free(ev);
+        free(names);
+        return -1;
+    }
+
+    rc = chirouter_pcapng_write_shb(f);
+
+    end = __atomic_load_n(&fr->pos, __ATOMIC_ACQUIRE);
+    start = end > fr->size ? end - fr->size + 1 : 1;
+
+    for (uint64_t seq = start; seq <= end && rc == 0; seq++)
+    {
+        chirouter_flightrec_event_t *slot = &fr->events[seq & (fr->size - 1)];
+        int iface_id;
+
+        /* Copy the event, and skip it if it was being written (or
+         * was overwritten) while we copied it */
+        state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if ((state >> 8) != seq)
+            continue;
+        memcpy(ev, slot, sizeof(chirouter_flightrec_event_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+        if ((state >> 8) != seq)
+            continue;
+
+        iface_id = flightrec_iface_id(f, ev, names, &num_names);
+        if (iface_id < 0)
+        {
+            rc = -1;
+            break;
+        }
+
+        rc = chirouter_pcapng_write_epb(f, iface_id, ev->ts, ev->data, ev->caplen, ev->len, ev->dir,
+                                        (state & 0xFF) ? chirouter_stat_name(state & 0xFF) : "no decision");
+        num_events++;
+    }
+
+    if (fclose(f) != 0)
+        rc = -1;
+
+    pthread_mutex_unlock(&fr->lock_dump);
+
+    if (rc == 0)
+        chilog(WARNING, "Flight recorder (%s): wrote last %u frame events to %s", reason, num_events, filename);
+    else
+        chilog(ERROR, "Flight recorder (%s): could not write %s", reason, filename);
+
+    free(ev);
+    free(names);
+
+    return rc ? -1 : 0;
+}
@@ -0,0 +1,193 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Flight recorder
+ *
+ *  The flight recorder keeps the last few thousand frame events (every
+ *  frame received or sent by any router) in an in-memory ring, so that
+ *  they can be inspected after something goes wrong, without having
+ *  to log every frame. Each event holds a timestamp, the router and
+ *  interface, the direction, the decision taken for the frame, and the
+ *  first FLIGHTREC_SNAPLEN bytes of the frame.
+ *
+ *  The decision is the last of the "outcome" counters (see stats.h)
+ *  that was updated while processing the frame: forwarded, one of the
+ *  drop reasons, withheld, the ICMP message sent, etc. For outbound
+ *  frames, it is the decision that led to sending the frame.
+ *
+ *  Recording an event takes one atomic increment and a copy of the
+ *  event into its slot in the ring; there are no locks. Each slot has
+ *  a sequence number which is cleared while the slot is written, so
+ *  the ring can be dumped while frames are being recorded.
+ *
+ *  The ring is dumped as a pcapng file (one comment per frame with
+ *  its decision) when chirouter receives SIGUSR1, or when a critical
+ *  error happens while processing a frame.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef FLIGHTREC_H_
+#define FLIGHTREC_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "chirouter.h"
+#include "pcap.h"
+
+/* Default number of events in the ring */
+#define FLIGHTREC_DEFAULT_SIZE (4096)
+
+/* Maximum number of bytes of each frame that are kept */
+#define FLIGHTREC_SNAPLEN (128)
+
+
+/* A single frame event */
+typedef struct
+{
+    /* Sequence number of the event (starting at 1) in the upper 56
+     * bits, and decision in the lower 8 bits. Zero if the slot is
+     * empty or being written. */
+    uint64_t state;
+
+    /* Nanoseconds since the epoch */
+    uint64_t ts;
+
+    /* Original length of the frame, and number of bytes kept */
+    uint16_t len;
+    uint8_t caplen;
+
+    /* pcap_packet_direction_t */
+    uint8_t dir;
+
+    char router[MAX_ROUTER_NAMELEN + 1];
+    char iface[MAX_IFACE_NAMELEN + 1];
+
+    uint8_t data[FLIGHTREC_SNAPLEN];
+} __attribute__((aligned(64))) chirouter_flightrec_event_t;
+
+
+/* The flight recorder */
+typedef struct chirouter_flightrec
+{
+    /* Ring of events ("size" entries, a power of two) */
+    chirouter_flightrec_event_t *events;
+    uint32_t size;
+
+    /* Sequence number of the last event recorded */
+    uint64_t pos __attribute__((aligned(64)));
+
+    /* Serializes dumps, and numbers the dump files */
+    pthread_mutex_t lock_dump;
+    uint32_t num_dumps;
+} chirouter_flightrec_t;
+
+
+/*
+ * chirouter_flightrec_create - Create a flight recorder
+ *
+ * size: Number of events in the ring (rounded up to a power of two)
+ *
+ * Returns: The flight recorder, or NULL if an error happens.
+ */
+chirouter_flightrec_t *chirouter_flightrec_create(uint32_t size);
+
+
+/*
+ * chirouter_flightrec_free - Free a flight recorder
+ *
+ * fr: Flight recorder (can be NULL)
+ *
+ * Returns: nothing.
+ */
+void chirouter_flightrec_free(chirouter_flightrec_t *fr);
+
+
+/*
+ * chirouter_flightrec_record - Record a frame event
+ *
+ * Can be called from any thread. The event's decision is set to
+ * the last decision made by the calling thread (see stats.h).
+ *
+ * fr: Flight recorder
+ *
+ * ctx: Router context
+ *
+ * iface: Interface the frame was received or sent on
+ *
+ * data: Pointer to the frame
+ *
+ * len: Length of the frame
+ *
+ * dir: Direction of the frame
+ *
+ * Returns: A handle for the event, to set its decision later on
+ *          (see chirouter_flightrec_decide)
+ */
+uint64_t chirouter_flightrec_record(chirouter_flightrec_t *fr, chirouter_ctx_t *ctx, chirouter_interface_t *iface,
+                                    const uint8_t *data, size_t len, pcap_packet_direction_t dir);
+
+
+/*
+ * chirouter_flightrec_decide - Set the decision of an event
+ *
+ * Does nothing if the event has already been overwritten.
+ *
+ * fr: Flight recorder
+ *
+ * event: Handle returned by chirouter_flightrec_record
+ *
+ * decision: Decision (a chirouter_stat_t counter, see stats.h)
+ *
+ * Returns: nothing.
+ */
+void chirouter_flightrec_decide(chirouter_flightrec_t *fr, uint64_t event, uint8_t decision);
+
+
+/*
+ * chirouter_flightrec_dump - Write the events in the ring to a pcapng file
+ *
+ * The file is created in the current directory, and is named
+ * chirouter-flightrec-PID-N.pcapng. Can be called from any thread.
+ *
+ * fr: Flight recorder
+ *
+ * reason: Why the ring is being dumped (for the log message)
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_flightrec_dump(chirouter_flightrec_t *fr, const char *reason);
+
+#endif /* FLIGHTREC_H_ */
@@ -0,0 +1,428 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  JSON parser
+ *
+ *  see json.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "json.h"
+
+/* State of the parser */
+typedef struct
+{
+    const char *text;
+    const char *p;
+    int depth;
+    char *error;
+} json_parser_t;
+
+
+/* Writes an error message, with the line where it happened */
+static void json_error(json_parser_t *parser, const char *msg)
+{
+    int line = 1;
+
+    for (const char *c = parser->text; c < parser->p; c++)
+        if (*c == '\n')
+            line++;
+
+    snprintf(parser->error, JSON_MAX_ERROR_LEN, "Line %i: %s", line, msg);
+}
+
+
+static void json_skip_space(json_parser_t *parser)
+{
+    while (isspace((unsigned char) *parser->p))
+        parser->p++;
+}
+
+
+/* Allocates a value */
+static chirouter_json_t *json_value(json_parser_t *parser, chirouter_json_type_t type)
+{
+    chirouter_json_t *value = calloc(1, sizeof(chirouter_json_t));
+
+    if (value == NULL)
+        json_error(parser, "Out of memory");
+    else
+        value->type = type;
+
+    return value;
+}
+
+
+/* Parses a string (parser->p must point to the opening quote) */
+static char *json_parse_string(json_parser_t *parser)
+{
+    const char *start = ++parser->p;
+    size_t len = 0;
+    char *str;
+
+    /* Find the closing quote first, to know how much to allocate */
+    while (*parser->p != '"')
+    {
+        if (*parser->p == '\0' || (unsigned char) *parser->p < 0x20)
+        {
+            json_error(parser, "Unterminated string");
+            return NULL;
+        }
+        if (*parser->p == '\\' && parser->p[1] != '\0')
+            parser->p++;
+        parser->p++;
+    }
+
+    str = malloc(parser->p - start + 1);
+    if (str == NULL)
+    {
+        json_error(parser, "Out of memory");
+        return NULL;
+    }
+
+    for (const char *c = start; c < parser->p; c++)
+    {
+        if (*c != '\\')
+        {
+            str[len++] = *c;
+            continue;
+        }
+
+        switch (*++c)
+        {
+        case '"':
+        case '\\':
+        case '/':
+            str[len++] = *c;
+            break;
+        case 'b':
+            str[len++] = '\b';
+            break;
+        case 'f':
+            str[len++] = '\f';
+            break;
+        case 'n':
+            str[len++] = '\n';
+            break;
+        case 'r':
+            str[len++] = '\r';
+            break;
+        case 't':
+            str[len++] = '\t';
+            break;
+        case 'u':
+        {
+            unsigned int code = 0;
+
+            for (int i = 1; i <= 4; i++)
+            {
+                if (!isxdigit((unsigned char) c[i]))
+                {
+                    parser->p = c;
+                    json_error(parser, "Invalid \\u escape in string");
+                    free(str);
+                    return NULL;
+                }
+                code = code * 16 + (isdigit((unsigned char) c[i]) ? c[i] - '0' : (tolower((unsigned char) c[i]) - 'a' + 10));
+            }
+            c += 4;
+            str[len++] = (code > 0 && code < 0x80) ? code : '?';
+            break;
+        }
+        default:
+            parser->p = c;
+            json_error(parser, "Invalid escape in string");
+            free(str);
+            return NULL;
+        }
+    }
+
+    str[len] = '\0';
+    parser->p++;
+
+    return str;
+}
+
+
+static chirouter_json_t *json_parse_value(json_parser_t *parser);
+
+
+/* Parses the elements of an array, or the members of an object
+ * (parser->p must point to the opening bracket or brace) */
+static bool json_parse_children(json_parser_t *parser, chirouter_json_t *value)
+{
+    bool is_object = value->type == JSON_OBJECT;
+    char close = is_object ? '}' : ']';
+    chirouter_json_t **tail = &value->child;
+
+    if (++parser->depth > JSON_MAX_DEPTH)
+    {
+        json_error(parser, "Too many nested arrays or objects");
+        return false;
+    }
+
+    parser->p++;
+    json_skip_space(parser);
+
+    if (*parser->p == close)
+    {
+        parser->p++;
+        parser->depth--;
+        return true;
+    }
+
+    while (true)
+    {
+        char *key = NULL;
+        chirouter_json_t *child;
+
+        json_skip_space(parser);
+
+        if (is_object)
+        {
+            if (*parser->p != '"')
+            {
+                json_error(parser, "Expected the name of an object member");
+                return false;
+            }
+            key = json_parse_string(parser);
+            if (key == NULL)
+                return false;
+
+            json_skip_space(parser);
+            if (*parser->p != ':')
+            {
+                json_error(parser, "Expected ':' after the name of an object member");
+                free(key);
+                return false;
+            }
+            parser->p++;
+        }
+
+        child = json_parse_value(parser);
+        if (child == NULL)
+        {
+            free(key);
+            return false;
+        }
+        child->key = key;
+
+        *tail = child;
+        tail = &child->next;
+
+        json_skip_space(parser);
+        if (*parser->p == ',')
+            parser->p++;
+        else if (*parser->p == close)
+        {
+            parser->p++;
+            break;
+        }
+        else
+        {
+            json_error(parser, is_object ? "Expected ',' or '}'" : "Expected ',' or ']'");
+            return false;
+        }
+    }
+
+    parser->depth--;
+    return true;
+}
+
+
+/* Parses a value of any type */
+static chirouter_json_t *json_parse_value(json_parser_t *parser)
+{
+    chirouter_json_t *value;
+
+    json_skip_space(parser);
+
+    switch (*parser->p)
+    {
+    case '{':
+    case '[':
+        value = json_value(parser, *parser->p == '{' ? JSON_OBJECT : JSON_ARRAY);
+        if (value && !json_parse_children(parser, value))
+        {
+            chirouter_json_free(value);
+            return NULL;
+        }
+        return value;
+
+    case '"':
+        value = json_value(parser, JSON_STRING);
+        if (value && (value->string = json_parse_string(parser)) == NULL)
+        {
+            free(value);
+            return NULL;
+        }
+        return value;
+
+    case '-':
+    case '0' ... '9':
+    {
+        char *end;
+        double number = strtod(parser->p, &end);
+
+        if (end == parser->p)
+        {
+            json_error(parser, "Invalid number");
+            return NULL;
+        }
+        parser->p = end;
+
+        value = json_value(parser, JSON_NUMBER);
+        if (value)
+            value->number = number;
+        return value;
+    }
+
+    default:
+        if (!strncmp(parser->p, "true", 4) || !strncmp(parser->p, "false", 5))
+        {
+            value = json_value(parser, JSON_BOOL);
+            if (value)
+                value->boolean = (*parser->p == 't');
+            parser->p += (*parser->p == 't') ? 4 : 5;
+            return value;
+        }
+        if (!strncmp(parser->p, "null", 4))
+        {
+            parser->p += 4;
+            return json_value(parser, JSON_NULL);
+        }
+
+        json_error(parser, *parser->p ? "Unexpected character" : "Unexpected end of document");
+        return NULL;
+    }
+}
+
+
+/* See json.h */
+chirouter_json_t *chirouter_json_parse(const char *text, char *error)
+{
+    json_parser_t parser = { .text = text, .p = text, .depth = 0, .error = error };
+    chirouter_json_t *root;
+
+    root = json_parse_value(&parser);
+    if (root == NULL)
+        return NULL;
+
+    json_skip_space(&parser);
+    if (*parser.p != '\0')
+    {
+        json_error(&parser, "Unexpected characters after the end of the document");
+        chirouter_json_free(root);
+        return NULL;
+    }
+
+    return root;
+}
+
+
+/* See json.h */
+chirouter_json_t *chirouter_json_parse_file(const char *path, char *error)
+{
+    chirouter_json_t *root;
+    char *text;
+    long len;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+    {
+        snprintf(error, JSON_MAX_ERROR_LEN, "Could not open %s", path);
+        return NULL;
+    }
+
+    if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0)
+    {
+        snprintf(error, JSON_MAX_ERROR_LEN, "Could not read %s", path);
+        fclose(f);
+        return NULL;
+    }
+
+    text = malloc(len + 1);
+    if (text == NULL || fread(text, 1, len, f) != (size_t) len)
+    {
+        snprintf(error, JSON_MAX_ERROR_LEN, "Could not read %s", path);
+        free(text);
+        fclose(f);
+        return NULL;
+    }
+    text[len] = '\0';
+    fclose(f);
+
+    root = chirouter_json_parse(text, error);
+    free(text);
+
+    return root;
+}
+
+
+/* See json.h */
+void chirouter_json_free(chirouter_json_t *value)
+{
+    while (value)
+    {
+        chirouter_json_t *next = value->next;
+
+        chirouter_json_free(value->child);
+        free(value->key);
+        free(value->string);
+        free(value);
+
+        value = next;
+    }
+}
+
+
+/* See json.h */
+chirouter_json_t *chirouter_json_get(const chirouter_json_t *obj, const char *key)
+{
+    if (obj == NULL || obj->type != JSON_OBJECT)
+        return NULL;
+
+    for (chirouter_json_t *member = obj->child; member; member = member->next)
+        if (!strcmp(member->key, key))
+            return member;
+
+    return NULL;
+}
@@ -0,0 +1,143 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  JSON parser
+ *
+ *  A small parser for the JSON files used to describe topologies
+ *  (see topologies/). A document is parsed into a tree of values:
+ *  the elements of an array, and the members of an object, are
+ *  linked through their "next" field, starting at the "child"
+ *  field of the array or object. For example:
+ *
+ *    for (chirouter_json_t *v = array->child; v; v = v->next)
+ *        ...
+ *
+ *  Only ASCII characters can be written as \u escapes in strings
+ *  (other escaped characters are replaced by '?').
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef JSON_H_
+#define JSON_H_
+
+#include <stdbool.h>
+
+/* Maximum length of the error message of the parsing functions */
+#define JSON_MAX_ERROR_LEN (128)
+
+/* Maximum nesting of arrays and objects */
+#define JSON_MAX_DEPTH (64)
+
+/* Types of JSON values */
+typedef enum
+{
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT,
+} chirouter_json_type_t;
+
+/* A JSON value */
+typedef struct chirouter_json
+{
+    chirouter_json_type_t type;
+
+    /* Name of the value, if it is a member of an object */
+    char *key;
+
+    bool boolean;
+    double number;
+    char *string;
+
+    /* First element of an array, or first member of an object */
+    struct chirouter_json *child;
+
+    /* Next element or member of the enclosing array or object */
+    struct chirouter_json *next;
+} chirouter_json_t;
+
+
+/*
+ * chirouter_json_parse - Parse a JSON document
+ *
+ * text: The document (a NUL-terminated string)
+ *
+ * error: Buffer of JSON_MAX_ERROR_LEN bytes where an error message
+ *        is written if the document is not valid
+ *
+ * Returns: The root value, or NULL if the document is not valid
+ *          (or if memory could not be allocated).
+ */
+chirouter_json_t *chirouter_json_parse(const char *text, char *error);
+
+
+/*
+ * chirouter_json_parse_file - Parse a JSON file
+ *
+ * path: Path of the file
+ *
+ * error: Buffer of JSON_MAX_ERROR_LEN bytes where an error message
+ *        is written if the file can't be read or is not valid
+ *
+ * Returns: The root value, or NULL if an error happens.
+ */
+chirouter_json_t *chirouter_json_parse_file(const char *path, char *error);
+
+
+/*
+ * chirouter_json_free - Free a JSON value (and all the values it contains)
+ *
+ * value: JSON value (can be NULL)
+ *
+ * Returns: nothing.
+ */
+void chirouter_json_free(chirouter_json_t *value);
+
+
+/*
+ * chirouter_json_get - Find a member of an object
+ *
+ * obj: JSON object (can be NULL, or a value of any other type)
+ *
+ * key: Name of the member
+ *
+ * Returns: The member, or NULL if obj is not an object or
+ *          does not have that member.
+ */
+chirouter_json_t *chirouter_json_get(const chirouter_json_t *obj, const char *key);
+
+#endif /* JSON_H_ */
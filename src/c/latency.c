@@ -0,0 +1,258 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Per-stage latency histograms
+ *
+ *  see latency.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency.h"
+
+uint32_t chirouter_latency_sample_rate = LATENCY_DEFAULT_SAMPLE_RATE;
+
+__thread chirouter_lat_sample_t chirouter_lat_cur;
+
+/* Number of frames seen by the calling thread since the last sample */
+static __thread uint32_t frames_since_sample;
+
+static const char *stage_names[CHIROUTER_STAGE_MAX] =
+{
+    [CHIROUTER_STAGE_FRAMING] = "framing",
+    [CHIROUTER_STAGE_VALIDATE] = "validate",
+    [CHIROUTER_STAGE_QUEUE] = "queue",
+    [CHIROUTER_STAGE_ROUTE] = "route",
+    [CHIROUTER_STAGE_ARP] = "arp",
+    [CHIROUTER_STAGE_BUILD] = "build",
+    [CHIROUTER_STAGE_TX] = "tx",
+    [CHIROUTER_STAGE_TOTAL] = "total",
+};
+
+
+/* Returns the bucket a value goes in */
+static inline int latency_bucket(uint64_t v)
+{
+    if (v < LATENCY_SUB_BUCKETS)
+        return v;
+
+    int msb = 63 - __builtin_clzll(v);
+    if (msb > LATENCY_MAX_BITS)
+        return LATENCY_BUCKETS - 1;
+
+    /* Values with the same most significant bit are in the same
+     * group, which is split into LATENCY_SUB_BUCKETS buckets */
+    int group = msb - LATENCY_SUB_BITS + 1;
+    int sub = (v >> (group - 1)) - LATENCY_SUB_BUCKETS;
+
+    return group * LATENCY_SUB_BUCKETS + sub;
+}
+
+
+/* Returns the largest value that goes in a bucket */
+static inline uint64_t latency_bucket_max(int bucket)
+{
+    int group = bucket / LATENCY_SUB_BUCKETS;
+    int sub = bucket % LATENCY_SUB_BUCKETS;
+
+    if (group == 0)
+        return bucket;
+
+    return ((uint64_t) (LATENCY_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
+
+
+/* See latency.h */
+int chirouter_latency_init(chirouter_latency_t *lat)
+{
+    lat->stages = calloc(CHIROUTER_STAGE_MAX, sizeof(chirouter_hist_t));
+
+    return lat->stages == NULL ? -1 : 0;
+}
+
+
+/* See latency.h */
+void chirouter_latency_free(chirouter_latency_t *lat)
+{
+    free(lat->stages);
+    lat->stages = NULL;
+}
+
+
+/* See latency.h */
+bool chirouter_latency_begin(uint64_t start)
+{
+    uint32_t rate = chirouter_latency_sample_rate;
+
+    if (rate == 0 || ++frames_since_sample < rate)
+    {
+        chirouter_lat_cur.start = 0;
+        return false;
+    }
+
+    frames_since_sample = 0;
+    chirouter_lat_cur.start = chirouter_lat_cur.mark = start;
+    return true;
+}
+
+
+/* See latency.h */
+void chirouter_latency_record(chirouter_latency_t *lat, chirouter_stage_t stage, uint64_t ns)
+{
+    if (lat->stages == NULL)
+        return;
+
+    chirouter_hist_record(&lat->stages[stage], ns);
+}
+
+
+/* See latency.h */
+void chirouter_hist_record(chirouter_hist_t *hist, uint64_t ns)
+{
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&hist->buckets[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, ns, __ATOMIC_RELAXED);
+
+    while (ns > max && !__atomic_compare_exchange_n(&hist->max, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+
+/* See latency.h */
+int chirouter_latency_snapshot(chirouter_latency_t *lat, chirouter_stage_t stage, chirouter_hist_t *hist)
+{
+    chirouter_hist_t *src;
+
+    if (lat->stages == NULL)
+        return -1;
+
+    src = &lat->stages[stage];
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        hist->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    hist->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    hist->sum = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    hist->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+
+/* See latency.h */
+uint64_t chirouter_latency_count_below(const chirouter_hist_t *hist, uint64_t ns)
+{
+    uint64_t count = 0;
+
+    for (int i = 0; i < LATENCY_BUCKETS && latency_bucket_max(i) <= ns; i++)
+        count += hist->buckets[i];
+
+    return count;
+}
+
+
+/* See latency.h */
+uint64_t chirouter_latency_percentile(const chirouter_hist_t *hist, double p)
+{
+    uint64_t count = 0, seen = 0, target;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        count += hist->buckets[i];
+
+    if (count == 0)
+        return 0;
+
+    target = (uint64_t) (p / 100.0 * count + 0.5);
+    if (target < 1)
+        target = 1;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen >= target)
+        {
+            uint64_t v = latency_bucket_max(i);
+            return v < hist->max ? v : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+
+/* See latency.h */
+void chirouter_latency_dump(FILE *f, const char *name, chirouter_latency_t *lat)
+{
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    chirouter_hist_t *hist;
+
+    if (lat->stages == NULL)
+        return;
+
+    /* Work on a copy, since the histograms may be updated as we go */
+    hist = malloc(sizeof(chirouter_hist_t));
+    if (hist == NULL)
+        return;
+
+    fprintf(f, "Latency of router %s (ns, one in %u frames sampled)\n", name, chirouter_latency_sample_rate);
+    fprintf(f, "  %-10s %10s %10s %10s %10s %10s %10s\n", "stage", "samples", "p50", "p90", "p99", "p99.9", "max");
+
+    for (int s = 0; s < CHIROUTER_STAGE_MAX; s++)
+    {
+        chirouter_latency_snapshot(lat, s, hist);
+
+        if (hist->count == 0)
+            continue;
+
+        fprintf(f, "  %-10s %10lu", chirouter_stage_name(s), hist->count);
+        for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+            fprintf(f, " %10lu", chirouter_latency_percentile(hist, percentiles[i]));
+        fprintf(f, " %10lu\n", hist->max);
+    }
+
+    free(hist);
+}
+
+
+/* See latency.h */
+const char *chirouter_stage_name(chirouter_stage_t stage)
+{
+    if (stage < 0 || stage >= CHIROUTER_STAGE_MAX)
+        return "unknown";
+
+    return stage_names[stage];
+}
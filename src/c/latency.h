@@ -0,0 +1,316 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Per-stage latency histograms
+ *
+ *  A sample of the inbound frames (one in every
+ *  chirouter_latency_sample_rate frames) is timestamped at each
+ *  stage of the pipeline, from the moment the frame is read from the
+ *  controller socket to the moment the resulting frames are sent:
+ *
+ *  - framing: from recv() returning to the frame being extracted from
+ *    the controller's message stream.
+ *  - validate: Ethernet-level checks in the server, before the frame
+ *    is handed to the router.
+ *  - queue: time spent waiting in an RSS queue (only with RSS).
+ *  - route: classification of the frame, and routing table lookup.
+ *  - arp: ARP cache lookup (and, on a miss, withholding the frame).
+ *  - build: construction of the outbound frame.
+ *  - tx: sending the frame (capture file and controller socket).
+ *  - total: from recv() returning to the frame being fully processed.
+ *
+ *  Each stage records the time elapsed since the previous stage, so a
+ *  stage that does not happen for a given frame (e.g., the frame is
+ *  dropped after the routing decision) is simply folded into the next
+ *  stage that does. Timestamps are taken with CLOCK_MONOTONIC_RAW,
+ *  which is consistent across threads (so a frame can be followed
+ *  across an RSS queue) and is read through the vDSO.
+ *
+ *  The samples are added to an HDR-style log-linear histogram per
+ *  router and stage: values are grouped by power of two, and each
+ *  power of two is split into 2^LATENCY_SUB_BITS equal-sized buckets,
+ *  so every value is recorded with a relative error of about 3%.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* Number of linear sub-buckets per power of two (as a power of two) */
+#define LATENCY_SUB_BITS (5)
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+
+/* Largest value that can be recorded precisely (larger values are
+ * recorded in the last bucket). About 18 minutes, in nanoseconds */
+#define LATENCY_MAX_BITS (40)
+
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+/* Default sampling rate (one in every N frames) */
+#define LATENCY_DEFAULT_SAMPLE_RATE (64)
+
+typedef enum
+{
+    CHIROUTER_STAGE_FRAMING = 0,
+    CHIROUTER_STAGE_VALIDATE,
+    CHIROUTER_STAGE_QUEUE,
+    CHIROUTER_STAGE_ROUTE,
+    CHIROUTER_STAGE_ARP,
+    CHIROUTER_STAGE_BUILD,
+    CHIROUTER_STAGE_TX,
+    CHIROUTER_STAGE_TOTAL,
+    CHIROUTER_STAGE_MAX
+} chirouter_stage_t;
+
+
+/* A histogram of latencies, in nanoseconds */
+typedef struct
+{
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} chirouter_hist_t;
+
+
+/* The latency histograms of a router (one per stage) */
+typedef struct
+{
+    /* CHIROUTER_STAGE_MAX histograms. If NULL, samples are ignored. */
+    chirouter_hist_t *stages;
+} chirouter_latency_t;
+
+
+/* The timestamps of a sampled frame: when it was received, and when
+ * the last stage ended. A frame that is not being sampled has a
+ * start time of zero. */
+typedef struct
+{
+    uint64_t start;
+    uint64_t mark;
+} chirouter_lat_sample_t;
+
+
+/* Sampling rate (one in every N frames is sampled). Zero disables sampling. */
+extern uint32_t chirouter_latency_sample_rate;
+
+/* Sample for the frame that the calling thread is processing */
+extern __thread chirouter_lat_sample_t chirouter_lat_cur;
+
+
+static inline uint64_t chirouter_latency_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/*
+ * chirouter_latency_init - Initialize the histograms of a router
+ *
+ * lat: Histograms
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_latency_init(chirouter_latency_t *lat);
+
+
+/*
+ * chirouter_latency_free - Free the histograms of a router
+ *
+ * lat: Histograms
+ *
+ * Returns: nothing.
+ */
+void chirouter_latency_free(chirouter_latency_t *lat);
+
+
+/*
+ * chirouter_latency_begin - Decide whether to sample the calling thread's next frame
+ *
+ * If the frame is sampled, chirouter_lat_cur is set so that it starts
+ * at the given time. Otherwise, it is cleared.
+ *
+ * start: Time when the frame was received (see chirouter_latency_now)
+ *
+ * Returns: true if the frame will be sampled.
+ */
+bool chirouter_latency_begin(uint64_t start);
+
+
+/*
+ * chirouter_latency_record - Record a single value in a histogram
+ *
+ * lat: Histograms
+ *
+ * stage: Stage
+ *
+ * ns: Latency, in nanoseconds
+ *
+ * Returns: nothing.
+ */
+void chirouter_latency_record(chirouter_latency_t *lat, chirouter_stage_t stage, uint64_t ns);
+
+
+/*
+ * chirouter_hist_record - Record a single value in a histogram
+ *
+ * Can be called concurrently from several threads.
+ *
+ * hist: Histogram
+ *
+ * ns: Latency, in nanoseconds
+ *
+ * Returns: nothing.
+ */
+void chirouter_hist_record(chirouter_hist_t *hist, uint64_t ns);
+
+
+/*
+ * chirouter_latency_mark - Mark the end of a stage for the calling thread's frame
+ *
+ * Records the time elapsed since the end of the previous stage. Does
+ * nothing if the frame is not being sampled.
+ *
+ * lat: Histograms of the router processing the frame
+ *
+ * stage: Stage that just ended
+ *
+ * Returns: nothing.
+ */
+static inline void chirouter_latency_mark(chirouter_latency_t *lat, chirouter_stage_t stage)
+{
+    if (__builtin_expect(chirouter_lat_cur.start == 0, 1))
+        return;
+
+    uint64_t now = chirouter_latency_now();
+    chirouter_latency_record(lat, stage, now - chirouter_lat_cur.mark);
+    chirouter_lat_cur.mark = now;
+}
+
+
+/*
+ * chirouter_latency_end - Finish sampling the calling thread's frame
+ *
+ * Records the total latency of the frame, and clears chirouter_lat_cur.
+ *
+ * lat: Histograms of the router processing the frame
+ *
+ * Returns: nothing.
+ */
+static inline void chirouter_latency_end(chirouter_latency_t *lat)
+{
+    if (__builtin_expect(chirouter_lat_cur.start == 0, 1))
+        return;
+
+    chirouter_latency_record(lat, CHIROUTER_STAGE_TOTAL, chirouter_latency_now() - chirouter_lat_cur.start);
+    chirouter_lat_cur.start = 0;
+}
+
+
+/*
+ * chirouter_latency_snapshot - Copy one of the histograms of a router
+ *
+ * The histogram can be updated while it is being copied, so the copy
+ * is not an exact snapshot (but no sample is counted twice).
+ *
+ * lat: Histograms
+ *
+ * stage: Stage
+ *
+ * hist: Where the copy will be stored
+ *
+ * Returns: 0 on success, -1 if the histograms have not been initialized.
+ */
+int chirouter_latency_snapshot(chirouter_latency_t *lat, chirouter_stage_t stage, chirouter_hist_t *hist);
+
+
+/*
+ * chirouter_latency_count_below - Count the values up to a given value
+ *
+ * hist: Histogram
+ *
+ * ns: Value (in nanoseconds)
+ *
+ * Returns: The number of values in the buckets whose upper bound is
+ *          less than or equal to the given value.
+ */
+uint64_t chirouter_latency_count_below(const chirouter_hist_t *hist, uint64_t ns);
+
+
+/*
+ * chirouter_latency_percentile - Compute a percentile of a histogram
+ *
+ * hist: Histogram
+ *
+ * p: Percentile (between 0 and 100)
+ *
+ * Returns: The value at the given percentile (more precisely, the upper
+ *          bound of the bucket that contains it), or 0 if the
+ *          histogram is empty.
+ */
+uint64_t chirouter_latency_percentile(const chirouter_hist_t *hist, double p);
+
+
+/*
+ * chirouter_latency_dump - Print the percentiles of every stage
+ *
+ * f: File to print to
+ *
+ * name: Name of the router
+ *
+ * lat: Histograms
+ *
+ * Returns: nothing.
+ */
+void chirouter_latency_dump(FILE *f, const char *name, chirouter_latency_t *lat);
+
+
+/*
+ * chirouter_stage_name - Get the name of a stage
+ *
+ * stage: Stage
+ *
+ * Returns: The name of the stage (e.g., "route")
+ */
+const char *chirouter_stage_name(chirouter_stage_t stage);
+
+#endif /* LATENCY_H_ */
@@ -40,10 +40,15 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 
 #include "protocols/ethernet.h"
@@ -54,85 +59,905 @@
 
 
 /* Logging level. Set by default to print just errors */
-static int loglevel = ERROR;
+int chirouter_loglevel = ERROR;
 
 
-/* See log.h */
-void chirouter_setloglevel(loglevel_t level)
+/* Size of each thread's ring of log records (must be a power of two) */
+#define LOG_RING_SIZE (1u << 18)
+
+/* Maximum size of a single log record */
+#define LOG_MAX_RECORD (2048u)
+
+/* Maximum length of a formatted log line */
+#define LOG_MAX_LINE (4096u)
+
+/* Size of the buffer the logging thread writes from */
+#define LOG_OUTBUF_SIZE (1u << 16)
+
+/* Maximum number of records written per batch */
+#define LOG_BATCH (4096)
+
+/* Record flags */
+#define LOG_REC_PAD (1)  /* Skip to the start of the ring */
+#define LOG_REC_RAW (2)  /* Payload is an already formatted message */
+#define LOG_REC_PACKET (4)  /* Payload is a log_packet_t to dissect */
+
+/* Kinds of packets that can be dissected */
+#define LOG_PKT_ETHERNET (1)
+#define LOG_PKT_ARP (2)
+#define LOG_PKT_IP (3)
+#define LOG_PKT_ICMP (4)
+#define LOG_PKT_HEX (5)
+
+#define LOG_ALIGN(x) (((x) + 7u) & ~7u)
+
+/* A log record. It is followed by the arguments of the message,
+ * packed by log_pack_args (or by the formatted message itself,
+ * if LOG_REC_RAW is set) */
+typedef struct
 {
-    loglevel = level;
-}
+    /* Total size of the record, including this header */
+    uint32_t size;
+    uint16_t level;
+    uint16_t flags;
+    /* CLOCK_REALTIME, in nanoseconds */
+    uint64_t timestamp;
+    const char *fmt;
+} log_record_t;
 
+/* Payload of a LOG_REC_PACKET record: a (possibly truncated) copy of
+ * the packet, which is only dissected by the logging thread */
+typedef struct
+{
+    uint8_t kind;
+    char prefix;
+    uint16_t unused;
+    /* Length of the packet, and number of bytes that were copied */
+    uint32_t len;
+    uint32_t caplen;
+    uint8_t data[];
+} log_packet_t;
 
-/* See log.h */
-void chilog(loglevel_t level, char *fmt, ...)
+/* Where the lines produced by a dissector go: either straight to
+ * stdout (synchronous logging) or to the logging thread's output
+ * buffer, with the timestamp of the record being dissected */
+typedef struct
 {
-    time_t t;
-    char buf[80], *levelstr;
-    va_list argptr;
+    loglevel_t level;
+    bool deferred;
+    uint64_t timestamp;
+} log_out_t;
 
-    if(level > loglevel)
-        return;
+static void log_dissect_packet(log_out_t *out, const log_packet_t *pkt);
+static void log_dissect_hex(log_out_t *out, void *data, int len);
 
-    t = time(NULL);
-    strftime(buf,80,"%Y-%m-%d %H:%M:%S",localtime(&t));
 
+/* A single-producer/single-consumer ring of log records. The producer
+ * is the thread that owns the ring, and the consumer is the logging
+ * thread. Positions are free-running byte counts. */
+typedef struct log_ring
+{
+    uint8_t *buf;
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+
+    /* Set when the owning thread exits. The logging thread frees
+     * the ring once it is empty */
+    bool dead;
+
+    struct log_ring *next;
+} log_ring_t;
+
+/* State of the asynchronous logging backend */
+static bool log_async;
+static bool log_stop;
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wakeup = PTHREAD_COND_INITIALIZER;
+static log_ring_t *log_rings;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+static __thread log_ring_t *log_ring;
+
+
+static const char *log_levelstr(loglevel_t level)
+{
     switch(level)
     {
     case CRITICAL:
-        levelstr = "CRITIC";
-        break;
+        return "CRITIC";
     case ERROR:
-        levelstr = "ERROR";
-        break;
+        return "ERROR";
     case WARNING:
-        levelstr = "WARN";
-        break;
+        return "WARN";
     case INFO:
-        levelstr = "INFO";
-        break;
+        return "INFO";
     case DEBUG:
-        levelstr = "DEBUG";
-        break;
+        return "DEBUG";
     case TRACE:
-        levelstr = "TRACE";
-        break;
+        return "TRACE";
     default:
-        levelstr = "UNKNOWN";
-        break;
+        return "UNKNOWN";
+    }
+}
+
+
+/* See log.h */
+void chirouter_setloglevel(loglevel_t level)
+{
+    chirouter_loglevel = level;
+}
+
+
+/* A parsed printf conversion specification */
+typedef struct
+{
+    const char *start;   /* The '%' */
+    const char *end;     /* One past the conversion character */
+    char flags[8];
+    int width;           /* -1 if not specified */
+    int precision;       /* -1 if not specified */
+    bool wide;           /* l, ll, z, j, t: the argument is 64-bit */
+    char conv;
+} log_spec_t;
+
+
+/* Parses the conversion specification starting at p (which points to a
+ * '%'). A '*' width or precision is taken from the arguments, using the
+ * get_int callback. Returns false if the specification is not supported. */
+static bool log_parse_spec(const char *p, log_spec_t *spec, int (*get_int)(void *), void *arg)
+{
+    int nflags = 0;
+
+    spec->start = p++;
+    spec->width = spec->precision = -1;
+    spec->wide = false;
+
+    while(*p && strchr("-+ #0", *p) && nflags < (int) sizeof(spec->flags) - 1)
+        spec->flags[nflags++] = *p++;
+    spec->flags[nflags] = '\0';
+
+    if(*p == '*')
+    {
+        spec->width = get_int(arg);
+        p++;
+    }
+    else if(*p >= '0' && *p <= '9')
+        spec->width = strtol(p, (char **) &p, 10);
+
+    if(*p == '.')
+    {
+        p++;
+        if(*p == '*')
+        {
+            spec->precision = get_int(arg);
+            p++;
+        }
+        else
+            spec->precision = strtol(p, (char **) &p, 10);
+    }
+
+    if(*p == 'h')
+        p += (p[1] == 'h') ? 2 : 1;
+    else if(*p == 'l' || *p == 'z' || *p == 'j' || *p == 't')
+    {
+        spec->wide = true;
+        p += (p[0] == 'l' && p[1] == 'l') ? 2 : 1;
+    }
+
+    spec->conv = *p;
+    spec->end = p + 1;
+
+    return *p != '\0' && strchr("diouxXcspfFeEgGaA", *p) != NULL &&
+           !(spec->wide && (*p == 'c' || *p == 's'));
+}
+
+
+/* Argument packing. Numbers take 8 bytes, and strings take a 4-byte
+ * length followed by the (non NUL-terminated) bytes, padded to 8 bytes. */
+typedef struct
+{
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    va_list ap;
+    bool overflow;
+} log_packer_t;
+
+static void log_pack(log_packer_t *p, const void *data, size_t len)
+{
+    if(p->len + 8 > p->cap)
+    {
+        p->overflow = true;
+        return;
+    }
+    memset(p->buf + p->len, 0, 8);
+    memcpy(p->buf + p->len, data, len);
+    p->len += 8;
+}
+
+static int log_pack_star(void *arg)
+{
+    log_packer_t *p = arg;
+    int v = va_arg(p->ap, int);
+    log_pack(p, &v, sizeof(v));
+    return v;
+}
+
+
+/* Packs the arguments of a message into buf. Returns the number of bytes
+ * used, or 0 if the format string is not supported or the arguments
+ * do not fit (the message must then be formatted by the caller) */
+static size_t log_pack_args(uint8_t *buf, size_t cap, const char *fmt, va_list ap)
+{
+    log_packer_t p = { .buf = buf, .len = 0, .cap = cap, .overflow = false };
+    log_spec_t spec;
+
+    va_copy(p.ap, ap);
+
+    for(const char *c = fmt; *c; c++)
+    {
+        if(*c != '%')
+            continue;
+        if(c[1] == '%')
+        {
+            c++;
+            continue;
+        }
+
+        if(!log_parse_spec(c, &spec, log_pack_star, &p))
+        {
+            va_end(p.ap);
+            return 0;
+        }
+        c = spec.end - 1;
+
+        switch(spec.conv)
+        {
+        case 's':
+        {
+            const char *str = va_arg(p.ap, const char *);
+            uint32_t len;
+
+            if(str == NULL)
+                str = "(null)";
+            len = strlen(str);
+            if(spec.precision >= 0 && len > (uint32_t) spec.precision)
+                len = spec.precision;
+            if(p.len + 8 + len > p.cap)
+            {
+                p.overflow = true;
+                break;
+            }
+            log_pack(&p, &len, sizeof(len));
+            memcpy(p.buf + p.len, str, len);
+            p.len += LOG_ALIGN(len);
+            break;
+        }
+        case 'p':
+        {
+            void *v = va_arg(p.ap, void *);
+            log_pack(&p, &v, sizeof(v));
+            break;
+        }
+        case 'f': case 'F': case 'e': case 'E':
+        case 'g': case 'G': case 'a': case 'A':
+        {
+            double v = va_arg(p.ap, double);
+            log_pack(&p, &v, sizeof(v));
+            break;
+        }
+        default:
+        {
+            long long v = spec.wide ? va_arg(p.ap, long long) : va_arg(p.ap, int);
+            log_pack(&p, &v, sizeof(v));
+            break;
+        }
+        }
+
+        if(p.overflow)
+            break;
+    }
+
+    va_end(p.ap);
+
+    return p.overflow ? 0 : (p.len == 0 ? 8 : p.len);
+}
+
+
+/* Argument unpacking (used by the logging thread) */
+typedef struct
+{
+    const uint8_t *buf;
+    size_t pos;
+} log_unpacker_t;
+
+static void log_unpack(log_unpacker_t *u, void *data, size_t len)
+{
+    memcpy(data, u->buf + u->pos, len);
+    u->pos += 8;
+}
+
+static int log_unpack_star(void *arg)
+{
+    int v;
+    log_unpack(arg, &v, sizeof(v));
+    return v;
+}
+
+
+/* Formats the message of a record (without the timestamp and level)
+ * into out, which has room for len bytes. Returns the number of
+ * characters written (not including the NUL terminator). */
+static size_t log_format_record(const log_record_t *rec, char *out, size_t len)
+{
+    const uint8_t *payload = (const uint8_t *) (rec + 1);
+    log_unpacker_t u = { .buf = payload, .pos = 0 };
+    log_spec_t spec;
+    char specstr[48], str[LOG_MAX_RECORD];
+    size_t n = 0;
+    int rc = 0;
+
+    if(rec->flags & LOG_REC_RAW)
+    {
+        snprintf(out, len, "%s", (const char *) payload);
+        return strlen(out);
+    }
+
+    for(const char *c = rec->fmt; *c && n < len - 1; c++)
+    {
+        if(*c != '%')
+        {
+            out[n++] = *c;
+            continue;
+        }
+        if(c[1] == '%')
+        {
+            out[n++] = '%';
+            c++;
+            continue;
+        }
+
+        log_parse_spec(c, &spec, log_unpack_star, &u);
+        c = spec.end - 1;
+
+        /* Rebuild the specification, with the width and precision
+         * inlined, and a length modifier matching the packed value */
+        int sn = snprintf(specstr, sizeof(specstr), "%%%s", spec.flags);
+        if(spec.width >= 0)
+            sn += snprintf(specstr + sn, sizeof(specstr) - sn, "%i", spec.width);
+        if(spec.precision >= 0)
+            sn += snprintf(specstr + sn, sizeof(specstr) - sn, ".%i", spec.precision);
+        snprintf(specstr + sn, sizeof(specstr) - sn, "%s%c", spec.wide ? "ll" : "", spec.conv);
+
+        switch(spec.conv)
+        {
+        case 's':
+        {
+            uint32_t slen;
+            log_unpack(&u, &slen, sizeof(slen));
+            memcpy(str, payload + u.pos, slen);
+            str[slen] = '\0';
+            u.pos += LOG_ALIGN(slen);
+            rc = snprintf(out + n, len - n, specstr, str);
+            break;
+        }
+        case 'p':
+        {
+            void *v;
+            log_unpack(&u, &v, sizeof(v));
+            rc = snprintf(out + n, len - n, specstr, v);
+            break;
+        }
+        case 'f': case 'F': case 'e': case 'E':
+        case 'g': case 'G': case 'a': case 'A':
+        {
+            double v;
+            log_unpack(&u, &v, sizeof(v));
+            rc = snprintf(out + n, len - n, specstr, v);
+            break;
+        }
+        default:
+        {
+            long long v;
+            log_unpack(&u, &v, sizeof(v));
+            if(spec.wide)
+                rc = snprintf(out + n, len - n, specstr, v);
+            else
+                rc = snprintf(out + n, len - n, specstr, (int) v);
+            break;
+        }
+        }
+
+        n += (rc < 0) ? 0 : ((size_t) rc < len - n ? (size_t) rc : len - n - 1);
+    }
+
+    out[n] = '\0';
+    return n;
+}
+
+
+/* Called when a thread that has a ring exits */
+static void log_ring_release(void *arg)
+{
+    log_ring_t *ring = arg;
+    __atomic_store_n(&ring->dead, true, __ATOMIC_RELEASE);
+}
+
+static void log_key_create()
+{
+    pthread_key_create(&log_ring_key, log_ring_release);
+}
+
+
+/* Returns the calling thread's ring, creating it if necessary */
+static log_ring_t *log_get_ring()
+{
+    if(log_ring != NULL)
+        return log_ring;
+
+    log_ring_t *ring = calloc(1, sizeof(log_ring_t));
+    if(ring == NULL)
+        return NULL;
+    ring->buf = malloc(LOG_RING_SIZE);
+    if(ring->buf == NULL)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    pthread_once(&log_key_once, log_key_create);
+    pthread_setspecific(log_ring_key, ring);
+
+    pthread_mutex_lock(&log_lock);
+    ring->next = log_rings;
+    log_rings = ring;
+    pthread_mutex_unlock(&log_lock);
+
+    log_ring = ring;
+    return ring;
+}
+
+
+/* Adds a record to the calling thread's ring. If the ring is full,
+ * waits until the logging thread makes room. Returns false if
+ * the record could not be added. */
+static bool log_ring_put(const log_record_t *rec)
+{
+    log_ring_t *ring = log_get_ring();
+
+    if(ring == NULL)
+        return false;
+
+    uint64_t head = ring->head;
+    uint32_t offset = head & (LOG_RING_SIZE - 1);
+    uint32_t skip = 0;
+
+    /* Records are contiguous in the ring. If there isn't enough room
+     * until the end of the ring, skip to the start */
+    if(LOG_RING_SIZE - offset < rec->size)
+        skip = LOG_RING_SIZE - offset;
+
+    while(head + skip + rec->size - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > LOG_RING_SIZE)
+    {
+        if(__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE))
+            return false;
+        sched_yield();
+    }
+
+    if(skip >= sizeof(log_record_t))
+    {
+        log_record_t *pad = (log_record_t *) (ring->buf + offset);
+        pad->size = skip;
+        pad->flags = LOG_REC_PAD;
+    }
+
+    memcpy(ring->buf + ((head + skip) & (LOG_RING_SIZE - 1)), rec, rec->size);
+    __atomic_store_n(&ring->head, head + skip + rec->size, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+
+/* Returns the next record in a ring (skipping over padding),
+ * or NULL if the ring is empty. */
+static log_record_t *log_ring_peek(log_ring_t *ring)
+{
+    while(ring->tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+    {
+        uint32_t offset = ring->tail & (LOG_RING_SIZE - 1);
+        log_record_t *rec = (log_record_t *) (ring->buf + offset);
+
+        if(LOG_RING_SIZE - offset < sizeof(log_record_t))
+            ring->tail += LOG_RING_SIZE - offset;
+        else if(rec->flags & LOG_REC_PAD)
+            ring->tail += rec->size;
+        else
+            return rec;
+    }
+
+    return NULL;
+}
+
+
+/* Output buffer of the logging thread */
+static char log_outbuf[LOG_OUTBUF_SIZE];
+static size_t log_outlen;
+
+/* Formatting the date is expensive, so it is only done once per second */
+static time_t log_datesec = -1;
+static char log_datestr[32];
+
+
+static void log_out_flush()
+{
+    if(log_outlen > 0)
+    {
+        fwrite(log_outbuf, 1, log_outlen, stdout);
+        fflush(stdout);
+        log_outlen = 0;
+    }
+}
+
+
+/* Starts a new line in the output buffer, with the given timestamp and
+ * level. Returns where the message must be written (with room for
+ * LOG_MAX_LINE bytes); log_out_end must be called afterwards. */
+static char *log_out_begin(uint64_t timestamp, loglevel_t level)
+{
+    time_t sec = timestamp / 1000000000ull;
+
+    if(sec != log_datesec)
+    {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(log_datestr, sizeof(log_datestr), "%Y-%m-%d %H:%M:%S", &tm);
+        log_datesec = sec;
+    }
+
+    if(LOG_OUTBUF_SIZE - log_outlen < LOG_MAX_LINE + 64)
+    {
+        fwrite(log_outbuf, 1, log_outlen, stdout);
+        log_outlen = 0;
+    }
+
+    log_outlen += sprintf(log_outbuf + log_outlen, "[%s] %6s ", log_datestr, log_levelstr(level));
+    return log_outbuf + log_outlen;
+}
+
+static void log_out_end(size_t len)
+{
+    log_outlen += len;
+    log_outbuf[log_outlen++] = '\n';
+}
+
+
+/* Writes out up to LOG_BATCH records, from all the rings, in timestamp
+ * order. Returns the number of records written. Must be called with
+ * log_lock held. */
+static int log_drain()
+{
+    int count;
+
+    for(count = 0; count < LOG_BATCH; count++)
+    {
+        log_ring_t *min_ring = NULL;
+        log_record_t *min_rec = NULL;
+
+        for(log_ring_t *ring = log_rings; ring != NULL; ring = ring->next)
+        {
+            log_record_t *rec = log_ring_peek(ring);
+            if(rec != NULL && (min_rec == NULL || rec->timestamp < min_rec->timestamp))
+            {
+                min_ring = ring;
+                min_rec = rec;
+            }
+        }
+
+        if(min_rec == NULL)
+            break;
+
+        if(min_rec->flags & LOG_REC_PACKET)
+        {
+            log_out_t out = { .level = min_rec->level, .deferred = true, .timestamp = min_rec->timestamp };
+            log_dissect_packet(&out, (const log_packet_t *) (min_rec + 1));
+        }
+        else
+        {
+            char *line = log_out_begin(min_rec->timestamp, min_rec->level);
+            log_out_end(log_format_record(min_rec, line, LOG_MAX_LINE));
+        }
+
+        __atomic_store_n(&min_ring->tail, min_ring->tail + min_rec->size, __ATOMIC_RELEASE);
+    }
+
+    log_out_flush();
+
+    /* Free the rings of threads that have exited */
+    for(log_ring_t **p = &log_rings; *p != NULL; )
+    {
+        log_ring_t *ring = *p;
+
+        if(__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) && log_ring_peek(ring) == NULL)
+        {
+            *p = ring->next;
+            free(ring->buf);
+            free(ring);
+        }
+        else
+            p = &ring->next;
     }
 
+    return count;
+}
+
+
+/* Logging thread function */
+static void *log_thread_func(void *arg)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&log_lock);
+    while(1)
+    {
+        bool stop = __atomic_load_n(&log_stop, __ATOMIC_ACQUIRE);
+
+        if(log_drain() > 0)
+            continue;
+        if(stop)
+            break;
+
+        /* Nothing to write. Producers don't wake us up (except for
+         * critical messages), so check again in a millisecond */
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 1000000;
+        if(ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&log_wakeup, &log_lock, &ts);
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    return NULL;
+}
+
+
+/* See log.h */
+int chirouter_log_start_async()
+{
+    sigset_t all, old;
+
+    if(log_async)
+        return 0;
+
+    log_stop = false;
+
+    /* The logging thread must not handle any signals (they are
+     * handled by the signal thread, see main.c) */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int rc = pthread_create(&log_thread, NULL, log_thread_func, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(rc != 0)
+        return -1;
+
+    __atomic_store_n(&log_async, true, __ATOMIC_RELEASE);
+    atexit(chirouter_log_stop_async);
+
+    return 0;
+}
+
+
+/* See log.h */
+void chirouter_log_stop_async()
+{
+    if(!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+        return;
+
+    __atomic_store_n(&log_async, false, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&log_lock);
+    __atomic_store_n(&log_stop, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&log_wakeup);
+    pthread_mutex_unlock(&log_lock);
+
+    pthread_join(log_thread, NULL);
+}
+
+
+/* Logs a message synchronously (when the async backend is not running) */
+static void chilog_sync(loglevel_t level, char *fmt, va_list argptr)
+{
+    time_t t;
+    char buf[80];
+
+    t = time(NULL);
+    strftime(buf,80,"%Y-%m-%d %H:%M:%S",localtime(&t));
+
     flockfile(stdout);
-    printf("[%s] %6s ", buf, levelstr);
-    va_start(argptr, fmt);
+    printf("[%s] %6s ", buf, log_levelstr(level));
     vprintf(fmt, argptr);
     printf("\n");
     funlockfile(stdout);
-    va_end(argptr);
     fflush(stdout);
 }
 
 
 /* See log.h */
-void chilog_ethernet(loglevel_t level, uint8_t *frame, int len, char prefix)
+void chilog_print(loglevel_t level, char *fmt, ...)
 {
-    if(level > loglevel)
+    va_list argptr;
+    union
+    {
+        log_record_t rec;
+        uint8_t buf[LOG_MAX_RECORD];
+    } u;
+    struct timespec ts;
+    size_t len;
+
+    if(level > chirouter_loglevel)
         return;
 
+    va_start(argptr, fmt);
+
+    if(!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+    {
+        chilog_sync(level, fmt, argptr);
+        va_end(argptr);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    u.rec.timestamp = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    u.rec.level = level;
+    u.rec.flags = 0;
+    u.rec.fmt = fmt;
+
+    /* Only the arguments are copied here; the message is formatted
+     * by the logging thread. If the arguments can't be packed, the
+     * message is formatted right away instead. */
+    len = log_pack_args(u.buf + sizeof(log_record_t), LOG_MAX_RECORD - sizeof(log_record_t), fmt, argptr);
+    if(len == 0)
+    {
+        vsnprintf((char *) u.buf + sizeof(log_record_t), LOG_MAX_RECORD - sizeof(log_record_t), fmt, argptr);
+        len = strlen((char *) u.buf + sizeof(log_record_t)) + 1;
+        u.rec.flags = LOG_REC_RAW;
+    }
+    va_end(argptr);
+
+    u.rec.size = sizeof(log_record_t) + LOG_ALIGN(len);
+
+    if(!log_ring_put(&u.rec))
+        return;
+
+    if(level == CRITICAL)
+    {
+        pthread_mutex_lock(&log_lock);
+        pthread_cond_signal(&log_wakeup);
+        pthread_mutex_unlock(&log_lock);
+    }
+}
+
+
+/* Prints a line produced by a dissector */
+static void log_line(log_out_t *out, const char *fmt, ...)
+{
+    va_list argptr;
+
+    va_start(argptr, fmt);
+    if(out->deferred)
+    {
+        char *line = log_out_begin(out->timestamp, out->level);
+        int n = vsnprintf(line, LOG_MAX_LINE, fmt, argptr);
+        log_out_end(n < 0 ? 0 : (n < (int) LOG_MAX_LINE ? n : LOG_MAX_LINE - 1));
+    }
+    else
+        chilog_sync(out->level, (char *) fmt, argptr);
+    va_end(argptr);
+}
+
+
+/* Logs a packet. In async mode, this only copies (at most
+ * LOG_MAX_RECORD bytes of) the packet, and the logging thread
+ * dissects it. Otherwise, the packet is dissected right away. */
+static void log_packet(loglevel_t level, uint8_t kind, const void *data, uint32_t len, char prefix)
+{
+    union
+    {
+        log_record_t rec;
+        uint8_t buf[LOG_MAX_RECORD];
+    } u;
+    log_packet_t *pkt = (log_packet_t *) (u.buf + sizeof(log_record_t));
+    uint32_t room = LOG_MAX_RECORD - sizeof(log_record_t) - sizeof(log_packet_t);
+    struct timespec ts;
+
+    if(level > chirouter_loglevel)
+        return;
+
+    pkt->kind = kind;
+    pkt->prefix = prefix;
+    pkt->len = len;
+    pkt->caplen = len < room ? len : room;
+
+    if(!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+    {
+        /* Keep the lines of the dissection together */
+        log_out_t out = { .level = level, .deferred = false };
+        flockfile(stdout);
+        memcpy(pkt->data, data, pkt->caplen);
+        log_dissect_packet(&out, pkt);
+        funlockfile(stdout);
+        return;
+    }
+
+    memcpy(pkt->data, data, pkt->caplen);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    u.rec.timestamp = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    u.rec.level = level;
+    u.rec.flags = LOG_REC_PACKET;
+    u.rec.fmt = NULL;
+    u.rec.size = sizeof(log_record_t) + LOG_ALIGN(sizeof(log_packet_t) + pkt->caplen);
+
+    log_ring_put(&u.rec);
+}
+
+
+/* See log.h */
+void chilog_ethernet_print(loglevel_t level, uint8_t *frame, int len, char prefix)
+{
+    log_packet(level, LOG_PKT_ETHERNET, frame, len, prefix);
+}
+
+
+/* See log.h */
+void chilog_arp_print(loglevel_t level, arp_packet_t* arp, char prefix)
+{
+    log_packet(level, LOG_PKT_ARP, arp, sizeof(arp_packet_t), prefix);
+}
+
+
+/* See log.h */
+void chilog_ip_print(loglevel_t level, iphdr_t* hdr, char prefix)
+{
+    log_packet(level, LOG_PKT_IP, hdr, sizeof(iphdr_t), prefix);
+}
+
+
+/* See log.h */
+void chilog_icmp_print(loglevel_t level, icmp_packet_t* icmp, char prefix)
+{
+    /* Only the header fields are printed */
+    log_packet(level, LOG_PKT_ICMP, icmp, ICMP_HDR_SIZE, prefix);
+}
+
+
+/* See log.h */
+void chilog_hex_print(loglevel_t level, void *data, int len)
+{
+    log_packet(level, LOG_PKT_HEX, data, len, LOG_NO_DIRECTION);
+}
+
+
+/* Dissector. See the corresponding chilog_* function in log.h */
+static void log_dissect_ethernet(log_out_t *out, uint8_t *frame, int len, int caplen, char prefix)
+{
     ethhdr_t *header = (ethhdr_t *) frame;
     uint8_t *payload = ETHER_PAYLOAD_START(frame);
     uint16_t payload_len = len - sizeof(ethhdr_t);
     uint16_t ethertype = ntohs(header->type);
 
-    flockfile(stdout);
-    chilog(level, "   ######################################################################");
+    log_line(out, "   ######################################################################");
 
-    chilog(level, "%c  Src: %02X:%02X:%02X:%02X:%02X:%02X",
-           prefix,
-           header->src[0], header->src[1], header->src[2], header->src[3], header->src[4], header->src[5]);
-    chilog(level, "%c  Dst: %02X:%02X:%02X:%02X:%02X:%02X",
-           prefix,
-           header->dst[0], header->dst[1], header->dst[2], header->dst[3], header->dst[4], header->dst[5]);
+    log_line(out, "%c  Src: %02X:%02X:%02X:%02X:%02X:%02X",
+             prefix,
+             header->src[0], header->src[1], header->src[2], header->src[3], header->src[4], header->src[5]);
+    log_line(out, "%c  Dst: %02X:%02X:%02X:%02X:%02X:%02X",
+             prefix,
+             header->dst[0], header->dst[1], header->dst[2], header->dst[3], header->dst[4], header->dst[5]);
 
     char *ethertype_str;
     switch(ethertype)
@@ -149,30 +974,27 @@ void chilog_ethernet(loglevel_t level, uint8_t *frame, int len, char prefix)
     default:
         ethertype_str = "Other";
     }
-    chilog(level, "%c  Ethertype: %04X (%s)", prefix, ethertype, ethertype_str);
+    log_line(out, "%c  Ethertype: %04X (%s)", prefix, ethertype, ethertype_str);
 
     if(payload_len > 0)
     {
-        chilog(level, "%c  Payload (%i bytes):", prefix, payload_len);
-        chilog_hex(level, payload, payload_len);
+        log_line(out, "%c  Payload (%i bytes):", prefix, payload_len);
+        log_dissect_hex(out, payload, caplen - (int) sizeof(ethhdr_t));
+        if(caplen < len)
+            log_line(out, "%c  (%i bytes not captured)", prefix, len - caplen);
     }
     else
     {
-        chilog(level, "%c  No Payload", prefix);
+        log_line(out, "%c  No Payload", prefix);
     }
-    chilog(level, "   ######################################################################");
-    funlockfile(stdout);
+    log_line(out, "   ######################################################################");
 }
 
 
-/* See log.h */
-void chilog_arp(loglevel_t level, arp_packet_t* arp, char prefix)
+/* Dissector. See the corresponding chilog_* function in log.h */
+static void log_dissect_arp(log_out_t *out, arp_packet_t* arp, char prefix)
 {
-    if(level > loglevel)
-        return;
-
-    flockfile(stdout);
-    chilog(level, "   ######################################################################");
+    log_line(out, "   ######################################################################");
 
     char *op_str;
     if(ntohs(arp->op) == ARP_OP_REQUEST)
@@ -188,7 +1010,7 @@ void chilog_arp(loglevel_t level, arp_packet_t* arp, char prefix)
         op_str = "Unknown";
     }
 
-    chilog(level, "%c  ARP operation type: %04X (%s)", prefix, ntohs(arp->op), op_str);
+    log_line(out, "%c  ARP operation type: %04X (%s)", prefix, ntohs(arp->op), op_str);
 
     char *hardwaretype_str;
     if(ntohs(arp->hrd) == ARP_HRD_ETHERNET)
@@ -212,34 +1034,29 @@ void chilog_arp(loglevel_t level, arp_packet_t* arp, char prefix)
     default:
         protocoltype_str = "Other";
     }
-    chilog(level, "%c  Hardware Type: %04X (%s)   Protocol Type: %04X (%s)", prefix, ntohs(arp->hrd), hardwaretype_str,
+    log_line(out, "%c  Hardware Type: %04X (%s)   Protocol Type: %04X (%s)", prefix, ntohs(arp->hrd), hardwaretype_str,
                                                                                      ntohs(arp->pro), protocoltype_str);
 
     char ip_str[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &arp->spa, ip_str, INET_ADDRSTRLEN);
-    chilog(level, "%c  Sender: %02X:%02X:%02X:%02X:%02X:%02X  %s",
-           prefix,
-           arp->sha[0], arp->sha[1], arp->sha[2], arp->sha[3], arp->sha[4], arp->sha[5], ip_str);
+    log_line(out, "%c  Sender: %02X:%02X:%02X:%02X:%02X:%02X  %s",
+             prefix,
+             arp->sha[0], arp->sha[1], arp->sha[2], arp->sha[3], arp->sha[4], arp->sha[5], ip_str);
 
     inet_ntop(AF_INET, &arp->tpa, ip_str, INET_ADDRSTRLEN);
-    chilog(level, "%c  Target: %02X:%02X:%02X:%02X:%02X:%02X  %s",
-           prefix,
-           arp->tha[0], arp->tha[1], arp->tha[2], arp->tha[3], arp->tha[4], arp->tha[5], ip_str);
+    log_line(out, "%c  Target: %02X:%02X:%02X:%02X:%02X:%02X  %s",
+             prefix,
+             arp->tha[0], arp->tha[1], arp->tha[2], arp->tha[3], arp->tha[4], arp->tha[5], ip_str);
 
 
-    chilog(level, "   ######################################################################");
-    funlockfile(stdout);
+    log_line(out, "   ######################################################################");
 }
 
 
-/* See log.h */
-void chilog_ip(loglevel_t level, iphdr_t* hdr, char prefix)
+/* Dissector. See the corresponding chilog_* function in log.h */
+static void log_dissect_ip(log_out_t *out, iphdr_t* hdr, char prefix)
 {
-    if(level > loglevel)
-        return;
-
-    flockfile(stdout);
-    chilog(level, "   ######################################################################");
+    log_line(out, "   ######################################################################");
 
     char *proto_str;
     switch(hdr->proto)
@@ -261,23 +1078,18 @@ void chilog_ip(loglevel_t level, iphdr_t* hdr, char prefix)
     char ip_src_str[INET_ADDRSTRLEN], ip_dst_str[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &hdr->src, ip_src_str, INET_ADDRSTRLEN);
     inet_ntop(AF_INET, &hdr->dst, ip_dst_str, INET_ADDRSTRLEN);
-    chilog(level, "%c  Source:      %s", prefix, ip_src_str);
-    chilog(level, "%c  Destination: %s", prefix, ip_dst_str);
-    chilog(level, "%c  Protocol:    %02X (%s)", prefix, hdr->proto, proto_str);
-    chilog(level, "%c  TTL:         %i   Total Length: %i   Checksum: %04X", prefix, hdr->ttl, ntohs(hdr->len), hdr->cksum);
-    chilog(level, "   ######################################################################");
-    funlockfile(stdout);
+    log_line(out, "%c  Source:      %s", prefix, ip_src_str);
+    log_line(out, "%c  Destination: %s", prefix, ip_dst_str);
+    log_line(out, "%c  Protocol:    %02X (%s)", prefix, hdr->proto, proto_str);
+    log_line(out, "%c  TTL:         %i   Total Length: %i   Checksum: %04X", prefix, hdr->ttl, ntohs(hdr->len), hdr->cksum);
+    log_line(out, "   ######################################################################");
 }
 
 
-/* See log.h */
-void chilog_icmp(loglevel_t level, icmp_packet_t* icmp, char prefix)
+/* Dissector. See the corresponding chilog_* function in log.h */
+static void log_dissect_icmp(log_out_t *out, icmp_packet_t* icmp, char prefix)
 {
-    if(level > loglevel)
-        return;
-
-    flockfile(stdout);
-    chilog(level, "   ######################################################################");
+    log_line(out, "   ######################################################################");
 
     char *type_str;
     switch(icmp->type)
@@ -320,32 +1132,31 @@ void chilog_icmp(loglevel_t level, icmp_packet_t* icmp, char prefix)
             code_str = "Other";
             break;
         }
-        chilog(level, "%c  Type: %02X (%s)  Code: %02X (%s)", prefix, icmp->type, type_str, icmp->code, code_str);
+        log_line(out, "%c  Type: %02X (%s)  Code: %02X (%s)", prefix, icmp->type, type_str, icmp->code, code_str);
     }
     else
     {
-        chilog(level, "%c  Type: %02X (%s)  Code: %02X", prefix, icmp->type, type_str, icmp->code);
+        log_line(out, "%c  Type: %02X (%s)  Code: %02X", prefix, icmp->type, type_str, icmp->code);
     }
 
-    chilog(level, "%c  Checksum: %04X", prefix, ntohs(icmp->chksum));
+    log_line(out, "%c  Checksum: %04X", prefix, ntohs(icmp->chksum));
 
     switch(icmp->type)
     {
     case ICMPTYPE_ECHO_REQUEST:
     case ICMPTYPE_ECHO_REPLY:
-        chilog(level, "%c  Identifier: %04X  Sequence Number: %04X", prefix, ntohs(icmp->echo.identifier), ntohs(icmp->echo.seq_num));
+        log_line(out, "%c  Identifier: %04X  Sequence Number: %04X", prefix, ntohs(icmp->echo.identifier), ntohs(icmp->echo.seq_num));
         break;
     case ICMPTYPE_DEST_UNREACHABLE:
         break;
     }
 
-    chilog(level, "   ######################################################################");
-    funlockfile(stdout);
+    log_line(out, "   ######################################################################");
 }
 
-/* See log.h */
+/* Dissector. See chilog_hex in log.h */
 // Based on http://stackoverflow.com/questions/7775991/how-to-get-hexdump-of-a-structure-data
-void chilog_hex (loglevel_t level, void *data, int len)
+static void log_dissect_hex(log_out_t *out, void *data, int len)
 {
     int i;
     char buf[8];
@@ -364,7 +1175,7 @@ void chilog_hex (loglevel_t level, void *data, int len)
             // Just don't print ASCII for the zeroth line.
             if (i != 0)
             {
-                chilog(level, "%s  %s", line, ascii);
+                log_line(out, "%s  %s", line, ascii);
                 line[0] = '\0';
             }
 
@@ -393,5 +1204,38 @@ void chilog_hex (loglevel_t level, void *data, int len)
     }
 
     // And print the final ASCII bit.
-    chilog(level, "%s  %s", line, ascii);
+    log_line(out, "%s  %s", line, ascii);
+}
+
+
+/* Dissects a packet captured by log_packet */
+static void log_dissect_packet(log_out_t *out, const log_packet_t *pkt)
+{
+    /* The dissectors take non-const pointers, and may read up to a
+     * full header, even if fewer bytes were captured */
+    uint8_t data[LOG_MAX_RECORD];
+
+    memset(data, 0, sizeof(data));
+    memcpy(data, pkt->data, pkt->caplen);
+
+    switch(pkt->kind)
+    {
+    case LOG_PKT_ETHERNET:
+        log_dissect_ethernet(out, data, pkt->len, pkt->caplen, pkt->prefix);
+        break;
+    case LOG_PKT_ARP:
+        log_dissect_arp(out, (arp_packet_t *) data, pkt->prefix);
+        break;
+    case LOG_PKT_IP:
+        log_dissect_ip(out, (iphdr_t *) data, pkt->prefix);
+        break;
+    case LOG_PKT_ICMP:
+        log_dissect_icmp(out, (icmp_packet_t *) data, pkt->prefix);
+        break;
+    case LOG_PKT_HEX:
+        log_dissect_hex(out, data, pkt->caplen);
+        if(pkt->caplen < pkt->len)
+            log_line(out, "  (%u bytes not captured)", pkt->len - pkt->caplen);
+        break;
+    }
 }
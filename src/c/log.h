@@ -65,6 +65,23 @@ typedef enum {
 #define LOG_OUTBOUND ('>')
 #define LOG_NO_DIRECTION ('|')
 
+/* Log messages that are less severe than CHIROUTER_MIN_LOG_LEVEL are
+ * compiled out entirely (their arguments are not even evaluated).
+ * This is set by the build (see CMakeLists.txt). By default, no
+ * messages are compiled out. */
+#ifndef CHIROUTER_MIN_LOG_LEVEL
+#define CHIROUTER_MIN_LOG_LEVEL TRACE
+#endif
+
+/* Current logging level. Use chirouter_setloglevel to change it. */
+extern int chirouter_loglevel;
+
+/* Whether messages at a given level will be printed. Checking the
+ * level is done inline by the logging macros below, so disabled log
+ * sites only cost a (predicted) branch. */
+#define chilog_enabled(level) \
+    ((level) <= CHIROUTER_MIN_LOG_LEVEL && __builtin_expect((level) <= chirouter_loglevel, 0))
+
 /*
  * chitcp_setloglevel - Sets the logging level
  *
@@ -79,6 +96,34 @@ typedef enum {
 void chirouter_setloglevel(loglevel_t level);
 
 
+/*
+ * chirouter_log_start_async - Start the asynchronous logging backend
+ *
+ * Once started, chilog() does not format or print messages itself.
+ * Instead, it copies the message's level, timestamp, format string
+ * pointer, and arguments to a ring owned by the calling thread, and a
+ * background thread formats and prints them in batches. Strings passed
+ * as arguments are copied, but the format string must be a literal (or,
+ * in general, must remain valid for the lifetime of the program).
+ *
+ * The backend is stopped automatically when the program exits.
+ *
+ * Returns: 0 on success, -1 if the logging thread could not be created.
+ */
+int chirouter_log_start_async();
+
+
+/*
+ * chirouter_log_stop_async - Stop the asynchronous logging backend
+ *
+ * Any pending messages are printed before this function returns, and
+ * chilog() reverts to printing messages synchronously.
+ *
+ * Returns: nothing.
+ */
+void chirouter_log_stop_async();
+
+
 /*
  * chilog - Print a log message
  *
@@ -90,7 +135,9 @@ void chirouter_setloglevel(loglevel_t level);
  *
  * Returns: nothing.
  */
-void chilog(loglevel_t level, char *fmt, ...);
+void chilog_print(loglevel_t level, char *fmt, ...);
+#define chilog(level, ...) \
+    do { if (chilog_enabled(level)) chilog_print(level, __VA_ARGS__); } while (0)
 
 
 /*
@@ -107,7 +154,9 @@ void chilog(loglevel_t level, char *fmt, ...);
  *
  * Returns: nothing.
  */
-void chilog_ethernet(loglevel_t level, uint8_t *frame, int len, char prefix);
+void chilog_ethernet_print(loglevel_t level, uint8_t *frame, int len, char prefix);
+#define chilog_ethernet(level, frame, len, prefix) \
+    do { if (chilog_enabled(level)) chilog_ethernet_print(level, frame, len, prefix); } while (0)
 
 
 /*
@@ -122,7 +171,9 @@ void chilog_ethernet(loglevel_t level, uint8_t *frame, int len, char prefix);
  *
  * Returns: nothing.
  */
-void chilog_arp(loglevel_t level, arp_packet_t* arp, char prefix);
+void chilog_arp_print(loglevel_t level, arp_packet_t* arp, char prefix);
+#define chilog_arp(level, arp, prefix) \
+    do { if (chilog_enabled(level)) chilog_arp_print(level, arp, prefix); } while (0)
 
 
 /*
@@ -137,7 +188,9 @@ void chilog_arp(loglevel_t level, arp_packet_t* arp, char prefix);
  *
  * Returns: nothing.
  */
-void chilog_ip(loglevel_t level, iphdr_t* hdr, char prefix);
+void chilog_ip_print(loglevel_t level, iphdr_t* hdr, char prefix);
+#define chilog_ip(level, hdr, prefix) \
+    do { if (chilog_enabled(level)) chilog_ip_print(level, hdr, prefix); } while (0)
 
 
 /*
@@ -152,7 +205,9 @@ void chilog_ip(loglevel_t level, iphdr_t* hdr, char prefix);
  *
  * Returns: nothing.
  */
-void chilog_icmp(loglevel_t level, icmp_packet_t* icmp, char prefix);
+void chilog_icmp_print(loglevel_t level, icmp_packet_t* icmp, char prefix);
+#define chilog_icmp(level, icmp, prefix) \
+    do { if (chilog_enabled(level)) chilog_icmp_print(level, icmp, prefix); } while (0)
 
 /*
  * chilog_hex - Print arbitrary data in hexdump style
@@ -165,7 +220,9 @@ void chilog_icmp(loglevel_t level, icmp_packet_t* icmp, char prefix);
  *
  * Returns: nothing.
  */
-void chilog_hex (loglevel_t level, void *data, int len);
+void chilog_hex_print(loglevel_t level, void *data, int len);
+#define chilog_hex(level, data, len) \
+    do { if (chilog_enabled(level)) chilog_hex_print(level, data, len); } while (0)
 
 
 #endif /* CHIROUTER_LOG_H_ */
@@ -3,11 +3,66 @@
  *
  *  main() function for the router
  *
- *  The chirouter executable accepts three command-line arguments:
+ *  The chirouter executable accepts the following command-line arguments:
  *
  *  -p PORT: Port on which chirouter will listen (default: 23300)
  *  -c FILE: If specified, will produce a pcapng capture file with all
  *           the Ethernet frames received/sent by the routers.
+ *  -C SIZE: Split the capture into files of at most SIZE megabytes,
+ *           named FILE.0, FILE.1, etc.
+ *  -W NUM: Rotate through NUM capture files (FILE.0 is overwritten
+ *          after FILE.<NUM-1>), so the capture never takes more than
+ *          NUM * SIZE megabytes. Requires -C.
+ *  -S SNAPLEN: Only capture the first SNAPLEN bytes of each frame
+ *              (the original length of the frame is still recorded).
+ *  -F FILTER: Only capture the frames that match FILTER (e.g.,
+ *             "arp or icmp", "router r1 and net 10.0.0.0/8"). See
+ *             filter.h for the syntax.
+ *  -M: Write the capture file(s) through memory mappings, instead
+ *      of with stdio. See pcap.h.
+ *  -q NUM: Number of RSS queues (and worker threads) per router. Inbound
+ *          frames are spread across the queues by flow. If not specified,
+ *          all frames are processed in a single thread.
+ *  -w NUM: Run the RSS queues of all the routers in a shared pool of NUM
+ *          worker threads, instead of using one thread per queue. Idle
+ *          workers steal queues from busy workers. If -q is not specified,
+ *          each router gets a single RSS queue.
+ *  -s N: Sample the latency of one in every N inbound frames (default:
+ *        64). If N is 0, latency is not sampled. The latency histograms
+ *        are printed to stderr when chirouter receives SIGUSR2.
+ *  -a SOCKET: Serve administrative requests (routing tables, ARP caches,
+ *             counters, etc.) on a Unix socket. See admin.h, and the
+ *             chirouter_admin tool.
+ *  -m PORT: Serve metrics in the Prometheus text format on
+ *           http://localhost:PORT/metrics. See metrics.h.
+ *  -f N: Keep the last N frame events in the flight recorder (default:
+ *        4096). If N is 0, the flight recorder is disabled. The events
+ *        are dumped to a pcapng file when chirouter receives SIGUSR1,
+ *        or after a critical error. See flightrec.h.
+ *  -t ROUTER:FILE: Load the routing table file FILE into router ROUTER,
+ *                  after the routes sent by the controller, every time
+ *                  the controller configures the routers. Can be repeated
+ *                  (the files are loaded in order). FILE has one route
+ *                  per line, in one of these formats:
+ *                    <destination> <gateway> <mask> <interface> [<metric>]
+ *                    <destination>/<prefix length> <gateway> <interface> [<metric>]
+ *                  where the gateway is 0.0.0.0 for directly connected
+ *                  networks. Blank lines, and everything after a '#',
+ *                  are ignored.
+ *  -b ROUTER:FILE: Load the FIB snapshot FILE (created with chirouter_fib)
+ *                  into router ROUTER. Like -t, but the snapshot is mapped
+ *                  into memory instead of parsed, and its routes are looked
+ *                  up through its lookup structure. The snapshot is loaded
+ *                  after the routes from the controller and from all the -t
+ *                  files, so its routes start at fib_base; those earlier
+ *                  routes are still looked up one by one, and win unless
+ *                  the snapshot has a route with a longer prefix. A router
+ *                  can only have one snapshot. See fib.h.
+ *  -k FILE: Write a checkpoint of the routers (with their ARP caches) to
+ *           FILE when chirouter receives SIGTERM, and restore the routers
+ *           from it when chirouter starts. The restored routers are only
+ *           used if the controller configures the same routers again.
+ *           See checkpoint.h.
  *  -v: Be verbose. Can be repeated up to three times for extra verbosity.
  *
  *  The main() function takes care of processing these command-line
@@ -65,6 +120,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 
 #include <getopt.h>
@@ -74,26 +130,59 @@
 #include "arp.h"
 #include "log.h"
 #include "pcap.h"
+#include "dispatch.h"
+#include "admin.h"
+#include "metrics.h"
+#include "flightrec.h"
+#include "checkpoint.h"
 
-#define USAGE "Usage: chirouter [-p PORT] [-c CAP_FILE] [(-v|-vv|-vvv)]\n"
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
 
+#define USAGE "Usage: chirouter [-p PORT] [-c CAP_FILE [-C CAP_SIZE_MB] [-W NUM_CAP_FILES] [-S SNAPLEN] [-F FILTER] [-M]] [-q NUM_QUEUES] [-w NUM_WORKERS] [-s SAMPLE_RATE] [-a ADMIN_SOCKET] [-m METRICS_PORT] [-f FLIGHTREC_SIZE] [-t ROUTER:RTABLE_FILE]... [-b ROUTER:FIB_FILE]... [-k CHECKPOINT_FILE] [(-v|-vv|-vvv)]\n"
 
-/* Unfortunately required by signal handler */
+
+/* Unfortunately required by the signal thread */
 static server_ctx_t *ctx;
 
-/* Signal handler. Ensures capture file is
- * flushed on SIGINT */
-void sig_handler(int signo)
+/* Signal (SIGINT or SIGTERM) that chirouter is exiting because of */
+static int exit_signo = 0;
+
+
+/* Signal thread. Handles the signals that are blocked in all
+ * the other threads (other than SIGPIPE).
+ *
+ * On SIGINT and SIGTERM, the server is only told to stop: main()
+ * then stops the routers before stopping the threads they use
+ * (e.g., the capture file writer), so no signal handler has to do
+ * anything that isn't async-signal-safe. */
+static void* signal_thread(void *args)
 {
-  if (signo == SIGINT)
-  {
-      fprintf(stderr, "Exiting chirouter...\n");
-      if(ctx->pcap)
-      {
-          fclose(ctx->pcap);
-      }
-      exit(0);
-  }
+    sigset_t *signals = (sigset_t *) args;
+    int signo;
+
+    while(1)
+    {
+        if(sigwait(signals, &signo) != 0)
+            continue;
+
+        if(signo == SIGUSR1 && ctx->flightrec)
+            chirouter_flightrec_dump(ctx->flightrec, "SIGUSR1");
+        else if(signo == SIGUSR2)
+            chirouter_server_dump_latency(ctx, stderr);
+        else if(signo == SIGINT || signo == SIGTERM)
+        {
+            /* A second signal exits right away, in case
+             * stopping the server got stuck */
+            if(__atomic_exchange_n(&exit_signo, signo, __ATOMIC_ACQ_REL) != 0)
+                _exit(EXIT_FAILURE);
+
+            fprintf(stderr, "Exiting chirouter...\n");
+            chirouter_server_shutdown(ctx);
+        }
+    }
+
+    return NULL;
 }
 
 
@@ -102,29 +191,51 @@ int main(int argc, char *argv[])
     int rc;
 
     sigset_t new;
+    static sigset_t handled;
+    pthread_t signal_tid;
     int opt;
     char *port = "23300";
     char *cap_file = NULL;
+    long cap_size = 0;
+    long cap_files = 0;
+    long snaplen = ETHER_FRAME_MAX_LEN;
+    chirouter_filter_t *cap_filter = NULL;
+    bool cap_mmap = false;
+    char filter_error[FILTER_MAX_ERROR_LEN];
+    char *admin_socket = NULL;
+    char *metrics_port = NULL;
     int verbosity = 0;
+    int num_rss_queues = 0;
+    int num_workers = 0;
+    long sample_rate;
+    long flightrec_size = FLIGHTREC_DEFAULT_SIZE;
+    char *checkpoint_file = NULL;
+    chirouter_rtable_file_t *rtable_files = NULL;
+    int num_rtable_files = 0;
+    char *sep;
 
-    /* Stop SIGPIPE from messing with our sockets */
+    /* Stop SIGPIPE from messing with our sockets. The other signals
+     * are blocked here (so all threads inherit the mask) and are
+     * handled by the signal thread. */
     sigemptyset(&new);
     sigaddset(&new, SIGPIPE);
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGUSR1);
+    sigaddset(&handled, SIGUSR2);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&new, SIGUSR1);
+    sigaddset(&new, SIGUSR2);
+    sigaddset(&new, SIGINT);
+    sigaddset(&new, SIGTERM);
     if (pthread_sigmask(SIG_BLOCK, &new, NULL) != 0)
     {
-        perror("Unable to mask SIGPIPE");
-        exit(-1);
-    }
-
-    /* Add a SIGINT handler to properly close the pcap file on exit */
-    if (signal(SIGINT, sig_handler) == SIG_ERR)
-    {
-        perror("Unable to register SIGINT handler");
+        perror("Unable to mask signals");
         exit(-1);
     }
 
     /* Process command-line arguments */
-    while ((opt = getopt(argc, argv, "p:c:vdh")) != -1)
+    while ((opt = getopt(argc, argv, "p:c:C:W:S:F:Mq:w:s:a:m:f:t:b:k:vdh")) != -1)
         switch (opt)
         {
         case 'p':
@@ -133,6 +244,112 @@ int main(int argc, char *argv[])
         case 'c':
             cap_file = strdup(optarg);
             break;
+        case 'C':
+            cap_size = atol(optarg);
+            if(cap_size < 1 || cap_size > 1024 * 1024)
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Capture file size must be between 1 and %u MB\n", 1024 * 1024);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'W':
+            cap_files = atol(optarg);
+            if(cap_files < 1 || cap_files > UINT32_MAX)
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Invalid number of capture files: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+            snaplen = atol(optarg);
+            if(snaplen < ETHER_HDR_LEN || snaplen > ETHER_FRAME_MAX_LEN)
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Snaplen must be between %u and %u\n", ETHER_HDR_LEN, ETHER_FRAME_MAX_LEN);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'F':
+            chirouter_filter_free(cap_filter);
+            cap_filter = chirouter_filter_compile(optarg, filter_error);
+            if(!cap_filter)
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Invalid capture filter: %s\n", filter_error);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'M':
+            cap_mmap = true;
+            break;
+        case 'q':
+            num_rss_queues = atoi(optarg);
+            if(num_rss_queues < 1 || num_rss_queues > MAX_RSS_QUEUES)
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Number of RSS queues must be between 1 and %u\n", MAX_RSS_QUEUES);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            if(num_workers < 1 || num_workers > MAX_SCHED_WORKERS)
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Number of workers must be between 1 and %u\n", MAX_SCHED_WORKERS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            sample_rate = atol(optarg);
+            if(sample_rate < 0 || sample_rate > UINT32_MAX)
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Invalid latency sampling rate: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            chirouter_latency_sample_rate = sample_rate;
+            break;
+        case 'a':
+            admin_socket = strdup(optarg);
+            break;
+        case 'm':
+            metrics_port = strdup(optarg);
+            break;
+        case 'f':
+            flightrec_size = atol(optarg);
+            if(flightrec_size < 0 || flightrec_size > (1 << 24))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Flight recorder size must be between 0 and %u\n", 1 << 24);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+        case 'b':
+            sep = strchr(optarg, ':');
+            if(!sep || sep == optarg || sep - optarg > (int) MAX_ROUTER_NAMELEN || access(sep + 1, R_OK) != 0)
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Invalid routing table (must be ROUTER:FILE, with a readable FILE): %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            rtable_files = realloc(rtable_files, (num_rtable_files + 1) * sizeof(chirouter_rtable_file_t));
+            if(!rtable_files)
+            {
+                perror("ERROR: Could not allocate memory");
+                return EXIT_FAILURE;
+            }
+            snprintf(rtable_files[num_rtable_files].router, sizeof(rtable_files[0].router), "%.*s", (int) (sep - optarg), optarg);
+            rtable_files[num_rtable_files].filename = strdup(sep + 1);
+            rtable_files[num_rtable_files].is_fib = (opt == 'b');
+            num_rtable_files++;
+            break;
+        case 'k':
+            checkpoint_file = strdup(optarg);
+            break;
         case 'v':
             verbosity++;
             break;
@@ -165,6 +382,14 @@ int main(int argc, char *argv[])
         break;
     }
 
+    if(chirouter_loglevel > CHIROUTER_MIN_LOG_LEVEL)
+        fprintf(stderr, "WARNING: This build of chirouter only includes log messages up to level %s\n", STRINGIFY(CHIROUTER_MIN_LOG_LEVEL));
+
+    /* Log messages are formatted and printed by a separate thread, so
+     * logging doesn't slow down the processing of frames */
+    if(chirouter_log_start_async() != 0)
+        fprintf(stderr, "WARNING: Could not start logging thread. Logging synchronously.\n");
+
     /* Initialize server context */
     rc = chirouter_server_ctx_init(&ctx);
     if(rc)
@@ -173,12 +398,60 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if(flightrec_size > 0)
+    {
+        ctx->flightrec = chirouter_flightrec_create(flightrec_size);
+        if(!ctx->flightrec)
+        {
+            fprintf(stderr, "ERROR: Could not allocate flight recorder\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(pthread_create(&signal_tid, NULL, signal_thread, &handled) != 0)
+    {
+        perror("ERROR: Could not create signal thread");
+        return EXIT_FAILURE;
+    }
+    pthread_detach(signal_tid);
+
+    ctx->num_rss_queues = num_rss_queues;
+    ctx->rtable_files = rtable_files;
+    ctx->num_rtable_files = num_rtable_files;
+
+    if(num_workers > 0)
+    {
+        if(num_rss_queues == 0)
+            ctx->num_rss_queues = 1;
+
+        ctx->sched = chirouter_sched_start(num_workers);
+        if(!ctx->sched)
+        {
+            fprintf(stderr, "ERROR: Could not start worker threads\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(!cap_file && (cap_size || cap_files || cap_filter || cap_mmap))
+    {
+        fprintf(stderr, USAGE);
+        fprintf(stderr, "ERROR: -C, -W, -F and -M require a capture file (-c)\n");
+        return EXIT_FAILURE;
+    }
+
+    if(cap_files && !cap_size)
+    {
+        fprintf(stderr, USAGE);
+        fprintf(stderr, "ERROR: -W requires a capture file size (-C)\n");
+        return EXIT_FAILURE;
+    }
+
     /* Create capture file */
     if(cap_file)
     {
-        ctx->pcap = fopen(cap_file,"w");
+        ctx->pcap_writer = chirouter_pcap_writer_start(cap_file, cap_size * 1024 * 1024, cap_files, snaplen, cap_filter, cap_mmap);
 
-        if(!ctx->pcap)
+        if(!ctx->pcap_writer)
         {
             fprintf(stderr, USAGE);
             perror("ERROR: Capture file could not be created.");
@@ -186,6 +459,37 @@ int main(int argc, char *argv[])
         }
     }
 
+    if(admin_socket)
+    {
+        ctx->admin = chirouter_admin_start(ctx, admin_socket);
+        if(!ctx->admin)
+        {
+            fprintf(stderr, "ERROR: Could not create admin socket %s\n", admin_socket);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(metrics_port)
+    {
+        ctx->metrics = chirouter_metrics_start(ctx, metrics_port);
+        if(!ctx->metrics)
+        {
+            fprintf(stderr, "ERROR: Could not serve metrics on port %s\n", metrics_port);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* The routers are restored after the routing table files and
+     * the capture file are set up, since they depend on both */
+    if(checkpoint_file && access(checkpoint_file, F_OK) == 0)
+    {
+        rc = chirouter_checkpoint_restore(ctx, checkpoint_file);
+        if(rc == 0)
+            chilog(INFO, "Restored %i routers from checkpoint %s", ctx->num_routers, checkpoint_file);
+        else if(rc == -1)
+            fprintf(stderr, "WARNING: Could not restore checkpoint %s. Starting without it.\n", checkpoint_file);
+    }
+
     rc = chirouter_server_setup(ctx, port);
     if(rc)
     {
@@ -195,6 +499,20 @@ int main(int argc, char *argv[])
 
     rc = chirouter_server_run(ctx);
 
+    /* The routers have been stopped (and kept, if they were running) */
+    if(rc == 0 && __atomic_load_n(&exit_signo, __ATOMIC_ACQUIRE) == SIGTERM && checkpoint_file)
+    {
+        rc = chirouter_checkpoint_write(ctx, checkpoint_file);
+        if(rc == 0)
+            fprintf(stderr, "Wrote checkpoint to %s\n", checkpoint_file);
+        else if(rc == 1)
+            fprintf(stderr, "No routers to checkpoint\n");
+        else
+            fprintf(stderr, "ERROR: Could not write checkpoint to %s\n", checkpoint_file);
+    }
+
+    /* Stops the routers before the capture file writer, and
+     * removes the admin socket */
     chirouter_server_ctx_destroy(ctx);
 
     return EXIT_SUCCESS;
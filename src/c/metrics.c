@@ -0,0 +1,449 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Metrics exporter
+ *
+ *  see metrics.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+#include "pcap.h"
+#include "arp.h"
+#include "dispatch.h"
+#include "log.h"
+
+/* Counters that are updated for interfaces (see stats.h) */
+static const chirouter_stat_t interface_stats[] =
+{
+    CHIROUTER_STAT_RX_PACKETS,
+    CHIROUTER_STAT_RX_BYTES,
+    CHIROUTER_STAT_TX_PACKETS,
+    CHIROUTER_STAT_TX_BYTES,
+    CHIROUTER_STAT_DROP_INVALID,
+    CHIROUTER_STAT_DROP_BAD_DST_MAC,
+    CHIROUTER_STAT_DROP_MULTICAST,
+};
+
+#define NUM_INTERFACE_STATS (sizeof(interface_stats) / sizeof(interface_stats[0]))
+
+/* Upper bounds (in nanoseconds) of the buckets of the exported
+ * latency histograms. The internal histograms are much finer-grained
+ * (see latency.h), so the counts are exact up to about 3%. */
+static const uint64_t latency_bounds[] =
+{
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000,
+    250000000, 500000000, 1000000000,
+};
+
+#define NUM_LATENCY_BOUNDS (sizeof(latency_bounds) / sizeof(latency_bounds[0]))
+
+#define HTTP_OK "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n"
+#define HTTP_NOT_FOUND "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nNot Found\n"
+#define HTTP_BAD_REQUEST "HTTP/1.0 400 Bad Request\r\nContent-Type: text/plain\r\nContent-Length: 12\r\nConnection: close\r\n\r\nBad Request\n"
+
+
+/* Writes a label, escaping its value as required by the format */
+static void metrics_label(FILE *out, const char *name, const char *value)
+{
+    fprintf(out, "%s=\"", name);
+    for(; *value; value++)
+    {
+        if(*value == '"' || *value == '\\')
+            fprintf(out, "\\%c", *value);
+        else if(*value == '\n')
+            fprintf(out, "\\n");
+        else
+            fputc(*value, out);
+    }
+    fputc('"', out);
+}
+
+
+/* Writes the latency histograms of a router */
+static void metrics_write_latency(FILE *out, chirouter_ctx_t *r, chirouter_hist_t *hist)
+{
+    for(int s=0; s < CHIROUTER_STAGE_MAX; s++)
+    {
+        if(chirouter_latency_snapshot(&r->latency, s, hist) != 0)
+            return;
+
+        for(size_t b=0; b < NUM_LATENCY_BOUNDS; b++)
+        {
+            fprintf(out, "chirouter_latency_seconds_bucket{");
+            metrics_label(out, "router", r->name);
+            fprintf(out, ",stage=\"%s\",le=\"%g\"} %lu\n", chirouter_stage_name(s),
+                         latency_bounds[b] / 1e9, chirouter_latency_count_below(hist, latency_bounds[b]));
+        }
+
+        fprintf(out, "chirouter_latency_seconds_bucket{");
+        metrics_label(out, "router", r->name);
+        fprintf(out, ",stage=\"%s\",le=\"+Inf\"} %lu\n", chirouter_stage_name(s), hist->count);
+
+        fprintf(out, "chirouter_latency_seconds_sum{");
+        metrics_label(out, "router", r->name);
+        fprintf(out, ",stage=\"%s\"} %.9f\n", chirouter_stage_name(s), hist->sum / 1e9);
+
+        fprintf(out, "chirouter_latency_seconds_count{");
+        metrics_label(out, "router", r->name);
+        fprintf(out, ",stage=\"%s\"} %lu\n", chirouter_stage_name(s), hist->count);
+    }
+}
+
+
+/* See metrics.h */
+void chirouter_metrics_write(server_ctx_t *server, FILE *out)
+{
+    chirouter_arpcache_entry_t arp[ARPCACHE_SIZE];
+    uint64_t values[CHIROUTER_STAT_MAX];
+    chirouter_hist_t *hist;
+    int num_routers;
+
+    fprintf(out, "# TYPE chirouter_arp_cache_size gauge\nchirouter_arp_cache_size %u\n", ARPCACHE_SIZE);
+    fprintf(out, "# TYPE chirouter_rss_queue_size gauge\nchirouter_rss_queue_size %u\n", RSS_QUEUE_SIZE);
+    fprintf(out, "# TYPE chirouter_latency_sample_rate gauge\nchirouter_latency_sample_rate %u\n", chirouter_latency_sample_rate);
+
+    if(server->pcap_writer)
+    {
+        chirouter_pcap_writer_t *writer = server->pcap_writer;
+
+        fprintf(out, "# TYPE chirouter_pcap_written_frames_total counter\nchirouter_pcap_written_frames_total %lu\n",
+                __atomic_load_n(&writer->num_written, __ATOMIC_RELAXED));
+        fprintf(out, "# TYPE chirouter_pcap_dropped_frames_total counter\nchirouter_pcap_dropped_frames_total %lu\n",
+                __atomic_load_n(&writer->num_dropped, __ATOMIC_RELAXED));
+        fprintf(out, "# TYPE chirouter_pcap_write_errors_total counter\nchirouter_pcap_write_errors_total %lu\n",
+                __atomic_load_n(&writer->num_errors, __ATOMIC_RELAXED));
+    }
+
+    pthread_mutex_lock(&server->lock_routers);
+
+    num_routers = server->state == RUNNING ? server->num_routers : 0;
+
+    fprintf(out, "# TYPE chirouter_routers gauge\nchirouter_routers %d\n", num_routers);
+
+    /* Router counters. All the samples of a metric must be
+     * together, so we go through the routers once per counter */
+    for(int s=0; s < CHIROUTER_STAT_MAX; s++)
+    {
+        fprintf(out, "# TYPE chirouter_%s_total counter\n", chirouter_stat_name(s));
+        for(int i=0; i < num_routers; i++)
+        {
+            chirouter_ctx_t *r = &server->routers[i];
+
+            chirouter_stats_read(&r->stats, values);
+            fprintf(out, "chirouter_%s_total{", chirouter_stat_name(s));
+            metrics_label(out, "router", r->name);
+            fprintf(out, "} %lu\n", values[s]);
+        }
+    }
+
+    /* Interface counters */
+    for(size_t s=0; s < NUM_INTERFACE_STATS; s++)
+    {
+        chirouter_stat_t stat = interface_stats[s];
+
+        fprintf(out, "# TYPE chirouter_interface_%s_total counter\n", chirouter_stat_name(stat));
+        for(int i=0; i < num_routers; i++)
+        {
+            chirouter_ctx_t *r = &server->routers[i];
+
+            for(int j=0; j < r->num_interfaces; j++)
+            {
+                chirouter_stats_read(&r->interfaces[j].stats, values);
+                fprintf(out, "chirouter_interface_%s_total{", chirouter_stat_name(stat));
+                metrics_label(out, "router", r->name);
+                fputc(',', out);
+                metrics_label(out, "interface", r->interfaces[j].name);
+                fprintf(out, "} %lu\n", values[stat]);
+            }
+        }
+    }
+
+    /* ARP gauges */
+    fprintf(out, "# TYPE chirouter_arp_cache_entries gauge\n");
+    for(int i=0; i < num_routers; i++)
+    {
+        fprintf(out, "chirouter_arp_cache_entries{");
+        metrics_label(out, "router", server->routers[i].name);
+        fprintf(out, "} %d\n", chirouter_arp_cache_snapshot(&server->routers[i], arp));
+    }
+
+    fprintf(out, "# TYPE chirouter_pending_arp_requests gauge\n");
+    for(int i=0; i < num_routers; i++)
+    {
+        fprintf(out, "chirouter_pending_arp_requests{");
+        metrics_label(out, "router", server->routers[i].name);
+        fprintf(out, "} %u\n", __atomic_load_n(&server->routers[i].num_pending_arp_reqs, __ATOMIC_RELAXED));
+    }
+
+    fprintf(out, "# TYPE chirouter_withheld_frames gauge\n");
+    for(int i=0; i < num_routers; i++)
+    {
+        fprintf(out, "chirouter_withheld_frames{");
+        metrics_label(out, "router", server->routers[i].name);
+        fprintf(out, "} %u\n", __atomic_load_n(&server->routers[i].num_withheld_frames, __ATOMIC_RELAXED));
+    }
+
+    /* RSS queue occupancy */
+    fprintf(out, "# TYPE chirouter_rss_queue_frames gauge\n");
+    for(int i=0; i < num_routers; i++)
+    {
+        chirouter_ctx_t *r = &server->routers[i];
+
+        for(int q=0; q < r->num_rss_queues; q++)
+        {
+            chirouter_rss_queue_t *queue = &r->rss_queues[q];
+            uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+            uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+            fprintf(out, "chirouter_rss_queue_frames{");
+            metrics_label(out, "router", r->name);
+            fprintf(out, ",queue=\"%d\"} %u\n", q, head - tail);
+        }
+    }
+
+    /* Latency histograms */
+    fprintf(out, "# TYPE chirouter_latency_seconds histogram\n");
+    hist = malloc(sizeof(chirouter_hist_t));
+    if(hist)
+    {
+        for(int i=0; i < num_routers; i++)
+            metrics_write_latency(out, &server->routers[i], hist);
+        free(hist);
+    }
+
+    pthread_mutex_unlock(&server->lock_routers);
+}
+
+
+/* Reads an HTTP request (up to the end of the headers). Returns
+ * 0 if the request is for the metrics, 1 if it is for something
+ * else, and -1 if it is invalid. */
+static int metrics_read_request(int client)
+{
+    char request[METRICS_MAX_REQUEST_LEN + 1];
+    size_t len = 0;
+    ssize_t nbytes;
+
+    while(len < METRICS_MAX_REQUEST_LEN)
+    {
+        nbytes = recv(client, request + len, METRICS_MAX_REQUEST_LEN - len, 0);
+        if(nbytes == -1 && errno == EINTR)
+            continue;
+        if(nbytes <= 0)
+            return -1;
+
+        len += nbytes;
+        request[len] = '\0';
+        if(strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+
+    if(len == METRICS_MAX_REQUEST_LEN)
+        return -1;
+
+    if(strncmp(request, "GET ", 4))
+        return -1;
+
+    if(strncmp(request + 4, "/metrics ", 9) && strncmp(request + 4, "/ ", 2))
+        return 1;
+
+    return 0;
+}
+
+
+/* Sends a whole buffer to a client */
+static void metrics_send(int client, const char *buf, size_t len)
+{
+    ssize_t nbytes;
+
+    while(len > 0)
+    {
+        nbytes = send(client, buf, len, MSG_NOSIGNAL);
+        if(nbytes == -1 && errno == EINTR)
+            continue;
+        if(nbytes <= 0)
+            return;
+
+        buf += nbytes;
+        len -= nbytes;
+    }
+}
+
+
+/* Metrics thread function. Serves one client at a time. */
+static void* chirouter_metrics_thread(void *args)
+{
+    chirouter_metrics_t *metrics = (chirouter_metrics_t *) args;
+    struct timeval timeout = { .tv_sec = METRICS_CLIENT_TIMEOUT, .tv_usec = 0 };
+    char header[sizeof(HTTP_OK) + 32];
+    char *body;
+    size_t body_len;
+    FILE *out;
+    int client, rc;
+
+    while(1)
+    {
+        client = accept(metrics->socket, NULL, NULL);
+        if(client == -1)
+        {
+            if(__atomic_load_n(&metrics->stop, __ATOMIC_ACQUIRE))
+                break;
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            chilog(ERROR, "Could not accept() connection on metrics port");
+            break;
+        }
+
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        rc = metrics_read_request(client);
+        if(rc == 1)
+            metrics_send(client, HTTP_NOT_FOUND, strlen(HTTP_NOT_FOUND));
+        else if(rc == -1)
+            metrics_send(client, HTTP_BAD_REQUEST, strlen(HTTP_BAD_REQUEST));
+        else if((out = open_memstream(&body, &body_len)) != NULL)
+        {
+            /* Build the whole response before sending it, so that
+             * no locks are held while waiting for the client */
+            chirouter_metrics_write(metrics->server, out);
+            fclose(out);
+
+            snprintf(header, sizeof(header), HTTP_OK, body_len);
+            metrics_send(client, header, strlen(header));
+            metrics_send(client, body, body_len);
+            free(body);
+        }
+
+        close(client);
+    }
+
+    return NULL;
+}
+
+
+/* See metrics.h */
+chirouter_metrics_t *chirouter_metrics_start(server_ctx_t *server, const char *port)
+{
+    struct addrinfo hints, *res, *p;
+    chirouter_metrics_t *metrics;
+    int yes = 1;
+
+    metrics = calloc(1, sizeof(chirouter_metrics_t));
+    if(!metrics)
+        return NULL;
+
+    metrics->server = server;
+
+    /* Only listen on the loopback interface */
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo("localhost", port, &hints, &res) != 0)
+    {
+        chilog(ERROR, "getaddrinfo() failed for metrics port %s", port);
+        free(metrics);
+        return NULL;
+    }
+
+    for(p = res; p != NULL; p = p->ai_next)
+    {
+        if ((metrics->socket = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+            continue;
+
+        if (setsockopt(metrics->socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+            bind(metrics->socket, p->ai_addr, p->ai_addrlen) == -1 ||
+            listen(metrics->socket, 5) == -1)
+        {
+            close(metrics->socket);
+            continue;
+        }
+
+        break;
+    }
+
+    freeaddrinfo(res);
+
+    if (p == NULL)
+    {
+        chilog(ERROR, "Could not listen on metrics port %s", port);
+        free(metrics);
+        return NULL;
+    }
+
+    if(pthread_create(&metrics->thread, NULL, chirouter_metrics_thread, metrics) != 0)
+    {
+        chilog(ERROR, "Could not create metrics thread");
+        close(metrics->socket);
+        free(metrics);
+        return NULL;
+    }
+
+    chilog(INFO, "Serving metrics on http://localhost:%s/metrics", port);
+
+    return metrics;
+}
+
+
+/* See metrics.h */
+int chirouter_metrics_stop(chirouter_metrics_t *metrics)
+{
+    if(!metrics)
+        return 0;
+
+    /* Shutting down the socket makes accept() return */
+    __atomic_store_n(&metrics->stop, true, __ATOMIC_RELEASE);
+    shutdown(metrics->socket, SHUT_RDWR);
+
+    if(pthread_join(metrics->thread, NULL) != 0)
+        return -1;
+
+    close(metrics->socket);
+    free(metrics);
+
+    return 0;
+}
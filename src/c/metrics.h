@@ -0,0 +1,131 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Metrics exporter
+ *
+ *  If enabled, chirouter serves its metrics in the Prometheus text
+ *  exposition format at http://127.0.0.1:PORT/metrics. Requests are
+ *  served by a separate thread, one at a time. The metrics are:
+ *
+ *  - chirouter_<counter>_total{router}: The statistics counters of
+ *    each router (see stats.h).
+ *  - chirouter_interface_<counter>_total{router,interface}: The
+ *    statistics counters of each interface.
+ *  - chirouter_arp_cache_entries{router}: Number of valid entries
+ *    in the ARP cache (out of chirouter_arp_cache_size).
+ *  - chirouter_pending_arp_requests{router}: Number of pending ARP
+ *    requests.
+ *  - chirouter_withheld_frames{router}: Number of frames withheld
+ *    until an ARP reply arrives.
+ *  - chirouter_rss_queue_frames{router,queue}: Number of frames
+ *    waiting in each RSS queue (out of chirouter_rss_queue_size).
+ *  - chirouter_latency_seconds{router,stage}: Histogram of the
+ *    sampled latencies of each stage (see latency.h).
+ *  - chirouter_pcap_{written,dropped}_frames_total and
+ *    chirouter_pcap_write_errors_total: Frames written to the capture
+ *    file (or dropped because the writer thread could not keep up),
+ *    and failed writes. Only if there is a capture file.
+ *
+ *  None of these require taking a lock that the threads processing
+ *  frames could be waiting on: counters and histograms are read with
+ *  relaxed loads, the ARP cache is read through its sequence counter,
+ *  and the gauges are read atomically. The response is fully built
+ *  before it is sent, so a slow scraper doesn't hold any lock either.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "server.h"
+
+/* Maximum length of a request (longer requests are rejected) */
+#define METRICS_MAX_REQUEST_LEN (4096)
+
+/* Time (in seconds) that a client has to send its request,
+ * and to read the response */
+#define METRICS_CLIENT_TIMEOUT (5)
+
+
+/* The metrics listener, and the thread serving it */
+typedef struct chirouter_metrics
+{
+    server_ctx_t *server;
+    int socket;
+    bool stop;
+    pthread_t thread;
+} chirouter_metrics_t;
+
+
+/*
+ * chirouter_metrics_start - Listen on a local port and start serving metrics
+ *
+ * server: Server context
+ *
+ * port: TCP port (on the loopback interface)
+ *
+ * Returns: The metrics listener, or NULL if an error happens.
+ */
+chirouter_metrics_t *chirouter_metrics_start(server_ctx_t *server, const char *port);
+
+
+/*
+ * chirouter_metrics_stop - Stop serving metrics
+ *
+ * metrics: Metrics listener (can be NULL, in which case nothing is done)
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_metrics_stop(chirouter_metrics_t *metrics);
+
+
+/*
+ * chirouter_metrics_write - Write the metrics of all the routers
+ *
+ * Can be called from any thread. If the routers are not running,
+ * only the metrics that don't depend on the routers are written.
+ *
+ * server: Server context
+ *
+ * out: File where the metrics will be written
+ *
+ * Returns: nothing.
+ */
+void chirouter_metrics_write(server_ctx_t *server, FILE *out);
+
+#endif /* METRICS_H_ */
@@ -1,12 +1,19 @@
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
 #include <assert.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "server.h"
 #include "chirouter.h"
 #include "pcap.h"
+#include "probes.h"
 
 #define PADDED_LEN(x) (x%4==0 ? x : ((x/4)+1)*4)
 #define PAD_LEN(x) (PADDED_LEN(x) - x)
@@ -24,6 +31,7 @@
 #define OPTION_HDR_LEN 4
 
 #define OPCODE_END 0
+#define OPCODE_COMMENT 1
 #define OPCODE_IF_NAME 2
 #define OPCODE_IF_MACADDR 6
 #define OPCODE_IF_TSRESOL 9
@@ -71,7 +79,7 @@ struct pcapng_epb {
 
 
 /* See pcap.h */
-int chirouter_pcap_write_section_header(server_ctx_t *ctx)
+int chirouter_pcapng_write_shb(FILE *f)
 {
     struct pcapng_shb hdr;
 
@@ -83,7 +91,7 @@ int chirouter_pcap_write_section_header(server_ctx_t *ctx)
     hdr.section_length = -1;
     hdr.block_total_length_trail = sizeof(hdr);
 
-    if (fwrite((char *)&hdr, sizeof(hdr), 1, ctx->pcap) != 1)
+    if (fwrite((char *)&hdr, sizeof(hdr), 1, f) != 1)
         return EXIT_FAILURE;
     else
         return EXIT_SUCCESS;
@@ -91,9 +99,9 @@ int chirouter_pcap_write_section_header(server_ctx_t *ctx)
 
 
 /*
- * chirouter_pcap_write_option - Writes a pcapng option
+ * chirouter_pcapng_write_option - Writes a pcapng option
  *
- * ctx: Server context
+ * f: File to write to
  *
  * option_code: Option code
  *
@@ -104,7 +112,7 @@ int chirouter_pcap_write_section_header(server_ctx_t *ctx)
  * Returns: 0 on success, -1 if an error happens.
  *
  */
-int chirouter_pcap_write_option(server_ctx_t *ctx, uint16_t option_code, uint16_t option_length, uint8_t *option_value)
+static int chirouter_pcapng_write_option(FILE *f, uint16_t option_code, uint16_t option_length, const uint8_t *option_value)
 {
     struct pcapng_option opt;
     uint16_t pad_length;
@@ -114,7 +122,7 @@ int chirouter_pcap_write_option(server_ctx_t *ctx, uint16_t option_code, uint16_
     opt.option_length = option_length;
 
     /* Write option code and length */
-    if (fwrite((char *)&opt, sizeof(opt), 1, ctx->pcap) != 1)
+    if (fwrite((char *)&opt, sizeof(opt), 1, f) != 1)
         return EXIT_FAILURE;
 
     if(option_length > 0)
@@ -124,13 +132,13 @@ int chirouter_pcap_write_option(server_ctx_t *ctx, uint16_t option_code, uint16_
         assert(pad_length >= 0 && pad_length <= 3);
 
         /* Write option value */
-        if (fwrite(option_value, 1, option_length, ctx->pcap) != option_length)
+        if (fwrite(option_value, 1, option_length, f) != option_length)
             return EXIT_FAILURE;
 
         if(pad_length > 0)
         {
             /* Write padding */
-            if (fwrite((char *)&pad, 1, pad_length, ctx->pcap) != pad_length)
+            if (fwrite((char *)&pad, 1, pad_length, f) != pad_length)
                 return EXIT_FAILURE;
         }
     }
@@ -140,53 +148,169 @@ int chirouter_pcap_write_option(server_ctx_t *ctx, uint16_t option_code, uint16_
 
 
 /* See pcap.h */
-int chirouter_pcap_write_interfaces(server_ctx_t *ctx)
+int chirouter_pcapng_write_idb(FILE *f, const char *name, const uint8_t *mac, uint32_t snaplen)
 {
-    uint32_t interface_id = 0;
+    struct pcapng_idb hdr;
+    uint8_t tsresol = 9;
 
-    for(int i=0; i < ctx->num_routers; i++)
+    hdr.block_type = BLOCK_TYPE_IDB;
+    hdr.link_type = LINKTYPE_ETHERNET;
+    hdr.reserved = 0;
+    hdr.snaplen = snaplen;
+
+    hdr.block_total_length = sizeof(hdr);
+    hdr.block_total_length += OPTION_HDR_LEN + PADDED_LEN(strlen(name));
+    if(mac)
+        hdr.block_total_length += OPTION_HDR_LEN + PADDED_LEN(ETHER_ADDR_LEN);
+    hdr.block_total_length += OPTION_HDR_LEN + PADDED_LEN(1);
+    hdr.block_total_length += OPTION_HDR_LEN; /* End of options */
+    hdr.block_total_length += 4; /* Trailing length */
+
+    if (fwrite((char *)&hdr, sizeof(hdr), 1, f) != 1)
+        return EXIT_FAILURE;
+
+    if(chirouter_pcapng_write_option(f, OPCODE_IF_NAME, strlen(name), (const uint8_t *) name))
+        return EXIT_FAILURE;
+
+    if(mac && chirouter_pcapng_write_option(f, OPCODE_IF_MACADDR, ETHER_ADDR_LEN, mac))
+        return EXIT_FAILURE;
+
+    if(chirouter_pcapng_write_option(f, OPCODE_IF_TSRESOL, 1, &tsresol))
+        return EXIT_FAILURE;
+
+    if(chirouter_pcapng_write_option(f, OPCODE_END, 0, NULL))
+        return EXIT_FAILURE;
+
+    if (fwrite((char *)&hdr.block_total_length, sizeof(hdr.block_total_length), 1, f) != 1)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+
+/* Copies a pcapng option (and its padding) to a buffer,
+ * and returns the number of bytes copied */
+static size_t chirouter_pcapng_put_option(uint8_t *buf, uint16_t option_code, uint16_t option_length, const void *option_value)
+{
+    struct pcapng_option opt;
+
+    opt.option_code = option_code;
+    opt.option_length = option_length;
+
+    memcpy(buf, &opt, sizeof(opt));
+    if(option_length > 0)
     {
-        chirouter_ctx_t *r = &ctx->routers[i];
+        memcpy(buf + sizeof(opt), option_value, option_length);
+        memset(buf + sizeof(opt) + option_length, 0, PAD_LEN(option_length));
+    }
 
-        for(int i=0; i < r->num_interfaces; i++)
-        {
-            chirouter_interface_t *iface = &r->interfaces[i];
-            struct pcapng_idb hdr;
-            char iface_name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 1];
+    return sizeof(opt) + PADDED_LEN(option_length);
+}
 
-            snprintf(iface_name, MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2, "%s-%s", r->name, iface->name);
 
-            iface->pcap_iface_id = interface_id++;
+/* Returns the length of an enhanced packet block */
+static size_t chirouter_pcapng_epb_len(size_t caplen, const char *comment)
+{
+    size_t len = sizeof(struct pcapng_epb);
 
-            hdr.block_type = BLOCK_TYPE_IDB;
-            hdr.link_type = LINKTYPE_ETHERNET;
-            hdr.reserved = 0;
-            hdr.snaplen = 65535;
+    len += PADDED_LEN(caplen);
+    len += OPTION_HDR_LEN + PADDED_LEN(4); /* Flags */
+    if(comment)
+        len += OPTION_HDR_LEN + PADDED_LEN(strlen(comment));
+    len += OPTION_HDR_LEN; /* End of options */
+    len += 4; /* Trailing length */
 
-            hdr.block_total_length = sizeof(hdr);
-            hdr.block_total_length += OPTION_HDR_LEN + PADDED_LEN(strlen(iface_name));
-            hdr.block_total_length += OPTION_HDR_LEN + PADDED_LEN(ETHER_ADDR_LEN);
-            hdr.block_total_length += OPTION_HDR_LEN + PADDED_LEN(1);
-            hdr.block_total_length += OPTION_HDR_LEN; /* End of options */
-            hdr.block_total_length += 4; /* Trailing length */
+    return len;
+}
 
-            if (fwrite((char *)&hdr, sizeof(hdr), 1, ctx->pcap) != 1)
-                return EXIT_FAILURE;
 
-            if(chirouter_pcap_write_option(ctx, OPCODE_IF_NAME, strlen(iface_name), (uint8_t *) iface_name))
-                return EXIT_FAILURE;
+/* Assembles an enhanced packet block in a buffer (which must have room
+ * for chirouter_pcapng_epb_len bytes), and returns its length */
+static size_t chirouter_pcapng_put_epb(uint8_t *buf, uint32_t iface_id, uint64_t ts, const uint8_t *data, size_t caplen,
+                                       size_t len, pcap_packet_direction_t dir, const char *comment)
+{
+    struct pcapng_epb hdr;
+    uint32_t flags = 0;
+    size_t pos = 0;
 
-            if(chirouter_pcap_write_option(ctx, OPCODE_IF_MACADDR, ETHER_ADDR_LEN, iface->mac))
-                return EXIT_FAILURE;
+    hdr.block_type = BLOCK_TYPE_EPB;
+    hdr.block_total_length = chirouter_pcapng_epb_len(caplen, comment);
+    hdr.interface_id = iface_id;
+    hdr.timestamp_high = ts >> 32;
+    hdr.timestamp_low = ts & 0x00000000FFFFFFFF;
+    hdr.captured_plen = caplen;
+    hdr.original_plen = len;
 
-            uint8_t tsresol = 9;
-            if(chirouter_pcap_write_option(ctx, OPCODE_IF_TSRESOL, 1, &tsresol))
-                return EXIT_FAILURE;
+    memcpy(buf, &hdr, sizeof(hdr));
+    pos += sizeof(hdr);
 
-            if(chirouter_pcap_write_option(ctx, OPCODE_END, 0, NULL))
-                return EXIT_FAILURE;
+    memcpy(buf + pos, data, caplen);
+    memset(buf + pos + caplen, 0, PAD_LEN(caplen));
+    pos += PADDED_LEN(caplen);
+
+    switch(dir)
+    {
+    case PCAP_UNSPECIFIED:
+        flags = 0;
+        break;
+    case PCAP_INBOUND:
+        flags = 1;
+        break;
+    case PCAP_OUTBOUND:
+        flags = 2;
+        break;
+    }
+
+    pos += chirouter_pcapng_put_option(buf + pos, OPCODE_EPB_FLAGS, 4, &flags);
+    if(comment)
+        pos += chirouter_pcapng_put_option(buf + pos, OPCODE_COMMENT, strlen(comment), comment);
+    pos += chirouter_pcapng_put_option(buf + pos, OPCODE_END, 0, NULL);
+
+    memcpy(buf + pos, &hdr.block_total_length, sizeof(hdr.block_total_length));
+    pos += sizeof(hdr.block_total_length);
+
+    assert(pos == hdr.block_total_length);
+
+    return pos;
+}
+
+
+/* See pcap.h */
+int chirouter_pcapng_write_epb(FILE *f, uint32_t iface_id, uint64_t ts, const uint8_t *data, size_t caplen, size_t len,
+                               pcap_packet_direction_t dir, const char *comment)
+{
+    uint8_t buf[chirouter_pcapng_epb_len(caplen, comment)];
+    size_t block_len;
 
-            if (fwrite((char *)&hdr.block_total_length, sizeof(hdr.block_total_length), 1, ctx->pcap) != 1)
+    /* The block is assembled first, so it is written with a single call */
+    block_len = chirouter_pcapng_put_epb(buf, iface_id, ts, data, caplen, len, dir, comment);
+
+    if (fwrite(buf, block_len, 1, f) != 1)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+
+/* See pcap.h */
+int chirouter_pcap_write_interfaces(server_ctx_t *ctx, FILE *f, uint32_t snaplen)
+{
+    uint32_t interface_id = 0;
+
+    for(int i=0; i < ctx->num_routers; i++)
+    {
+        chirouter_ctx_t *r = &ctx->routers[i];
+
+        for(int i=0; i < r->num_interfaces; i++)
+        {
+            chirouter_interface_t *iface = &r->interfaces[i];
+            char iface_name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+
+            snprintf(iface_name, sizeof(iface_name), "%s-%s", r->name, iface->name);
+
+            iface->pcap_iface_id = interface_id++;
+
+            if(chirouter_pcapng_write_idb(f, iface_name, iface->mac, snaplen))
                 return EXIT_FAILURE;
         }
     }
@@ -196,9 +320,16 @@ int chirouter_pcap_write_interfaces(server_ctx_t *ctx)
 
 #define BILLION 1000000000L
 
+
+/* See pcap.h */
 int chirouter_pcap_write_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *msg, size_t len, pcap_packet_direction_t dir)
 {
-    struct pcapng_epb hdr;
+    chirouter_pcap_writer_t *writer = ctx->server->pcap_writer;
+    chirouter_pcap_slot_t *slot;
+    uint64_t pos, seq;
+
+    if(writer->filter && !chirouter_filter_match(writer->filter, ctx, iface, msg, len, dir))
+        return EXIT_SUCCESS;
 
     /* Get nanoseconds since epoch */
     uint64_t ns;
@@ -207,65 +338,707 @@ int chirouter_pcap_write_frame(chirouter_ctx_t *ctx, chirouter_interface_t *ifac
     clock_gettime(CLOCK_REALTIME, &spec);
     ns = (uint64_t) spec.tv_sec * BILLION + (uint64_t) spec.tv_nsec;
 
-    hdr.block_type = BLOCK_TYPE_EPB;
-    hdr.interface_id = iface->pcap_iface_id;
-    hdr.timestamp_high = ns >> 32;
-    hdr.timestamp_low = ns & 0x00000000FFFFFFFF;
-    hdr.captured_plen = len;
-    hdr.original_plen = len;
+    /* Claim a slot. A slot is free for position pos when its sequence
+     * number is pos (and holds the frame for pos when it is pos + 1) */
+    pos = __atomic_load_n(&writer->head, __ATOMIC_RELAXED);
+    while(1)
+    {
+        slot = &writer->slots[pos & (PCAP_RING_SIZE - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
 
-    hdr.block_total_length = sizeof(hdr);
-    hdr.block_total_length += len;
-    hdr.block_total_length += OPTION_HDR_LEN + PADDED_LEN(4); /* Flags */
-    hdr.block_total_length += OPTION_HDR_LEN; /* End of options */
-    hdr.block_total_length += 4; /* Trailing length */
+        if(seq == pos)
+        {
+            if(__atomic_compare_exchange_n(&writer->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if((int64_t) (seq - pos) < 0)
+        {
+            /* The ring is full: the writer thread can't keep up */
+            __atomic_add_fetch(&writer->num_dropped, 1, __ATOMIC_RELAXED);
+            CHIROUTER_PROBE4(pcap__drop, ctx->name, iface->name, len, dir);
+            return EXIT_FAILURE;
+        }
+        else
+            pos = __atomic_load_n(&writer->head, __ATOMIC_RELAXED);
+    }
 
-    if (fwrite((char *)&hdr, sizeof(hdr), 1, ctx->server->pcap) != 1)
-        return EXIT_FAILURE;
+    slot->ts = ns;
+    slot->iface_id = iface->pcap_iface_id;
+    slot->len = len;
+    slot->caplen = min(len, writer->snaplen);
+    slot->dir = dir;
+    memcpy(slot->data, msg, slot->caplen);
 
-    uint32_t pad_length;
-    uint32_t pad = 0;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
 
-    pad_length = PAD_LEN(len);
+    CHIROUTER_PROBE4(pcap__write, ctx->name, iface->name, len, dir);
 
-    assert(pad_length >= 0 && pad_length <= 3);
+    return EXIT_SUCCESS;
+}
 
-    if (fwrite(msg, 1, len, ctx->server->pcap) != len)
-        return EXIT_FAILURE;
 
-    /* Write padding */
-    if(pad_length > 0)
+/* Maps the window of the capture file that the next byte goes into,
+ * unmapping the current one. The file is extended as needed. */
+static int chirouter_pcap_writer_map(chirouter_pcap_writer_t *writer)
+{
+    uint64_t off = writer->file_len & ~((uint64_t) PCAP_MMAP_WINDOW - 1);
+    void *window;
+
+    if(writer->window)
     {
-        if (fwrite((char *)&pad, 1, pad_length, ctx->server->pcap) != pad_length)
-            return EXIT_FAILURE;
+        /* Start writing the window back, but don't wait for it */
+        msync(writer->window, PCAP_MMAP_WINDOW, MS_ASYNC);
+        munmap(writer->window, PCAP_MMAP_WINDOW);
+        writer->window = NULL;
+    }
+
+    if(off + PCAP_MMAP_WINDOW > writer->file_alloc)
+    {
+        if(posix_fallocate(writer->fd, off, PCAP_MMAP_WINDOW) != 0)
+            return -1;
+        writer->file_alloc = off + PCAP_MMAP_WINDOW;
     }
 
-    /* Compute flags */
-    uint32_t flags;
+    window = mmap(NULL, PCAP_MMAP_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, writer->fd, off);
+    if(window == MAP_FAILED)
+        return -1;
 
-    switch(dir)
+    writer->window = window;
+    writer->window_off = off;
+
+    return 0;
+}
+
+
+/* Writes to the current capture file. Returns 0 on success,
+ * -1 if an error happens. */
+static int chirouter_pcap_writer_write(chirouter_pcap_writer_t *writer, const uint8_t *data, size_t len)
+{
+    if(!writer->use_mmap)
     {
-    case PCAP_UNSPECIFIED:
-        flags = 0;
-        break;
-    case PCAP_INBOUND:
-        flags = 1;
-        break;
-    case PCAP_OUTBOUND:
-        flags = 2;
-        break;
+        if(fwrite(data, len, 1, writer->f) != 1)
+            return -1;
+        writer->file_len += len;
+        return 0;
     }
 
-    if(chirouter_pcap_write_option(ctx->server, OPCODE_EPB_FLAGS, 4, (uint8_t*) &flags))
-        return EXIT_FAILURE;
+    while(len > 0)
+    {
+        if(writer->window == NULL || writer->file_len >= writer->window_off + PCAP_MMAP_WINDOW)
+            if(chirouter_pcap_writer_map(writer) != 0)
+                return -1;
+
+        size_t off = writer->file_len - writer->window_off;
+        size_t n = min(len, PCAP_MMAP_WINDOW - off);
+
+        memcpy(writer->window + off, data, n);
+        writer->file_len += n;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+/* Closes the current capture file. If it is mapped, the space
+ * that was allocated but not written is given back. */
+static void chirouter_pcap_writer_close(chirouter_pcap_writer_t *writer)
+{
+    if(!writer->use_mmap)
+    {
+        if(writer->f)
+            fclose(writer->f);
+        writer->f = NULL;
+        return;
+    }
+
+    if(writer->fd < 0)
+        return;
+
+    if(writer->window)
+    {
+        munmap(writer->window, PCAP_MMAP_WINDOW);
+        writer->window = NULL;
+    }
+
+    if(ftruncate(writer->fd, writer->file_len) != 0)
+        __atomic_add_fetch(&writer->num_errors, 1, __ATOMIC_RELAXED);
+    close(writer->fd);
+    writer->fd = -1;
+}
+
+
+/* Opens the next capture file (closing the current one, if any) and
+ * writes the headers to it, if they are known. Returns 0 on success,
+ * -1 if the file could not be opened or its headers written. */
+static int chirouter_pcap_writer_open(chirouter_pcap_writer_t *writer)
+{
+    char *path = writer->path;
+    char *numbered = NULL;
+
+    if(writer->is_open)
+    {
+        chirouter_pcap_writer_close(writer);
+        writer->is_open = false;
+        writer->file_num++;
+    }
+
+    if(writer->max_size > 0)
+    {
+        uint32_t n = writer->max_files > 0 ? writer->file_num % writer->max_files : writer->file_num;
+
+        size_t len = strlen(writer->path) + 12;
 
-    if(chirouter_pcap_write_option(ctx->server, OPCODE_END, 0, NULL))
+        numbered = malloc(len);
+        if(numbered == NULL)
+            return -1;
+        snprintf(numbered, len, "%s.%u", writer->path, n);
+        path = numbered;
+    }
+
+    if(writer->use_mmap)
+    {
+        writer->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        writer->file_alloc = 0;
+
+        /* If the files have a fixed size, allocate it right away */
+        if(writer->fd >= 0 && writer->max_size > 0 && posix_fallocate(writer->fd, 0, writer->max_size) == 0)
+            writer->file_alloc = writer->max_size;
+    }
+    else
+    {
+        /* Frames are written in batches, so the file is
+         * written straight from the batch buffer */
+        writer->f = fopen(path, "w");
+        if(writer->f)
+            setvbuf(writer->f, NULL, _IONBF, 0);
+    }
+    free(numbered);
+
+    if(writer->use_mmap ? writer->fd < 0 : writer->f == NULL)
+        return -1;
+
+    writer->is_open = true;
+    writer->file_len = 0;
+
+    /* A file without its headers can't be read */
+    if(writer->header && chirouter_pcap_writer_write(writer, writer->header, writer->header_len) != 0)
+    {
+        chirouter_pcap_writer_close(writer);
+        writer->is_open = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Returns true if the current file can't take extra bytes (plus the
+ * ones already written to it), and it must be rotated */
+static inline bool chirouter_pcap_writer_full(chirouter_pcap_writer_t *writer, size_t extra)
+{
+    /* A file always gets at least one batch after its headers, even
+     * if that makes it go over the limit */
+    return writer->max_size > 0 && writer->file_len > writer->header_len &&
+           writer->file_len + extra > writer->max_size;
+}
+
+
+/* Writes the batch buffer to the current file */
+static void chirouter_pcap_writer_flush(chirouter_pcap_writer_t *writer, size_t batch_len)
+{
+    if(!writer->is_open && chirouter_pcap_writer_open(writer) != 0)
+    {
+        __atomic_add_fetch(&writer->num_errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if(chirouter_pcap_writer_write(writer, writer->batch, batch_len) != 0)
+        __atomic_add_fetch(&writer->num_errors, 1, __ATOMIC_RELAXED);
+}
+
+
+/* Switches to the headers passed on by chirouter_pcap_writer_set_interfaces,
+ * and writes them to the current file (the first file is created before
+ * the interfaces are known, and the next headers start a new section) */
+static void chirouter_pcap_writer_set_header(chirouter_pcap_writer_t *writer, uint8_t *header)
+{
+    int rc;
+
+    free(writer->header);
+    writer->header = header;
+    writer->header_len = writer->new_header_len;
+
+    if(writer->is_open)
+        rc = chirouter_pcap_writer_write(writer, writer->header, writer->header_len);
+    else
+        rc = chirouter_pcap_writer_open(writer);
+
+    writer->new_header_rc = rc;
+    __atomic_store_n(&writer->new_header, NULL, __ATOMIC_RELEASE);
+}
+
+
+/* Writes the frames in the ring to the capture file, in batches of up
+ * to PCAP_BATCH_SIZE bytes. Returns the number of frames written. */
+static uint64_t chirouter_pcap_writer_drain(chirouter_pcap_writer_t *writer)
+{
+    chirouter_pcap_slot_t *slot;
+    uint64_t count = 0;
+    size_t batch_len = 0;
+
+    while(1)
+    {
+        uint8_t *new_header = __atomic_load_n(&writer->new_header, __ATOMIC_ACQUIRE);
+
+        /* The frames that were added before the new headers are
+         * written with the ones they were added with */
+        if(new_header && writer->tail == writer->new_header_pos)
+        {
+            if(batch_len > 0)
+            {
+                chirouter_pcap_writer_flush(writer, batch_len);
+                batch_len = 0;
+            }
+            chirouter_pcap_writer_set_header(writer, new_header);
+        }
+
+        slot = &writer->slots[writer->tail & (PCAP_RING_SIZE - 1)];
+
+        bool ready = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == writer->tail + 1;
+
+        /* Write the batch if there are no more frames, or if the
+         * next frame might not fit in it (or in the current file) */
+        if(batch_len > 0 && (!ready || PCAP_BATCH_SIZE - batch_len < PCAP_MAX_EPB_LEN ||
+                             chirouter_pcap_writer_full(writer, batch_len + PCAP_MAX_EPB_LEN)))
+        {
+            chirouter_pcap_writer_flush(writer, batch_len);
+            batch_len = 0;
+        }
+
+        if(!ready)
+            break;
+
+        if(batch_len == 0 && chirouter_pcap_writer_full(writer, PCAP_MAX_EPB_LEN)
+                && chirouter_pcap_writer_open(writer) != 0)
+            __atomic_add_fetch(&writer->num_errors, 1, __ATOMIC_RELAXED);
+
+        batch_len += chirouter_pcapng_put_epb(writer->batch + batch_len, slot->iface_id, slot->ts,
+                                              slot->data, slot->caplen, slot->len, slot->dir, NULL);
+
+        /* Free the slot for the position it will have on the next lap */
+        __atomic_store_n(&slot->seq, writer->tail + PCAP_RING_SIZE, __ATOMIC_RELEASE);
+        writer->tail++;
+        count++;
+    }
+
+    __atomic_add_fetch(&writer->num_written, count, __ATOMIC_RELAXED);
+
+    return count;
+}
+
+
+/* Writer thread function */
+static void *chirouter_pcap_writer_func(void *arg)
+{
+    chirouter_pcap_writer_t *writer = arg;
+    struct timespec ts;
+
+    while(1)
+    {
+        bool stop = __atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE);
+
+        if(chirouter_pcap_writer_drain(writer) > 0)
+            continue;
+        if(stop)
+            break;
+
+        /* Nothing to write. Producers don't wake us up, so
+         * check again in PCAP_WRITER_INTERVAL microseconds */
+        ts.tv_sec = 0;
+        ts.tv_nsec = PCAP_WRITER_INTERVAL * 1000;
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
+
+
+/* Frees a writer (once its thread is done) */
+static void chirouter_pcap_writer_free(chirouter_pcap_writer_t *writer)
+{
+    if(writer->is_open)
+        chirouter_pcap_writer_close(writer);
+    chirouter_filter_free(writer->filter);
+    free(writer->path);
+    free(writer->header);
+    free(writer->slots);
+    free(writer->batch);
+    free(writer);
+}
+
+
+/* See pcap.h */
+chirouter_pcap_writer_t *chirouter_pcap_writer_start(const char *path, uint64_t max_size, uint32_t max_files, uint32_t snaplen,
+                                                     chirouter_filter_t *filter, bool use_mmap)
+{
+    chirouter_pcap_writer_t *writer;
+    sigset_t all, old;
+    int rc;
+
+    writer = calloc(1, sizeof(chirouter_pcap_writer_t));
+    if(writer == NULL)
+    {
+        chirouter_filter_free(filter);
+        return NULL;
+    }
+
+    writer->filter = filter;
+    writer->use_mmap = use_mmap;
+    writer->fd = -1;
+
+    writer->path = strdup(path);
+    writer->slots = aligned_alloc(64, PCAP_RING_SIZE * sizeof(chirouter_pcap_slot_t));
+    writer->batch = malloc(PCAP_BATCH_SIZE);
+    if(writer->path == NULL || writer->slots == NULL || writer->batch == NULL)
+    {
+        chirouter_pcap_writer_free(writer);
+        return NULL;
+    }
+
+    for(uint64_t i = 0; i < PCAP_RING_SIZE; i++)
+        writer->slots[i].seq = i;
+
+    writer->max_size = max_size;
+    writer->max_files = max_files;
+    writer->snaplen = min(snaplen, ETHER_FRAME_MAX_LEN);
+
+    /* The first file is created right away, so that
+     * we fail early if it can't be created */
+    if(chirouter_pcap_writer_open(writer) != 0)
+    {
+        chirouter_pcap_writer_free(writer);
+        return NULL;
+    }
+
+    /* The writer thread must not handle any signals (they are
+     * handled by the signal thread, see main.c) */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    rc = pthread_create(&writer->thread, NULL, chirouter_pcap_writer_func, writer);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(rc != 0)
+    {
+        chirouter_pcap_writer_free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+
+/* See pcap.h */
+int chirouter_pcap_writer_set_interfaces(chirouter_pcap_writer_t *writer, server_ctx_t *ctx)
+{
+    char *header;
+    size_t header_len;
+    struct timespec ts;
+    FILE *f;
+    int rc;
+
+    f = open_memstream(&header, &header_len);
+    if(f == NULL)
         return EXIT_FAILURE;
 
-    if (fwrite((char *)&hdr.block_total_length, sizeof(hdr.block_total_length), 1, ctx->server->pcap) != 1)
+    rc = chirouter_pcapng_write_shb(f);
+    if(rc == 0)
+        rc = chirouter_pcap_write_interfaces(ctx, f, writer->snaplen);
+
+    if(fclose(f) != 0 || rc != 0)
+    {
+        free(header);
         return EXIT_FAILURE;
+    }
 
-    return EXIT_SUCCESS;
+    /* The writer thread writes the headers once it has written the
+     * frames that are already in the ring, and at the start of every
+     * file after that */
+    writer->new_header_len = header_len;
+    writer->new_header_pos = __atomic_load_n(&writer->head, __ATOMIC_RELAXED);
+    __atomic_store_n(&writer->new_header, (uint8_t *) header, __ATOMIC_RELEASE);
+
+    while(__atomic_load_n(&writer->new_header, __ATOMIC_ACQUIRE) != NULL)
+    {
+        ts.tv_sec = 0;
+        ts.tv_nsec = PCAP_WRITER_INTERVAL * 1000;
+        nanosleep(&ts, NULL);
+    }
+
+    return writer->new_header_rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* See pcap.h */
+int chirouter_pcap_writer_stop(chirouter_pcap_writer_t *writer)
+{
+    uint64_t dropped;
+
+    if(writer == NULL)
+        return 0;
+
+    __atomic_store_n(&writer->stop, true, __ATOMIC_RELEASE);
+    pthread_join(writer->thread, NULL);
+
+    dropped = __atomic_load_n(&writer->num_dropped, __ATOMIC_RELAXED);
+    if(dropped > 0)
+        chilog(ERROR, "%lu frames could not be written to the capture file (the writer thread could not keep up)", dropped);
+
+    chirouter_pcap_writer_free(writer);
+
+    return 0;
+}
+
+
+/* Maximum length of a block that can be read (larger blocks are
+ * assumed to be the result of a corrupted file) */
+#define PCAPNG_MAX_READ_BLOCK (16 * 1024 * 1024)
+
+
+/*
+ * chirouter_pcapng_read_block - Reads a block into the reader's buffer
+ *
+ * reader: Capture file reader
+ *
+ * block_type: Where the type of the block is stored
+ *
+ * Returns: Length of the block (including its header and trailing
+ *          length), 0 at the end of the file, -1 if the file is not valid.
+ *
+ */
+static long chirouter_pcapng_read_block(chirouter_pcapng_reader_t *reader, uint32_t *block_type)
+{
+    uint32_t hdr[2];
+    size_t n;
+
+    n = fread(hdr, 1, sizeof(hdr), reader->f);
+    if(n == 0 && feof(reader->f))
+        return 0;
+    if(n != sizeof(hdr) || hdr[1] < 12 || hdr[1] > PCAPNG_MAX_READ_BLOCK)
+        return -1;
+
+    /* Older versions of chirouter did not include the padding of
+     * the frame in the length of enhanced packet blocks */
+    hdr[1] = PADDED_LEN(hdr[1]);
+
+    if(hdr[1] > reader->block_size)
+    {
+        uint8_t *block = realloc(reader->block, hdr[1]);
+
+        if(block == NULL)
+            return -1;
+        reader->block = block;
+        reader->block_size = hdr[1];
+    }
+
+    memcpy(reader->block, hdr, sizeof(hdr));
+    if(fread(reader->block + sizeof(hdr), 1, hdr[1] - sizeof(hdr), reader->f) != hdr[1] - sizeof(hdr))
+        return -1;
+
+    *block_type = hdr[0];
+    return hdr[1];
+}
+
+
+/*
+ * chirouter_pcapng_find_option - Finds an option of a block
+ *
+ * options: Pointer to the first option
+ *
+ * end: Pointer to the end of the options
+ *
+ * option_code: Option code
+ *
+ * option_length: Where the length of the option is stored
+ *
+ * Returns: Pointer to the value of the option, or NULL if the
+ *          block does not have the option.
+ *
+ */
+static const uint8_t *chirouter_pcapng_find_option(const uint8_t *options, const uint8_t *end, uint16_t option_code,
+                                                   uint16_t *option_length)
+{
+    struct pcapng_option opt;
+
+    while(options + sizeof(opt) <= end)
+    {
+        memcpy(&opt, options, sizeof(opt));
+        if(opt.option_code == OPCODE_END || options + sizeof(opt) + opt.option_length > end)
+            break;
+
+        if(opt.option_code == option_code)
+        {
+            *option_length = opt.option_length;
+            return options + sizeof(opt);
+        }
+
+        options += sizeof(opt) + PADDED_LEN(opt.option_length);
+    }
+
+    return NULL;
+}
+
+
+/* See pcap.h */
+chirouter_pcapng_reader_t *chirouter_pcapng_open(const char *path)
+{
+    chirouter_pcapng_reader_t *reader;
+    uint32_t block_type, magic;
+    long len;
+
+    reader = calloc(1, sizeof(chirouter_pcapng_reader_t));
+    if(reader == NULL)
+        return NULL;
+
+    reader->f = fopen(path, "rb");
+    if(reader->f == NULL)
+    {
+        free(reader);
+        return NULL;
+    }
+
+    /* The file must start with a section header in our byte order */
+    len = chirouter_pcapng_read_block(reader, &block_type);
+    if(len < (long) sizeof(struct pcapng_shb) || block_type != BLOCK_TYPE_SHB)
+    {
+        chirouter_pcapng_close(reader);
+        return NULL;
+    }
+
+    memcpy(&magic, reader->block + offsetof(struct pcapng_shb, byte_order_magic), sizeof(magic));
+    if(magic != BYTEORDER_MAGIC)
+    {
+        chirouter_pcapng_close(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+
+/* See pcap.h */
+int chirouter_pcapng_read_frame(chirouter_pcapng_reader_t *reader, chirouter_pcapng_frame_t *frame)
+{
+    uint32_t block_type;
+    long len;
+
+    while((len = chirouter_pcapng_read_block(reader, &block_type)) > 0)
+    {
+        const uint8_t *end = reader->block + len - 4;
+
+        if(block_type == BLOCK_TYPE_SHB)
+        {
+            /* Interfaces are numbered again in each section */
+            reader->num_ifaces = 0;
+        }
+        else if(block_type == BLOCK_TYPE_IDB)
+        {
+            chirouter_pcapng_iface_t *iface, *ifaces;
+            const uint8_t *value;
+            uint16_t value_len;
+
+            if(len < (long) sizeof(struct pcapng_idb) + 4)
+                return -1;
+
+            ifaces = realloc(reader->ifaces, (reader->num_ifaces + 1) * sizeof(chirouter_pcapng_iface_t));
+            if(ifaces == NULL)
+                return -1;
+            reader->ifaces = ifaces;
+            iface = &reader->ifaces[reader->num_ifaces++];
+            memset(iface, 0, sizeof(chirouter_pcapng_iface_t));
+
+            const uint8_t *options = reader->block + sizeof(struct pcapng_idb);
+
+            value = chirouter_pcapng_find_option(options, end, OPCODE_IF_NAME, &value_len);
+            if(value)
+                memcpy(iface->name, value, min(value_len, sizeof(iface->name) - 1));
+
+            value = chirouter_pcapng_find_option(options, end, OPCODE_IF_MACADDR, &value_len);
+            if(value && value_len == ETHER_ADDR_LEN)
+            {
+                memcpy(iface->mac, value, ETHER_ADDR_LEN);
+                iface->has_mac = true;
+            }
+
+            /* Microseconds, unless the interface says otherwise */
+            iface->ts_per_sec = 1000000;
+            value = chirouter_pcapng_find_option(options, end, OPCODE_IF_TSRESOL, &value_len);
+            if(value && value_len == 1)
+            {
+                uint8_t tsresol = *value;
+
+                if((tsresol & 0x80) && (tsresol & 0x7F) < 64)
+                    iface->ts_per_sec = 1ull << (tsresol & 0x7F);
+                else if(!(tsresol & 0x80) && tsresol <= 19)
+                    for(iface->ts_per_sec = 1; tsresol > 0; tsresol--)
+                        iface->ts_per_sec *= 10;
+            }
+        }
+        else if(block_type == BLOCK_TYPE_EPB)
+        {
+            struct pcapng_epb hdr;
+            const uint8_t *value;
+            uint16_t value_len;
+            uint64_t ts, per_sec;
+
+            if(len < (long) sizeof(hdr) + 4)
+                return -1;
+            memcpy(&hdr, reader->block, sizeof(hdr));
+
+            if(hdr.interface_id >= reader->num_ifaces || hdr.captured_plen > (size_t) len ||
+               sizeof(hdr) + PADDED_LEN(hdr.captured_plen) > (size_t) (len - 4))
+                return -1;
+
+            ts = ((uint64_t) hdr.timestamp_high << 32) | hdr.timestamp_low;
+            per_sec = reader->ifaces[hdr.interface_id].ts_per_sec;
+
+            frame->iface_id = hdr.interface_id;
+            frame->ts = (ts / per_sec) * BILLION + (ts % per_sec) * BILLION / per_sec;
+            frame->data = reader->block + sizeof(hdr);
+            frame->caplen = hdr.captured_plen;
+            frame->len = hdr.original_plen;
+            frame->dir = PCAP_UNSPECIFIED;
+
+            value = chirouter_pcapng_find_option(frame->data + PADDED_LEN(hdr.captured_plen), end, OPCODE_EPB_FLAGS, &value_len);
+            if(value && value_len == 4)
+            {
+                uint32_t flags;
+
+                memcpy(&flags, value, sizeof(flags));
+                if((flags & 0x3) == 1)
+                    frame->dir = PCAP_INBOUND;
+                else if((flags & 0x3) == 2)
+                    frame->dir = PCAP_OUTBOUND;
+            }
+
+            return 1;
+        }
+    }
+
+    return len;
 }
 
 
+/* See pcap.h */
+void chirouter_pcapng_close(chirouter_pcapng_reader_t *reader)
+{
+    if(reader == NULL)
+        return;
+
+    if(reader->f)
+        fclose(reader->f);
+    free(reader->ifaces);
+    free(reader->block);
+    free(reader);
+}
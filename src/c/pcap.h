@@ -56,6 +56,7 @@
 
 #include "server.h"
 #include "chirouter.h"
+#include "filter.h"
 
 /* Packet direction */
 typedef enum
@@ -66,35 +67,151 @@ typedef enum
 } pcap_packet_direction_t;
 
 
-/*
- * chirouter_pcap_write_section_header - Writes a pcapng section header
- *
- * ctx: Server context
+/* Number of frames that can be waiting to be written to the
+ * capture file (must be a power of two). If the ring is full,
+ * frames are dropped from the capture. */
+#define PCAP_RING_SIZE (4096)
+
+/* Size of the buffer where the writer thread assembles the
+ * blocks that are written to the capture file at once */
+#define PCAP_BATCH_SIZE (256 * 1024)
+
+/* Maximum size of an enhanced packet block without a comment */
+#define PCAP_MAX_EPB_LEN (64 + ETHER_FRAME_MAX_LEN)
+
+/* Size of the windows in which capture files are mapped, if they
+ * are written through memory mappings (must be a power of two,
+ * and a multiple of the page size) */
+#define PCAP_MMAP_WINDOW (4 * 1024 * 1024)
+
+/* How often (in microseconds) the writer thread checks for
+ * frames when there were none to write */
+#define PCAP_WRITER_INTERVAL (1000)
+
+/* A frame waiting to be written to the capture file */
+typedef struct
+{
+    /* Position in the ring that the slot is free for, or that
+     * position plus one if it holds the frame for it */
+    uint64_t seq;
+
+    uint64_t ts;
+    uint32_t iface_id;
+    uint16_t len;
+    uint16_t caplen;
+    uint8_t dir;
+    uint8_t data[ETHER_FRAME_MAX_LEN];
+} __attribute__((aligned(64))) chirouter_pcap_slot_t;
+
+/* Asynchronous capture file writer. Frames are copied into a bounded
+ * multi-producer ring (any thread that sends or receives frames can
+ * add to it without taking a lock), and a single writer thread turns
+ * them into pcapng blocks, writing them in batches.
  *
- * Returns: 0 on success, -1 if an error happens.
+ * The capture can be split into files of at most max_size bytes,
+ * named PATH.0, PATH.1, etc. If max_files is not zero, the files are
+ * reused in a ring (PATH.0 is overwritten after PATH.<max_files-1>),
+ * so the capture never takes more than max_files * max_size bytes.
+ * Each file starts with its own section header and interface
+ * description blocks, so it can be opened on its own.
  *
- */
-int chirouter_pcap_write_section_header(server_ctx_t *ctx);
+ * Files are written either with stdio (one fwrite per batch) or, if
+ * use_mmap is set, by copying the batches into the file through a
+ * shared mapping of PCAP_MMAP_WINDOW bytes, which is moved along the
+ * file as it fills up. The file is allocated a window at a time (or,
+ * if its size is bounded, all at once when it is created) and is
+ * truncated to the bytes actually written when it is closed. */
+typedef struct chirouter_pcap_writer
+{
+    chirouter_pcap_slot_t *slots;
+
+    /* Next position to be claimed by a producer, and next
+     * position to be written by the writer thread */
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+
+    /* Capture file(s). max_size is zero if the capture is not split. */
+    char *path;
+    uint64_t max_size;
+    uint32_t max_files;
+
+    /* Maximum number of bytes of each frame that are written */
+    uint32_t snaplen;
+
+    /* If set, only frames that match this filter are written */
+    chirouter_filter_t *filter;
+
+    /* File being written, its number, and number of bytes written to it */
+    bool is_open;
+    uint32_t file_num;
+    uint64_t file_len;
+
+    /* stdio backend */
+    FILE *f;
+
+    /* mmap backend: file descriptor, bytes allocated to the file,
+     * and current window (and its offset in the file) */
+    bool use_mmap;
+    int fd;
+    uint64_t file_alloc;
+    uint8_t *window;
+    uint64_t window_off;
+
+    /* Section header and interface description blocks that each file
+     * starts with (only used by the writer thread) */
+    uint8_t *header;
+    size_t header_len;
+
+    /* New headers passed on to the writer thread by
+     * chirouter_pcap_writer_set_interfaces, the position in the ring
+     * from which they apply, and the result of writing them. The
+     * writer thread sets new_header back to NULL once it is done. */
+    uint8_t *new_header;
+    size_t new_header_len;
+    uint64_t new_header_pos;
+    int new_header_rc;
+
+    /* Buffer of PCAP_BATCH_SIZE bytes */
+    uint8_t *batch;
+
+    /* Frames written, dropped because the ring was full, and
+     * batches that could not be written */
+    uint64_t num_written;
+    uint64_t num_dropped;
+    uint64_t num_errors;
+
+    bool stop;
+    pthread_t thread;
+} chirouter_pcap_writer_t;
 
 
 /*
  * chirouter_pcap_write_interfaces
  *
  * Writes the interface description blocks for all the interfaces
- * from all the routers.
+ * from all the routers, and numbers the interfaces accordingly.
  *
  * ctx: Server context
  *
+ * f: File to write to
+ *
+ * snaplen: Maximum number of bytes of each frame that are captured
+ *
  * Returns: 0 on success, -1 if an error happens.
  *
  */
-int chirouter_pcap_write_interfaces(server_ctx_t *ctx);
+int chirouter_pcap_write_interfaces(server_ctx_t *ctx, FILE *f, uint32_t snaplen);
 
 
 /*
  * chirouter_pcap_write_frame - Writes an Ethernet frame to the capture file
  *
- * ctx: Server context
+ * The frame is only added to the ring of the server's capture file
+ * writer (or dropped, if the ring is full), and is written later by
+ * the writer thread. Frames that don't match the writer's capture
+ * filter are discarded before anything else is done with them.
+ *
+ * ctx: Router context
  *
  * iface: Interface the frame was sent on
  *
@@ -110,4 +227,220 @@ int chirouter_pcap_write_interfaces(server_ctx_t *ctx);
 int chirouter_pcap_write_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *msg, size_t len, pcap_packet_direction_t dir);
 
 
+/*
+ * chirouter_pcap_writer_start - Create the capture file, and start its writer thread
+ *
+ * path: Path of the capture file
+ *
+ * max_size: Maximum size (in bytes) of each file, or zero to write
+ *           a single file, with no size limit
+ *
+ * max_files: Number of files to rotate through, or zero to keep all
+ *            of them (ignored if max_size is zero)
+ *
+ * snaplen: Maximum number of bytes of each frame that are written
+ *
+ * filter: Capture filter, or NULL to capture all frames. The writer
+ *         takes ownership of the filter (even if an error happens).
+ *
+ * use_mmap: Write the files through memory mappings instead of stdio
+ *
+ * Returns: The writer, or NULL if an error happens.
+ *
+ */
+chirouter_pcap_writer_t *chirouter_pcap_writer_start(const char *path, uint64_t max_size, uint32_t max_files, uint32_t snaplen,
+                                                     chirouter_filter_t *filter, bool use_mmap);
+
+
+/*
+ * chirouter_pcap_writer_set_interfaces - Write the headers of the capture file
+ *
+ * Writes the section header and the interface description blocks of
+ * all the interfaces of all the routers, and numbers the interfaces
+ * accordingly. Must be called once all the routers have been
+ * configured, and before they start running.
+ *
+ * It can be called again when the routers change (e.g., when a
+ * controller connects with another configuration). The frames of the
+ * previous routers are written first, and then a new section is
+ * started in the current file, with the new interfaces (and the files
+ * after it start with them too). This function waits until the
+ * writer thread has written the new headers.
+ *
+ * writer: Capture file writer
+ *
+ * ctx: Server context
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_pcap_writer_set_interfaces(chirouter_pcap_writer_t *writer, server_ctx_t *ctx);
+
+
+/*
+ * chirouter_pcap_writer_stop - Write the remaining frames, stop the
+ *                              writer thread, and close the capture file
+ *
+ * No frames must be added to the writer once this function is called.
+ *
+ * writer: Capture file writer (can be NULL, in which case nothing is done)
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_pcap_writer_stop(chirouter_pcap_writer_t *writer);
+
+
+/* The functions below write pcapng blocks to an arbitrary file. The
+ * functions above use them to write to the server's capture file. */
+
+/*
+ * chirouter_pcapng_write_shb - Writes a pcapng section header
+ *
+ * f: File to write to
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_pcapng_write_shb(FILE *f);
+
+
+/*
+ * chirouter_pcapng_write_idb - Writes a pcapng interface description block
+ *
+ * Interfaces are numbered (starting at zero) in the order in which
+ * their blocks are written.
+ *
+ * f: File to write to
+ *
+ * name: Name of the interface
+ *
+ * mac: MAC address of the interface (NULL if not known)
+ *
+ * snaplen: Maximum number of bytes of each frame that are captured
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_pcapng_write_idb(FILE *f, const char *name, const uint8_t *mac, uint32_t snaplen);
+
+
+/*
+ * chirouter_pcapng_write_epb - Writes a pcapng enhanced packet block
+ *
+ * f: File to write to
+ *
+ * iface_id: Interface the frame was sent or received on
+ *
+ * ts: Timestamp, in nanoseconds since the epoch
+ *
+ * data: Pointer to the frame (or to its first caplen bytes)
+ *
+ * caplen: Number of bytes of the frame to write
+ *
+ * len: Length in bytes of the frame
+ *
+ * dir: Direction of the frame (inbound or outbound)
+ *
+ * comment: Comment for the frame (NULL if none)
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_pcapng_write_epb(FILE *f, uint32_t iface_id, uint64_t ts, const uint8_t *data, size_t caplen, size_t len,
+                               pcap_packet_direction_t dir, const char *comment);
+
+
+/* The functions below read pcapng files (such as the ones written
+ * above). Only files in the byte order of the host can be read. */
+
+/* An interface described in a capture file */
+typedef struct
+{
+    char name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+
+    /* MAC address (only if has_mac is set) */
+    uint8_t mac[ETHER_ADDR_LEN];
+    bool has_mac;
+
+    /* Timestamp units per second */
+    uint64_t ts_per_sec;
+} chirouter_pcapng_iface_t;
+
+/* A capture file being read */
+typedef struct
+{
+    FILE *f;
+
+    /* Interfaces described so far in the current section */
+    chirouter_pcapng_iface_t *ifaces;
+    uint32_t num_ifaces;
+
+    /* Buffer for the block being read */
+    uint8_t *block;
+    size_t block_size;
+} chirouter_pcapng_reader_t;
+
+/* A frame read from a capture file */
+typedef struct
+{
+    /* Interface the frame was captured on (an index in the
+     * reader's interfaces) */
+    uint32_t iface_id;
+
+    /* Timestamp, in nanoseconds since the epoch */
+    uint64_t ts;
+
+    /* The frame (or its first caplen bytes, if it was truncated). It
+     * points into the reader's buffer, so it is only valid until the
+     * next frame is read. */
+    const uint8_t *data;
+    uint32_t caplen;
+    uint32_t len;
+
+    /* Direction (PCAP_UNSPECIFIED if the capture doesn't say) */
+    pcap_packet_direction_t dir;
+} chirouter_pcapng_frame_t;
+
+
+/*
+ * chirouter_pcapng_open - Open a capture file for reading
+ *
+ * path: Path of the capture file
+ *
+ * Returns: The reader, or NULL if the file can't be opened or
+ *          doesn't start with a section header.
+ *
+ */
+chirouter_pcapng_reader_t *chirouter_pcapng_open(const char *path);
+
+
+/*
+ * chirouter_pcapng_read_frame - Read the next frame of a capture file
+ *
+ * Blocks other than enhanced packet blocks are skipped (interface
+ * description blocks are added to the reader's interfaces first).
+ *
+ * reader: Capture file reader
+ *
+ * frame: Where the frame is stored
+ *
+ * Returns: 1 if a frame was read, 0 at the end of the file,
+ *          -1 if the file is not valid (or if an error happens).
+ *
+ */
+int chirouter_pcapng_read_frame(chirouter_pcapng_reader_t *reader, chirouter_pcapng_frame_t *frame);
+
+
+/*
+ * chirouter_pcapng_close - Close a capture file that was being read
+ *
+ * reader: Capture file reader (can be NULL)
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_pcapng_close(chirouter_pcapng_reader_t *reader);
+
+
 #endif
@@ -0,0 +1,103 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Static tracepoints
+ *
+ *  chirouter defines a few USDT (user-level statically defined tracing)
+ *  probes along the lifecycle of a frame, which can be attached to with
+ *  perf, bpftrace, SystemTap, etc. without rebuilding chirouter or
+ *  enabling the (much slower) log messages. For example:
+ *
+ *    bpftrace -e 'usdt:./chirouter:chirouter:route__lookup
+ *                 { @[str(arg0), arg2 != 0] = count(); }'
+ *
+ *  When a probe isn't attached, it costs a single nop instruction (plus
+ *  whatever it takes to have its arguments at hand, which is why they
+ *  are all cheap to compute). The probes are only compiled in if sys/sdt.h is available (on Debian and
+ *  Ubuntu, it is in the systemtap-sdt-dev package) and CHIROUTER_USDT is
+ *  enabled in CMake; otherwise, they compile to nothing.
+ *
+ *  All the probes are in the "chirouter" provider. String arguments are
+ *  router and interface names.
+ *
+ *  - frame__receive(router, iface, frame, len): A frame was received,
+ *    before it is validated.
+ *  - route__lookup(router, dst_ip, out_iface, gw_ip): Result of a
+ *    routing table lookup for a frame being forwarded. out_iface is
+ *    NULL if there is no route (gw_ip is 0 if the destination is
+ *    directly connected). IP addresses are in network byte order.
+ *  - arp__miss(router, ip): The MAC address of the next hop is not in
+ *    the ARP cache.
+ *  - arp__enqueue(router, ip, new_request): A frame was withheld until
+ *    an ARP reply for ip arrives. new_request is 1 if this frame caused
+ *    an ARP request to be sent.
+ *  - arp__dequeue(router, ip, num_frames): An ARP reply arrived for a
+ *    pending ARP request, releasing num_frames withheld frames.
+ *  - arp__request(router, iface, ip): An ARP request was sent (either
+ *    a new request, or a retransmission).
+ *  - arp__timeout(router, ip, num_frames): No ARP reply arrived after
+ *    the last retransmission; the withheld frames are dropped.
+ *  - icmp__send(router, type, code, dst_ip): An ICMP message is sent.
+ *  - frame__send(router, iface, frame, len): A frame is sent.
+ *  - pcap__write(router, iface, len, direction): A frame was queued to
+ *    be written to the capture file (direction is a
+ *    pcap_packet_direction_t).
+ *  - pcap__drop(router, iface, len, direction): A frame could not be
+ *    queued, because the capture file writer could not keep up.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef PROBES_H_
+#define PROBES_H_
+
+#if defined(CHIROUTER_USDT) && CHIROUTER_USDT
+
+#include <sys/sdt.h>
+
+#define CHIROUTER_PROBE2(name, a, b) DTRACE_PROBE2(chirouter, name, a, b)
+#define CHIROUTER_PROBE3(name, a, b, c) DTRACE_PROBE3(chirouter, name, a, b, c)
+#define CHIROUTER_PROBE4(name, a, b, c, d) DTRACE_PROBE4(chirouter, name, a, b, c, d)
+
+#else
+
+/* The arguments are still "used", so variables only passed
+ * to probes don't trigger unused variable warnings */
+#define CHIROUTER_PROBE2(name, a, b) do { (void) (a); (void) (b); } while(0)
+#define CHIROUTER_PROBE3(name, a, b, c) do { (void) (a); (void) (b); (void) (c); } while(0)
+#define CHIROUTER_PROBE4(name, a, b, c, d) do { (void) (a); (void) (b); (void) (c); (void) (d); } while(0)
+
+#endif
+
+#endif /* PROBES_H_ */
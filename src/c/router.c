@@ -63,6 +63,8 @@
 #include "arp.h"
 #include "utils.h"
 #include "utlist.h"
+#include "probes.h"
+#include "fib.h"
 
 /* Helper function to get the correct forward IP destination.
  * If there routing entry for given destination IP has a non-zero gateway then
@@ -90,8 +92,10 @@ chirouter_rtable_entry_t* chirouter_get_matching_entry(chirouter_ctx_t *ctx,
 {
     iphdr_t *ip_hdr = (iphdr_t *)(frame->raw + sizeof(ethhdr_t));
     chirouter_rtable_entry_t *result = NULL;
+    /* Entries in a FIB snapshot are looked up with the snapshot (below) */
+    uint32_t num_scanned = ctx->fib ? ctx->fib_base : ctx->num_rtable_entries;
     
-    for (int i = 0; i < ctx->num_rtable_entries; i++)
+    for (uint32_t i = 0; i < num_scanned; i++)
     {
         /* Loop through each entry in router's routing table */
         uint32_t entry_mask = in_addr_to_uint32(ctx->routing_table[i].mask);
@@ -115,6 +119,19 @@ chirouter_rtable_entry_t* chirouter_get_matching_entry(chirouter_ctx_t *ctx,
         }
     }
 
+    if (ctx->fib)
+    {
+        uint32_t route = chirouter_fib_lookup(ctx->fib, ntohl(ip_hdr->dst));
+
+        if (route != FIB_NO_ROUTE)
+        {
+            chirouter_rtable_entry_t *entry = &ctx->routing_table[ctx->fib_base + route];
+
+            if (result == NULL || in_addr_to_uint32(result->mask) < in_addr_to_uint32(entry->mask))
+                result = entry;
+        }
+    }
+
     return result;
 }
 
@@ -152,6 +169,8 @@ void forward_ip_datagram(chirouter_ctx_t *ctx, ethernet_frame_t *frame, uint8_t
     ip_hdr->cksum = cksum(ip_hdr, sizeof(iphdr_t));
 
     // Forward newly constructed IP datagram
+    chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_FORWARDED);
+    chirouter_latency_mark(&ctx->latency, CHIROUTER_STAGE_BUILD);
     chirouter_send_frame(ctx, rentry->interface, msg, msg_len);
     return;
 }
@@ -178,6 +197,35 @@ bool chirouter_find_match_router(chirouter_ctx_t *ctx, ethernet_frame_t *frame)
     return false;
 }
 
+/* Helper function to get the statistics counter for an ICMP message
+ * @Params: ICMP type, ICMP code
+ * Return: the counter (see stats.h)
+ */
+static chirouter_stat_t chirouter_icmp_stat(uint8_t type, uint8_t code)
+{
+    if (type == ICMPTYPE_ECHO_REPLY)
+    {
+        return CHIROUTER_STAT_ICMP_ECHO_REPLY;
+    }
+    else if (type == ICMPTYPE_TIME_EXCEEDED)
+    {
+        return CHIROUTER_STAT_ICMP_TIME_EXCEEDED;
+    }
+    else if (code == ICMPCODE_DEST_NET_UNREACHABLE)
+    {
+        return CHIROUTER_STAT_ICMP_NET_UNREACHABLE;
+    }
+    else if (code == ICMPCODE_DEST_HOST_UNREACHABLE)
+    {
+        return CHIROUTER_STAT_ICMP_HOST_UNREACHABLE;
+    }
+    else if (code == ICMPCODE_DEST_PROTOCOL_UNREACHABLE)
+    {
+        return CHIROUTER_STAT_ICMP_PROTO_UNREACHABLE;
+    }
+    return CHIROUTER_STAT_ICMP_PORT_UNREACHABLE;
+}
+
 /* Helper function to create and send an ICMP message
  * @Params: pointer to router's context struct, ICMP type, ICMP code, pointer
  * to ethernet frame that triggers the icmp message
@@ -267,6 +315,9 @@ void chirouter_send_icmp(chirouter_ctx_t *ctx, uint8_t type,
     reply_icmp->chksum = cksum(reply_icmp, ICMP_HDR_SIZE + payload_len);
 
     // Send ICMP message
+    CHIROUTER_PROBE4(icmp__send, ctx->name, type, code, reply_ip_hdr->dst);
+    chirouter_stats_inc(&ctx->stats, chirouter_icmp_stat(type, code));
+    chirouter_latency_mark(&ctx->latency, CHIROUTER_STAGE_BUILD);
     chirouter_send_frame(ctx, frame->in_interface, reply, reply_len);
     return;
 }
@@ -283,13 +334,17 @@ void chirouter_send_icmp(chirouter_ctx_t *ctx, uint8_t type,
  * adding it to a list of withheld frames in the pending ARP request list)
  * you must make a deep copy of the frame.
  *
- * chirouter can manage multiple routers at once, but does so in a single
- * thread. i.e., it is guaranteed that this function is always called
+ * By default, chirouter manages multiple routers at once, but does so in a
+ * single thread. i.e., it is guaranteed that this function is always called
  * sequentially, and that there will not be concurrent calls to this
  * function. If two routers receive Ethernet frames "at the same time",
  * they will be ordered arbitrarily and processed sequentially, not
  * concurrently (and with each call receiving a different router context)
  *
+ * If RSS queues are enabled (see dispatch.h), this function can be called
+ * concurrently for the same router, but frames belonging to the same flow
+ * are always processed sequentially, in the order they were received.
+ *
  * ctx: Router context
  *
  * frame: Inbound Ethernet frame
@@ -327,6 +382,7 @@ int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *fra
             {
                 // ICMP DESTINATION PORT UNREACHABLE
                 chilog(DEBUG, "[TCP/UDP PROTOCOL TYPE]");
+                chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_DROP_UNSUPPORTED);
                 chirouter_send_icmp(ctx, ICMPTYPE_DEST_UNREACHABLE, 
                                     ICMPCODE_DEST_PORT_UNREACHABLE, frame);
             }
@@ -334,6 +390,7 @@ int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *fra
             {
                 // ICMP time exceeded
                 chilog(DEBUG, "[TIME EXCEEDED TTL = 1]");
+                chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_DROP_TTL_EXCEEDED);
                 chirouter_send_icmp(ctx, ICMPTYPE_TIME_EXCEEDED, 0, frame);
             }
             else if (ip_hdr->proto == IPPROTO_ICMP)
@@ -347,11 +404,16 @@ int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *fra
                     chilog(DEBUG, "[ICMP] SEND ECHO REPLIES");
                     chirouter_send_icmp(ctx, ICMPTYPE_ECHO_REPLY, 0, frame);
                 }
+                else
+                {
+                    chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_DROP_UNSUPPORTED);
+                }
             }
             else 
             {
                 // ICMP destination protocol unreachable
                 chilog(DEBUG, "[DEST UNREACHABLE]");
+                chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_DROP_UNSUPPORTED);
                 chirouter_send_icmp(ctx, ICMPTYPE_DEST_UNREACHABLE, 
                                     ICMPCODE_DEST_PROTOCOL_UNREACHABLE, frame);
             }
@@ -359,6 +421,7 @@ int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *fra
         else if (chirouter_find_match_router(ctx, frame))
         {
             chilog(DEBUG, "[SECOND CASE]: FRAME COMES TO OTHER INTERFACES OF THE ROUTER");
+            chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_DROP_HOST_UNREACHABLE);
             // ICMP HOST UNREACHABLE
             chirouter_send_icmp(ctx, ICMPTYPE_DEST_UNREACHABLE, 
                                         ICMPCODE_DEST_HOST_UNREACHABLE, frame);
@@ -367,65 +430,71 @@ int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *fra
         {
             chilog(DEBUG, "[THIRD CASE]: TRY TO FORWARD DATAGRAM");
             chirouter_rtable_entry_t* forward_entry = chirouter_get_matching_entry(ctx, frame);
+            chirouter_latency_mark(&ctx->latency, CHIROUTER_STAGE_ROUTE);
+            CHIROUTER_PROBE4(route__lookup, ctx->name, ip_hdr->dst,
+                             forward_entry ? forward_entry->interface->name : NULL,
+                             forward_entry ? in_addr_to_uint32(forward_entry->gw) : 0);
             if (forward_entry != NULL)
             {
                 chilog(DEBUG, "[IP FORWARDING]: ROUTING ENTRY FOUND");
                 uint32_t forward_ip = get_forward_ip(forward_entry, ip_hdr->dst);
-                pthread_mutex_lock(&(ctx->lock_arp));
-                chirouter_arpcache_entry_t* arpcache_entry = chirouter_arp_cache_lookup(ctx, uint32_to_in_addr(forward_ip));
-                pthread_mutex_unlock(&(ctx->lock_arp));
-                if (arpcache_entry == NULL)
+                uint8_t dst_mac[ETHER_ADDR_LEN];
+                bool arpcache_hit = chirouter_arp_cache_lookup_mac(ctx, forward_ip, dst_mac);
+                chirouter_stats_inc(&ctx->stats, arpcache_hit ? CHIROUTER_STAT_ARP_HITS : CHIROUTER_STAT_ARP_MISSES);
+                if (!arpcache_hit)
                 {
                     chilog(DEBUG, "[IP FORWARDING]: ARP CACHE ENTRY NOT FOUND");
+                    CHIROUTER_PROBE2(arp__miss, ctx->name, forward_ip);
+                    struct in_addr forward_addr = { .s_addr = forward_ip };
+                    int result = 0;
                     pthread_mutex_lock(&(ctx->lock_arp));
-                    chirouter_pending_arp_req_t* pending_req = chirouter_arp_pending_req_lookup(ctx, uint32_to_in_addr(forward_ip));
-                    pthread_mutex_unlock(&(ctx->lock_arp));
-                    if (pending_req == NULL)
+                    // The ARP reply could have been processed since we looked
+                    // up the cache. It is added to the cache (with lock_arp held)
+                    // only after the withheld frames have been forwarded.
+                    arpcache_hit = chirouter_arp_cache_lookup_mac(ctx, forward_ip, dst_mac);
+                    if (!arpcache_hit)
                     {
-                        
-                        chilog(DEBUG, "[IP FORWARDING]: NOT IN PENDING REQUEST LIST");
-                        pthread_mutex_lock(&(ctx->lock_arp));
-                        chilog(DEBUG, "[ARP MESSAGE]: SEND ARP REQUEST");
-                        chirouter_send_arp_message(ctx, 
-                                                    forward_entry->interface, 
-                                                    NULL, forward_ip, 
-                                                    ARP_OP_REQUEST);
-                        // add IP address to pending arp request list
-                        pending_req = chirouter_arp_pending_req_add(ctx, 
-                                                uint32_to_in_addr(forward_ip), 
-                                                forward_entry->interface);
-                        pending_req->times_sent++;
-                        pending_req->last_sent = time(NULL);
-                        // add frame to the newly created pending arp request item
-                        int result = chirouter_arp_pending_req_add_frame(ctx, 
-                                                        pending_req, frame);
-                        if (result == 1) {
-                            /* An error occurred when adding withheld frames */
-                            return -1;
+                        chirouter_pending_arp_req_t* pending_req = chirouter_arp_pending_req_lookup(ctx, &forward_addr);
+                        CHIROUTER_PROBE3(arp__enqueue, ctx->name, forward_ip, pending_req == NULL);
+                        if (pending_req == NULL)
+                        {
+                            chilog(DEBUG, "[IP FORWARDING]: NOT IN PENDING REQUEST LIST");
+                            chilog(DEBUG, "[ARP MESSAGE]: SEND ARP REQUEST");
+                            chirouter_send_arp_message(ctx,
+                                                        forward_entry->interface,
+                                                        NULL, forward_ip,
+                                                        ARP_OP_REQUEST);
+                            // add IP address to pending arp request list
+                            pending_req = chirouter_arp_pending_req_add(ctx,
+                                                    &forward_addr,
+                                                    forward_entry->interface);
+                            pending_req->times_sent++;
+                            pending_req->last_sent = chirouter_clock_now(ctx->clock);
                         }
-                        pthread_mutex_unlock(&(ctx->lock_arp));
-                    }
-                    else
-                    {
-                        chilog(DEBUG, "[IP FORWARDING]: ALREADY IN PENDING REQUEST LIST");
-                        pthread_mutex_lock(&(ctx->lock_arp));
-                        // add frame to the already created pending arp request item
-                        int result = chirouter_arp_pending_req_add_frame(ctx, 
-                                                        pending_req, frame);
-                        if (result == 1)
+                        else
                         {
-                            /* An error occurred when adding withheld frames */
-                            return -1;
+                            chilog(DEBUG, "[IP FORWARDING]: ALREADY IN PENDING REQUEST LIST");
                         }
-                        pthread_mutex_unlock(&(ctx->lock_arp));
+                        // add frame to the pending arp request item
+                        result = chirouter_arp_pending_req_add_frame(ctx,
+                                                        pending_req, frame);
+                        chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_WITHHELD);
+                    }
+                    pthread_mutex_unlock(&(ctx->lock_arp));
+                    if (result == 1)
+                    {
+                        /* An error occurred when adding withheld frames */
+                        return -1;
                     }
                 }
-                else
+                chirouter_latency_mark(&ctx->latency, CHIROUTER_STAGE_ARP);
+                if (arpcache_hit)
                 {
                     chilog(DEBUG, "[IP FORWARDING]: ARP CACHE ENTRY FOUND");
                     if (ip_hdr->ttl == 1)
                     {
                         // TIME_EXCEEDED
+                        chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_DROP_TTL_EXCEEDED);
                         chirouter_send_icmp(ctx, 
                                             ICMPTYPE_TIME_EXCEEDED, 
                                             0, frame);
@@ -433,13 +502,15 @@ int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *fra
                     else
                     {
                         // Forward IP datagram
-                        forward_ip_datagram(ctx, frame, arpcache_entry->mac);
+                        forward_ip_datagram(ctx, frame, dst_mac);
                     }
                 }
             }
             else 
             {
                 chilog(DEBUG, "[IP FORWARDING]: ROUTING ENTRY NOT FOUND");
+                chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_FIB_MISSES);
+                chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_DROP_NO_ROUTE);
                 // ICMP network unreachable
                 chirouter_send_icmp(ctx, ICMPTYPE_DEST_UNREACHABLE, 
                                     ICMPCODE_DEST_NET_UNREACHABLE, frame);
@@ -458,20 +529,11 @@ int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *fra
             if (ntohs(arp->op) == ARP_OP_REPLY)
             {
                 chilog(DEBUG, "[ARP MESSAGE]: ARP REPLY");
+                struct in_addr sender_addr = { .s_addr = arp->spa };
+                int result = 0;
                 pthread_mutex_lock(&(ctx->lock_arp));
-                // add ip and corresponding mac address to arp cache
-                int result = chirouter_arp_cache_add(ctx, 
-                                                uint32_to_in_addr(arp->spa),
-                                                arp->sha); 
-                pthread_mutex_unlock(&(ctx->lock_arp));
-                if (result != 0)
-                {
-                    /* An error occurred when adding to ARP cache */
-                    return -1;
-                }
                 // forward withheld frames - decrement TTL - checksum
-                pthread_mutex_lock(&(ctx->lock_arp));
-                chirouter_pending_arp_req_t *arp_req = chirouter_arp_pending_req_lookup(ctx, uint32_to_in_addr(arp->spa));
+                chirouter_pending_arp_req_t *arp_req = chirouter_arp_pending_req_lookup(ctx, &sender_addr);
                 if (arp_req == NULL)
                 {
                     chilog(DEBUG, "[ARP MESSAGE]: NO PENDING ARP FOUND");
@@ -480,15 +542,20 @@ int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *fra
                 {
                     chilog(DEBUG, "[ARP MESSAGE] PENDING ARP FOUND");
                     withheld_frame_t *elt;
+                    int num_frames;
+                    DL_COUNT(arp_req->withheld_frames, elt, num_frames);
+                    CHIROUTER_PROBE3(arp__dequeue, ctx->name, arp->spa, num_frames);
                     DL_FOREACH(arp_req->withheld_frames, elt)
                     {
                         // Forward IP datagram
                         if (elt != NULL)
                         {
                             iphdr_t *ip_hdr = (iphdr_t *)(elt->frame->raw + sizeof(ethhdr_t));
+                            chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_WITHHELD_RELEASED);
                             if (ip_hdr->ttl == 1) 
                             {
                                 // Time exceeded
+                                chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_DROP_TTL_EXCEEDED);
                                 chirouter_send_icmp(ctx, 
                                                     ICMPTYPE_TIME_EXCEEDED,
                                                     0, elt->frame);
@@ -501,18 +568,23 @@ int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *fra
                             
                         }
                     }
-                    // Free withheld frames
-                    int result = chirouter_arp_pending_req_free_frames(arp_req);
-                    if (result == 1) {
-                        /* An error occurred */
-                        return result;
-                    }
                     // remove the pending ARP request from the pending ARP request list
-                    DL_DELETE(ctx->pending_arp_reqs, arp_req);
-                    free(arp_req);
+                    // (and free the withheld frames)
+                    result = chirouter_arp_pending_req_remove(ctx, arp_req);
+                }
+                // add ip and corresponding mac address to arp cache. This is done
+                // after forwarding the withheld frames so that, if frames are being
+                // processed concurrently, new frames cannot overtake withheld ones.
+                if (result == 0)
+                {
+                    result = chirouter_arp_cache_add(ctx, &sender_addr, arp->sha);
                 }
                 pthread_mutex_unlock(&(ctx->lock_arp));
-                
+                if (result != 0)
+                {
+                    /* An error occurred when adding to ARP cache */
+                    return -1;
+                }
             } 
             else if (ntohs(arp->op) == ARP_OP_REQUEST)
             {
@@ -525,15 +597,21 @@ int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *fra
             else
             {
                 chilog(DEBUG, "[ARP MESSAGE]: ARP CODE NOT VALID");
+                chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_DROP_UNSUPPORTED);
             }
         }
         else
         {
             chilog(DEBUG, "[ARP MESSAGE]: IT'S NOT FOR ME");
+            chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_DROP_UNSUPPORTED);
             return 0;
         }
         return 0;
     }
+
+    // Other Ethernet types are not supported
+    chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_DROP_UNSUPPORTED);
+    return 0;
 }
 
 
@@ -59,6 +59,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <endian.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -70,13 +71,20 @@
 #include "utils.h"
 #include "pcap.h"
 #include "arp.h"
+#include "dispatch.h"
+#include "admin.h"
+#include "metrics.h"
+#include "flightrec.h"
+#include "fib.h"
+#include "probes.h"
 
 
 /* Forward declarations */
 int chirouter_server_process_messages(server_ctx_t *ctx);
 int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *msg);
-int chirouter_server_process_ethernet_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *msg, size_t len);
-int chirouter_server_ctx_free_routers(server_ctx_t *ctx);
+int chirouter_server_start_routers(server_ctx_t *ctx);
+int chirouter_server_stop_routers(server_ctx_t *ctx);
+void chirouter_server_close_client(server_ctx_t *ctx);
 
 
 /*
@@ -94,6 +102,12 @@ int chirouter_server_ctx_init(server_ctx_t **ctx)
     if(*ctx == NULL)
         return -1;
 
+    pthread_mutex_init(&(*ctx)->lock_send, NULL);
+    pthread_mutex_init(&(*ctx)->lock_routers, NULL);
+
+    (*ctx)->server_socket = -1;
+    (*ctx)->client_socket = -1;
+
     return 0;
 }
 
@@ -120,7 +134,7 @@ int chirouter_server_setup(server_ctx_t *ctx, char *port)
 
     if (getaddrinfo(NULL, port, &hints, &res) != 0)
     {
-        chilog(CRITICAL, NULL, "getaddrinfo() failed");
+        chilog(CRITICAL, "getaddrinfo() failed");
         return -1;
     }
 
@@ -128,27 +142,27 @@ int chirouter_server_setup(server_ctx_t *ctx, char *port)
     {
         if ((ctx->server_socket = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
         {
-            chilog(WARNING, NULL, "Could not open socket");
+            chilog(WARNING, "Could not open socket");
             continue;
         }
 
         if (setsockopt(ctx->server_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
         {
-            chilog(WARNING, NULL, "Socket setsockopt() failed");
+            chilog(WARNING, "Socket setsockopt() failed");
             close(ctx->server_socket);
             continue;
         }
 
         if (bind(ctx->server_socket, p->ai_addr, p->ai_addrlen) == -1)
         {
-            chilog(WARNING, NULL, "Socket bind() failed");
+            chilog(WARNING, "Socket bind() failed");
             close(ctx->server_socket);
             continue;
         }
 
         if (listen(ctx->server_socket, 5) == -1)
         {
-            chilog(WARNING, NULL, "Socket listen() failed");
+            chilog(WARNING, "Socket listen() failed");
             close(ctx->server_socket);
             continue;
         }
@@ -160,7 +174,7 @@ int chirouter_server_setup(server_ctx_t *ctx, char *port)
 
     if (p == NULL)
     {
-        chilog(CRITICAL, NULL, "Could not find a socket to bind to.");
+        chilog(CRITICAL, "Could not find a socket to bind to.");
         return -1;
     }
 
@@ -184,14 +198,17 @@ int chirouter_server_send_msg(server_ctx_t *ctx, chirouter_msg_t *msg)
     int totallen = 4 + ntohs(msg->payload_length);
     char *buf = (char *) msg;
 
+    pthread_mutex_lock(&ctx->lock_send);
     while (sent < totallen) {
         int cur = send(ctx->client_socket, buf+sent, totallen-sent, 0);
         sent = sent + cur;
         if (cur == -1) {
+            pthread_mutex_unlock(&ctx->lock_send);
             chilog(CRITICAL, "Could not send message to controller");
             return -1;
         }
     }
+    pthread_mutex_unlock(&ctx->lock_send);
 
     return 0;
 }
@@ -217,11 +234,15 @@ int chirouter_server_run(server_ctx_t *ctx)
     socklen_t sa_size = sizeof(struct sockaddr_storage);
 
     client_addr = calloc(1, sa_size);
-    while (1)
+    while (!__atomic_load_n(&ctx->stopping, __ATOMIC_ACQUIRE))
     {
         chilog(INFO, "Waiting for connection from controller...");
         if ((client_socket = accept(ctx->server_socket, (struct sockaddr *) client_addr, &sa_size)) == -1)
         {
+            /* accept() fails once the server socket is shut down */
+            if(__atomic_load_n(&ctx->stopping, __ATOMIC_ACQUIRE))
+                break;
+
             free(client_addr);
             chilog(CRITICAL, "Could not accept() connection");
             return -1;
@@ -237,7 +258,17 @@ int chirouter_server_run(server_ctx_t *ctx)
 
 
         ctx->state = HELLO_WAIT;
+
+        /* chirouter_server_shutdown only shuts down the client socket
+         * once it's set, so the flag is checked again after setting it */
+        pthread_mutex_lock(&ctx->lock_send);
         ctx->client_socket = client_socket;
+        pthread_mutex_unlock(&ctx->lock_send);
+        if(__atomic_load_n(&ctx->stopping, __ATOMIC_ACQUIRE))
+        {
+            chirouter_server_close_client(ctx);
+            break;
+        }
 
         rc = chirouter_server_process_messages(ctx);
 
@@ -250,8 +281,12 @@ int chirouter_server_run(server_ctx_t *ctx)
         {
             chilog(INFO, "Controller has disconnected.");
 
-            ctx->state = HELLO_WAIT;
-            rc = chirouter_server_ctx_free_routers(ctx);
+            /* Fully configured routers are kept (stopped), in case the
+             * controller reconnects with the same configuration */
+            if(ctx->state == RUNNING)
+                rc = chirouter_server_stop_routers(ctx);
+            else
+                rc = chirouter_server_ctx_free_routers(ctx);
             if(rc == -1)
             {
                 chilog(CRITICAL, "Error while freeing router resources");
@@ -264,6 +299,50 @@ int chirouter_server_run(server_ctx_t *ctx)
 }
 
 
+/*
+ * chirouter_server_shutdown - Makes chirouter_server_run return
+ *
+ * Can be called from any thread. The connection with the controller
+ * (if any) is closed as if the controller had disconnected (so the
+ * routers are stopped, and kept if they were running), and then
+ * chirouter_server_run returns 0.
+ *
+ * ctx: Server context
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_server_shutdown(server_ctx_t *ctx)
+{
+    __atomic_store_n(&ctx->stopping, true, __ATOMIC_RELEASE);
+
+    if(ctx->server_socket != -1)
+        shutdown(ctx->server_socket, SHUT_RDWR);
+
+    pthread_mutex_lock(&ctx->lock_send);
+    if(ctx->client_socket != -1)
+        shutdown(ctx->client_socket, SHUT_RDWR);
+    pthread_mutex_unlock(&ctx->lock_send);
+}
+
+
+/*
+ * chirouter_server_close_client - Closes the connection with the controller
+ *
+ * ctx: Server context
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_server_close_client(server_ctx_t *ctx)
+{
+    pthread_mutex_lock(&ctx->lock_send);
+    close(ctx->client_socket);
+    ctx->client_socket = -1;
+    pthread_mutex_unlock(&ctx->lock_send);
+}
+
+
 /*
  * chirouter_server_process_messages - Processes messages received by the server
  *
@@ -276,34 +355,38 @@ int chirouter_server_run(server_ctx_t *ctx)
  */
 int chirouter_server_process_messages(server_ctx_t *ctx)
 {
-    char recv_buffer[4096], msg_buffer[4096];
+    char recv_buffer[4096], msg_buffer[MSG_MAX_LEN];
     chirouter_msg_t *msg;
     int nbytes, rc;
     bool reading_header = true;
-    size_t len;
+    size_t len = 0;
     int i, bufpos = 0;
+    uint64_t recv_ts = 0;
 
     while(1)
     {
         nbytes = recv(ctx->client_socket, recv_buffer, sizeof(recv_buffer), 0);
+        if (chirouter_latency_sample_rate)
+            recv_ts = chirouter_latency_now();
         if (nbytes == 0)
         {
             chilog(DEBUG, "Controller closed connection");
-            close(ctx->client_socket);
+            chirouter_server_close_client(ctx);
             return 0;
         }
         else if (nbytes == -1)
         {
             chilog(CRITICAL, "recv() from controller failed");
-            close(ctx->client_socket);
+            chirouter_server_close_client(ctx);
             return -1;
         }
 
         chilog(TRACE, "recv() from controller (%i bytes)", nbytes);
         chilog_hex(TRACE, recv_buffer, nbytes);
 
+        /* A message can be split across several recv() calls, so len
+         * (the payload length of the message being read) is kept */
         i = 0;
-        len = 0;
         while(i < nbytes)
         {
             msg_buffer[bufpos++] = recv_buffer[i++];
@@ -319,11 +402,14 @@ int chirouter_server_process_messages(server_ctx_t *ctx)
             if(!reading_header && bufpos == (4+len))
             {
                 /* We have a complete message */
+                if(recv_ts && msg->type == MSG_TYPE_ETHERNET_FRAME)
+                    chirouter_latency_begin(recv_ts);
+
                 rc = chirouter_server_process_single_message(ctx, msg);
-                if(rc)
+                if(rc || __atomic_load_n(&ctx->fatal_error, __ATOMIC_ACQUIRE))
                 {
                     chilog(CRITICAL, "Error while processing message.");
-                    close(ctx->client_socket);
+                    chirouter_server_close_client(ctx);
                     return -1;
                 }
                 reading_header = true;
@@ -336,6 +422,53 @@ int chirouter_server_process_messages(server_ctx_t *ctx)
 }
 
 
+/*
+ * chirouter_server_add_rtable_entry - Adds an entry to the routing table of a router
+ *
+ * ctx: Server context
+ *
+ * entry: Routing table entry (as received in a ROUTING TABLE ENTRY or ROUTES message)
+ *
+ * Returns: 0 on success, -1 if the entry is not valid.
+ *
+ */
+static int chirouter_server_add_rtable_entry(server_ctx_t *ctx, struct chirouter_msg_rtable_entry *entry)
+{
+    if(entry->r_id >= ctx->num_routers)
+    {
+        chilog(CRITICAL, "Received invalid Router ID: %d", entry->r_id);
+        return -1;
+    }
+
+    chirouter_ctx_t *r = &ctx->routers[entry->r_id];
+
+    if(entry->iface_id >= r->num_interfaces)
+    {
+        chilog(CRITICAL, "Received invalid Interface ID: %d", entry->iface_id);
+        return -1;
+    }
+
+    if(r->num_rtable_entries >= r->max_rtable_entries)
+    {
+        chilog(CRITICAL, "Received ROUTING TABLE ENTRY but already have %u expected entries", r->max_rtable_entries);
+        return -1;
+    }
+
+    chilog(TRACE, "Processing Routing Table Entry in Router ID %d (with Interface ID %d)", entry->r_id, entry->iface_id);
+
+    chirouter_rtable_entry_t *rtentry = &r->routing_table[r->num_rtable_entries];
+
+    rtentry->dest.s_addr = entry->dest;
+    rtentry->mask.s_addr = entry->mask;
+    rtentry->gw.s_addr = entry->gw;
+    rtentry->metric = ntohs(entry->metric);
+    rtentry->interface = &r->interfaces[entry->iface_id];
+
+    r->num_rtable_entries++;
+    return 0;
+}
+
+
 /*
  * chirouter_server_process_single_message - Process a single message
  *
@@ -350,20 +483,48 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
     chirouter_msg_t reply_msg;
     uint16_t payload_len = ntohs(msg->payload_length);
 
+    /* The routers are identified by the hash of the messages
+     * they were configured with (see HELLO in server.h) */
+    if(ctx->state == CONFIG)
+        ctx->config_hash = hash64(ctx->config_hash, msg, 4 + payload_len);
+
     switch(msg->type)
     {
     case MSG_TYPE_HELLO:
     {
+        bool reuse;
+
         if(ctx->state != HELLO_WAIT)
         {
             chilog(CRITICAL, "Received a HELLO message but not in the HELLO_WAIT state");
             return -1;
         }
 
+        if(payload_len != 0 && payload_len != sizeof(msg->hello))
+        {
+            chilog(CRITICAL, "Received a HELLO message with an invalid length (%u)", payload_len);
+            return -1;
+        }
+
+        reuse = ctx->routers_kept && payload_len == sizeof(msg->hello) &&
+                be64toh(msg->hello.config_hash) == ctx->config_hash;
+
+        if(ctx->routers_kept && !reuse)
+        {
+            chilog(INFO, "Controller sent a different configuration. Discarding routers.");
+            if(chirouter_server_ctx_free_routers(ctx) != 0)
+                return -1;
+        }
+
         /* Send back HELLO message */
         reply_msg.type = MSG_TYPE_HELLO;
         reply_msg.subtype = FROM_ROUTER;
         reply_msg.payload_length = 0;
+        if(reuse)
+        {
+            reply_msg.payload_length = htons(sizeof(reply_msg.hello));
+            reply_msg.hello.config_hash = htobe64(ctx->config_hash);
+        }
 
         rc = chirouter_server_send_msg(ctx, &reply_msg);
         if(rc)
@@ -372,6 +533,15 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
             return -1;
         }
 
+        if(reuse)
+        {
+            chilog(INFO, "Controller sent the same configuration. Resuming %i routers.", ctx->num_routers);
+            if(chirouter_server_start_routers(ctx) != 0)
+                return -1;
+            break;
+        }
+
+        ctx->config_hash = HASH64_INIT;
         ctx->state = CONFIG;
         break;
     }
@@ -417,17 +587,34 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
 
         r->r_id = msg->router.r_id;
 
-        int name_len = payload_len - 3;
-        memcpy(r->name, msg->router.name, name_len);
+        /* The Extended subtype only differs in the size of the routing table length */
+        bool extended = msg->subtype == EXTENDED;
+        int name_len = payload_len - (extended ? 6 : 3);
+        if(name_len < 1 || name_len > (int) MAX_ROUTER_NAMELEN)
+        {
+            chilog(CRITICAL, "Received ROUTER message with an invalid name length (%d)", name_len);
+            return -1;
+        }
+        memcpy(r->name, extended ? msg->router_ext.name : msg->router.name, name_len);
         r->name[name_len] = '\0';
 
         r->max_interfaces = msg->router.num_interfaces;
         r->num_interfaces = 0;
         r->interfaces = calloc(r->max_interfaces, sizeof(chirouter_interface_t));
 
-        r->max_rtable_entries = msg->router.len_rtable;
+        r->max_rtable_entries = extended ? ntohl(msg->router_ext.len_rtable) : msg->router.len_rtable;
+        if(r->max_rtable_entries > MAX_NUM_RTABLE_ENTRIES)
+        {
+            chilog(CRITICAL, "Router %s: Routing table is too large (%u entries)", r->name, r->max_rtable_entries);
+            return -1;
+        }
         r->num_rtable_entries = 0;
         r->routing_table = calloc(r->max_rtable_entries, sizeof(chirouter_rtable_entry_t));
+        if(r->max_rtable_entries > 0 && r->routing_table == NULL)
+        {
+            chilog(CRITICAL, "Router %s: Not enough memory for %u routing table entries", r->name, r->max_rtable_entries);
+            return -1;
+        }
 
         ctx->num_routers++;
 
@@ -467,6 +654,12 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
         memcpy(iface->mac, msg->interface.hwaddr, ETHER_ADDR_LEN);
         memcpy(&iface->ip, &msg->interface.ipaddr, sizeof(struct in_addr));
 
+        if(chirouter_stats_init(&iface->stats) != 0)
+        {
+            chilog(CRITICAL, "Could not allocate statistics counters");
+            return -1;
+        }
+
         r->num_interfaces++;
 
         break;
@@ -479,38 +672,31 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
             return -1;
         }
 
-        if(msg->rtable_entry.r_id >= ctx->num_routers)
-        {
-            chilog(CRITICAL, "Received invalid Router ID: %d", msg->rtable_entry.r_id);
+        if(chirouter_server_add_rtable_entry(ctx, &msg->rtable_entry) != 0)
             return -1;
-        }
-
-        chirouter_ctx_t *r = &ctx->routers[msg->rtable_entry.r_id];
-
-        if(msg->rtable_entry.iface_id >= r->num_interfaces)
+        break;
+    }
+    case MSG_TYPE_ROUTES:
+    {
+        if(ctx->state != CONFIG)
         {
-            chilog(CRITICAL, "Received invalid Interface ID: %d", msg->rtable_entry.iface_id);
+            chilog(CRITICAL, "Received a ROUTES message but not in the CONFIG state");
             return -1;
         }
 
-        if(r->num_rtable_entries >= r->max_rtable_entries)
+        uint16_t num_entries = ntohs(msg->routes.num_entries);
+
+        if(payload_len < 2 || payload_len != 2 + num_entries * sizeof(struct chirouter_msg_rtable_entry))
         {
-            chilog(CRITICAL, "Received ROUTING TABLE ENTRY but already have %d expected entries", r->max_rtable_entries);
+            chilog(CRITICAL, "Received ROUTES message with %u entries but a payload of %u bytes", num_entries, payload_len);
             return -1;
         }
 
-        chilog(TRACE, "Processing Routing Table Entry in Router ID %d (with Interface ID %d)", msg->rtable_entry.r_id, msg->rtable_entry.iface_id);
-
-        chirouter_interface_t *iface = &r->interfaces[msg->rtable_entry.iface_id];
-        chirouter_rtable_entry_t *rtentry = &r->routing_table[r->num_rtable_entries];
+        chilog(TRACE, "Processing %u Routing Table Entries", num_entries);
 
-        rtentry->dest.s_addr = msg->rtable_entry.dest;
-        rtentry->mask.s_addr = msg->rtable_entry.mask;
-        rtentry->gw.s_addr = msg->rtable_entry.gw;
-        rtentry->metric = ntohs(msg->rtable_entry.metric);
-        rtentry->interface = iface;
-
-        r->num_rtable_entries++;
+        for(int i = 0; i < num_entries; i++)
+            if(chirouter_server_add_rtable_entry(ctx, &msg->routes.entries[i]) != 0)
+                return -1;
         break;
     }
     case MSG_TYPE_END_CONFIG:
@@ -523,6 +709,36 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
 
         chilog(INFO, "Received %i routers", ctx->num_routers);
 
+        /* FIB snapshots are loaded last, since they only
+         * cover the routes that are added with them */
+        for(int fibs=0; fibs < 2; fibs++)
+            for(int i=0; i < ctx->num_rtable_files; i++)
+            {
+                chirouter_rtable_file_t *rf = &ctx->rtable_files[i];
+                chirouter_fib_t *fib;
+                int j;
+
+                if(rf->is_fib != fibs)
+                    continue;
+
+                for(j=0; j < ctx->num_routers && strcmp(ctx->routers[j].name, rf->router); j++);
+
+                if(j == ctx->num_routers)
+                    chilog(WARNING, "No router %s to load routing table %s into", rf->router, rf->filename);
+                else if(!rf->is_fib && chirouter_ctx_load_rtable(&ctx->routers[j], rf->filename) != 0)
+                {
+                    chilog(CRITICAL, "Router %s: Could not load routing table %s", rf->router, rf->filename);
+                    return -1;
+                }
+                else if(rf->is_fib && ((fib = chirouter_fib_open(rf->filename)) == NULL ||
+                                       chirouter_fib_attach(&ctx->routers[j], fib) != 0))
+                {
+                    chirouter_fib_free(fib);
+                    chilog(CRITICAL, "Router %s: Could not load FIB %s", rf->router, rf->filename);
+                    return -1;
+                }
+            }
+
         chilog(INFO, "--------------------------------------------------------------------------------");
         for(int i=0; i < ctx->num_routers; i++)
         {
@@ -535,17 +751,20 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
             }
 
             chirouter_ctx_log(&ctx->routers[i], INFO);
-            pthread_create(&r->arp_thread, NULL, chirouter_arp_process, r);
             chilog(INFO, "--------------------------------------------------------------------------------");
         }
 
-        if(ctx->pcap)
+        /* The routers are not kept if this fails, since their frames
+         * would be captured on the interfaces of the previous routers */
+        if(ctx->pcap_writer && chirouter_pcap_writer_set_interfaces(ctx->pcap_writer, ctx) != 0)
         {
-            chirouter_pcap_write_section_header(ctx);
-            chirouter_pcap_write_interfaces(ctx);
+            chilog(CRITICAL, "Could not write the headers of the capture file");
+            chirouter_server_ctx_free_routers(ctx);
+            return -1;
         }
 
-        ctx->state = RUNNING;
+        if(chirouter_server_start_routers(ctx) != 0)
+            return -1;
         break;
     }
     case MSG_TYPE_ETHERNET_FRAME:
@@ -572,6 +791,8 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
 
         chirouter_interface_t *iface = &r->interfaces[msg->ethernet.iface_id];
 
+        chirouter_latency_mark(&r->latency, CHIROUTER_STAGE_FRAMING);
+
         rc = chirouter_server_process_ethernet_frame(r, iface, msg->ethernet.frame, ntohs(msg->ethernet.frame_len));
         if(rc == -1)
         {
@@ -587,6 +808,17 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
 }
 
 
+/* Counts an inbound frame dropped before reaching the router */
+static inline void chirouter_server_count_drop(chirouter_ctx_t *ctx, chirouter_interface_t *iface, chirouter_stat_t reason, uint64_t fr_event)
+{
+    chirouter_stats_inc(&ctx->stats, reason);
+    chirouter_stats_inc(&iface->stats, reason);
+
+    if(ctx->server->flightrec)
+        chirouter_flightrec_decide(ctx->server->flightrec, fr_event, reason);
+}
+
+
 /*
  * chirouter_server_process_ethernet_frame - Process an Ethernet frame received in an ETHERNET FRAME message
  *
@@ -607,10 +839,24 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
 int chirouter_server_process_ethernet_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *msg, size_t len)
 {
     int rc;
+    uint64_t fr_event = 0;
+
+    chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_RX_PACKETS);
+    chirouter_stats_add(&ctx->stats, CHIROUTER_STAT_RX_BYTES, len);
+    chirouter_stats_inc(&iface->stats, CHIROUTER_STAT_RX_PACKETS);
+    chirouter_stats_add(&iface->stats, CHIROUTER_STAT_RX_BYTES, len);
+
+    CHIROUTER_PROBE4(frame__receive, ctx->name, iface->name, msg, len);
+
+    /* No decision has been made for this frame yet */
+    chirouter_stats_last = 0;
+    if(ctx->server->flightrec)
+        fr_event = chirouter_flightrec_record(ctx->server->flightrec, ctx, iface, msg, len, PCAP_INBOUND);
 
     if(len < ETHER_HDR_LEN)
     {
         chilog(ERROR, "Received an Ethernet frame on interface %s that is %i bytes long (shorter than an Ethernet header)", iface->name, len);
+        chirouter_server_count_drop(ctx, iface, CHIROUTER_STAT_DROP_INVALID, fr_event);
         return 1;
     }
 
@@ -633,6 +879,7 @@ int chirouter_server_process_ethernet_frame(chirouter_ctx_t *ctx, chirouter_inte
     {
         chilog(TRACE, "Received a multicast Ethernet frame. Ignoring.");
         chilog_ethernet(TRACE, msg, len, LOG_INBOUND);
+        chirouter_server_count_drop(ctx, iface, CHIROUTER_STAT_DROP_MULTICAST, fr_event);
         return 1;
     }
 
@@ -649,6 +896,7 @@ int chirouter_server_process_ethernet_frame(chirouter_ctx_t *ctx, chirouter_inte
                                                                                                 iface->mac[3], iface->mac[4], iface->mac[5]);
             chilog(WARNING, "Ethernet destination address: %02X:%02X:%02X:%02X:%02X:%02X", hdr->dst[0], hdr->dst[1], hdr->dst[2],
                                                                                            hdr->dst[3], hdr->dst[4], hdr->dst[5]);
+            chirouter_server_count_drop(ctx, iface, CHIROUTER_STAT_DROP_BAD_DST_MAC, fr_event);
             return 1;
         }
     }
@@ -661,6 +909,7 @@ int chirouter_server_process_ethernet_frame(chirouter_ctx_t *ctx, chirouter_inte
     if(len > ETHER_FRAME_MAX_LEN)
     {
         chilog(WARNING, "Received an Ethernet frame that is %i bytes long (larger than the maximum size of an Ethernet frame: %i)", len, ETHER_FRAME_MAX_LEN);
+        chirouter_server_count_drop(ctx, iface, CHIROUTER_STAT_DROP_INVALID, fr_event);
         return 1;
     }
 
@@ -671,18 +920,38 @@ int chirouter_server_process_ethernet_frame(chirouter_ctx_t *ctx, chirouter_inte
     memcpy(frame->raw, msg, len);
     frame->length = len;
     frame->in_interface = iface;
+    frame->fr_event = fr_event;
 
-    if(ctx->server->pcap)
+    if(ctx->server->pcap_writer)
         chirouter_pcap_write_frame(ctx, iface, msg, len, PCAP_INBOUND);
 
+    chirouter_latency_mark(&ctx->latency, CHIROUTER_STAGE_VALIDATE);
+
+    if(ctx->num_rss_queues > 0)
+    {
+        /* The worker thread will free the frame (and finish
+         * sampling its latency) */
+        frame->lat = chirouter_lat_cur;
+        chirouter_lat_cur.start = 0;
+        chirouter_rss_dispatch(ctx, frame);
+        return 0;
+    }
+
     rc = chirouter_process_ethernet_frame(ctx, frame);
 
+    chirouter_latency_end(&ctx->latency);
+
+    if(ctx->server->flightrec)
+        chirouter_flightrec_decide(ctx->server->flightrec, fr_event, chirouter_stats_last);
+
     free(frame->raw);
     free(frame);
 
     if (rc == -1)
     {
         chilog(CRITICAL, "Critical error while processing Ethernet frame");
+        if(ctx->server->flightrec)
+            chirouter_flightrec_dump(ctx->server->flightrec, "critical error");
         return -1;
     }
 
@@ -693,6 +962,8 @@ int chirouter_server_process_ethernet_frame(chirouter_ctx_t *ctx, chirouter_inte
 /* See chirouter.h */
 int chirouter_send_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *frame, size_t frame_len)
 {
+    int rc;
+
     if(frame_len < ETHER_HDR_LEN)
     {
         chilog(ERROR, "Trying to send an Ethernet frame on interface %s that is %i bytes long (shorter than an Ethernet header)", iface->name, frame_len);
@@ -716,9 +987,26 @@ int chirouter_send_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uin
         return 1;
     }
 
-    if(ctx->server->pcap)
+    CHIROUTER_PROBE4(frame__send, ctx->name, iface->name, frame, frame_len);
+
+    chirouter_stats_inc(&ctx->stats, CHIROUTER_STAT_TX_PACKETS);
+    chirouter_stats_add(&ctx->stats, CHIROUTER_STAT_TX_BYTES, frame_len);
+    chirouter_stats_inc(&iface->stats, CHIROUTER_STAT_TX_PACKETS);
+    chirouter_stats_add(&iface->stats, CHIROUTER_STAT_TX_BYTES, frame_len);
+
+    if(ctx->server->pcap_writer)
         chirouter_pcap_write_frame(ctx, iface, frame, frame_len, PCAP_OUTBOUND);
 
+    if(ctx->server->flightrec)
+        chirouter_flightrec_record(ctx->server->flightrec, ctx, iface, frame, frame_len, PCAP_OUTBOUND);
+
+    if(ctx->server->frame_sink)
+    {
+        rc = ctx->server->frame_sink(ctx, iface, frame, frame_len, ctx->server->frame_sink_arg);
+        chirouter_latency_mark(&ctx->latency, CHIROUTER_STAGE_TX);
+        return rc;
+    }
+
     chirouter_msg_t msg;
 
     msg.type = MSG_TYPE_ETHERNET_FRAME;
@@ -729,9 +1017,92 @@ int chirouter_send_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uin
     msg.ethernet.frame_len = htons(frame_len);
     memcpy(msg.ethernet.frame, frame, frame_len);
 
-    return chirouter_server_send_msg(ctx->server, &msg);
+    rc = chirouter_server_send_msg(ctx->server, &msg);
+    chirouter_latency_mark(&ctx->latency, CHIROUTER_STAGE_TX);
+
+    return rc;
+}
+
+/*
+ * chirouter_server_start_routers - Starts the routers
+ *
+ * Starts the ARP thread and the RSS queues (if any) of every
+ * router, and transitions to the RUNNING state.
+ *
+ * ctx: Server context
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_server_start_routers(server_ctx_t *ctx)
+{
+    for(int i=0; i < ctx->num_routers; i++)
+    {
+        chirouter_ctx_t *r = &ctx->routers[i];
+
+        if(chirouter_arp_start(r) != 0)
+        {
+            chilog(CRITICAL, "Router %d: Could not start ARP thread", i);
+            return -1;
+        }
+
+        if(ctx->num_rss_queues > 0 && chirouter_rss_start(r, ctx->num_rss_queues) != 0)
+        {
+            chilog(CRITICAL, "Router %d: Could not start RSS queues", i);
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&ctx->lock_routers);
+    ctx->state = RUNNING;
+    ctx->routers_kept = false;
+    pthread_mutex_unlock(&ctx->lock_routers);
+
+    return 0;
 }
 
+
+/*
+ * chirouter_server_stop_routers - Stops the routers, but keeps them
+ *
+ * Stops the ARP thread and the RSS queues (if any) of every router,
+ * and transitions to the HELLO_WAIT state. The routers keep their
+ * configuration, ARP cache, and statistics, and can be started again
+ * with chirouter_server_start_routers.
+ *
+ * ctx: Server context
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_server_stop_routers(server_ctx_t *ctx)
+{
+    pthread_mutex_lock(&ctx->lock_routers);
+    ctx->state = HELLO_WAIT;
+
+    for(int i=0; i < ctx->num_routers; i++)
+    {
+        /* The ARP thread uses the router until it's stopped */
+        chirouter_arp_stop(&ctx->routers[i]);
+
+        if(chirouter_rss_stop(&ctx->routers[i]) != 0)
+        {
+            chilog(CRITICAL, "Could not stop RSS workers");
+            pthread_mutex_unlock(&ctx->lock_routers);
+            return -1;
+        }
+
+        if(!ctx->routers_kept)
+            chirouter_ctx_log_stats(&ctx->routers[i], INFO);
+    }
+
+    ctx->routers_kept = ctx->num_routers > 0;
+    pthread_mutex_unlock(&ctx->lock_routers);
+
+    return 0;
+}
+
+
 /*
  * chirouter_server_ctx_free_routers - Frees router resources
  *
@@ -744,12 +1115,19 @@ int chirouter_server_ctx_free_routers(server_ctx_t *ctx)
 {
     int rc;
 
+    rc = chirouter_server_stop_routers(ctx);
+    if(rc)
+        return -1;
+
+    pthread_mutex_lock(&ctx->lock_routers);
+
     for(int i=0; i < ctx->num_routers; i++)
     {
         rc = chirouter_ctx_destroy(&ctx->routers[i]);
         if(rc)
         {
             chilog(CRITICAL, "Could not free router resource");
+            pthread_mutex_unlock(&ctx->lock_routers);
             return -1;
         }
     }
@@ -759,6 +1137,9 @@ int chirouter_server_ctx_free_routers(server_ctx_t *ctx)
     ctx->routers = NULL;
     ctx->num_routers = 0;
     ctx->max_routers = 0;
+    ctx->routers_kept = false;
+
+    pthread_mutex_unlock(&ctx->lock_routers);
 
     return 0;
 }
@@ -776,6 +1157,12 @@ int chirouter_server_ctx_destroy(server_ctx_t *ctx)
 {
     int rc;
 
+    chirouter_admin_stop(ctx->admin);
+    ctx->admin = NULL;
+
+    chirouter_metrics_stop(ctx->metrics);
+    ctx->metrics = NULL;
+
     rc = chirouter_server_ctx_free_routers(ctx);
     if(rc)
     {
@@ -783,6 +1170,51 @@ int chirouter_server_ctx_destroy(server_ctx_t *ctx)
         return -1;
     }
 
+    chirouter_sched_stop(ctx->sched);
+    ctx->sched = NULL;
+
+    /* Only stopped once no router can write frames */
+    chirouter_pcap_writer_stop(ctx->pcap_writer);
+    ctx->pcap_writer = NULL;
+
+    /* Only freed once no router can record events */
+    chirouter_flightrec_free(ctx->flightrec);
+    ctx->flightrec = NULL;
+
+    for(int i = 0; i < ctx->num_rtable_files; i++)
+        free(ctx->rtable_files[i].filename);
+    free(ctx->rtable_files);
+    ctx->rtable_files = NULL;
+    ctx->num_rtable_files = 0;
+
+    pthread_mutex_destroy(&ctx->lock_send);
+    pthread_mutex_destroy(&ctx->lock_routers);
+
     return 0;
 }
 
+
+/*
+ * chirouter_server_dump_latency - Print the latency histograms of all the routers
+ *
+ * Can be called from any thread. Does nothing if the routers are
+ * not running.
+ *
+ * ctx: Server context
+ *
+ * f: File to print to
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_server_dump_latency(server_ctx_t *ctx, FILE *f)
+{
+    pthread_mutex_lock(&ctx->lock_routers);
+
+    if(ctx->state == RUNNING)
+        for(int i=0; i < ctx->num_routers; i++)
+            chirouter_latency_dump(f, ctx->routers[i].name, &ctx->routers[i].latency);
+
+    pthread_mutex_unlock(&ctx->lock_routers);
+}
+
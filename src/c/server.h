@@ -91,13 +91,30 @@
  *
  *  Subtypes: 1 (From Router) and 2 (To Router)
  *
- *  Payload: None (Payload Length = 0)
+ *  Payload: None (Payload Length = 0), or:
+ *
+ *   ------------------------
+ *  |  Configuration Hash   |
+ *  |      (8 bytes)        |
+ *   ------------------------
+ *
+ *  Payload Length: 0 or 8
  *
  *  Used to perform a simple handshake with the POX controller. When
  *  the POX controller connects to chirouter, it must send a HELLO
  *  message with Subtype = 2 (To Router). chirouter will respond
  *  with a HELLO message with Subtype = 1 (From Router)
  *
+ *  The POX controller can include the hash of the configuration it is
+ *  about to send: the 64-bit FNV-1a hash of all the configuration messages
+ *  (headers included, from the ROUTERS message to the END CONFIG message),
+ *  in network order. If chirouter still has the routers of a previous
+ *  connection, and they were configured with the same hash, it responds
+ *  with a HELLO message with that same hash, and keeps using those routers
+ *  (with their ARP caches). In that case, the POX controller must not
+ *  send the configuration. Otherwise, chirouter responds with a HELLO
+ *  message with no payload, and the configuration is sent as usual.
+ *
  *
  *
  *  ROUTERS (Type = 2)
@@ -120,9 +137,9 @@
  *  ROUTER (Type = 3)
  *  =================
  *
- *  Subtype: Always 0 (None)
+ *  Subtypes: 0 (None) and 3 (Extended)
  *
- *  Payload:
+ *  Payload (Subtype = 0):
  *
  *   -------------------------------------------------------------------------------------
  *  |   Router ID  |  Number of Interfaces  |  Routing Table Length  |       Name         |
@@ -131,9 +148,19 @@
  *
  *  Payload Length: 3 + len(Name)
  *
+ *  Payload (Subtype = 3):
+ *
+ *   -------------------------------------------------------------------------------------
+ *  |   Router ID  |  Number of Interfaces  |  Routing Table Length  |       Name         |
+ *  |   (1 byte)   |        (1 byte)        |       (4 bytes)        |  0 < bytes <= 8 )  |
+ *   -------------------------------------------------------------------------------------
+ *
+ *  Payload Length: 6 + len(Name)
+ *
  *  This message specifies the basic parameters of a single router. It must be followed
- *  by (Number of Interfaces) INTERFACE messages and then by (Routing Table Length)
- *  ROUTING TABLE ENTRY messages.
+ *  by (Number of Interfaces) INTERFACE messages and then by ROUTING TABLE ENTRY and/or
+ *  ROUTES messages with (Routing Table Length) entries in total. The Extended subtype
+ *  is only needed for routing tables with more than 255 entries.
  *
  *
  *  INTERFACE (Type = 4)
@@ -171,6 +198,25 @@
  *  Gateway must be set to 0 for routes that don't have a gateway.
  *
  *
+ *  ROUTES (Type = 8)
+ *  =================
+ *
+ *  Subtype: Always 0 (None)
+ *
+ *  Payload:
+ *
+ *   -----------------------------------------------------
+ *  |   Number of Entries  |  Entries                      |
+ *  |      (2 bytes)       |  (16 bytes each)     ...      |
+ *   -----------------------------------------------------
+ *
+ *  Payload Length: 2 + 16 * (Number of Entries)
+ *
+ *  This message specifies several routing table entries at once (at most 4095).
+ *  Each entry has the same format as the payload of a ROUTING TABLE ENTRY message,
+ *  and the entries can be for different routers.
+ *
+ *
  *  END CONFIG (Type = 6)
  *  =====================
  *
@@ -219,7 +265,7 @@
  *  The next message from the POX controller must be a ROUTERS message specifying the
  *  number N of routers that chirouter will manage. This must be followed by N router
  *  specifications using the following messages: one ROUTER, one or more INTERFACE
- *  messages, and one or more ROUTING TABLE ENTRY messages.
+ *  messages, and one or more ROUTING TABLE ENTRY (or ROUTES) messages.
  *
  *  The router ID numbers must start from zero and be numbered consecutively. For
  *  a given router, the interface ID numbers must start from zero and be numbered
@@ -236,12 +282,21 @@
  *  Router ID and/or Interface ID, it must log this occurrence and drop that frame.
  *
  *  If the POX controller closes the connection while the server is in the RUNNING
- *  state, the server must reset the chirouter data structures and return to
- *  the HELLO_WAIT state.
+ *  state, the server stops the routers (but keeps them, in case the controller
+ *  reconnects with the same configuration, see HELLO) and returns to the
+ *  HELLO_WAIT state. If it closes the connection in any other state, the
+ *  server resets the chirouter data structures and returns to the
+ *  HELLO_WAIT state.
  *
  */
 
 
+/* Maximum length of a message (header and payload) */
+#define MSG_MAX_LEN (4 + UINT16_MAX)
+
+/* Maximum number of entries in a ROUTES message */
+#define MSG_MAX_ROUTES ((UINT16_MAX - 2) / 16)
+
 /* chirouter server messages */
 struct chirouter_msg {
   uint8_t type;
@@ -249,6 +304,10 @@ struct chirouter_msg {
   uint16_t payload_length;
   union
   {
+      struct
+      {
+          uint64_t config_hash;
+      } __attribute__ ((packed)) hello;
       struct
       {
           uint8_t nrouters;
@@ -261,6 +320,13 @@ struct chirouter_msg {
           char name[MAX_ROUTER_NAMELEN];
       } router;
       struct
+      {
+          uint8_t r_id;
+          uint8_t num_interfaces;
+          uint32_t len_rtable;
+          char name[MAX_ROUTER_NAMELEN];
+      } __attribute__ ((packed)) router_ext;
+      struct
       {
           uint8_t r_id;
           uint8_t iface_id;
@@ -268,7 +334,7 @@ struct chirouter_msg {
           uint32_t ipaddr;
           char name[MAX_IFACE_NAMELEN];
       } interface;
-      struct
+      struct chirouter_msg_rtable_entry
       {
           uint8_t r_id;
           uint8_t iface_id;
@@ -276,7 +342,12 @@ struct chirouter_msg {
           uint32_t dest;
           uint32_t mask;
           uint32_t gw;
-      } rtable_entry;
+      } __attribute__ ((packed)) rtable_entry;
+      struct
+      {
+          uint16_t num_entries;
+          struct chirouter_msg_rtable_entry entries[0];
+      } routes;
       struct
       {
           uint8_t r_id;
@@ -298,7 +369,8 @@ typedef enum
     MSG_TYPE_INTERFACE = 4,
     MSG_TYPE_RTABLE_ENTRY = 5,
     MSG_TYPE_END_CONFIG = 6,
-    MSG_TYPE_ETHERNET_FRAME = 7
+    MSG_TYPE_ETHERNET_FRAME = 7,
+    MSG_TYPE_ROUTES = 8
 } chirouter_msg_type_t;
 
 
@@ -307,7 +379,8 @@ typedef enum
 {
     NONE = 0,
     FROM_ROUTER = 1,
-    TO_ROUTER = 2
+    TO_ROUTER = 2,
+    EXTENDED = 3
 } chirouter_msg_subtype_t;
 
 
@@ -320,6 +393,23 @@ typedef enum
 } server_state_t;
 
 
+/* Function that outbound frames can be handed to, instead of sending
+ * them to the controller (used to run routers without a controller) */
+typedef int (*chirouter_frame_sink_t)(chirouter_ctx_t *ctx, chirouter_interface_t *iface,
+                                      uint8_t *frame, size_t len, void *arg);
+
+
+/* A routing table file to load into a router (by name) once the
+ * controller has configured it: either a text file (see
+ * chirouter_ctx_load_rtable) or a FIB snapshot (see fib.h) */
+typedef struct chirouter_rtable_file
+{
+    char router[MAX_ROUTER_NAMELEN + 1];
+    char *filename;
+    bool is_fib;
+} chirouter_rtable_file_t;
+
+
 /* The server context. Contains all the information needed
  * to run the server, as well as the router data structures. */
 typedef struct server_ctx
@@ -327,7 +417,8 @@ typedef struct server_ctx
     /* Server (passive) socket */
     int server_socket;
 
-    /* Client (active) socket */
+    /* Client (active) socket, or -1 if there is no controller
+     * connected. Only closed with lock_send held. */
     int client_socket;
 
     /* Server state */
@@ -341,14 +432,70 @@ typedef struct server_ctx
      * be of size "num_routers" */
     chirouter_ctx_t* routers;
 
-    /* PCAP file to dump to */
-    FILE *pcap;
+    /* Mutex to keep the routers from being freed while another
+     * thread (other than the server thread) is reading them. Other
+     * threads must only read the routers while the server is in
+     * the RUNNING state, and with this mutex held. */
+    pthread_mutex_t lock_routers;
+
+    /* If set, frames are written to a pcapng capture file (or to
+     * a rotating set of files) by this writer thread */
+    struct chirouter_pcap_writer *pcap_writer;
+
+    /* Number of RSS queues (and worker threads) per router.
+     * If zero, frames are processed in the server thread. */
+    uint16_t num_rss_queues;
+
+    /* If set, the RSS queues of all the routers are run by this
+     * pool of worker threads (instead of one thread per queue) */
+    struct chirouter_sched *sched;
+
+    /* If set, administrative requests are served on this socket */
+    struct chirouter_admin *admin;
+
+    /* If set, metrics are served on a local HTTP port */
+    struct chirouter_metrics *metrics;
+
+    /* If set, the last frame events are kept in this ring */
+    struct chirouter_flightrec *flightrec;
+
+    /* Routing table files that are loaded into the routers
+     * every time the controller configures them */
+    chirouter_rtable_file_t *rtable_files;
+    uint16_t num_rtable_files;
+
+    /* Hash of the configuration messages (see HELLO) the routers were
+     * configured with, and whether they were kept after the controller
+     * disconnected (stopped, but with their state intact) */
+    uint64_t config_hash;
+    bool routers_kept;
+
+    /* Set by a worker thread if a critical error happens
+     * while processing a frame */
+    bool fatal_error;
+
+    /* Set (by chirouter_server_shutdown) when the server
+     * must stop serving the controller and return */
+    bool stopping;
+
+    /* Mutex to serialize sending messages to the controller,
+     * since it can happen from several threads at once */
+    pthread_mutex_t lock_send;
+
+    /* If set, outbound frames are passed to this function
+     * instead of being sent to the controller */
+    chirouter_frame_sink_t frame_sink;
+    void *frame_sink_arg;
 } server_ctx_t;
 
 /* See server.c for documentation */
 int chirouter_server_ctx_init(server_ctx_t **ctx);
 int chirouter_server_setup(server_ctx_t *ctx, char *port);
 int chirouter_server_run(server_ctx_t *ctx);
+void chirouter_server_shutdown(server_ctx_t *ctx);
+int chirouter_server_process_ethernet_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *msg, size_t len);
+int chirouter_server_ctx_free_routers(server_ctx_t *ctx);
 int chirouter_server_ctx_destroy(server_ctx_t *ctx);
+void chirouter_server_dump_latency(server_ctx_t *ctx, FILE *f);
 
 #endif /* SERVER_H_ */
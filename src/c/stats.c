@@ -0,0 +1,172 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Statistics counters
+ *
+ *  see stats.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+__thread int chirouter_stats_slot = -1;
+__thread uint8_t chirouter_stats_last;
+
+/* Which slots are assigned to a thread. The last slot is shared, and
+ * is never marked as used. */
+static bool slot_used[MAX_STATS_SLOTS];
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+static const char *stat_names[CHIROUTER_STAT_MAX] =
+{
+    [CHIROUTER_STAT_RX_PACKETS] = "rx_packets",
+    [CHIROUTER_STAT_RX_BYTES] = "rx_bytes",
+    [CHIROUTER_STAT_TX_PACKETS] = "tx_packets",
+    [CHIROUTER_STAT_TX_BYTES] = "tx_bytes",
+    [CHIROUTER_STAT_FORWARDED] = "forwarded",
+    [CHIROUTER_STAT_DROP_INVALID] = "drop_invalid",
+    [CHIROUTER_STAT_DROP_BAD_DST_MAC] = "drop_bad_dst_mac",
+    [CHIROUTER_STAT_DROP_MULTICAST] = "drop_multicast",
+    [CHIROUTER_STAT_DROP_TTL_EXCEEDED] = "drop_ttl_exceeded",
+    [CHIROUTER_STAT_DROP_NO_ROUTE] = "drop_no_route",
+    [CHIROUTER_STAT_DROP_HOST_UNREACHABLE] = "drop_host_unreachable",
+    [CHIROUTER_STAT_DROP_UNSUPPORTED] = "drop_unsupported",
+    [CHIROUTER_STAT_FIB_MISSES] = "fib_misses",
+    [CHIROUTER_STAT_ARP_HITS] = "arp_hits",
+    [CHIROUTER_STAT_ARP_MISSES] = "arp_misses",
+    [CHIROUTER_STAT_ARP_REQUESTS_SENT] = "arp_requests_sent",
+    [CHIROUTER_STAT_ARP_REPLIES_SENT] = "arp_replies_sent",
+    [CHIROUTER_STAT_WITHHELD] = "withheld",
+    [CHIROUTER_STAT_WITHHELD_RELEASED] = "withheld_released",
+    [CHIROUTER_STAT_ICMP_ECHO_REPLY] = "icmp_echo_reply",
+    [CHIROUTER_STAT_ICMP_NET_UNREACHABLE] = "icmp_net_unreachable",
+    [CHIROUTER_STAT_ICMP_HOST_UNREACHABLE] = "icmp_host_unreachable",
+    [CHIROUTER_STAT_ICMP_PROTO_UNREACHABLE] = "icmp_proto_unreachable",
+    [CHIROUTER_STAT_ICMP_PORT_UNREACHABLE] = "icmp_port_unreachable",
+    [CHIROUTER_STAT_ICMP_TIME_EXCEEDED] = "icmp_time_exceeded",
+};
+
+
+/* Returns a thread's slot when the thread exits */
+static void release_slot(void *arg)
+{
+    int slot = (int) (intptr_t) arg - 1;
+
+    pthread_mutex_lock(&slot_lock);
+    slot_used[slot] = false;
+    pthread_mutex_unlock(&slot_lock);
+}
+
+static void create_slot_key()
+{
+    pthread_key_create(&slot_key, release_slot);
+}
+
+
+/* See stats.h */
+int chirouter_stats_assign_slot()
+{
+    int slot = MAX_STATS_SLOTS - 1;
+
+    pthread_once(&slot_key_once, create_slot_key);
+
+    pthread_mutex_lock(&slot_lock);
+    for (int i = 0; i < MAX_STATS_SLOTS - 1; i++)
+        if (!slot_used[i])
+        {
+            slot_used[i] = true;
+            slot = i;
+            break;
+        }
+    pthread_mutex_unlock(&slot_lock);
+
+    /* The key's value can't be zero, or the destructor won't run */
+    if (slot != MAX_STATS_SLOTS - 1)
+        pthread_setspecific(slot_key, (void *) (intptr_t) (slot + 1));
+
+    chirouter_stats_slot = slot;
+    return slot;
+}
+
+
+/* See stats.h */
+int chirouter_stats_init(chirouter_stats_t *stats)
+{
+    stats->slots = aligned_alloc(64, MAX_STATS_SLOTS * sizeof(chirouter_stats_slot_t));
+    if (stats->slots == NULL)
+        return -1;
+
+    memset(stats->slots, 0, MAX_STATS_SLOTS * sizeof(chirouter_stats_slot_t));
+
+    return 0;
+}
+
+
+/* See stats.h */
+void chirouter_stats_free(chirouter_stats_t *stats)
+{
+    free(stats->slots);
+    stats->slots = NULL;
+}
+
+
+/* See stats.h */
+void chirouter_stats_read(chirouter_stats_t *stats, uint64_t *values)
+{
+    memset(values, 0, CHIROUTER_STAT_MAX * sizeof(uint64_t));
+
+    if (stats->slots == NULL)
+        return;
+
+    for (int i = 0; i < MAX_STATS_SLOTS; i++)
+        for (int j = 0; j < CHIROUTER_STAT_MAX; j++)
+            values[j] += __atomic_load_n(&stats->slots[i].values[j], __ATOMIC_RELAXED);
+}
+
+
+/* See stats.h */
+const char *chirouter_stat_name(chirouter_stat_t stat)
+{
+    if (stat < 0 || stat >= CHIROUTER_STAT_MAX)
+        return "unknown";
+
+    return stat_names[stat];
+}
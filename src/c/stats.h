@@ -0,0 +1,215 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Statistics counters
+ *
+ *  Each router, and each interface, has a set of counters (packets
+ *  received/sent, drops by reason, ARP cache hits/misses, ICMP messages
+ *  sent by type, etc.) that can be updated from any thread without
+ *  locks or atomic read-modify-write operations: every thread gets its
+ *  own "slot" (a copy of the counters, padded to a cache line boundary)
+ *  and only ever updates its own slot. Reading a counter adds up the
+ *  values in all the slots.
+ *
+ *  Threads are assigned a slot the first time they update a counter,
+ *  and the slot is returned when the thread exits. If there are more
+ *  than MAX_STATS_SLOTS - 1 threads updating counters at the same time,
+ *  the remaining threads share the last slot (and update it atomically).
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Maximum number of per-thread slots */
+#define MAX_STATS_SLOTS (32)
+
+/* Counters. Interfaces only use the RX/TX counters and the drops
+ * that happen before a frame reaches the router (invalid, bad
+ * destination MAC, and multicast frames) */
+typedef enum
+{
+    CHIROUTER_STAT_RX_PACKETS = 0,
+    CHIROUTER_STAT_RX_BYTES,
+    CHIROUTER_STAT_TX_PACKETS,
+    CHIROUTER_STAT_TX_BYTES,
+    CHIROUTER_STAT_FORWARDED,
+
+    /* Frames that were dropped, by reason */
+    CHIROUTER_STAT_DROP_INVALID,
+    CHIROUTER_STAT_DROP_BAD_DST_MAC,
+    CHIROUTER_STAT_DROP_MULTICAST,
+    CHIROUTER_STAT_DROP_TTL_EXCEEDED,
+    CHIROUTER_STAT_DROP_NO_ROUTE,
+    CHIROUTER_STAT_DROP_HOST_UNREACHABLE,
+    CHIROUTER_STAT_DROP_UNSUPPORTED,
+
+    CHIROUTER_STAT_FIB_MISSES,
+    CHIROUTER_STAT_ARP_HITS,
+    CHIROUTER_STAT_ARP_MISSES,
+    CHIROUTER_STAT_ARP_REQUESTS_SENT,
+    CHIROUTER_STAT_ARP_REPLIES_SENT,
+
+    /* Frames withheld while waiting for an ARP reply, and
+     * withheld frames that were sent once the reply arrived */
+    CHIROUTER_STAT_WITHHELD,
+    CHIROUTER_STAT_WITHHELD_RELEASED,
+
+    /* ICMP messages sent, by type (and code) */
+    CHIROUTER_STAT_ICMP_ECHO_REPLY,
+    CHIROUTER_STAT_ICMP_NET_UNREACHABLE,
+    CHIROUTER_STAT_ICMP_HOST_UNREACHABLE,
+    CHIROUTER_STAT_ICMP_PROTO_UNREACHABLE,
+    CHIROUTER_STAT_ICMP_PORT_UNREACHABLE,
+    CHIROUTER_STAT_ICMP_TIME_EXCEEDED,
+
+    CHIROUTER_STAT_MAX
+} chirouter_stat_t;
+
+
+/* One thread's copy of the counters */
+typedef struct
+{
+    uint64_t values[CHIROUTER_STAT_MAX];
+} __attribute__((aligned(64))) chirouter_stats_slot_t;
+
+
+/* A set of counters */
+typedef struct
+{
+    /* MAX_STATS_SLOTS slots. If NULL, the counters have not been
+     * initialized, and updates are ignored. */
+    chirouter_stats_slot_t *slots;
+} chirouter_stats_t;
+
+
+/* Slot of the calling thread (-1 if it has not been assigned yet) */
+extern __thread int chirouter_stats_slot;
+
+/* The counters from CHIROUTER_STAT_FORWARDED onwards account for what
+ * happened to a frame. This is the last one of them that the calling
+ * thread updated, which is taken as the decision made for the frame
+ * being processed (see flightrec.h). */
+extern __thread uint8_t chirouter_stats_last;
+
+/* Assigns a slot to the calling thread. Do not call directly. */
+int chirouter_stats_assign_slot();
+
+
+/*
+ * chirouter_stats_init - Initialize a set of counters (to zero)
+ *
+ * stats: Counters
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_stats_init(chirouter_stats_t *stats);
+
+
+/*
+ * chirouter_stats_free - Free a set of counters
+ *
+ * stats: Counters
+ *
+ * Returns: nothing.
+ */
+void chirouter_stats_free(chirouter_stats_t *stats);
+
+
+/*
+ * chirouter_stats_add - Add a value to a counter
+ *
+ * stats: Counters
+ *
+ * stat: Counter to update
+ *
+ * value: Value to add
+ *
+ * Returns: nothing.
+ */
+static inline void chirouter_stats_add(chirouter_stats_t *stats, chirouter_stat_t stat, uint64_t value)
+{
+    int slot = chirouter_stats_slot;
+
+    if (__builtin_expect(stats->slots == NULL, 0))
+        return;
+
+    if (__builtin_expect(slot < 0, 0))
+        slot = chirouter_stats_assign_slot();
+
+    if (stat >= CHIROUTER_STAT_FORWARDED)
+        chirouter_stats_last = stat;
+
+    uint64_t *counter = &stats->slots[slot].values[stat];
+
+    if (__builtin_expect(slot == MAX_STATS_SLOTS - 1, 0))
+        __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+#define chirouter_stats_inc(stats, stat) chirouter_stats_add(stats, stat, 1)
+
+
+/*
+ * chirouter_stats_read - Read all the counters
+ *
+ * The counters are read without stopping the threads that update them,
+ * so the values are not a consistent snapshot across counters (but
+ * each individual value is exact as of some point during the read)
+ *
+ * stats: Counters
+ *
+ * values: Array of CHIROUTER_STAT_MAX values, where the counters
+ *         will be stored.
+ *
+ * Returns: nothing.
+ */
+void chirouter_stats_read(chirouter_stats_t *stats, uint64_t *values);
+
+
+/*
+ * chirouter_stat_name - Get the name of a counter
+ *
+ * stat: Counter
+ *
+ * Returns: The name of the counter (e.g., "rx_packets")
+ */
+const char *chirouter_stat_name(chirouter_stat_t stat);
+
+#endif /* STATS_H_ */
@@ -0,0 +1,123 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  chirouter_admin: sends a request to chirouter's admin socket
+ *  (see admin.h), and prints the response.
+ *
+ *  Usage: chirouter_admin [-a SOCKET] [-j] COMMAND [ROUTER]
+ *
+ *  -a SOCKET: Path of the admin socket (default: /tmp/chirouter.sock)
+ *  -j: Request the response in JSON format.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "admin.h"
+
+#define USAGE "Usage: chirouter_admin [-a SOCKET] [-j] COMMAND [ROUTER]\n"
+
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    char *path = ADMIN_DEFAULT_SOCKET;
+    char request[ADMIN_MAX_REQUEST_LEN + 1], buf[4096];
+    bool json = false;
+    ssize_t nbytes;
+    int opt, sock, len;
+
+    while ((opt = getopt(argc, argv, "a:jh")) != -1)
+        switch (opt)
+        {
+        case 'a':
+            path = optarg;
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 'h':
+            printf(USAGE);
+            exit(0);
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+        }
+
+    if(optind >= argc || argc - optind > 2)
+    {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    len = snprintf(request, sizeof(request), "%s%s%s%s\n", json ? "json " : "", argv[optind],
+                   optind + 1 < argc ? " " : "", optind + 1 < argc ? argv[optind + 1] : "");
+    if(len >= (int) sizeof(request) || strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "ERROR: Request or socket path is too long\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+       connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    {
+        perror("ERROR: Could not connect to admin socket");
+        return EXIT_FAILURE;
+    }
+
+    if(write(sock, request, len) != len)
+    {
+        perror("ERROR: Could not send request");
+        return EXIT_FAILURE;
+    }
+    shutdown(sock, SHUT_WR);
+
+    while((nbytes = read(sock, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, nbytes, stdout);
+
+    close(sock);
+
+    return nbytes == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,382 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  chirouter_fib: creates FIB snapshots (see fib.h), and checks them.
+ *
+ *  A snapshot is created for one router, from the routing table of the
+ *  router in a topology file, and/or from routing table files (see
+ *  chirouter_ctx_load_rtable), in that order. The interfaces of the
+ *  router are taken from the topology or, if there is no topology,
+ *  given with -i. The snapshot can then be loaded into the router
+ *  with chirouter -b ROUTER:FIB.
+ *
+ *  With -d, a snapshot is described instead, and the given addresses
+ *  are looked up in it. With -V, the lookups of the snapshot are also
+ *  checked against a linear scan of its routes.
+ *
+ *  Usage: chirouter_fib -o FIB (-t TOPOLOGY -R ROUTER | -i IFACES) [-f RTABLE_FILE]...
+ *         chirouter_fib -d FIB [-V COUNT] [ADDRESS...]
+ *
+ *  -o FIB: Create this snapshot
+ *  -t TOPOLOGY: Topology file (e.g., topologies/3router.json)
+ *  -R ROUTER: Router of the topology (e.g., r1)
+ *  -i IFACES: Interfaces of the router, separated by commas (e.g.,
+ *             eth1,eth2,eth3), if there is no topology
+ *  -f RTABLE_FILE: Add the routes in this file (can be repeated)
+ *  -d FIB: Describe this snapshot
+ *  -V COUNT: Check the lookups of COUNT random addresses (and of the
+ *            first and last address of up to COUNT routes)
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include "chirouter.h"
+#include "fib.h"
+#include "topology.h"
+
+#define USAGE "Usage: chirouter_fib -o FIB (-t TOPOLOGY -R ROUTER | -i IFACES) [-f RTABLE_FILE]...\n" \
+              "       chirouter_fib -d FIB [-V COUNT] [ADDRESS...]\n"
+
+#define MAX_RTABLE_FILES (64)
+
+
+static double elapsed_ms(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+
+/* Sets up the interfaces (and routes) of the router from a topology */
+static int fib_router_from_topology(chirouter_ctx_t *r, const char *topo_file, const char *router)
+{
+    char error[TOPOLOGY_MAX_ERROR_LEN];
+    chirouter_topology_t *topo;
+    const chirouter_topo_router_t *tr = NULL;
+
+    topo = chirouter_topology_load(topo_file, error);
+    if (topo == NULL)
+    {
+        fprintf(stderr, "ERROR: %s\n", error);
+        return -1;
+    }
+
+    for (int i = 0; i < topo->num_routers; i++)
+        if (strcmp(topo->routers[i].name, router) == 0)
+            tr = &topo->routers[i];
+
+    if (tr == NULL)
+    {
+        fprintf(stderr, "ERROR: There is no router %s in %s\n", router, topo_file);
+        chirouter_topology_free(topo);
+        return -1;
+    }
+
+    strcpy(r->name, tr->name);
+    r->interfaces = calloc(tr->num_interfaces, sizeof(chirouter_interface_t));
+    r->routing_table = calloc(tr->num_routes, sizeof(chirouter_rtable_entry_t));
+    if ((tr->num_interfaces > 0 && r->interfaces == NULL) || (tr->num_routes > 0 && r->routing_table == NULL))
+    {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        chirouter_topology_free(topo);
+        return -1;
+    }
+
+    r->num_interfaces = r->max_interfaces = tr->num_interfaces;
+    for (int i = 0; i < tr->num_interfaces; i++)
+    {
+        strcpy(r->interfaces[i].name, tr->interfaces[i].name);
+        r->interfaces[i].ip = tr->interfaces[i].ip;
+    }
+
+    r->num_rtable_entries = r->max_rtable_entries = tr->num_routes;
+    for (uint32_t i = 0; i < tr->num_routes; i++)
+    {
+        chirouter_rtable_entry_t *entry = &r->routing_table[i];
+
+        entry->dest = tr->routes[i].dest;
+        entry->mask = tr->routes[i].mask;
+        entry->gw = tr->routes[i].gw;
+        entry->metric = tr->routes[i].metric;
+        entry->interface = &r->interfaces[tr->routes[i].iface];
+    }
+
+    chirouter_topology_free(topo);
+    return 0;
+}
+
+
+/* Sets up the interfaces of the router from a list of names */
+static int fib_router_from_ifaces(chirouter_ctx_t *r, char *ifaces)
+{
+    int n = 1;
+
+    for (char *c = ifaces; *c; c++)
+        if (*c == ',')
+            n++;
+
+    if (n > UINT16_MAX || (r->interfaces = calloc(n, sizeof(chirouter_interface_t))) == NULL)
+        return -1;
+
+    strcpy(r->name, "-");
+    for (char *name = strtok(ifaces, ","); name; name = strtok(NULL, ","))
+    {
+        if (strlen(name) > MAX_IFACE_NAMELEN)
+        {
+            fprintf(stderr, "ERROR: Interface name is too long: %s\n", name);
+            return -1;
+        }
+        strcpy(r->interfaces[r->num_interfaces++].name, name);
+    }
+    r->max_interfaces = r->num_interfaces;
+
+    return 0;
+}
+
+
+/* Creates a snapshot */
+static int fib_create(const char *fib_file, const char *topo_file, const char *router, char *ifaces,
+                      char **rtable_files, int num_rtable_files)
+{
+    chirouter_ctx_t r;
+    chirouter_fib_t *fib;
+    struct timespec start;
+
+    memset(&r, 0, sizeof(r));
+
+    if (topo_file && router)
+    {
+        if (fib_router_from_topology(&r, topo_file, router) != 0)
+            return -1;
+    }
+    else if (fib_router_from_ifaces(&r, ifaces) != 0)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_rtable_files; i++)
+        if (chirouter_ctx_load_rtable(&r, rtable_files[i]) != 0)
+            return -1;
+    printf("Loaded %u routes in %.1f ms\n", r.num_rtable_entries, elapsed_ms(&start));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fib = chirouter_fib_build(&r);
+    if (fib == NULL)
+        return -1;
+    printf("Built %u ranges in %.1f ms\n", fib->hdr->num_ranges, elapsed_ms(&start));
+
+    if (chirouter_fib_write(fib, fib_file) != 0)
+        return -1;
+    printf("Wrote %s (%zu bytes)\n", fib_file, fib->size);
+
+    chirouter_fib_free(fib);
+    free(r.interfaces);
+    free(r.routing_table);
+    return 0;
+}
+
+
+/* Looks up an address with a linear scan of the routes of a snapshot
+ * (like chirouter_get_matching_entry does) */
+static uint32_t fib_lookup_linear(const chirouter_fib_t *fib, uint32_t addr)
+{
+    uint32_t result = FIB_NO_ROUTE, result_mask = 0;
+
+    for (uint32_t i = 0; i < fib->hdr->num_routes; i++)
+    {
+        uint32_t mask = ntohl(fib->routes[i].mask);
+
+        if ((addr & mask) == ntohl(fib->routes[i].dest) && (result == FIB_NO_ROUTE || mask > result_mask))
+        {
+            result = i;
+            result_mask = mask;
+        }
+    }
+
+    return result;
+}
+
+
+/* Checks the lookup of an address. Returns true if it's correct. */
+static bool fib_check_addr(const chirouter_fib_t *fib, uint32_t addr)
+{
+    uint32_t expected = fib_lookup_linear(fib, addr), got = chirouter_fib_lookup(fib, addr);
+    struct in_addr a = { .s_addr = htonl(addr) };
+
+    if (expected == got)
+        return true;
+
+    printf("MISMATCH: %s matches route %d, but the snapshot says %d\n", inet_ntoa(a), (int) expected, (int) got);
+    return false;
+}
+
+
+static void fib_print_route(const chirouter_fib_t *fib, uint32_t i)
+{
+    const chirouter_fib_route_t *route = &fib->routes[i];
+    char dest[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN], mask[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &route->dest, dest, sizeof(dest));
+    inet_ntop(AF_INET, &route->gw, gw, sizeof(gw));
+    inet_ntop(AF_INET, &route->mask, mask, sizeof(mask));
+
+    printf("route %u: %-16s%-16s%-16s%.*s\n", i, dest, gw, mask, (int) MAX_IFACE_NAMELEN,
+           route->iface < fib->hdr->num_ifaces ? fib->ifaces[route->iface] : "?");
+}
+
+
+/* Describes a snapshot, and looks up (and checks) addresses in it */
+static int fib_describe(const char *fib_file, long num_checks, char **addrs, int num_addrs)
+{
+    chirouter_fib_t *fib;
+    struct timespec start;
+    uint64_t failures = 0, checks = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fib = chirouter_fib_open(fib_file);
+    if (fib == NULL)
+        return -1;
+
+    printf("%s: %u interfaces, %u routes, %u ranges, %zu bytes (opened in %.3f ms)\n", fib_file,
+           fib->hdr->num_ifaces, fib->hdr->num_routes, fib->hdr->num_ranges, fib->size, elapsed_ms(&start));
+
+    for (int i = 0; i < num_addrs; i++)
+    {
+        struct in_addr a;
+        uint32_t route;
+
+        if (inet_pton(AF_INET, addrs[i], &a) != 1)
+        {
+            fprintf(stderr, "ERROR: Invalid address: %s\n", addrs[i]);
+            chirouter_fib_free(fib);
+            return -1;
+        }
+
+        route = chirouter_fib_lookup(fib, ntohl(a.s_addr));
+        printf("%-16s", addrs[i]);
+        if (route == FIB_NO_ROUTE)
+            printf("no route\n");
+        else
+            fib_print_route(fib, route);
+    }
+
+    if (num_checks > 0)
+    {
+        srandom(1);
+        for (long i = 0; i < num_checks; i++, checks++)
+            failures += !fib_check_addr(fib, ((uint32_t) random() << 16) ^ (uint32_t) random());
+
+        for (uint32_t i = 0; i < fib->hdr->num_routes && i < num_checks; i++, checks += 2)
+        {
+            uint32_t dest = ntohl(fib->routes[i].dest), mask = ntohl(fib->routes[i].mask);
+
+            failures += !fib_check_addr(fib, dest);
+            failures += !fib_check_addr(fib, dest | ~mask);
+        }
+
+        printf("Checked %lu lookups: %lu mismatches\n", checks, failures);
+    }
+
+    chirouter_fib_free(fib);
+    return failures ? -1 : 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    char *fib_file = NULL, *describe_file = NULL, *topo_file = NULL, *router = NULL, *ifaces = NULL;
+    char *rtable_files[MAX_RTABLE_FILES];
+    int num_rtable_files = 0;
+    long num_checks = 0;
+    int opt, rc;
+
+    while ((opt = getopt(argc, argv, "o:t:R:i:f:d:V:h")) != -1)
+        switch (opt)
+        {
+        case 'o':
+            fib_file = optarg;
+            break;
+        case 't':
+            topo_file = optarg;
+            break;
+        case 'R':
+            router = optarg;
+            break;
+        case 'i':
+            ifaces = optarg;
+            break;
+        case 'f':
+            if (num_rtable_files == MAX_RTABLE_FILES)
+            {
+                fprintf(stderr, "ERROR: Too many routing table files\n");
+                return EXIT_FAILURE;
+            }
+            rtable_files[num_rtable_files++] = optarg;
+            break;
+        case 'd':
+            describe_file = optarg;
+            break;
+        case 'V':
+            num_checks = atol(optarg);
+            break;
+        case 'h':
+            printf(USAGE);
+            return EXIT_SUCCESS;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+        }
+
+    chirouter_setloglevel(ERROR);
+
+    if (describe_file && !fib_file)
+        rc = fib_describe(describe_file, num_checks, argv + optind, argc - optind);
+    else if (fib_file && !describe_file && ((topo_file && router && !ifaces) || (ifaces && !topo_file && !router)))
+        rc = fib_create(fib_file, topo_file, router, ifaces, rtable_files, num_rtable_files);
+    else
+    {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1133 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  chirouter_loadgen: load generator that takes the place of the POX
+ *  controller, to measure how much traffic chirouter can handle.
+ *
+ *  It connects to chirouter and configures the routers of a topology
+ *  file (see topology.h) through the controller protocol, just like
+ *  the controller does. Then, it emulates hosts on the directly
+ *  connected networks of every router interface (HOSTS hosts on each
+ *  interface, with addresses starting at .100 of the network), and
+ *  sends synthetic traffic from those hosts through the routers:
+ *
+ *    udp:   UDP datagrams to a host on another interface of the router
+ *    ping:  ICMP echo requests to a host on another interface of the
+ *           router (which the emulated host answers, so they go
+ *           through the router twice)
+ *    rping: ICMP echo requests to the router's own interface
+ *
+ *  Traffic is split into FLOWS flows (each with its own addresses and
+ *  ports), whose kind is chosen according to the weights in the flow
+ *  mix (e.g., "udp:80,ping:20"). The emulated hosts answer the ARP
+ *  requests of the routers (unless -A is given).
+ *
+ *  Each frame carries its send time, so the latency of the frames
+ *  that come back (the one-way latency through the router for udp,
+ *  the round-trip time for ping and rping) is measured, and reported
+ *  as percentiles together with the throughput.
+ *
+ *  Usage: chirouter_loadgen -t TOPOLOGY [-c HOST] [-p PORT] [-R ROUTER] [-H HOSTS]
+ *                           [-f FLOWS] [-m MIX] [-s SIZE[-MAX_SIZE]] [-r RATE]
+ *                           [-d SECONDS | -n FRAMES] [-w WINDOW] [-A]
+ *
+ *  -t TOPOLOGY: Topology file (e.g., topologies/3router.json)
+ *  -c HOST, -p PORT: Address of chirouter (default: localhost, 23300)
+ *  -R ROUTER: Only send traffic through this router (e.g., r1)
+ *  -H HOSTS: Hosts per interface (default: 4)
+ *  -f FLOWS: Number of flows (default: 64)
+ *  -m MIX: Flow mix (default: udp:100)
+ *  -s SIZE[-MAX_SIZE]: Frame size, or range of frame sizes (default: 128)
+ *  -r RATE: Frames per second (default: as fast as possible)
+ *  -d SECONDS: Send frames for this long (default: 5)
+ *  -n FRAMES: Send this many frames (instead of -d)
+ *  -w WINDOW: Maximum number of frames in flight (default: unlimited)
+ *  -A: Don't answer ARP requests
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "chirouter.h"
+#include "server.h"
+#include "latency.h"
+#include "topology.h"
+#include "utils.h"
+
+#define USAGE "Usage: chirouter_loadgen -t TOPOLOGY [-c HOST] [-p PORT] [-R ROUTER] [-H HOSTS]\n" \
+              "                         [-f FLOWS] [-m MIX] [-s SIZE[-MAX_SIZE]] [-r RATE]\n" \
+              "                         [-d SECONDS | -n FRAMES] [-w WINDOW] [-A]\n"
+
+#define MAX_HOSTS (64)
+#define MSG_HDR_LEN (4)
+#define BATCH_SIZE (64 * 1024)
+#define RECV_BUFFER_SIZE (256 * 1024)
+
+/* How long to wait for frames to come back, once all frames have been
+ * sent (DRAIN_TIME_NS) and when the window is full (WINDOW_TIMEOUT_NS),
+ * before giving up on them */
+#define DRAIN_TIME_NS (250000000ull)
+#define WINDOW_TIMEOUT_NS (100000000ull)
+
+/* Payload of the frames sent by the load generator, right after
+ * the UDP or ICMP header */
+#define LOADGEN_MAGIC (0x4C47454E)
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t flow;
+    uint64_t ts;
+} __attribute__((packed)) loadgen_stamp_t;
+
+#define UDP_HDR_LEN (8)
+#define MIN_FRAME_LEN (sizeof(ethhdr_t) + sizeof(iphdr_t) + ICMP_HDR_SIZE + sizeof(loadgen_stamp_t))
+
+/* Kinds of flows */
+typedef enum
+{
+    FLOW_UDP = 0,
+    FLOW_PING,
+    FLOW_RPING,
+    FLOW_KINDS
+} flow_kind_t;
+
+static const char *flow_kind_names[FLOW_KINDS] = { "udp", "ping", "rping" };
+
+/* An emulated host */
+typedef struct
+{
+    uint32_t ip;
+    uint8_t mac[ETHER_ADDR_LEN];
+} host_t;
+
+/* A router interface, and the hosts connected to it */
+typedef struct
+{
+    uint8_t r_id;
+    uint8_t iface_id;
+    uint32_t ip;
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    host_t hosts[MAX_HOSTS];
+    int num_hosts;
+} lg_iface_t;
+
+/* A flow: the frames of a flow only differ in their stamp */
+typedef struct
+{
+    flow_kind_t kind;
+    lg_iface_t *src;
+    uint8_t frame[ETHER_FRAME_MAX_LEN];
+    uint16_t len;
+} flow_t;
+
+/* A buffer of messages to send to chirouter */
+typedef struct
+{
+    uint8_t data[BATCH_SIZE];
+    size_t len;
+} batch_t;
+
+/* State of the load generator */
+typedef struct
+{
+    int sock;
+    pthread_mutex_t lock_send;
+
+    /* Interfaces of router r_id, indexed by interface ID */
+    lg_iface_t *ifaces[TOPOLOGY_MAX_ROUTERS];
+    uint16_t num_ifaces[TOPOLOGY_MAX_ROUTERS];
+
+    bool arp_responder;
+
+    /* If set, batches are added to the configuration hash
+     * (see HELLO in server.h) instead of being sent */
+    bool hash_only;
+    uint64_t config_hash;
+
+    /* Set by the sender once it's done */
+    bool done;
+
+    /* Frames sent, and received back */
+    uint64_t num_sent;
+    uint64_t bytes_sent;
+    uint64_t num_received;
+    uint64_t bytes_received;
+
+    /* Frames that came back, by kind of flow, and their latency */
+    uint64_t num_returned[FLOW_KINDS];
+    chirouter_hist_t latency[FLOW_KINDS];
+
+    uint64_t num_arp_replies;
+    uint64_t num_icmp_errors;
+    uint64_t num_other;
+} loadgen_t;
+
+
+static uint64_t now_ns()
+{
+    return chirouter_latency_now();
+}
+
+
+/* Writes a whole buffer to the socket */
+static int send_all(loadgen_t *lg, const uint8_t *data, size_t len)
+{
+    size_t sent = 0;
+
+    while (sent < len)
+    {
+        ssize_t n = send(lg->sock, data + sent, len - sent, MSG_NOSIGNAL);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+
+    return 0;
+}
+
+
+/* Sends the messages in a batch, and empties it */
+static int batch_flush(loadgen_t *lg, batch_t *batch)
+{
+    int rc;
+
+    if (batch->len == 0)
+        return 0;
+
+    if (lg->hash_only)
+    {
+        lg->config_hash = hash64(lg->config_hash, batch->data, batch->len);
+        batch->len = 0;
+        return 0;
+    }
+
+    pthread_mutex_lock(&lg->lock_send);
+    rc = send_all(lg, batch->data, batch->len);
+    pthread_mutex_unlock(&lg->lock_send);
+
+    batch->len = 0;
+    return rc;
+}
+
+
+/* Adds a message to a batch (flushing it first if it's full), and
+ * returns a pointer to its payload, where len bytes must be written */
+static uint8_t *batch_add(loadgen_t *lg, batch_t *batch, uint8_t type, uint8_t subtype, uint16_t len)
+{
+    uint8_t *msg;
+    uint16_t payload_len = htons(len);
+
+    if (batch->len + MSG_HDR_LEN + len > BATCH_SIZE && batch_flush(lg, batch) != 0)
+        return NULL;
+
+    msg = batch->data + batch->len;
+    msg[0] = type;
+    msg[1] = subtype;
+    memcpy(msg + 2, &payload_len, sizeof(payload_len));
+    batch->len += MSG_HDR_LEN + len;
+
+    return msg + MSG_HDR_LEN;
+}
+
+
+/* Adds an ETHERNET message to a batch, and returns a pointer to the frame */
+static uint8_t *batch_add_frame(loadgen_t *lg, batch_t *batch, lg_iface_t *iface, uint16_t len)
+{
+    uint8_t *payload = batch_add(lg, batch, MSG_TYPE_ETHERNET_FRAME, TO_ROUTER, 4 + len);
+    uint16_t frame_len = htons(len);
+
+    if (payload == NULL)
+        return NULL;
+
+    payload[0] = iface->r_id;
+    payload[1] = iface->iface_id;
+    memcpy(payload + 2, &frame_len, sizeof(frame_len));
+
+    return payload + 4;
+}
+
+
+/* Connects to chirouter */
+static int loadgen_connect(const char *host, const char *port)
+{
+    struct addrinfo hints, *res, *p;
+    int sock = -1, yes = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+
+    for (p = res; p != NULL; p = p->ai_next)
+    {
+        sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (sock == -1)
+            continue;
+        if (connect(sock, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+
+    if (sock != -1)
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    return sock;
+}
+
+
+/* Reads exactly len bytes from the socket */
+static int recv_all(loadgen_t *lg, uint8_t *data, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len)
+    {
+        ssize_t n = recv(lg->sock, data + got, len - got, 0);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+
+    return 0;
+}
+
+
+/* Sends the configuration of the routers (or, with hash_only
+ * set, only computes its hash) */
+static int loadgen_send_config(loadgen_t *lg, const chirouter_topology_t *topo, batch_t *batch)
+{
+    uint8_t *p;
+
+    p = batch_add(lg, batch, MSG_TYPE_ROUTERS, TO_ROUTER, 1);
+    if (p == NULL)
+        return -1;
+    p[0] = topo->num_routers;
+
+    for (int i = 0; i < topo->num_routers; i++)
+    {
+        const chirouter_topo_router_t *r = &topo->routers[i];
+        size_t name_len = strlen(r->name);
+
+        if (r->num_interfaces > UINT8_MAX)
+        {
+            fprintf(stderr, "ERROR: Router %s has too many interfaces\n", r->name);
+            return -1;
+        }
+
+        /* Routing tables with more than 255 entries need the
+         * extended ROUTER message (with a 4-byte length) */
+        if (r->num_routes > UINT8_MAX)
+        {
+            uint32_t len_rtable = htonl(r->num_routes);
+
+            p = batch_add(lg, batch, MSG_TYPE_ROUTER, EXTENDED, 6 + name_len);
+            if (p == NULL)
+                return -1;
+            p[0] = i;
+            p[1] = r->num_interfaces;
+            memcpy(p + 2, &len_rtable, 4);
+            memcpy(p + 6, r->name, name_len);
+        }
+        else
+        {
+            p = batch_add(lg, batch, MSG_TYPE_ROUTER, TO_ROUTER, 3 + name_len);
+            if (p == NULL)
+                return -1;
+            p[0] = i;
+            p[1] = r->num_interfaces;
+            p[2] = r->num_routes;
+            memcpy(p + 3, r->name, name_len);
+        }
+
+        for (int j = 0; j < r->num_interfaces; j++)
+        {
+            size_t iface_name_len = strlen(r->interfaces[j].name);
+
+            p = batch_add(lg, batch, MSG_TYPE_INTERFACE, TO_ROUTER, 12 + iface_name_len);
+            if (p == NULL)
+                return -1;
+            p[0] = i;
+            p[1] = j;
+            memcpy(p + 2, lg->ifaces[i][j].mac, ETHER_ADDR_LEN);
+            memcpy(p + 8, &r->interfaces[j].ip, 4);
+            memcpy(p + 12, r->interfaces[j].name, iface_name_len);
+        }
+
+        /* The routing table is sent in bulk, in ROUTES messages */
+        for (int j = 0; j < r->num_routes; )
+        {
+            uint16_t n = r->num_routes - j < (int) MSG_MAX_ROUTES ? r->num_routes - j : MSG_MAX_ROUTES;
+            uint16_t num_entries = htons(n);
+
+            p = batch_add(lg, batch, MSG_TYPE_ROUTES, TO_ROUTER, 2 + 16 * n);
+            if (p == NULL)
+                return -1;
+            memcpy(p, &num_entries, 2);
+            p += 2;
+
+            for (int k = 0; k < n; k++, j++, p += 16)
+            {
+                const chirouter_topo_route_t *route = &r->routes[j];
+                uint16_t metric = htons(route->metric);
+
+                p[0] = i;
+                p[1] = route->iface;
+                memcpy(p + 2, &metric, 2);
+                memcpy(p + 4, &route->dest, 4);
+                memcpy(p + 8, &route->mask, 4);
+                memcpy(p + 12, &route->gw, 4);
+            }
+        }
+    }
+
+    if (batch_add(lg, batch, MSG_TYPE_END_CONFIG, TO_ROUTER, 0) == NULL)
+        return -1;
+
+    return batch_flush(lg, batch);
+}
+
+
+/* Performs the HELLO exchange, and sends the configuration of the
+ * routers, unless chirouter still has them from a previous run */
+static int loadgen_configure(loadgen_t *lg, const chirouter_topology_t *topo, batch_t *batch)
+{
+    uint8_t hdr[MSG_HDR_LEN], *p;
+    uint64_t config_hash, reply_hash;
+    uint16_t reply_len;
+
+    lg->hash_only = true;
+    lg->config_hash = HASH64_INIT;
+    if (loadgen_send_config(lg, topo, batch) != 0)
+        return -1;
+    lg->hash_only = false;
+
+    config_hash = htobe64(lg->config_hash);
+    p = batch_add(lg, batch, MSG_TYPE_HELLO, TO_ROUTER, sizeof(config_hash));
+    if (p == NULL)
+        return -1;
+    memcpy(p, &config_hash, sizeof(config_hash));
+    if (batch_flush(lg, batch) != 0)
+        return -1;
+
+    if (recv_all(lg, hdr, sizeof(hdr)) != 0 || hdr[0] != MSG_TYPE_HELLO)
+        return -1;
+
+    memcpy(&reply_len, hdr + 2, 2);
+    reply_len = ntohs(reply_len);
+    if (reply_len == sizeof(reply_hash))
+    {
+        if (recv_all(lg, (uint8_t *) &reply_hash, sizeof(reply_hash)) != 0)
+            return -1;
+        if (reply_hash == config_hash)
+        {
+            printf("# chirouter already has this configuration, resuming its routers\n");
+            return 0;
+        }
+    }
+    else if (reply_len != 0)
+        return -1;
+
+    return loadgen_send_config(lg, topo, batch);
+}
+
+
+/* Creates the emulated hosts, on the directly connected network of
+ * every interface (skipping the address of the router itself) */
+static int loadgen_create_hosts(loadgen_t *lg, const chirouter_topology_t *topo, int hosts_per_iface)
+{
+    for (int i = 0; i < topo->num_routers; i++)
+    {
+        const chirouter_topo_router_t *r = &topo->routers[i];
+
+        lg->num_ifaces[i] = r->num_interfaces;
+        lg->ifaces[i] = calloc(r->num_interfaces ? r->num_interfaces : 1, sizeof(lg_iface_t));
+        if (lg->ifaces[i] == NULL)
+            return -1;
+
+        for (int j = 0; j < r->num_interfaces; j++)
+        {
+            const chirouter_topo_iface_t *ti = &r->interfaces[j];
+            lg_iface_t *iface = &lg->ifaces[i][j];
+            uint32_t net = ntohl(ti->ip.s_addr & ti->mask.s_addr);
+            uint32_t hostmask = ~ntohl(ti->mask.s_addr);
+            uint8_t mac[ETHER_ADDR_LEN] = {0x02, 0x00, 0x00, 0x00, i, j};
+
+            iface->r_id = i;
+            iface->iface_id = j;
+            iface->ip = ti->ip.s_addr;
+            memcpy(iface->mac, ti->has_mac ? ti->mac : mac, ETHER_ADDR_LEN);
+
+            for (uint32_t h = 100; iface->num_hosts < hosts_per_iface && h < hostmask; h++)
+            {
+                host_t *host = &iface->hosts[iface->num_hosts];
+
+                if (htonl(net | h) == ti->ip.s_addr)
+                    continue;
+
+                host->ip = htonl(net | h);
+                host->mac[0] = 0x02;
+                host->mac[1] = 0x4C;
+                host->mac[2] = 0x47;
+                host->mac[3] = i;
+                host->mac[4] = j;
+                host->mac[5] = iface->num_hosts;
+                iface->num_hosts++;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/* Builds the template of a flow's frames */
+static void build_flow(flow_t *flow, lg_iface_t *src, host_t *src_host, lg_iface_t *dst_iface, host_t *dst_host,
+                       int id, uint16_t len)
+{
+    ethhdr_t *eth = (ethhdr_t *) flow->frame;
+    iphdr_t *ip = (iphdr_t *) (flow->frame + sizeof(ethhdr_t));
+    uint8_t *l4 = flow->frame + sizeof(ethhdr_t) + sizeof(iphdr_t);
+
+    memset(flow->frame, 0, sizeof(flow->frame));
+    flow->src = src;
+    flow->len = len;
+
+    memcpy(eth->dst, src->mac, ETHER_ADDR_LEN);
+    memcpy(eth->src, src_host->mac, ETHER_ADDR_LEN);
+    eth->type = htons(ETHERTYPE_IP);
+
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->len = htons(len - sizeof(ethhdr_t));
+    ip->id = htons(id);
+    ip->ttl = 64;
+    ip->src = src_host->ip;
+    ip->dst = (flow->kind == FLOW_RPING) ? src->ip : dst_host->ip;
+
+    if (flow->kind == FLOW_UDP)
+    {
+        uint16_t *udp = (uint16_t *) l4;
+
+        ip->proto = IPPROTO_UDP;
+        udp[0] = htons(1024 + id);
+        udp[1] = htons(9);
+        udp[2] = htons(len - sizeof(ethhdr_t) - sizeof(iphdr_t));
+        udp[3] = 0;
+    }
+    else
+    {
+        icmp_packet_t *icmp = (icmp_packet_t *) l4;
+
+        ip->proto = IPPROTO_ICMP;
+        icmp->type = ICMPTYPE_ECHO_REQUEST;
+        icmp->echo.identifier = htons(id);
+    }
+
+    ip->cksum = cksum(ip, sizeof(iphdr_t));
+}
+
+
+/* Offset of the stamp in a frame */
+static inline size_t stamp_offset(uint8_t proto)
+{
+    return sizeof(ethhdr_t) + sizeof(iphdr_t) + (proto == IPPROTO_UDP ? UDP_HDR_LEN : ICMP_HDR_SIZE);
+}
+
+
+/* Answers an ARP request for one of the hosts on an interface */
+static void handle_arp(loadgen_t *lg, batch_t *batch, lg_iface_t *iface, uint8_t *frame, size_t len)
+{
+    arp_packet_t *arp = (arp_packet_t *) (frame + sizeof(ethhdr_t));
+    size_t reply_len = sizeof(ethhdr_t) + sizeof(arp_packet_t);
+
+    if (len < reply_len || ntohs(arp->op) != ARP_OP_REQUEST || !lg->arp_responder)
+    {
+        lg->num_other++;
+        return;
+    }
+
+    for (int h = 0; h < iface->num_hosts; h++)
+    {
+        host_t *host = &iface->hosts[h];
+
+        if (host->ip != arp->tpa)
+            continue;
+
+        uint8_t *reply = batch_add_frame(lg, batch, iface, reply_len);
+        if (reply == NULL)
+            return;
+
+        ethhdr_t *eth = (ethhdr_t *) reply;
+        arp_packet_t *rarp = (arp_packet_t *) (reply + sizeof(ethhdr_t));
+
+        memcpy(eth->dst, arp->sha, ETHER_ADDR_LEN);
+        memcpy(eth->src, host->mac, ETHER_ADDR_LEN);
+        eth->type = htons(ETHERTYPE_ARP);
+        rarp->hrd = htons(ARP_HRD_ETHERNET);
+        rarp->pro = htons(ETHERTYPE_IP);
+        rarp->hln = ETHER_ADDR_LEN;
+        rarp->pln = IPV4_ADDR_LEN;
+        rarp->op = htons(ARP_OP_REPLY);
+        memcpy(rarp->sha, host->mac, ETHER_ADDR_LEN);
+        rarp->spa = host->ip;
+        memcpy(rarp->tha, arp->sha, ETHER_ADDR_LEN);
+        rarp->tpa = arp->spa;
+
+        lg->num_arp_replies++;
+        return;
+    }
+
+    lg->num_other++;
+}
+
+
+/* Handles a frame sent by a router on one of its interfaces */
+static void handle_frame(loadgen_t *lg, batch_t *batch, lg_iface_t *iface, uint8_t *frame, size_t len)
+{
+    ethhdr_t *eth = (ethhdr_t *) frame;
+    iphdr_t *ip = (iphdr_t *) (frame + sizeof(ethhdr_t));
+    loadgen_stamp_t stamp;
+    flow_kind_t kind;
+
+    if (len < sizeof(ethhdr_t))
+    {
+        lg->num_other++;
+        return;
+    }
+
+    if (ntohs(eth->type) == ETHERTYPE_ARP)
+    {
+        handle_arp(lg, batch, iface, frame, len);
+        return;
+    }
+
+    if (ntohs(eth->type) != ETHERTYPE_IP || len < MIN_FRAME_LEN)
+    {
+        lg->num_other++;
+        return;
+    }
+
+    if (ip->proto == IPPROTO_ICMP)
+    {
+        icmp_packet_t *icmp = (icmp_packet_t *) (frame + sizeof(ethhdr_t) + sizeof(iphdr_t));
+
+        if (icmp->type == ICMPTYPE_DEST_UNREACHABLE || icmp->type == ICMPTYPE_TIME_EXCEEDED)
+        {
+            lg->num_icmp_errors++;
+            return;
+        }
+
+        /* A ping to one of our hosts: the host answers it */
+        if (icmp->type == ICMPTYPE_ECHO_REQUEST)
+        {
+            uint8_t *reply = batch_add_frame(lg, batch, iface, len);
+
+            if (reply == NULL)
+                return;
+
+            memcpy(reply, frame, len);
+
+            ethhdr_t *reth = (ethhdr_t *) reply;
+            iphdr_t *rip = (iphdr_t *) (reply + sizeof(ethhdr_t));
+            icmp_packet_t *ricmp = (icmp_packet_t *) (reply + sizeof(ethhdr_t) + sizeof(iphdr_t));
+            size_t icmp_len = len - sizeof(ethhdr_t) - sizeof(iphdr_t);
+
+            memcpy(reth->dst, eth->src, ETHER_ADDR_LEN);
+            memcpy(reth->src, eth->dst, ETHER_ADDR_LEN);
+            rip->src = ip->dst;
+            rip->dst = ip->src;
+            rip->ttl = 64;
+            rip->cksum = 0;
+            rip->cksum = cksum(rip, sizeof(iphdr_t));
+            ricmp->type = ICMPTYPE_ECHO_REPLY;
+            ricmp->chksum = 0;
+            ricmp->chksum = cksum(ricmp, icmp_len);
+            return;
+        }
+
+        if (icmp->type != ICMPTYPE_ECHO_REPLY)
+        {
+            lg->num_other++;
+            return;
+        }
+
+        /* The reply came from the router itself if it's from its interface */
+        kind = (ip->src == iface->ip) ? FLOW_RPING : FLOW_PING;
+    }
+    else if (ip->proto == IPPROTO_UDP)
+        kind = FLOW_UDP;
+    else
+    {
+        lg->num_other++;
+        return;
+    }
+
+    memcpy(&stamp, frame + stamp_offset(ip->proto), sizeof(stamp));
+    if (stamp.magic != LOADGEN_MAGIC)
+    {
+        lg->num_other++;
+        return;
+    }
+
+    __atomic_store_n(&lg->num_returned[kind], lg->num_returned[kind] + 1, __ATOMIC_RELAXED);
+    chirouter_hist_record(&lg->latency[kind], now_ns() - stamp.ts);
+}
+
+
+/* Receiver thread: reads the messages sent by chirouter */
+static void *loadgen_receiver(void *arg)
+{
+    loadgen_t *lg = arg;
+    uint8_t *buf = malloc(RECV_BUFFER_SIZE);
+    batch_t *batch = calloc(1, sizeof(batch_t));
+    size_t len = 0;
+
+    while (buf && batch)
+    {
+        ssize_t n = recv(lg->sock, buf + len, RECV_BUFFER_SIZE - len, 0);
+        size_t pos = 0;
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+
+        while (len - pos >= MSG_HDR_LEN)
+        {
+            uint8_t *msg = buf + pos;
+            uint16_t payload_len;
+
+            memcpy(&payload_len, msg + 2, sizeof(payload_len));
+            payload_len = ntohs(payload_len);
+            if (len - pos < MSG_HDR_LEN + payload_len)
+                break;
+            pos += MSG_HDR_LEN + payload_len;
+
+            if (msg[0] != MSG_TYPE_ETHERNET_FRAME || payload_len < 4)
+                continue;
+
+            uint8_t r_id = msg[4], iface_id = msg[5];
+            uint16_t frame_len;
+
+            memcpy(&frame_len, msg + 6, sizeof(frame_len));
+            frame_len = ntohs(frame_len);
+            if (frame_len > payload_len - 4 || iface_id >= lg->num_ifaces[r_id])
+                continue;
+
+            lg->num_received++;
+            lg->bytes_received += frame_len;
+
+            handle_frame(lg, batch, &lg->ifaces[r_id][iface_id], msg + 8, frame_len);
+        }
+
+        /* ARP and echo replies are sent once all the
+         * messages that were read have been handled */
+        if (batch_flush(lg, batch) != 0)
+            break;
+
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+    }
+
+    free(buf);
+    free(batch);
+    return NULL;
+}
+
+
+/* Number of frames that came back so far */
+static uint64_t loadgen_returned(loadgen_t *lg)
+{
+    uint64_t returned = 0;
+
+    for (int k = 0; k < FLOW_KINDS; k++)
+        returned += __atomic_load_n(&lg->num_returned[k], __ATOMIC_RELAXED);
+
+    return returned;
+}
+
+
+/* Parses a flow mix (e.g., "udp:80,ping:20") into weights */
+static int parse_mix(const char *mix, int *weights)
+{
+    char *copy = strdup(mix), *saveptr = NULL;
+
+    memset(weights, 0, FLOW_KINDS * sizeof(int));
+
+    for (char *tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr))
+    {
+        char *colon = strchr(tok, ':');
+        int k;
+
+        if (colon)
+            *colon = '\0';
+
+        for (k = 0; k < FLOW_KINDS; k++)
+            if (!strcmp(tok, flow_kind_names[k]))
+                break;
+
+        if (k == FLOW_KINDS || (colon && atoi(colon + 1) < 0))
+        {
+            free(copy);
+            return -1;
+        }
+
+        weights[k] = colon ? atoi(colon + 1) : 1;
+    }
+
+    free(copy);
+    return (weights[FLOW_UDP] + weights[FLOW_PING] + weights[FLOW_RPING] > 0) ? 0 : -1;
+}
+
+
+static void print_latency(const char *name, const chirouter_hist_t *hist)
+{
+    printf("%-8s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, hist->count,
+           chirouter_latency_percentile(hist, 50) / 1e3,
+           chirouter_latency_percentile(hist, 90) / 1e3,
+           chirouter_latency_percentile(hist, 99) / 1e3,
+           chirouter_latency_percentile(hist, 99.9) / 1e3,
+           hist->max / 1e3);
+}
+
+
+int main(int argc, char *argv[])
+{
+    char error[TOPOLOGY_MAX_ERROR_LEN];
+    char *topo_file = NULL, *host = "localhost", *port = "23300", *router = NULL, *mix = "udp:100";
+    int hosts_per_iface = 4, num_flows = 64, min_size = 128, max_size = 128;
+    double rate = 0, duration = 5;
+    long num_frames = 0, window = 0;
+    int weights[FLOW_KINDS];
+    chirouter_topology_t *topo;
+    pthread_t receiver;
+    loadgen_t *lg;
+    batch_t *batch;
+    int opt;
+
+    lg = calloc(1, sizeof(loadgen_t));
+    batch = calloc(1, sizeof(batch_t));
+    lg->arp_responder = true;
+    pthread_mutex_init(&lg->lock_send, NULL);
+
+    while ((opt = getopt(argc, argv, "t:c:p:R:H:f:m:s:r:d:n:w:Ah")) != -1)
+        switch (opt)
+        {
+        case 't':
+            topo_file = optarg;
+            break;
+        case 'c':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'R':
+            router = optarg;
+            break;
+        case 'H':
+            hosts_per_iface = atoi(optarg);
+            break;
+        case 'f':
+            num_flows = atoi(optarg);
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 's':
+            if (sscanf(optarg, "%i-%i", &min_size, &max_size) == 1)
+                max_size = min_size;
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'n':
+            num_frames = atol(optarg);
+            break;
+        case 'w':
+            window = atol(optarg);
+            break;
+        case 'A':
+            lg->arp_responder = false;
+            break;
+        case 'h':
+            printf(USAGE);
+            return EXIT_SUCCESS;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+        }
+
+    if (topo_file == NULL)
+    {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    if (hosts_per_iface < 1 || hosts_per_iface > MAX_HOSTS || num_flows < 1 || num_flows > UINT16_MAX)
+    {
+        fprintf(stderr, "ERROR: Hosts per interface must be between 1 and %i, and flows between 1 and %i\n", MAX_HOSTS, UINT16_MAX);
+        return EXIT_FAILURE;
+    }
+
+    if (min_size < (int) MIN_FRAME_LEN || max_size > (int) ETHER_FRAME_MAX_LEN || min_size > max_size)
+    {
+        fprintf(stderr, "ERROR: Frame sizes must be between %zu and %i\n", MIN_FRAME_LEN, ETHER_FRAME_MAX_LEN);
+        return EXIT_FAILURE;
+    }
+
+    if (parse_mix(mix, weights) != 0)
+    {
+        fprintf(stderr, "ERROR: Invalid flow mix: %s\n", mix);
+        return EXIT_FAILURE;
+    }
+
+    topo = chirouter_topology_load(topo_file, error);
+    if (topo == NULL)
+    {
+        fprintf(stderr, "ERROR: %s: %s\n", topo_file, error);
+        return EXIT_FAILURE;
+    }
+
+    if (loadgen_create_hosts(lg, topo, hosts_per_iface) != 0)
+    {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Flows go through the routers in turn. Flows that need two
+     * interfaces (udp and ping) skip routers that have just one. */
+    flow_t *flows = calloc(num_flows, sizeof(flow_t));
+    int total_weight = weights[FLOW_UDP] + weights[FLOW_PING] + weights[FLOW_RPING];
+    uint32_t rand = 12345;
+    int r_id = 0, nr = 0;
+
+    for (int i = 0; i < num_flows; i++)
+    {
+        flow_t *flow = &flows[i];
+        int w;
+
+        rand = rand * 1103515245 + 12345;
+        w = (rand >> 8) % total_weight;
+        flow->kind = (w < weights[FLOW_UDP]) ? FLOW_UDP : (w < weights[FLOW_UDP] + weights[FLOW_PING]) ? FLOW_PING : FLOW_RPING;
+
+        for (nr = 0; nr < topo->num_routers; nr++, r_id = (r_id + 1) % topo->num_routers)
+            if ((router == NULL || !strcmp(topo->routers[r_id].name, router)) &&
+                lg->num_ifaces[r_id] >= (flow->kind == FLOW_RPING ? 1 : 2))
+                break;
+
+        if (nr == topo->num_routers)
+        {
+            fprintf(stderr, "ERROR: No router %s can carry %s flows\n", router ? router : "", flow_kind_names[flow->kind]);
+            return EXIT_FAILURE;
+        }
+
+        int src = (rand >> 16) % lg->num_ifaces[r_id];
+        int dst = (src + 1 + i % (lg->num_ifaces[r_id] > 1 ? lg->num_ifaces[r_id] - 1 : 1)) % lg->num_ifaces[r_id];
+        lg_iface_t *src_iface = &lg->ifaces[r_id][src], *dst_iface = &lg->ifaces[r_id][dst];
+
+        if (src_iface->num_hosts == 0 || dst_iface->num_hosts == 0)
+        {
+            fprintf(stderr, "ERROR: The network of an interface of %s is too small for the emulated hosts\n", topo->routers[r_id].name);
+            return EXIT_FAILURE;
+        }
+
+        uint16_t len = min_size + (max_size > min_size ? (rand >> 4) % (max_size - min_size + 1) : 0);
+
+        build_flow(flow, src_iface, &src_iface->hosts[i % src_iface->num_hosts], dst_iface,
+                   &dst_iface->hosts[(i / src_iface->num_hosts) % dst_iface->num_hosts], i, len);
+
+        r_id = (r_id + 1) % topo->num_routers;
+    }
+
+    lg->sock = loadgen_connect(host, port);
+    if (lg->sock == -1)
+    {
+        fprintf(stderr, "ERROR: Could not connect to chirouter at %s:%s\n", host, port);
+        return EXIT_FAILURE;
+    }
+
+    if (loadgen_configure(lg, topo, batch) != 0)
+    {
+        fprintf(stderr, "ERROR: Could not configure the routers\n");
+        return EXIT_FAILURE;
+    }
+
+    if (pthread_create(&receiver, NULL, loadgen_receiver, lg) != 0)
+    {
+        fprintf(stderr, "ERROR: Could not create the receiver thread\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("# %i routers, %i flows (%s), %i-%i byte frames, ", topo->num_routers, num_flows, mix, min_size, max_size);
+    if (rate > 0)
+        printf("%.0f frames/s", rate);
+    else
+        printf("as fast as possible");
+    if (num_frames > 0)
+        printf(", %li frames\n", num_frames);
+    else
+        printf(", %.1f s\n", duration);
+
+    uint64_t start = now_ns(), next = start;
+    uint64_t end = start + duration * 1e9;
+    uint64_t gap = rate > 0 ? 1e9 / rate : 0;
+
+    for (long i = 0; num_frames > 0 ? i < num_frames : true; i++)
+    {
+        flow_t *flow = &flows[i % num_flows];
+        uint64_t now = 0;
+
+        /* Check the clock (and the pacing) only once in a while
+         * when sending as fast as possible */
+        if (gap > 0 || i % 64 == 0)
+        {
+            now = now_ns();
+            if (num_frames == 0 && now >= end)
+                break;
+        }
+
+        if (gap > 0)
+        {
+            if (now < next)
+            {
+                if (batch_flush(lg, batch) != 0)
+                    break;
+                while ((now = now_ns()) < next)
+                    ;
+            }
+            next += gap;
+        }
+
+        /* Frames that don't come back (or are dropped by the router)
+         * only hold the window for a while */
+        if (window > 0 && i - (long) loadgen_returned(lg) >= window)
+        {
+            uint64_t wait_start = now_ns();
+
+            if (batch_flush(lg, batch) != 0)
+                break;
+            while (i - (long) loadgen_returned(lg) >= window && now_ns() - wait_start < WINDOW_TIMEOUT_NS)
+                sched_yield();
+        }
+
+        uint8_t *frame = batch_add_frame(lg, batch, flow->src, flow->len);
+        if (frame == NULL)
+            break;
+
+        memcpy(frame, flow->frame, flow->len);
+
+        iphdr_t *ip = (iphdr_t *) (frame + sizeof(ethhdr_t));
+        loadgen_stamp_t stamp = { .magic = LOADGEN_MAGIC, .flow = i % num_flows, .ts = now_ns() };
+
+        memcpy(frame + stamp_offset(ip->proto), &stamp, sizeof(stamp));
+        if (ip->proto == IPPROTO_ICMP)
+        {
+            icmp_packet_t *icmp = (icmp_packet_t *) (frame + sizeof(ethhdr_t) + sizeof(iphdr_t));
+
+            icmp->echo.seq_num = htons(i);
+            icmp->chksum = cksum(icmp, flow->len - sizeof(ethhdr_t) - sizeof(iphdr_t));
+        }
+
+        lg->num_sent++;
+        lg->bytes_sent += flow->len;
+    }
+
+    batch_flush(lg, batch);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    /* Wait for the frames in flight, for as long as they keep coming back */
+    uint64_t last, returned = loadgen_returned(lg);
+    do
+    {
+        last = returned;
+        usleep(DRAIN_TIME_NS / 1000);
+        returned = loadgen_returned(lg);
+    } while (returned != last && returned < lg->num_sent);
+
+    shutdown(lg->sock, SHUT_RDWR);
+    pthread_join(receiver, NULL);
+    close(lg->sock);
+
+    returned = loadgen_returned(lg);
+
+    printf("sent:        %lu frames in %.3f s (%.0f frames/s, %.2f Mbit/s)\n", lg->num_sent, elapsed,
+           lg->num_sent / elapsed, lg->bytes_sent * 8 / elapsed / 1e6);
+    printf("received:    %lu frames (%lu came back, %.2f%%)\n", lg->num_received, returned,
+           lg->num_sent ? 100.0 * returned / lg->num_sent : 0);
+    printf("arp replies: %lu, icmp errors: %lu, other frames: %lu\n", lg->num_arp_replies, lg->num_icmp_errors, lg->num_other);
+    printf("%-8s %10s %10s %10s %10s %10s %10s\n", "latency", "count", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    for (int k = 0; k < FLOW_KINDS; k++)
+        if (weights[k] > 0)
+            print_latency(flow_kind_names[k], &lg->latency[k]);
+
+    for (int i = 0; i < topo->num_routers; i++)
+        free(lg->ifaces[i]);
+    chirouter_topology_free(topo);
+    free(flows);
+    free(batch);
+    free(lg);
+
+    return EXIT_SUCCESS;
+}
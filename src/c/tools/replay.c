@@ -0,0 +1,548 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  chirouter_replay: runs the routers of a topology in-process (without
+ *  POX or Mininet), and feeds them the inbound frames of a capture file.
+ *
+ *  The routers are built from a topology file (see topology.h). The
+ *  MAC addresses of their interfaces are taken from the topology or,
+ *  if it doesn't specify them, from the interface description blocks
+ *  of the capture file (captures written with chirouter -w have them),
+ *  so the recorded frames are addressed to the routers. The frames
+ *  the routers send are written to an output capture file, together
+ *  with the inbound frames, in the same format as chirouter -w.
+ *
+ *  By default, frames are replayed as fast as possible, and the frames
+ *  the routers send are timestamped with the time of the inbound frame
+ *  that caused them, so replaying the same capture always produces the
+ *  same output. Since no time passes, ARP requests are not resent and
+ *  don't time out. With -r, frames are replayed at their recorded
+ *  timing (sped up by a factor of SPEED), and the routers run their
+ *  ARP threads as usual.
+ *
+ *  When it's done, it reports the throughput, and how many of the
+ *  outbound frames in the capture file were sent by the routers (and
+ *  exits with status 2 if some of them weren't).
+ *
+ *  Usage: chirouter_replay -t TOPOLOGY -i INPUT [-o OUTPUT] [-r SPEED] [-n LOOPS] [-l LINGER] [-v]
+ *
+ *  -t TOPOLOGY: Topology file (e.g., topologies/3router.json)
+ *  -i INPUT: Capture file with the frames to replay
+ *  -o OUTPUT: Capture file to write the frames to
+ *  -r SPEED: Replay at the recorded timing, sped up by SPEED (1 for
+ *            the recorded timing). By default, frames are replayed
+ *            as fast as possible.
+ *  -n LOOPS: Replay the frames LOOPS times (default: 1). The ARP caches
+ *            of the routers are flushed before each loop.
+ *  -l LINGER: With -r, keep the routers running LINGER seconds after
+ *             the last frame (e.g., to let pending ARP requests time out)
+ *  -v: Be verbose (can be repeated)
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "chirouter.h"
+#include "server.h"
+#include "pcap.h"
+#include "arp.h"
+#include "topology.h"
+
+#define USAGE "Usage: chirouter_replay -t TOPOLOGY -i INPUT [-o OUTPUT] [-r SPEED] [-n LOOPS] [-l LINGER] [-v]\n"
+
+#define BILLION (1000000000ull)
+
+/* A frame of the input capture file */
+typedef struct
+{
+    uint64_t ts;
+    uint8_t *data;
+    uint32_t len;
+    pcap_packet_direction_t dir;
+
+    /* Router interface the frame was captured on
+     * (NULL if it isn't an interface of the topology) */
+    chirouter_ctx_t *router;
+    chirouter_interface_t *iface;
+} replay_frame_t;
+
+/* State of the replay, shared with the frame sink */
+typedef struct
+{
+    /* Output capture file (NULL if none) */
+    FILE *out;
+    pthread_mutex_t lock;
+
+    /* Timestamp to give the frames written to the output */
+    double speed;
+    uint64_t ts;
+    uint64_t first_ts;
+    uint64_t start;
+
+    /* Frames sent by the routers */
+    uint64_t num_sent;
+    uint64_t bytes_sent;
+
+    /* Hashes of the frames sent by the routers (only during
+     * the first loop) and of the expected outbound frames */
+    uint64_t *sent_hashes;
+    uint64_t num_sent_hashes;
+    uint64_t max_sent_hashes;
+    bool first_loop;
+} replay_t;
+
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+
+/* Hash of a frame and the interface it was sent on (FNV-1a) */
+static uint64_t frame_hash(chirouter_interface_t *iface, const uint8_t *data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < sizeof(iface); i++)
+        hash = (hash ^ ((uintptr_t) iface >> (i * 8) & 0xFF)) * 0x100000001b3ull;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+
+    return hash;
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+
+/* Timestamp for a frame written to the output */
+static uint64_t replay_ts(replay_t *replay)
+{
+    if (replay->speed > 0)
+        return replay->first_ts + (now_ns() - replay->start) * replay->speed;
+    else
+        return replay->ts;
+}
+
+
+/* Frame sink: writes the frames sent by the routers to the output */
+static int replay_sink(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *frame, size_t len, void *arg)
+{
+    replay_t *replay = arg;
+    int rc = 0;
+
+    /* With -r, the ARP threads can send frames too */
+    pthread_mutex_lock(&replay->lock);
+
+    replay->num_sent++;
+    replay->bytes_sent += len;
+
+    if (replay->first_loop)
+    {
+        if (replay->num_sent_hashes == replay->max_sent_hashes)
+        {
+            uint64_t max = replay->max_sent_hashes ? replay->max_sent_hashes * 2 : 1024;
+            uint64_t *hashes = realloc(replay->sent_hashes, max * sizeof(uint64_t));
+
+            if (hashes != NULL)
+            {
+                replay->sent_hashes = hashes;
+                replay->max_sent_hashes = max;
+            }
+        }
+        if (replay->num_sent_hashes < replay->max_sent_hashes)
+            replay->sent_hashes[replay->num_sent_hashes++] = frame_hash(iface, frame, len);
+    }
+
+    if (replay->out && chirouter_pcapng_write_epb(replay->out, iface->pcap_iface_id, replay_ts(replay), frame, len, len,
+                                                  PCAP_OUTBOUND, NULL) != 0)
+        rc = -1;
+
+    pthread_mutex_unlock(&replay->lock);
+
+    return rc;
+}
+
+
+/* Reads all the frames of the input capture file, and maps the
+ * interfaces they were captured on to the routers' interfaces. The
+ * interfaces that don't have a MAC address get the one in the capture
+ * file or, if it doesn't have one either, a locally administered one. */
+static replay_frame_t *load_frames(server_ctx_t *ctx, const chirouter_topology_t *topo, const char *path, uint64_t *num_frames)
+{
+    chirouter_pcapng_reader_t *reader;
+    chirouter_pcapng_frame_t frame;
+    replay_frame_t *frames = NULL;
+    uint64_t max_frames = 0;
+    uint32_t *iface_ids = NULL;
+    int rc;
+
+    reader = chirouter_pcapng_open(path);
+    if (reader == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not open %s (or it is not a pcapng file)\n", path);
+        return NULL;
+    }
+
+    *num_frames = 0;
+    while ((rc = chirouter_pcapng_read_frame(reader, &frame)) == 1)
+    {
+        if (*num_frames == max_frames)
+        {
+            max_frames = max_frames ? max_frames * 2 : 1024;
+            frames = realloc(frames, max_frames * sizeof(replay_frame_t));
+            iface_ids = realloc(iface_ids, max_frames * sizeof(uint32_t));
+            if (frames == NULL || iface_ids == NULL)
+            {
+                fprintf(stderr, "ERROR: Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        replay_frame_t *f = &frames[*num_frames];
+
+        f->ts = frame.ts;
+        f->len = frame.caplen;
+        f->dir = frame.dir;
+        f->data = malloc(frame.caplen);
+        if (f->data == NULL)
+        {
+            fprintf(stderr, "ERROR: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(f->data, frame.data, frame.caplen);
+        iface_ids[*num_frames] = frame.iface_id;
+
+        (*num_frames)++;
+    }
+
+    if (rc == -1)
+    {
+        fprintf(stderr, "ERROR: %s is not a valid pcapng file\n", path);
+        return NULL;
+    }
+
+    /* Interface description blocks can appear anywhere in the file,
+     * so the frames are only mapped once all of them have been read */
+    for (int i = 0; i < ctx->num_routers; i++)
+        for (int j = 0; j < ctx->routers[i].num_interfaces; j++)
+        {
+            chirouter_interface_t *iface = &ctx->routers[i].interfaces[j];
+            char name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+
+            if (topo->routers[i].interfaces[j].has_mac)
+                continue;
+
+            snprintf(name, sizeof(name), "%s-%s", ctx->routers[i].name, iface->name);
+
+            uint8_t mac[ETHER_ADDR_LEN] = {0x02, 0x00, 0x00, 0x00, i, j};
+            memcpy(iface->mac, mac, ETHER_ADDR_LEN);
+
+            for (uint32_t k = 0; k < reader->num_ifaces; k++)
+                if (reader->ifaces[k].has_mac && !strcmp(reader->ifaces[k].name, name))
+                    memcpy(iface->mac, reader->ifaces[k].mac, ETHER_ADDR_LEN);
+        }
+
+    for (uint64_t i = 0; i < *num_frames; i++)
+        frames[i].iface = chirouter_topology_find_iface(ctx, reader->ifaces[iface_ids[i]].name, &frames[i].router);
+
+    free(iface_ids);
+    chirouter_pcapng_close(reader);
+
+    return frames;
+}
+
+
+int main(int argc, char *argv[])
+{
+    char error[TOPOLOGY_MAX_ERROR_LEN];
+    char *topo_file = NULL, *in_file = NULL, *out_file = NULL;
+    chirouter_topology_t *topo;
+    server_ctx_t *ctx;
+    replay_frame_t *frames;
+    uint64_t num_frames;
+    replay_t replay;
+    long num_loops = 1;
+    double linger = 0;
+    int verbosity = 0;
+    int opt;
+
+    memset(&replay, 0, sizeof(replay));
+
+    while ((opt = getopt(argc, argv, "t:i:o:r:n:l:vh")) != -1)
+        switch (opt)
+        {
+        case 't':
+            topo_file = optarg;
+            break;
+        case 'i':
+            in_file = optarg;
+            break;
+        case 'o':
+            out_file = optarg;
+            break;
+        case 'r':
+            replay.speed = atof(optarg);
+            if (replay.speed <= 0)
+            {
+                fprintf(stderr, "ERROR: Invalid speed: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            num_loops = atol(optarg);
+            if (num_loops < 1)
+            {
+                fprintf(stderr, "ERROR: Invalid number of loops: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'l':
+            linger = atof(optarg);
+            break;
+        case 'v':
+            verbosity++;
+            break;
+        case 'h':
+            printf(USAGE);
+            return EXIT_SUCCESS;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+        }
+
+    if (topo_file == NULL || in_file == NULL)
+    {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    chirouter_setloglevel(verbosity == 0 ? ERROR : verbosity == 1 ? INFO : verbosity == 2 ? DEBUG : TRACE);
+
+    topo = chirouter_topology_load(topo_file, error);
+    if (topo == NULL)
+    {
+        fprintf(stderr, "ERROR: %s: %s\n", topo_file, error);
+        return EXIT_FAILURE;
+    }
+
+    chirouter_server_ctx_init(&ctx);
+    ctx->frame_sink = replay_sink;
+    ctx->frame_sink_arg = &replay;
+    pthread_mutex_init(&replay.lock, NULL);
+
+    if (chirouter_topology_build(ctx, topo) != 0)
+    {
+        fprintf(stderr, "ERROR: Could not create the routers\n");
+        return EXIT_FAILURE;
+    }
+
+    frames = load_frames(ctx, topo, in_file, &num_frames);
+    if (frames == NULL)
+        return EXIT_FAILURE;
+
+    for (int i = 0; i < ctx->num_routers; i++)
+        chirouter_ctx_log(&ctx->routers[i], INFO);
+
+    if (out_file)
+    {
+        replay.out = fopen(out_file, "w");
+        if (replay.out == NULL)
+        {
+            fprintf(stderr, "ERROR: Could not create %s\n", out_file);
+            return EXIT_FAILURE;
+        }
+        setvbuf(replay.out, NULL, _IOFBF, PCAP_BATCH_SIZE);
+
+        if (chirouter_pcapng_write_shb(replay.out) != 0 ||
+            chirouter_pcap_write_interfaces(ctx, replay.out, ETHER_FRAME_MAX_LEN) != 0)
+        {
+            fprintf(stderr, "ERROR: Could not write to %s\n", out_file);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (replay.speed > 0)
+        for (int i = 0; i < ctx->num_routers; i++)
+            if (chirouter_arp_start(&ctx->routers[i]) != 0)
+            {
+                fprintf(stderr, "ERROR: Could not start the ARP threads\n");
+                return EXIT_FAILURE;
+            }
+
+    /* Hashes of the outbound frames in the capture file */
+    uint64_t *expected = malloc((num_frames ? num_frames : 1) * sizeof(uint64_t));
+    uint64_t num_expected = 0;
+
+    for (uint64_t i = 0; i < num_frames; i++)
+        if (frames[i].iface && frames[i].dir == PCAP_OUTBOUND)
+            expected[num_expected++] = frame_hash(frames[i].iface, frames[i].data, frames[i].len);
+
+    uint64_t num_received = 0, bytes_received = 0, num_skipped = 0;
+    uint64_t first_ts = num_frames ? frames[0].ts : 0;
+    uint64_t last_ts = num_frames ? frames[num_frames - 1].ts : 0;
+
+    replay.first_ts = first_ts;
+    replay.first_loop = true;
+    replay.start = now_ns();
+
+    for (long loop = 0; loop < num_loops; loop++)
+    {
+        /* With -r, loops are played one after the other */
+        uint64_t loop_offset = loop * (last_ts - first_ts);
+
+        for (uint64_t i = 0; i < num_frames; i++)
+        {
+            replay_frame_t *f = &frames[i];
+
+            /* Outbound frames are what the routers are expected to send */
+            if (f->dir == PCAP_OUTBOUND)
+                continue;
+
+            if (f->iface == NULL)
+            {
+                num_skipped++;
+                continue;
+            }
+
+            if (replay.speed > 0)
+            {
+                uint64_t due = replay.start + (f->ts - first_ts + loop_offset) / replay.speed;
+                uint64_t now = now_ns();
+
+                if (due > now)
+                {
+                    struct timespec delay = { .tv_sec = (due - now) / BILLION, .tv_nsec = (due - now) % BILLION };
+                    nanosleep(&delay, NULL);
+                }
+            }
+
+            pthread_mutex_lock(&replay.lock);
+            replay.ts = f->ts + loop_offset;
+            if (replay.out)
+                chirouter_pcapng_write_epb(replay.out, f->iface->pcap_iface_id, replay_ts(&replay), f->data, f->len, f->len,
+                                           PCAP_INBOUND, NULL);
+            pthread_mutex_unlock(&replay.lock);
+
+            num_received++;
+            bytes_received += f->len;
+
+            if (chirouter_server_process_ethernet_frame(f->router, f->iface, f->data, f->len) == -1)
+            {
+                fprintf(stderr, "ERROR: Critical error while processing frame %lu\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+
+        pthread_mutex_lock(&replay.lock);
+        replay.first_loop = false;
+        pthread_mutex_unlock(&replay.lock);
+
+        /* Each loop starts with empty ARP caches, as the capture did
+         * (otherwise, the caches would fill up with the same entries) */
+        if (loop < num_loops - 1)
+            for (int i = 0; i < ctx->num_routers; i++)
+                chirouter_arp_flush(&ctx->routers[i]);
+    }
+
+    double elapsed = (now_ns() - replay.start) / 1e9;
+
+    if (replay.speed > 0 && linger > 0)
+    {
+        struct timespec delay = { .tv_sec = linger, .tv_nsec = (linger - (long) linger) * 1e9 };
+        nanosleep(&delay, NULL);
+    }
+
+    /* The ARP threads can't send frames once they are stopped */
+    for (int i = 0; i < ctx->num_routers; i++)
+        chirouter_arp_stop(&ctx->routers[i]);
+
+    pthread_mutex_lock(&replay.lock);
+
+    if (replay.out && fclose(replay.out) != 0)
+        fprintf(stderr, "ERROR: Could not write to %s\n", out_file);
+    replay.out = NULL;
+
+    /* Count the expected frames that were sent (as multisets) */
+    uint64_t num_matching = 0;
+
+    qsort(expected, num_expected, sizeof(uint64_t), cmp_u64);
+    qsort(replay.sent_hashes, replay.num_sent_hashes, sizeof(uint64_t), cmp_u64);
+    for (uint64_t i = 0, j = 0; i < num_expected && j < replay.num_sent_hashes; )
+    {
+        if (expected[i] == replay.sent_hashes[j])
+        {
+            num_matching++;
+            i++;
+            j++;
+        }
+        else if (expected[i] < replay.sent_hashes[j])
+            i++;
+        else
+            j++;
+    }
+
+    printf("frames received:  %lu (%lu bytes, %lu not on a router interface)\n", num_received, bytes_received, num_skipped);
+    printf("frames sent:      %lu (%lu bytes)\n", replay.num_sent, replay.bytes_sent);
+    printf("expected frames:  %lu of %lu sent\n", num_matching, num_expected);
+    printf("elapsed:          %.6f s\n", elapsed);
+    if (num_received > 0 && elapsed > 0)
+        printf("throughput:       %.0f frames/s, %.2f Mbit/s, %.1f ns/frame\n", num_received / elapsed,
+               bytes_received * 8 / elapsed / 1e6, elapsed * 1e9 / num_received);
+
+    chirouter_server_ctx_destroy(ctx);
+    free(ctx);
+
+    for (uint64_t i = 0; i < num_frames; i++)
+        free(frames[i].data);
+    free(frames);
+    free(expected);
+    free(replay.sent_hashes);
+    chirouter_topology_free(topo);
+
+    return (num_matching == num_expected) ? EXIT_SUCCESS : 2;
+}
@@ -0,0 +1,1417 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  chirouter_sim: in-process simulator of a whole topology, to measure
+ *  the end-to-end latency and throughput of traffic through chains of
+ *  routers without Mininet.
+ *
+ *  It builds the routers of a topology file (see topology.h) in the
+ *  same process, along with the hosts, switches and links of the
+ *  topology, and runs a discrete event simulation of the network:
+ *
+ *  - Frames travel over in-memory links. Every hop (a host or router
+ *    interface sending a frame to a switch or to the other end of a
+ *    direct link) takes a fixed delay (-D), drops frames with a given
+ *    probability (-L), and can have a limited bandwidth (-B). Switches
+ *    know the MAC addresses of all the ports connected to them, so
+ *    they send unicast frames to one port, and broadcasts to all.
+ *
+ *  - Routers process frames with chirouter_server_process_ethernet_frame
+ *    (so their statistics and flight recorders work like in chirouter),
+ *    one frame at a time: a frame that arrives while a router is busy
+ *    waits in its queue. Processing a frame takes as much virtual time
+ *    as it took in real time, unless a fixed cost is given (-C), which
+ *    makes runs reproducible.
+ *
+ *  - Hosts answer ARP requests and pings, answer UDP datagrams to ports
+ *    other than 9 (discard) with port unreachable errors, and send the
+ *    traffic of the flows given in the command line: pings (-p),
+ *    traceroutes (-T), and UDP streams (-u) from a host to a host or
+ *    an IP address. Without flows, every host pings every other host.
+ *
+ *  Time is virtual, so the results don't depend on how fast the machine
+ *  is, except for the cost of the routers (which is what is measured).
+ *  The routers use a virtual clock too (see clock.h): instead of ARP
+ *  threads, the simulation runs chirouter_arp_tick on every router each
+ *  ARP_TICK_INTERVAL of virtual time, so ARP requests are retried, and
+ *  time out, just like in chirouter (only much faster).
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include "chirouter.h"
+#include "server.h"
+#include "arp.h"
+#include "clock.h"
+#include "latency.h"
+#include "topology.h"
+#include "utils.h"
+#include "utlist.h"
+
+#define USAGE "Usage: chirouter_sim -t TOPOLOGY [-p SRC:DST] [-T SRC:DST] [-u SRC:DST] [-c COUNT] [-i INTERVAL]\n" \
+              "                     [-s SIZE] [-D DELAY] [-L LOSS] [-B MBPS] [-C COST] [-S SEED] [-v]\n"
+
+#define BILLION (1000000000ull)
+
+#define MAX_FLOWS (1024)
+#define HOST_ARP_CACHE_SIZE (64)
+
+/* Hosts send ARP requests again if they don't get a reply in this time */
+#define HOST_ARP_RETRY_NS (1000000000ull)
+
+/* Traceroutes send probes with TTLs up to TRACEROUTE_MAX_TTL, and
+ * wait up to TRACEROUTE_TIMEOUT_NS for an answer to each one */
+#define TRACEROUTE_MAX_TTL (30)
+#define TRACEROUTE_TIMEOUT_NS (1000000000ull)
+#define TRACEROUTE_PORT (33434)
+
+/* Source ports of UDP flows are FLOW_PORT + the flow number */
+#define FLOW_PORT (40000)
+#define DISCARD_PORT (9)
+
+#define UDP_HDR_LEN (8)
+#define SIM_MAGIC (0x4353494D)
+
+/* Stamp in the payload of pings and UDP datagrams */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t flow;
+    uint64_t ts;
+} __attribute__((packed)) sim_stamp_t;
+
+#define MIN_FRAME_LEN (sizeof(ethhdr_t) + sizeof(iphdr_t) + ICMP_HDR_SIZE + sizeof(sim_stamp_t))
+
+typedef enum
+{
+    FLOW_PING = 0,
+    FLOW_TRACEROUTE,
+    FLOW_UDP,
+} flow_kind_t;
+
+static const char *flow_kind_names[] = { "ping", "traceroute", "udp" };
+
+/* A frame withheld by a host until it knows the MAC address of its next hop */
+typedef struct sim_pending
+{
+    uint32_t next_hop;
+    uint64_t requested;
+    uint8_t *frame;
+    size_t len;
+    struct sim_pending *prev;
+    struct sim_pending *next;
+} sim_pending_t;
+
+typedef struct
+{
+    const chirouter_topo_host_t *topo;
+    int port;
+    uint32_t ip, mask, gateway;
+
+    struct
+    {
+        uint32_t ip;
+        uint8_t mac[ETHER_ADDR_LEN];
+    } arp[HOST_ARP_CACHE_SIZE];
+    int num_arp;
+
+    sim_pending_t *pending;
+} sim_host_t;
+
+/* A port of a segment: a router interface, or a host */
+typedef struct
+{
+    char name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    /* Segment the port is connected to (-1 if it isn't connected) */
+    int segment;
+
+    /* Router and interface, or host */
+    chirouter_ctx_t *router;
+    chirouter_interface_t *iface;
+    sim_host_t *host;
+
+    /* Time at which the port is done sending what it has sent so far */
+    uint64_t tx_busy;
+} sim_port_t;
+
+/* A frame waiting for a router */
+typedef struct sim_queued
+{
+    int port;
+    uint8_t *frame;
+    size_t len;
+    struct sim_queued *prev;
+    struct sim_queued *next;
+} sim_queued_t;
+
+typedef struct
+{
+    chirouter_ctx_t *ctx;
+    uint64_t busy_until;
+    sim_queued_t *queue;
+
+    uint64_t num_frames;
+    uint64_t total_cost;
+} sim_router_t;
+
+typedef struct
+{
+    flow_kind_t kind;
+    sim_host_t *src;
+    uint32_t dst;
+    char dst_name[TOPOLOGY_MAX_HOST_NAMELEN + 1];
+
+    uint64_t sent, received, errors;
+    uint64_t bytes_received;
+    uint64_t first_sent, last_received;
+    int hops;
+    chirouter_hist_t latency;
+
+    /* Traceroute: TTL of the probe being waited for, when
+     * it was sent, and the address of each hop (0 if none) */
+    int probe_ttl;
+    uint64_t probe_sent;
+    uint32_t hop_ip[TRACEROUTE_MAX_TTL + 1];
+    uint64_t hop_rtt[TRACEROUTE_MAX_TTL + 1];
+    bool done;
+} sim_flow_t;
+
+typedef enum
+{
+    EV_FRAME = 0,   /* A frame arrives at a port */
+    EV_ROUTER,      /* A router is done with a frame */
+    EV_FLOW,        /* A flow sends its next frame (or a traceroute probe times out) */
+    EV_ARP,         /* The routers run their ARP timeouts */
+} sim_event_type_t;
+
+typedef struct
+{
+    uint64_t time;
+    uint64_t seq;
+    sim_event_type_t type;
+    int index;
+    int arg;
+    uint8_t *frame;
+    size_t len;
+} sim_event_t;
+
+/* Output frames of the router that is processing a frame */
+typedef struct
+{
+    int port;
+    uint8_t *frame;
+    size_t len;
+} sim_output_t;
+
+typedef struct
+{
+    server_ctx_t *ctx;
+
+    sim_port_t *ports;
+    int num_ports;
+    int num_segments;
+
+    sim_router_t *routers;
+    sim_host_t *hosts;
+    int num_hosts;
+
+    sim_flow_t *flows;
+    int num_flows;
+    int count;
+    uint64_t interval;
+    int size;
+
+    /* Link parameters */
+    uint64_t delay;
+    double loss;
+    double mbps;
+    uint64_t cost;
+    uint64_t rand;
+
+    /* Event queue (a binary heap ordered by time and sequence number) */
+    sim_event_t *events;
+    int num_events;
+    int max_events;
+    uint64_t seq;
+    uint64_t now;
+
+    /* Clock of the routers, and time of the last event other than EV_ARP */
+    chirouter_clock_t clock;
+    uint64_t last_activity;
+
+    sim_output_t *outputs;
+    int num_outputs;
+    int max_outputs;
+
+    uint64_t num_processed;
+    uint64_t num_lost;
+    uint64_t num_unlinked;
+    uint64_t num_unknown;
+} sim_t;
+
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (p == NULL)
+    {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return p;
+}
+
+
+/* Random number in [0, 1) (xorshift64*) */
+static double sim_random(sim_t *sim)
+{
+    sim->rand ^= sim->rand >> 12;
+    sim->rand ^= sim->rand << 25;
+    sim->rand ^= sim->rand >> 27;
+    return ((sim->rand * 0x2545F4914F6CDD1Dull) >> 11) / (double) (1ull << 53);
+}
+
+
+static bool event_before(const sim_event_t *a, const sim_event_t *b)
+{
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+
+static void sim_schedule(sim_t *sim, uint64_t time, sim_event_type_t type, int index, int arg, uint8_t *frame, size_t len)
+{
+    sim_event_t ev = { .time = time, .seq = sim->seq++, .type = type, .index = index, .arg = arg,
+                       .frame = frame, .len = len };
+    int i;
+
+    if (sim->num_events == sim->max_events)
+    {
+        sim->max_events = sim->max_events ? sim->max_events * 2 : 1024;
+        sim->events = realloc(sim->events, sim->max_events * sizeof(sim_event_t));
+        if (sim->events == NULL)
+        {
+            fprintf(stderr, "ERROR: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = sim->num_events++; i > 0 && event_before(&ev, &sim->events[(i - 1) / 2]); i = (i - 1) / 2)
+        sim->events[i] = sim->events[(i - 1) / 2];
+    sim->events[i] = ev;
+}
+
+
+static sim_event_t sim_next_event(sim_t *sim)
+{
+    sim_event_t first = sim->events[0];
+    sim_event_t last = sim->events[--sim->num_events];
+    int i = 0;
+
+    while (2 * i + 1 < sim->num_events)
+    {
+        int child = 2 * i + 1;
+
+        if (child + 1 < sim->num_events && event_before(&sim->events[child + 1], &sim->events[child]))
+            child++;
+        if (!event_before(&sim->events[child], &last))
+            break;
+
+        sim->events[i] = sim->events[child];
+        i = child;
+    }
+    sim->events[i] = last;
+
+    return first;
+}
+
+
+/* Sends a frame from a port at a given time. Takes ownership of the frame. */
+static void sim_transmit(sim_t *sim, int port, uint64_t time, uint8_t *frame, size_t len)
+{
+    sim_port_t *src = &sim->ports[port];
+    ethhdr_t *eth = (ethhdr_t *) frame;
+    bool flood = eth->dst[0] & 0x01;
+    int num_dsts = 0;
+
+    if (src->segment == -1)
+    {
+        sim->num_unlinked++;
+        free(frame);
+        return;
+    }
+
+    /* The frame is on the wire until it has been sent entirely */
+    if (sim->mbps > 0)
+    {
+        if (src->tx_busy > time)
+            time = src->tx_busy;
+        time += len * 8 * 1000 / sim->mbps;
+        src->tx_busy = time;
+    }
+
+    for (int i = 0; i < sim->num_ports; i++)
+    {
+        sim_port_t *dst = &sim->ports[i];
+
+        if (i == port || dst->segment != src->segment)
+            continue;
+        if (!flood && memcmp(dst->mac, eth->dst, ETHER_ADDR_LEN))
+            continue;
+
+        num_dsts++;
+
+        if (sim->loss > 0 && sim_random(sim) < sim->loss)
+        {
+            sim->num_lost++;
+            continue;
+        }
+
+        uint8_t *copy = xmalloc(len);
+        memcpy(copy, frame, len);
+        sim_schedule(sim, time + sim->delay, EV_FRAME, i, 0, copy, len);
+    }
+
+    if (num_dsts == 0)
+        sim->num_unknown++;
+
+    free(frame);
+}
+
+
+/* Frame sink: collects the frames sent by the router being run */
+static int sim_sink(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *frame, size_t len, void *arg)
+{
+    sim_t *sim = arg;
+    int port = -1;
+
+    for (int i = 0; i < sim->num_ports; i++)
+        if (sim->ports[i].iface == iface)
+            port = i;
+
+    if (port == -1)
+        return -1;
+
+    if (sim->num_outputs == sim->max_outputs)
+    {
+        sim->max_outputs = sim->max_outputs ? sim->max_outputs * 2 : 64;
+        sim->outputs = realloc(sim->outputs, sim->max_outputs * sizeof(sim_output_t));
+        if (sim->outputs == NULL)
+            return -1;
+    }
+
+    sim->outputs[sim->num_outputs].port = port;
+    sim->outputs[sim->num_outputs].frame = xmalloc(len);
+    sim->outputs[sim->num_outputs].len = len;
+    memcpy(sim->outputs[sim->num_outputs].frame, frame, len);
+    sim->num_outputs++;
+
+    return 0;
+}
+
+
+/* Runs a router on a frame, and sends the frames it produces once it's done */
+static int sim_router_process(sim_t *sim, sim_router_t *router, int port, uint8_t *frame, size_t len)
+{
+    uint64_t start = now_ns();
+    int rc;
+
+    sim->num_outputs = 0;
+    rc = chirouter_server_process_ethernet_frame(router->ctx, sim->ports[port].iface, frame, len);
+    uint64_t cost = sim->cost ? sim->cost : now_ns() - start;
+    free(frame);
+
+    if (rc == -1)
+        return -1;
+
+    router->num_frames++;
+    router->total_cost += cost;
+    router->busy_until = sim->now + cost;
+
+    for (int i = 0; i < sim->num_outputs; i++)
+        sim_transmit(sim, sim->outputs[i].port, router->busy_until, sim->outputs[i].frame, sim->outputs[i].len);
+
+    sim_schedule(sim, router->busy_until, EV_ROUTER, router - sim->routers, 0, NULL, 0);
+
+    return 0;
+}
+
+
+/* Runs the ARP timeouts of all the routers (which can send ARP requests
+ * and ICMP errors) and schedules the next run, unless there is nothing
+ * left to do */
+static void sim_arp_tick(sim_t *sim)
+{
+    bool pending = false;
+
+    for (int i = 0; i < sim->ctx->num_routers; i++)
+    {
+        sim->num_outputs = 0;
+        chirouter_arp_tick(sim->routers[i].ctx);
+
+        for (int j = 0; j < sim->num_outputs; j++)
+            sim_transmit(sim, sim->outputs[j].port, sim->now, sim->outputs[j].frame, sim->outputs[j].len);
+
+        pending |= sim->routers[i].ctx->num_pending_arp_reqs > 0;
+    }
+
+    if (sim->num_events > 0 || pending)
+        sim_schedule(sim, sim->now + ARP_TICK_INTERVAL, EV_ARP, 0, 0, NULL, 0);
+}
+
+
+/* Builds an Ethernet frame with an IP datagram from a host (with the
+ * Ethernet destination left to host_send) and returns its payload */
+static uint8_t *host_build_ip(sim_host_t *host, uint8_t **frame, size_t len, uint8_t proto, uint32_t dst, uint8_t ttl)
+{
+    ethhdr_t *eth;
+    iphdr_t *ip;
+
+    *frame = xmalloc(len);
+    memset(*frame, 0, len);
+    eth = (ethhdr_t *) *frame;
+    ip = (iphdr_t *) (*frame + sizeof(ethhdr_t));
+
+    eth->type = htons(ETHERTYPE_IP);
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->len = htons(len - sizeof(ethhdr_t));
+    ip->ttl = ttl;
+    ip->proto = proto;
+    ip->src = host->ip;
+    ip->dst = dst;
+
+    return *frame + sizeof(ethhdr_t) + sizeof(iphdr_t);
+}
+
+
+static void host_send_arp(sim_t *sim, sim_host_t *host, uint16_t op, uint32_t tpa, const uint8_t *tha)
+{
+    size_t len = sizeof(ethhdr_t) + sizeof(arp_packet_t);
+    uint8_t *frame = xmalloc(len);
+    ethhdr_t *eth = (ethhdr_t *) frame;
+    arp_packet_t *arp = (arp_packet_t *) (frame + sizeof(ethhdr_t));
+    const uint8_t *mac = sim->ports[host->port].mac;
+
+    memset(eth->dst, 0xFF, ETHER_ADDR_LEN);
+    if (op == ARP_OP_REPLY)
+        memcpy(eth->dst, tha, ETHER_ADDR_LEN);
+    memcpy(eth->src, mac, ETHER_ADDR_LEN);
+    eth->type = htons(ETHERTYPE_ARP);
+
+    arp->hrd = htons(ARP_HRD_ETHERNET);
+    arp->pro = htons(ETHERTYPE_IP);
+    arp->hln = ETHER_ADDR_LEN;
+    arp->pln = IPV4_ADDR_LEN;
+    arp->op = htons(op);
+    memcpy(arp->sha, mac, ETHER_ADDR_LEN);
+    arp->spa = host->ip;
+    memset(arp->tha, 0, ETHER_ADDR_LEN);
+    if (op == ARP_OP_REPLY)
+        memcpy(arp->tha, tha, ETHER_ADDR_LEN);
+    arp->tpa = tpa;
+
+    sim_transmit(sim, host->port, sim->now, frame, len);
+}
+
+
+static const uint8_t *host_arp_lookup(sim_host_t *host, uint32_t ip)
+{
+    for (int i = 0; i < host->num_arp && i < HOST_ARP_CACHE_SIZE; i++)
+        if (host->arp[i].ip == ip)
+            return host->arp[i].mac;
+
+    return NULL;
+}
+
+
+/* Sends an IP datagram built with host_build_ip (takes ownership of the frame) */
+static void host_send(sim_t *sim, sim_host_t *host, uint8_t *frame, size_t len)
+{
+    ethhdr_t *eth = (ethhdr_t *) frame;
+    iphdr_t *ip = (iphdr_t *) (frame + sizeof(ethhdr_t));
+    uint32_t next_hop = ((ip->dst & host->mask) == (host->ip & host->mask)) ? ip->dst : host->gateway;
+    const uint8_t *mac;
+    sim_pending_t *pending, *last = NULL;
+
+    ip->cksum = 0;
+    ip->cksum = cksum(ip, sizeof(iphdr_t));
+
+    if (next_hop == 0)
+    {
+        sim->num_unknown++;
+        free(frame);
+        return;
+    }
+
+    memcpy(eth->src, sim->ports[host->port].mac, ETHER_ADDR_LEN);
+
+    mac = host_arp_lookup(host, next_hop);
+    if (mac != NULL)
+    {
+        memcpy(eth->dst, mac, ETHER_ADDR_LEN);
+        sim_transmit(sim, host->port, sim->now, frame, len);
+        return;
+    }
+
+    DL_FOREACH(host->pending, pending)
+        if (pending->next_hop == next_hop)
+            last = pending;
+
+    pending = xmalloc(sizeof(sim_pending_t));
+    pending->next_hop = next_hop;
+    pending->frame = frame;
+    pending->len = len;
+    DL_APPEND(host->pending, pending);
+
+    /* Only one ARP request is sent for all the frames to the same next
+     * hop, unless there hasn't been a reply in HOST_ARP_RETRY_NS */
+    if (last != NULL && sim->now - last->requested < HOST_ARP_RETRY_NS)
+        pending->requested = last->requested;
+    else
+    {
+        pending->requested = sim->now;
+        host_send_arp(sim, host, ARP_OP_REQUEST, next_hop, NULL);
+    }
+}
+
+
+static void host_arp_add(sim_t *sim, sim_host_t *host, uint32_t ip, const uint8_t *mac)
+{
+    sim_pending_t *pending, *tmp;
+
+    if (host_arp_lookup(host, ip) == NULL)
+    {
+        /* When the cache is full, the oldest entries are replaced */
+        int i = host->num_arp++ % HOST_ARP_CACHE_SIZE;
+
+        host->arp[i].ip = ip;
+        memcpy(host->arp[i].mac, mac, ETHER_ADDR_LEN);
+    }
+
+    DL_FOREACH_SAFE(host->pending, pending, tmp)
+        if (pending->next_hop == ip)
+        {
+            DL_DELETE(host->pending, pending);
+            memcpy(((ethhdr_t *) pending->frame)->dst, mac, ETHER_ADDR_LEN);
+            sim_transmit(sim, host->port, sim->now, pending->frame, pending->len);
+            free(pending);
+        }
+}
+
+
+static void flow_send_probe(sim_t *sim, int f);
+
+
+/* Handles an ICMP error about a datagram sent by a host */
+static void host_icmp_error(sim_t *sim, iphdr_t *ip, icmp_packet_t *icmp, size_t icmp_len)
+{
+    iphdr_t *inner = (iphdr_t *) icmp->time_exceeded.payload;
+    uint8_t *l4 = icmp->time_exceeded.payload + sizeof(iphdr_t);
+    int f;
+
+    if (icmp_len < ICMP_HDR_SIZE + sizeof(iphdr_t) + 8)
+        return;
+
+    if (inner->proto == IPPROTO_ICMP)
+    {
+        uint16_t id;
+
+        memcpy(&id, l4 + 4, sizeof(id));
+        f = ntohs(id);
+    }
+    else if (inner->proto == IPPROTO_UDP)
+    {
+        uint16_t sport;
+
+        memcpy(&sport, l4, sizeof(sport));
+        f = ntohs(sport) - FLOW_PORT;
+    }
+    else
+        return;
+
+    if (f < 0 || f >= sim->num_flows)
+        return;
+
+    sim_flow_t *flow = &sim->flows[f];
+
+    if (flow->kind != FLOW_TRACEROUTE)
+    {
+        flow->errors++;
+        return;
+    }
+
+    uint16_t dport;
+    memcpy(&dport, l4 + 2, sizeof(dport));
+
+    /* Answers to probes that already timed out are ignored */
+    if (flow->done || ntohs(dport) - TRACEROUTE_PORT != flow->probe_ttl)
+        return;
+
+    flow->received++;
+    flow->hop_ip[flow->probe_ttl] = ip->src;
+    flow->hop_rtt[flow->probe_ttl] = sim->now - flow->probe_sent;
+    chirouter_hist_record(&flow->latency, sim->now - flow->probe_sent);
+
+    if (ip->src == flow->dst || icmp->type == ICMPTYPE_DEST_UNREACHABLE)
+    {
+        /* Like for the other flows, hops are the routers on the way */
+        flow->hops = flow->probe_ttl - (ip->src == flow->dst);
+        flow->done = true;
+    }
+    else
+        flow_send_probe(sim, f);
+}
+
+
+/* Handles a frame that arrives at a host */
+static void host_receive(sim_t *sim, sim_host_t *host, uint8_t *frame, size_t len)
+{
+    ethhdr_t *eth = (ethhdr_t *) frame;
+    iphdr_t *ip = (iphdr_t *) (frame + sizeof(ethhdr_t));
+    uint8_t *l4 = frame + sizeof(ethhdr_t) + sizeof(iphdr_t);
+    size_t l4_len = len - sizeof(ethhdr_t) - sizeof(iphdr_t);
+
+    if (len < sizeof(ethhdr_t))
+        return;
+
+    if (ntohs(eth->type) == ETHERTYPE_ARP && len >= sizeof(ethhdr_t) + sizeof(arp_packet_t))
+    {
+        arp_packet_t *arp = (arp_packet_t *) (frame + sizeof(ethhdr_t));
+
+        if (arp->tpa != host->ip)
+            return;
+
+        if (ntohs(arp->op) == ARP_OP_REQUEST)
+            host_send_arp(sim, host, ARP_OP_REPLY, arp->spa, arp->sha);
+        host_arp_add(sim, host, arp->spa, arp->sha);
+        return;
+    }
+
+    if (ntohs(eth->type) != ETHERTYPE_IP || len < sizeof(ethhdr_t) + sizeof(iphdr_t) + UDP_HDR_LEN ||
+        ip->dst != host->ip)
+        return;
+
+    if (ip->proto == IPPROTO_ICMP)
+    {
+        icmp_packet_t *icmp = (icmp_packet_t *) l4;
+        sim_stamp_t stamp;
+
+        if (icmp->type == ICMPTYPE_ECHO_REQUEST)
+        {
+            uint8_t *reply;
+            icmp_packet_t *ricmp = (icmp_packet_t *) host_build_ip(host, &reply, len, IPPROTO_ICMP, ip->src, 64);
+
+            memcpy(ricmp, icmp, l4_len);
+            ricmp->type = ICMPTYPE_ECHO_REPLY;
+            ricmp->chksum = 0;
+            ricmp->chksum = cksum(ricmp, l4_len);
+            host_send(sim, host, reply, len);
+        }
+        else if (icmp->type == ICMPTYPE_ECHO_REPLY && len >= MIN_FRAME_LEN)
+        {
+            memcpy(&stamp, icmp->echo.payload, sizeof(stamp));
+            if (stamp.magic != SIM_MAGIC || stamp.flow >= (uint32_t) sim->num_flows)
+                return;
+
+            sim_flow_t *flow = &sim->flows[stamp.flow];
+
+            flow->received++;
+            flow->hops = 64 - ip->ttl;
+            chirouter_hist_record(&flow->latency, sim->now - stamp.ts);
+        }
+        else if (icmp->type == ICMPTYPE_DEST_UNREACHABLE || icmp->type == ICMPTYPE_TIME_EXCEEDED)
+            host_icmp_error(sim, ip, icmp, l4_len);
+    }
+    else if (ip->proto == IPPROTO_UDP)
+    {
+        uint16_t dport;
+        sim_stamp_t stamp;
+
+        memcpy(&dport, l4 + 2, sizeof(dport));
+
+        if (ntohs(dport) != DISCARD_PORT)
+        {
+            size_t reply_len = sizeof(ethhdr_t) + sizeof(iphdr_t) + ICMP_HDR_SIZE + sizeof(iphdr_t) + 8;
+            uint8_t *reply;
+            icmp_packet_t *ricmp = (icmp_packet_t *) host_build_ip(host, &reply, reply_len, IPPROTO_ICMP, ip->src, 64);
+
+            ricmp->type = ICMPTYPE_DEST_UNREACHABLE;
+            ricmp->code = ICMPCODE_DEST_PORT_UNREACHABLE;
+            memcpy(ricmp->dest_unreachable.payload, ip, sizeof(iphdr_t) + 8);
+            ricmp->chksum = cksum(ricmp, ICMP_HDR_SIZE + sizeof(iphdr_t) + 8);
+            host_send(sim, host, reply, reply_len);
+            return;
+        }
+
+        if (l4_len < UDP_HDR_LEN + sizeof(stamp))
+            return;
+
+        memcpy(&stamp, l4 + UDP_HDR_LEN, sizeof(stamp));
+        if (stamp.magic != SIM_MAGIC || stamp.flow >= (uint32_t) sim->num_flows)
+            return;
+
+        sim_flow_t *flow = &sim->flows[stamp.flow];
+
+        flow->received++;
+        flow->bytes_received += len;
+        flow->last_received = sim->now;
+        flow->hops = 64 - ip->ttl;
+        chirouter_hist_record(&flow->latency, sim->now - stamp.ts);
+    }
+}
+
+
+/* Sends the next traceroute probe (or finishes the traceroute) */
+static void flow_send_probe(sim_t *sim, int f)
+{
+    sim_flow_t *flow = &sim->flows[f];
+    size_t len = sizeof(ethhdr_t) + sizeof(iphdr_t) + UDP_HDR_LEN;
+    uint8_t *frame;
+    uint16_t *udp;
+
+    if (flow->probe_ttl == TRACEROUTE_MAX_TTL)
+    {
+        flow->done = true;
+        return;
+    }
+
+    flow->probe_ttl++;
+    flow->probe_sent = sim->now;
+    flow->sent++;
+
+    udp = (uint16_t *) host_build_ip(flow->src, &frame, len, IPPROTO_UDP, flow->dst, flow->probe_ttl);
+    udp[0] = htons(FLOW_PORT + f);
+    udp[1] = htons(TRACEROUTE_PORT + flow->probe_ttl);
+    udp[2] = htons(UDP_HDR_LEN);
+    udp[3] = 0;
+    host_send(sim, flow->src, frame, len);
+
+    sim_schedule(sim, sim->now + TRACEROUTE_TIMEOUT_NS, EV_FLOW, f, flow->probe_ttl, NULL, 0);
+}
+
+
+/* Handles the timer of a flow */
+static void flow_timer(sim_t *sim, int f, int ttl)
+{
+    sim_flow_t *flow = &sim->flows[f];
+    sim_stamp_t stamp = { .magic = SIM_MAGIC, .flow = f, .ts = sim->now };
+    uint8_t *frame;
+
+    if (flow->kind == FLOW_TRACEROUTE)
+    {
+        /* A probe timed out (unless it was answered in the meantime) */
+        if (!flow->done && ttl == flow->probe_ttl)
+            flow_send_probe(sim, f);
+        return;
+    }
+
+    if (flow->sent == 0)
+        flow->first_sent = sim->now;
+
+    if (flow->kind == FLOW_PING)
+    {
+        icmp_packet_t *icmp = (icmp_packet_t *) host_build_ip(flow->src, &frame, sim->size, IPPROTO_ICMP, flow->dst, 64);
+        size_t icmp_len = sim->size - sizeof(ethhdr_t) - sizeof(iphdr_t);
+
+        icmp->type = ICMPTYPE_ECHO_REQUEST;
+        icmp->echo.identifier = htons(f);
+        icmp->echo.seq_num = htons(flow->sent);
+        memcpy(icmp->echo.payload, &stamp, sizeof(stamp));
+        icmp->chksum = cksum(icmp, icmp_len);
+    }
+    else
+    {
+        uint8_t *l4 = host_build_ip(flow->src, &frame, sim->size, IPPROTO_UDP, flow->dst, 64);
+        uint16_t *udp = (uint16_t *) l4;
+
+        udp[0] = htons(FLOW_PORT + f);
+        udp[1] = htons(DISCARD_PORT);
+        udp[2] = htons(sim->size - sizeof(ethhdr_t) - sizeof(iphdr_t));
+        udp[3] = 0;
+        memcpy(l4 + UDP_HDR_LEN, &stamp, sizeof(stamp));
+    }
+
+    host_send(sim, flow->src, frame, sim->size);
+
+    if (++flow->sent < (uint64_t) sim->count)
+        sim_schedule(sim, sim->now + sim->interval, EV_FLOW, f, 0, NULL, 0);
+}
+
+
+/* Runs the simulation until there is nothing left to do */
+static int sim_run(sim_t *sim)
+{
+    while (sim->num_events > 0)
+    {
+        sim_event_t ev = sim_next_event(sim);
+
+        chirouter_clock_advance(&sim->clock, ev.time - sim->now);
+        sim->now = ev.time;
+        sim->num_processed++;
+        if (ev.type != EV_ARP)
+            sim->last_activity = ev.time;
+
+        if (ev.type == EV_ARP)
+            sim_arp_tick(sim);
+        else if (ev.type == EV_FLOW)
+            flow_timer(sim, ev.index, ev.arg);
+        else if (ev.type == EV_ROUTER)
+        {
+            sim_router_t *router = &sim->routers[ev.index];
+            sim_queued_t *queued = router->queue;
+
+            if (queued != NULL && router->busy_until <= sim->now)
+            {
+                DL_DELETE(router->queue, queued);
+                if (sim_router_process(sim, router, queued->port, queued->frame, queued->len) != 0)
+                    return -1;
+                free(queued);
+            }
+        }
+        else
+        {
+            sim_port_t *port = &sim->ports[ev.index];
+
+            if (port->host)
+            {
+                host_receive(sim, port->host, ev.frame, ev.len);
+                free(ev.frame);
+            }
+            else
+            {
+                sim_router_t *router = &sim->routers[port->router->r_id];
+
+                /* Frames wait for the router to be done with the ones before them */
+                if (router->busy_until > sim->now || router->queue != NULL)
+                {
+                    sim_queued_t *queued = xmalloc(sizeof(sim_queued_t));
+
+                    queued->port = ev.index;
+                    queued->frame = ev.frame;
+                    queued->len = ev.len;
+                    DL_APPEND(router->queue, queued);
+                }
+                else if (sim_router_process(sim, router, ev.index, ev.frame, ev.len) != 0)
+                    return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/* Finds the port of a link end (or, if it is a switch, its segment) */
+static int find_link_end(sim_t *sim, const chirouter_topology_t *topo, uint32_t id, const char *iface, int *segment)
+{
+    int port = 0;
+
+    *segment = -1;
+
+    for (int i = 0; i < topo->num_routers; i++)
+        for (int j = 0; j < topo->routers[i].num_interfaces; j++, port++)
+            if (topo->routers[i].id == id && !strcmp(topo->routers[i].interfaces[j].name, iface))
+                return port;
+
+    for (int i = 0; i < topo->num_hosts; i++, port++)
+        if (topo->hosts[i].id == id)
+            return port;
+
+    for (int i = 0; i < topo->num_switches; i++)
+        if (topo->switches[i] == id)
+            *segment = i;
+
+    return -1;
+}
+
+
+static int find_root(int *parent, int i)
+{
+    while (parent[i] != i)
+        i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+
+/* Creates the ports of the routers and hosts, and connects them to segments
+ * (the switches, which are merged if they are linked to each other, and
+ * the direct links between two ports) */
+static void sim_build(sim_t *sim, const chirouter_topology_t *topo)
+{
+    int max_segments = topo->num_switches + topo->num_links;
+    int *parent = xmalloc((max_segments ? max_segments : 1) * sizeof(int));
+    sim_port_t *port;
+
+    sim->num_ports = topo->num_hosts;
+    for (int i = 0; i < topo->num_routers; i++)
+        sim->num_ports += topo->routers[i].num_interfaces;
+
+    sim->ports = calloc(sim->num_ports ? sim->num_ports : 1, sizeof(sim_port_t));
+    sim->routers = calloc(topo->num_routers ? topo->num_routers : 1, sizeof(sim_router_t));
+    sim->hosts = calloc(topo->num_hosts ? topo->num_hosts : 1, sizeof(sim_host_t));
+    if (sim->ports == NULL || sim->routers == NULL || sim->hosts == NULL)
+    {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    port = sim->ports;
+    for (int i = 0; i < sim->ctx->num_routers; i++)
+    {
+        chirouter_ctx_t *r = &sim->ctx->routers[i];
+
+        sim->routers[i].ctx = r;
+
+        for (int j = 0; j < r->num_interfaces; j++, port++)
+        {
+            if (!topo->routers[i].interfaces[j].has_mac)
+            {
+                uint8_t mac[ETHER_ADDR_LEN] = {0x02, 0x00, 0x00, 0x00, i, j};
+                memcpy(r->interfaces[j].mac, mac, ETHER_ADDR_LEN);
+            }
+
+            snprintf(port->name, sizeof(port->name), "%s-%s", r->name, r->interfaces[j].name);
+            memcpy(port->mac, r->interfaces[j].mac, ETHER_ADDR_LEN);
+            port->router = r;
+            port->iface = &r->interfaces[j];
+        }
+    }
+
+    sim->num_hosts = topo->num_hosts;
+    for (int i = 0; i < topo->num_hosts; i++, port++)
+    {
+        sim_host_t *host = &sim->hosts[i];
+        const chirouter_topo_host_t *th = &topo->hosts[i];
+
+        host->topo = th;
+        host->port = port - sim->ports;
+        host->ip = th->iface.ip.s_addr;
+        host->mask = th->iface.mask.s_addr;
+        host->gateway = th->gateway.s_addr;
+
+        snprintf(port->name, sizeof(port->name), "%s", th->name);
+        if (th->iface.has_mac)
+            memcpy(port->mac, th->iface.mac, ETHER_ADDR_LEN);
+        else
+        {
+            uint8_t mac[ETHER_ADDR_LEN] = {0x02, 0x48, 0x00, 0x00, i >> 8, i & 0xFF};
+            memcpy(port->mac, mac, ETHER_ADDR_LEN);
+        }
+        port->host = host;
+    }
+
+    for (int i = 0; i < sim->num_ports; i++)
+        sim->ports[i].segment = -1;
+    for (int i = 0; i < max_segments; i++)
+        parent[i] = i;
+    sim->num_segments = topo->num_switches;
+
+    for (int i = 0; i < topo->num_links; i++)
+    {
+        const chirouter_topo_link_t *link = &topo->links[i];
+        int from_seg, to_seg;
+        int from = find_link_end(sim, topo, link->from_id, link->from_iface, &from_seg);
+        int to = find_link_end(sim, topo, link->to_id, link->to_iface, &to_seg);
+
+        if (from != -1 && to != -1)
+        {
+            /* A direct link is a segment of its own */
+            sim->ports[from].segment = sim->ports[to].segment = sim->num_segments++;
+        }
+        else if (from != -1)
+            sim->ports[from].segment = to_seg;
+        else if (to != -1)
+            sim->ports[to].segment = from_seg;
+        else if (from_seg != -1 && to_seg != -1)
+            parent[find_root(parent, from_seg)] = find_root(parent, to_seg);
+    }
+
+    for (int i = 0; i < sim->num_ports; i++)
+        if (sim->ports[i].segment != -1)
+            sim->ports[i].segment = find_root(parent, sim->ports[i].segment);
+
+    free(parent);
+}
+
+
+/* Finds a host by name or IP address */
+static sim_host_t *find_host(sim_t *sim, const char *name)
+{
+    struct in_addr addr;
+    bool is_addr = inet_pton(AF_INET, name, &addr) == 1;
+
+    for (int i = 0; i < sim->num_hosts; i++)
+        if (!strcmp(sim->hosts[i].topo->name, name) || (is_addr && sim->hosts[i].ip == addr.s_addr))
+            return &sim->hosts[i];
+
+    return NULL;
+}
+
+
+/* Adds a flow from a SRC:DST argument (the source must be a host,
+ * and the destination can be a host or any IP address) */
+static int add_flow(sim_t *sim, flow_kind_t kind, char *arg)
+{
+    char *colon = strchr(arg, ':');
+    sim_host_t *dst_host;
+    struct in_addr addr;
+    sim_flow_t *flow;
+
+    if (colon == NULL)
+    {
+        fprintf(stderr, "ERROR: Invalid flow (must be SRC:DST): %s\n", arg);
+        return -1;
+    }
+    *colon = '\0';
+
+    if (sim->num_flows == MAX_FLOWS)
+    {
+        fprintf(stderr, "ERROR: Too many flows\n");
+        return -1;
+    }
+
+    flow = &sim->flows[sim->num_flows];
+    flow->kind = kind;
+    flow->src = find_host(sim, arg);
+    if (flow->src == NULL)
+    {
+        fprintf(stderr, "ERROR: No such host: %s\n", arg);
+        return -1;
+    }
+
+    dst_host = find_host(sim, colon + 1);
+    if (dst_host != NULL)
+    {
+        flow->dst = dst_host->ip;
+        snprintf(flow->dst_name, sizeof(flow->dst_name), "%s", dst_host->topo->name);
+    }
+    else if (inet_pton(AF_INET, colon + 1, &addr) == 1)
+    {
+        flow->dst = addr.s_addr;
+        snprintf(flow->dst_name, sizeof(flow->dst_name), "%s", colon + 1);
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: No such host: %s\n", colon + 1);
+        return -1;
+    }
+
+    sim->num_flows++;
+    return 0;
+}
+
+
+static void print_flow(sim_t *sim, int f)
+{
+    sim_flow_t *flow = &sim->flows[f];
+    char name[2 * TOPOLOGY_MAX_HOST_NAMELEN + 8];
+    char hops[12] = "-";
+
+    snprintf(name, sizeof(name), "%s -> %s", flow->src->topo->name, flow->dst_name);
+    if (flow->hops > 0)
+        snprintf(hops, sizeof(hops), "%d", flow->hops);
+
+    printf("%-28s %-10s %6lu %6lu %6.1f%% %5s %10.1f %10.1f %10.1f", name, flow_kind_names[flow->kind],
+           flow->sent, flow->received, flow->sent ? 100.0 * (flow->sent - flow->received) / flow->sent : 0.0, hops,
+           chirouter_latency_percentile(&flow->latency, 50) / 1e3,
+           chirouter_latency_percentile(&flow->latency, 99) / 1e3,
+           flow->latency.max / 1e3);
+
+    if (flow->kind == FLOW_UDP && flow->last_received > flow->first_sent)
+        printf(" %9.2f Mbit/s", flow->bytes_received * 8 * 1e3 / (flow->last_received - flow->first_sent));
+    if (flow->errors > 0)
+        printf(" (%lu ICMP errors)", flow->errors);
+    printf("\n");
+}
+
+
+static void print_traceroute(sim_t *sim, int f)
+{
+    sim_flow_t *flow = &sim->flows[f];
+    char ip[INET_ADDRSTRLEN];
+
+    printf("\ntraceroute %s -> %s\n", flow->src->topo->name, flow->dst_name);
+
+    for (int ttl = 1; ttl <= flow->probe_ttl; ttl++)
+    {
+        if (flow->hop_ip[ttl] == 0)
+        {
+            printf("%3d  *\n", ttl);
+            continue;
+        }
+
+        inet_ntop(AF_INET, &flow->hop_ip[ttl], ip, sizeof(ip));
+        printf("%3d  %-16s %10.1f us\n", ttl, ip, flow->hop_rtt[ttl] / 1e3);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    char error[TOPOLOGY_MAX_ERROR_LEN];
+    char *topo_file = NULL;
+    chirouter_topology_t *topo;
+    sim_t sim;
+    int verbosity = 0;
+    int opt;
+
+    memset(&sim, 0, sizeof(sim));
+    sim.count = 10;
+    sim.interval = 1000000;
+    sim.size = 128;
+    sim.delay = 10000;
+    sim.rand = 1;
+
+    /* Flows are added once the topology has been built */
+    char **flow_args = calloc(argc, sizeof(char *));
+    flow_kind_t *flow_kinds = calloc(argc, sizeof(flow_kind_t));
+    int num_flow_args = 0;
+
+    while ((opt = getopt(argc, argv, "t:p:T:u:c:i:s:D:L:B:C:S:vh")) != -1)
+        switch (opt)
+        {
+        case 't':
+            topo_file = optarg;
+            break;
+        case 'p':
+        case 'T':
+        case 'u':
+            flow_kinds[num_flow_args] = (opt == 'p') ? FLOW_PING : (opt == 'T') ? FLOW_TRACEROUTE : FLOW_UDP;
+            flow_args[num_flow_args++] = optarg;
+            break;
+        case 'c':
+            sim.count = atoi(optarg);
+            break;
+        case 'i':
+            sim.interval = atof(optarg) * 1e3;
+            break;
+        case 's':
+            sim.size = atoi(optarg);
+            break;
+        case 'D':
+            sim.delay = atof(optarg) * 1e3;
+            break;
+        case 'L':
+            sim.loss = atof(optarg) / 100;
+            break;
+        case 'B':
+            sim.mbps = atof(optarg);
+            break;
+        case 'C':
+            sim.cost = atol(optarg);
+            break;
+        case 'S':
+            sim.rand = strtoull(optarg, NULL, 10) | 1;
+            break;
+        case 'v':
+            verbosity++;
+            break;
+        case 'h':
+            printf(USAGE);
+            return EXIT_SUCCESS;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+        }
+
+    if (topo_file == NULL)
+    {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    if (sim.count < 1 || sim.interval == 0 || sim.loss < 0 || sim.loss >= 1 || sim.mbps < 0)
+    {
+        fprintf(stderr, "ERROR: Invalid count, interval, loss, or bandwidth\n");
+        return EXIT_FAILURE;
+    }
+
+    if (sim.size < (int) MIN_FRAME_LEN || sim.size > ETHER_FRAME_MAX_LEN)
+    {
+        fprintf(stderr, "ERROR: Frame size must be between %zu and %d bytes\n", MIN_FRAME_LEN, ETHER_FRAME_MAX_LEN);
+        return EXIT_FAILURE;
+    }
+
+    chirouter_setloglevel(verbosity == 0 ? ERROR : verbosity == 1 ? INFO : verbosity == 2 ? DEBUG : TRACE);
+
+    topo = chirouter_topology_load(topo_file, error);
+    if (topo == NULL)
+    {
+        fprintf(stderr, "ERROR: %s: %s\n", topo_file, error);
+        return EXIT_FAILURE;
+    }
+
+    chirouter_server_ctx_init(&sim.ctx);
+    sim.ctx->frame_sink = sim_sink;
+    sim.ctx->frame_sink_arg = &sim;
+
+    if (chirouter_topology_build(sim.ctx, topo) != 0)
+    {
+        fprintf(stderr, "ERROR: Could not create the routers\n");
+        return EXIT_FAILURE;
+    }
+
+    sim_build(&sim, topo);
+
+    if (chirouter_clock_init(&sim.clock, true) != 0)
+    {
+        fprintf(stderr, "ERROR: Could not create the clock\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < sim.ctx->num_routers; i++)
+        sim.ctx->routers[i].clock = &sim.clock;
+
+    for (int i = 0; i < sim.ctx->num_routers; i++)
+        chirouter_ctx_log(&sim.ctx->routers[i], INFO);
+
+    sim.flows = calloc(MAX_FLOWS, sizeof(sim_flow_t));
+    if (sim.flows == NULL)
+    {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < num_flow_args; i++)
+        if (add_flow(&sim, flow_kinds[i], flow_args[i]) != 0)
+            return EXIT_FAILURE;
+
+    if (num_flow_args == 0)
+        for (int i = 0; i < sim.num_hosts; i++)
+            for (int j = 0; j < sim.num_hosts && sim.num_flows < MAX_FLOWS; j++)
+                if (i != j)
+                {
+                    sim_flow_t *flow = &sim.flows[sim.num_flows++];
+
+                    flow->kind = FLOW_PING;
+                    flow->src = &sim.hosts[i];
+                    flow->dst = sim.hosts[j].ip;
+                    snprintf(flow->dst_name, sizeof(flow->dst_name), "%s", sim.hosts[j].topo->name);
+                }
+
+    if (sim.num_flows == 0)
+    {
+        fprintf(stderr, "ERROR: The topology doesn't have any hosts to send traffic from\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int f = 0; f < sim.num_flows; f++)
+        if (sim.flows[f].kind == FLOW_TRACEROUTE)
+            flow_send_probe(&sim, f);
+        else
+            sim_schedule(&sim, 0, EV_FLOW, f, 0, NULL, 0);
+    sim_schedule(&sim, ARP_TICK_INTERVAL, EV_ARP, 0, 0, NULL, 0);
+
+    uint64_t start = now_ns();
+
+    if (sim_run(&sim) != 0)
+    {
+        fprintf(stderr, "ERROR: Critical error while processing a frame\n");
+        return EXIT_FAILURE;
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%-28s %-10s %6s %6s %7s %5s %10s %10s %10s\n", "flow", "kind", "sent", "recv", "loss", "hops",
+           "p50 (us)", "p99 (us)", "max (us)");
+    for (int f = 0; f < sim.num_flows; f++)
+        print_flow(&sim, f);
+
+    for (int f = 0; f < sim.num_flows; f++)
+        if (sim.flows[f].kind == FLOW_TRACEROUTE)
+            print_traceroute(&sim, f);
+
+    uint64_t router_frames = 0, router_cost = 0;
+    for (int i = 0; i < sim.ctx->num_routers; i++)
+    {
+        router_frames += sim.routers[i].num_frames;
+        router_cost += sim.routers[i].total_cost;
+    }
+
+    printf("\n");
+    printf("virtual time:     %.6f s\n", sim.last_activity / 1e9);
+    printf("events:           %lu (%.6f s, %.0f events/s)\n", sim.num_processed, elapsed,
+           elapsed > 0 ? sim.num_processed / elapsed : 0);
+    printf("router frames:    %lu (%.1f ns/frame", router_frames, router_frames ? (double) router_cost / router_frames : 0);
+    if (router_cost > 0)
+        printf(", %.0f frames/s", router_frames * 1e9 / router_cost);
+    printf(")\n");
+    printf("dropped frames:   %lu lost, %lu on unlinked ports, %lu with no destination\n", sim.num_lost,
+           sim.num_unlinked, sim.num_unknown);
+
+    for (int i = 0; i < sim.num_hosts; i++)
+    {
+        sim_pending_t *pending, *tmp;
+
+        DL_FOREACH_SAFE(sim.hosts[i].pending, pending, tmp)
+        {
+            DL_DELETE(sim.hosts[i].pending, pending);
+            free(pending->frame);
+            free(pending);
+        }
+    }
+
+    chirouter_server_ctx_destroy(sim.ctx);
+    free(sim.ctx);
+    chirouter_clock_destroy(&sim.clock);
+    free(sim.ports);
+    free(sim.routers);
+    free(sim.hosts);
+    free(sim.flows);
+    free(sim.events);
+    free(sim.outputs);
+    free(flow_args);
+    free(flow_kinds);
+    chirouter_topology_free(topo);
+
+    return EXIT_SUCCESS;
+}
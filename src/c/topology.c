@@ -0,0 +1,615 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Topology files
+ *
+ *  see topology.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "topology.h"
+#include "json.h"
+#include "server.h"
+
+/* Returns a string member of an object, or NULL (with
+ * an error message) if it's missing or not a string */
+static const char *topo_get_string(const chirouter_json_t *obj, const char *what, const char *key, char *error)
+{
+    chirouter_json_t *member = chirouter_json_get(obj, key);
+
+    if (member == NULL || member->type != JSON_STRING)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "%s is missing '%s' field", what, key);
+        return NULL;
+    }
+
+    return member->string;
+}
+
+
+/* Reads an IPv4 address member of an object */
+static bool topo_get_addr(const chirouter_json_t *obj, const char *what, const char *key, struct in_addr *addr, char *error)
+{
+    const char *str = topo_get_string(obj, what, key, error);
+
+    if (str == NULL)
+        return false;
+
+    if (inet_pton(AF_INET, str, addr) != 1)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "%s has an invalid '%s' field: %s", what, key, str);
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Reads an interface of a router */
+static bool topo_load_iface(const chirouter_json_t *obj, chirouter_topo_iface_t *iface, char *error)
+{
+    const char *name, *hwaddr;
+    unsigned int mac[ETHER_ADDR_LEN];
+    char end;
+
+    name = topo_get_string(obj, "Interface", "name", error);
+    if (name == NULL)
+        return false;
+
+    if (strlen(name) > MAX_IFACE_NAMELEN)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Interface name is too long: %s", name);
+        return false;
+    }
+    strcpy(iface->name, name);
+
+    if (!topo_get_addr(obj, "Interface", "ip", &iface->ip, error) ||
+        !topo_get_addr(obj, "Interface", "mask", &iface->mask, error))
+        return false;
+
+    /* The MAC address is optional (Mininet usually assigns it) */
+    if (chirouter_json_get(obj, "hwaddr") == NULL)
+        return true;
+
+    hwaddr = topo_get_string(obj, "Interface", "hwaddr", error);
+    if (hwaddr == NULL)
+        return false;
+
+    if (sscanf(hwaddr, "%x:%x:%x:%x:%x:%x%c", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &end) != 6)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Interface %s has an invalid 'hwaddr' field: %s", name, hwaddr);
+        return false;
+    }
+
+    for (int i = 0; i < ETHER_ADDR_LEN; i++)
+        iface->mac[i] = mac[i];
+    iface->has_mac = true;
+
+    return true;
+}
+
+
+static int topo_cmp_iface(const void *a, const void *b)
+{
+    return strcmp(((const chirouter_topo_iface_t *) a)->name, ((const chirouter_topo_iface_t *) b)->name);
+}
+
+
+/* Reads a routing table entry of a router (whose interfaces must already be read) */
+static bool topo_load_route(const chirouter_json_t *obj, chirouter_topo_router_t *router, chirouter_topo_route_t *route, char *error)
+{
+    chirouter_json_t *metric = chirouter_json_get(obj, "metric");
+    const char *iface;
+
+    if (!topo_get_addr(obj, "Routing Table Entry", "destination", &route->dest, error) ||
+        !topo_get_addr(obj, "Routing Table Entry", "gateway", &route->gw, error) ||
+        !topo_get_addr(obj, "Routing Table Entry", "mask", &route->mask, error))
+        return false;
+
+    if (metric == NULL || metric->type != JSON_NUMBER || metric->number < 0 || metric->number > UINT16_MAX)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Routing Table Entry is missing a valid 'metric' field");
+        return false;
+    }
+    route->metric = metric->number;
+
+    iface = topo_get_string(obj, "Routing Table Entry", "iface", error);
+    if (iface == NULL)
+        return false;
+
+    for (int i = 0; i < router->num_interfaces; i++)
+        if (!strcmp(router->interfaces[i].name, iface))
+        {
+            route->iface = i;
+            return true;
+        }
+
+    snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Incorrect interface in routing table entry: %s", iface);
+    return false;
+}
+
+
+/* Reads a router */
+static bool topo_load_router(const chirouter_json_t *obj, chirouter_topo_router_t *router, char *error)
+{
+    chirouter_json_t *id = chirouter_json_get(obj, "id");
+    chirouter_json_t *ifaces = chirouter_json_get(obj, "interfaces");
+    chirouter_json_t *rtable = chirouter_json_get(obj, "rtable");
+    chirouter_json_t *v;
+    int n;
+
+    if (id == NULL || id->type != JSON_NUMBER || id->number < 0)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Router is missing a valid 'id' field");
+        return false;
+    }
+    router->id = id->number;
+
+    if (snprintf(router->name, sizeof(router->name), "r%u", router->id) >= (int) sizeof(router->name))
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Router ID is too large: %u", router->id);
+        return false;
+    }
+
+    if (ifaces == NULL || ifaces->type != JSON_ARRAY || rtable == NULL || rtable->type != JSON_ARRAY)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Router %s is missing 'interfaces' or 'rtable' field", router->name);
+        return false;
+    }
+
+    n = 0;
+    for (v = ifaces->child; v; v = v->next)
+        n++;
+    if (n > UINT8_MAX)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Router %s has too many interfaces", router->name);
+        return false;
+    }
+
+    router->interfaces = calloc(n, sizeof(chirouter_topo_iface_t));
+    if (n > 0 && router->interfaces == NULL)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Out of memory");
+        return false;
+    }
+
+    for (v = ifaces->child; v; v = v->next)
+        if (!topo_load_iface(v, &router->interfaces[router->num_interfaces++], error))
+            return false;
+
+    /* The controller numbers the interfaces in order of their names */
+    qsort(router->interfaces, router->num_interfaces, sizeof(chirouter_topo_iface_t), topo_cmp_iface);
+
+    n = 0;
+    for (v = rtable->child; v; v = v->next)
+        n++;
+    if (n >= (int) MAX_NUM_RTABLE_ENTRIES)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Router %s has too many routing table entries", router->name);
+        return false;
+    }
+
+    router->routes = calloc(n, sizeof(chirouter_topo_route_t));
+    if (n > 0 && router->routes == NULL)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Out of memory");
+        return false;
+    }
+
+    for (v = rtable->child; v; v = v->next)
+        if (!topo_load_route(v, router, &router->routes[router->num_routes++], error))
+            return false;
+
+    return true;
+}
+
+
+/* Reads a host */
+static bool topo_load_host(const chirouter_json_t *obj, chirouter_topo_host_t *host, char *error)
+{
+    chirouter_json_t *id = chirouter_json_get(obj, "id");
+    chirouter_json_t *ifaces = chirouter_json_get(obj, "interfaces");
+    const char *name;
+
+    if (id == NULL || id->type != JSON_NUMBER || id->number < 0)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Host is missing a valid 'id' field");
+        return false;
+    }
+    host->id = id->number;
+
+    name = topo_get_string(obj, "Host", "hostname", error);
+    if (name == NULL)
+        return false;
+
+    if (strlen(name) > TOPOLOGY_MAX_HOST_NAMELEN)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Host name is too long: %s", name);
+        return false;
+    }
+    strcpy(host->name, name);
+
+    if (ifaces == NULL || ifaces->type != JSON_ARRAY || ifaces->child == NULL)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Host %s doesn't have any interfaces", host->name);
+        return false;
+    }
+
+    if (!topo_load_iface(ifaces->child, &host->iface, error))
+        return false;
+
+    /* The gateway is optional (hosts may only talk to their own subnet) */
+    if (chirouter_json_get(ifaces->child, "gateway") == NULL)
+        return true;
+
+    return topo_get_addr(ifaces->child, "Interface", "gateway", &host->gateway, error);
+}
+
+
+/* Reads one end of a link (the interface is optional) */
+static bool topo_load_link_end(const chirouter_json_t *obj, const char *key, uint32_t *id, char *iface, char *error)
+{
+    chirouter_json_t *end = chirouter_json_get(obj, key);
+    chirouter_json_t *v;
+
+    if (end == NULL || end->type != JSON_OBJECT)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Link is missing '%s' field", key);
+        return false;
+    }
+
+    v = chirouter_json_get(end, "id");
+    if (v == NULL || v->type != JSON_NUMBER || v->number < 0)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Link is missing a valid '%s' id", key);
+        return false;
+    }
+    *id = v->number;
+
+    iface[0] = '\0';
+    v = chirouter_json_get(end, "interface");
+    if (v == NULL)
+        return true;
+
+    if (v->type != JSON_STRING || strlen(v->string) > MAX_IFACE_NAMELEN)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Link has an invalid '%s' interface", key);
+        return false;
+    }
+    strcpy(iface, v->string);
+
+    return true;
+}
+
+
+/* Checks that a link end is an interface of a router or host, or a switch */
+static bool topo_check_link_end(const chirouter_topology_t *topo, uint32_t id, const char *iface, char *error)
+{
+    for (int i = 0; i < topo->num_routers; i++)
+        if (topo->routers[i].id == id)
+        {
+            for (int j = 0; j < topo->routers[i].num_interfaces; j++)
+                if (!strcmp(topo->routers[i].interfaces[j].name, iface))
+                    return true;
+
+            snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Link to unknown interface of %s: '%s'", topo->routers[i].name, iface);
+            return false;
+        }
+
+    for (int i = 0; i < topo->num_hosts; i++)
+        if (topo->hosts[i].id == id)
+        {
+            if (!strcmp(topo->hosts[i].iface.name, iface))
+                return true;
+
+            snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Link to unknown interface of %s: '%s'", topo->hosts[i].name, iface);
+            return false;
+        }
+
+    for (int i = 0; i < topo->num_switches; i++)
+        if (topo->switches[i] == id)
+            return true;
+
+    snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Link to unknown node: %u", id);
+    return false;
+}
+
+
+/* Returns the number of elements of an array (0 if it's missing) */
+static int topo_count(const chirouter_json_t *array)
+{
+    int n = 0;
+
+    if (array == NULL)
+        return 0;
+
+    for (chirouter_json_t *v = array->child; v; v = v->next)
+        n++;
+
+    return n;
+}
+
+
+/* Reads the hosts and links of a topology (after its routers and switches) */
+static bool topo_load_hosts_links(const chirouter_json_t *root, chirouter_topology_t *topo, char *error)
+{
+    chirouter_json_t *hosts = chirouter_json_get(root, "hosts");
+    chirouter_json_t *links = chirouter_json_get(root, "links");
+    chirouter_json_t *v;
+    int num_hosts, num_links;
+
+    if ((hosts != NULL && hosts->type != JSON_ARRAY) || (links != NULL && links->type != JSON_ARRAY))
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Topology has invalid 'hosts' or 'links' field");
+        return false;
+    }
+
+    num_hosts = topo_count(hosts);
+    num_links = topo_count(links);
+    if (num_hosts > UINT16_MAX || num_links > UINT16_MAX)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Topology has too many hosts or links");
+        return false;
+    }
+
+    topo->hosts = calloc(num_hosts ? num_hosts : 1, sizeof(chirouter_topo_host_t));
+    topo->links = calloc(num_links ? num_links : 1, sizeof(chirouter_topo_link_t));
+    if (topo->hosts == NULL || topo->links == NULL)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Out of memory");
+        return false;
+    }
+
+    for (v = hosts ? hosts->child : NULL; v; v = v->next)
+        if (!topo_load_host(v, &topo->hosts[topo->num_hosts++], error))
+            return false;
+
+    for (v = links ? links->child : NULL; v; v = v->next)
+    {
+        chirouter_topo_link_t *link = &topo->links[topo->num_links++];
+
+        if (!topo_load_link_end(v, "from", &link->from_id, link->from_iface, error) ||
+            !topo_load_link_end(v, "to", &link->to_id, link->to_iface, error) ||
+            !topo_check_link_end(topo, link->from_id, link->from_iface, error) ||
+            !topo_check_link_end(topo, link->to_id, link->to_iface, error))
+            return false;
+    }
+
+    return true;
+}
+
+
+/* See topology.h */
+chirouter_topology_t *chirouter_topology_load(const char *path, char *error)
+{
+    char json_error[JSON_MAX_ERROR_LEN];
+    chirouter_topology_t *topo;
+    chirouter_json_t *root, *switches, *v;
+    int n = 0;
+
+    root = chirouter_json_parse_file(path, json_error);
+    if (root == NULL)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "%s", json_error);
+        return NULL;
+    }
+
+    switches = chirouter_json_get(root, "switches");
+    if (switches == NULL || switches->type != JSON_ARRAY)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Topology is missing 'switches' field");
+        chirouter_json_free(root);
+        return NULL;
+    }
+
+    for (v = switches->child; v; v = v->next)
+        n++;
+
+    topo = calloc(1, sizeof(chirouter_topology_t));
+    if (topo == NULL || (topo->routers = calloc(n ? n : 1, sizeof(chirouter_topo_router_t))) == NULL ||
+        (topo->switches = calloc(n ? n : 1, sizeof(uint32_t))) == NULL)
+    {
+        snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Out of memory");
+        chirouter_topology_free(topo);
+        chirouter_json_free(root);
+        return NULL;
+    }
+
+    for (v = switches->child; v; v = v->next)
+    {
+        const char *type = topo_get_string(v, "Switch", "type", error);
+
+        if (type == NULL)
+            goto error;
+
+        if (!strcmp(type, "switch"))
+        {
+            chirouter_json_t *id = chirouter_json_get(v, "id");
+
+            if (id == NULL || id->type != JSON_NUMBER || id->number < 0)
+            {
+                snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Switch is missing a valid 'id' field");
+                goto error;
+            }
+            topo->switches[topo->num_switches++] = id->number;
+            continue;
+        }
+
+        if (strcmp(type, "router"))
+        {
+            snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Unknown switch type: '%s'", type);
+            goto error;
+        }
+
+        if (topo->num_routers == TOPOLOGY_MAX_ROUTERS)
+        {
+            snprintf(error, TOPOLOGY_MAX_ERROR_LEN, "Topology has more than %i routers", TOPOLOGY_MAX_ROUTERS);
+            goto error;
+        }
+
+        if (!topo_load_router(v, &topo->routers[topo->num_routers++], error))
+            goto error;
+    }
+
+    if (!topo_load_hosts_links(root, topo, error))
+        goto error;
+
+    chirouter_json_free(root);
+    return topo;
+
+error:
+    chirouter_json_free(root);
+    chirouter_topology_free(topo);
+    return NULL;
+}
+
+
+/* See topology.h */
+void chirouter_topology_free(chirouter_topology_t *topo)
+{
+    if (topo == NULL)
+        return;
+
+    for (int i = 0; i < topo->num_routers; i++)
+    {
+        free(topo->routers[i].interfaces);
+        free(topo->routers[i].routes);
+    }
+
+    free(topo->routers);
+    free(topo->hosts);
+    free(topo->switches);
+    free(topo->links);
+    free(topo);
+}
+
+
+/* See topology.h */
+chirouter_interface_t *chirouter_topology_find_iface(server_ctx_t *ctx, const char *name, chirouter_ctx_t **router)
+{
+    const char *dash = strchr(name, '-');
+
+    if (dash == NULL)
+        return NULL;
+
+    for (int i = 0; i < ctx->num_routers; i++)
+    {
+        chirouter_ctx_t *r = &ctx->routers[i];
+
+        if (strlen(r->name) != (size_t) (dash - name) || strncmp(r->name, name, dash - name))
+            continue;
+
+        for (int j = 0; j < r->num_interfaces; j++)
+            if (!strcmp(r->interfaces[j].name, dash + 1))
+            {
+                *router = r;
+                return &r->interfaces[j];
+            }
+    }
+
+    return NULL;
+}
+
+
+/* See topology.h */
+int chirouter_topology_build(server_ctx_t *ctx, const chirouter_topology_t *topo)
+{
+    ctx->routers = calloc(topo->num_routers, sizeof(chirouter_ctx_t));
+    if (topo->num_routers > 0 && ctx->routers == NULL)
+        return -1;
+
+    ctx->max_routers = topo->num_routers;
+    ctx->num_routers = 0;
+
+    for (int i = 0; i < topo->num_routers; i++)
+    {
+        const chirouter_topo_router_t *tr = &topo->routers[i];
+        chirouter_ctx_t *r = &ctx->routers[i];
+
+        if (chirouter_ctx_init(r) != 0)
+            return -1;
+
+        r->server = ctx;
+        r->r_id = i;
+        strcpy(r->name, tr->name);
+        ctx->num_routers++;
+
+        r->interfaces = calloc(tr->num_interfaces, sizeof(chirouter_interface_t));
+        r->routing_table = calloc(tr->num_routes, sizeof(chirouter_rtable_entry_t));
+        if ((tr->num_interfaces > 0 && r->interfaces == NULL) || (tr->num_routes > 0 && r->routing_table == NULL))
+            return -1;
+        r->max_interfaces = tr->num_interfaces;
+        r->max_rtable_entries = tr->num_routes;
+
+        for (int j = 0; j < tr->num_interfaces; j++)
+        {
+            chirouter_interface_t *iface = &r->interfaces[j];
+
+            strcpy(iface->name, tr->interfaces[j].name);
+            memcpy(iface->mac, tr->interfaces[j].mac, ETHER_ADDR_LEN);
+            iface->ip = tr->interfaces[j].ip;
+            iface->pox_iface_id = j;
+
+            if (chirouter_stats_init(&iface->stats) != 0)
+                return -1;
+
+            r->num_interfaces++;
+        }
+
+        for (int j = 0; j < tr->num_routes; j++)
+        {
+            chirouter_rtable_entry_t *entry = &r->routing_table[j];
+
+            entry->dest = tr->routes[j].dest;
+            entry->mask = tr->routes[j].mask;
+            entry->gw = tr->routes[j].gw;
+            entry->metric = tr->routes[j].metric;
+            entry->interface = &r->interfaces[tr->routes[j].iface];
+
+            r->num_rtable_entries++;
+        }
+    }
+
+    pthread_mutex_lock(&ctx->lock_routers);
+    ctx->state = RUNNING;
+    pthread_mutex_unlock(&ctx->lock_routers);
+
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Topology files
+ *
+ *  Topologies are described in the JSON files that the POX controller
+ *  uses to build the network (see topologies/). This module reads the
+ *  routers in those files, so they can be run without a controller:
+ *  chirouter_topology_build configures the routers in the same way as
+ *  the controller does through the ROUTERS, ROUTER, INTERFACE and
+ *  RTABLE_ENTRY messages. In particular, routers are named r<ID>, and
+ *  the interfaces of each router are numbered in order of their names.
+ *
+ *  The hosts, (plain) switches, and links of the topology are also
+ *  read, so that tools can build the rest of the network around the
+ *  routers (see tools/sim.c).
+ *
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TOPOLOGY_H_
+#define TOPOLOGY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "chirouter.h"
+
+/* Maximum length of the error message of chirouter_topology_load */
+#define TOPOLOGY_MAX_ERROR_LEN (128)
+
+/* Maximum number of routers (the controller protocol
+ * uses a single byte for router IDs) */
+#define TOPOLOGY_MAX_ROUTERS (256)
+
+/* An interface of a router */
+typedef struct
+{
+    char name[MAX_IFACE_NAMELEN + 1];
+    struct in_addr ip;
+    struct in_addr mask;
+
+    /* MAC address (all zeros unless the topology specifies it,
+     * in which case has_mac is set) */
+    uint8_t mac[ETHER_ADDR_LEN];
+    bool has_mac;
+} chirouter_topo_iface_t;
+
+/* A routing table entry */
+typedef struct
+{
+    struct in_addr dest;
+    struct in_addr mask;
+    struct in_addr gw;
+    uint16_t metric;
+
+    /* Index of the interface in the router's interfaces */
+    uint16_t iface;
+} chirouter_topo_route_t;
+
+/* A router */
+typedef struct
+{
+    uint32_t id;
+    char name[MAX_ROUTER_NAMELEN + 1];
+
+    /* Interfaces (sorted by name) */
+    chirouter_topo_iface_t *interfaces;
+    uint16_t num_interfaces;
+
+    chirouter_topo_route_t *routes;
+    uint32_t num_routes;
+} chirouter_topo_router_t;
+
+/* Maximum length of the name of a host */
+#define TOPOLOGY_MAX_HOST_NAMELEN (32)
+
+/* A host. Hosts can only have one interface (other
+ * than the first one, their interfaces are ignored) */
+typedef struct
+{
+    uint32_t id;
+    char name[TOPOLOGY_MAX_HOST_NAMELEN + 1];
+    chirouter_topo_iface_t iface;
+
+    /* Default gateway (0.0.0.0 if the host doesn't have one) */
+    struct in_addr gateway;
+} chirouter_topo_host_t;
+
+/* A link between an interface of a router or host, and a switch
+ * or an interface of another router or host */
+typedef struct
+{
+    uint32_t from_id;
+    char from_iface[MAX_IFACE_NAMELEN + 1];
+
+    uint32_t to_id;
+    /* Empty if the link goes to a switch */
+    char to_iface[MAX_IFACE_NAMELEN + 1];
+} chirouter_topo_link_t;
+
+/* The nodes of a topology, in the order they appear in the file */
+typedef struct
+{
+    chirouter_topo_router_t *routers;
+    uint16_t num_routers;
+
+    chirouter_topo_host_t *hosts;
+    uint16_t num_hosts;
+
+    /* IDs of the switches (other than routers) */
+    uint32_t *switches;
+    uint16_t num_switches;
+
+    chirouter_topo_link_t *links;
+    uint16_t num_links;
+} chirouter_topology_t;
+
+
+/*
+ * chirouter_topology_load - Read a topology file
+ *
+ * The "hosts" and "links" of the topology are optional, but
+ * if they are present, links must connect existing nodes.
+ *
+ * path: Path of the topology file
+ *
+ * error: Buffer of TOPOLOGY_MAX_ERROR_LEN bytes where an error
+ *        message is written if the file can't be read or is not valid
+ *
+ * Returns: The topology, or NULL if an error happens.
+ */
+chirouter_topology_t *chirouter_topology_load(const char *path, char *error);
+
+
+/*
+ * chirouter_topology_free - Free a topology
+ *
+ * topo: Topology (can be NULL)
+ *
+ * Returns: nothing.
+ */
+void chirouter_topology_free(chirouter_topology_t *topo);
+
+
+/*
+ * chirouter_topology_find_iface - Find an interface by its capture name
+ *
+ * Finds a router interface by the name it is given in capture files
+ * (and by Mininet), <ROUTER>-<INTERFACE> (e.g., r1-eth2).
+ *
+ * ctx: Server context, with the routers already built
+ *
+ * name: Name of the interface
+ *
+ * router: Where the router of the interface is stored
+ *
+ * Returns: The interface, or NULL if there is no such interface.
+ */
+chirouter_interface_t *chirouter_topology_find_iface(server_ctx_t *ctx, const char *name, chirouter_ctx_t **router);
+
+
+/*
+ * chirouter_topology_build - Create the routers of a topology
+ *
+ * Creates and configures the routers in the server context (which
+ * must not have any routers yet), and sets the server state to
+ * RUNNING. Interfaces get the MAC addresses in the topology, so the
+ * caller must set them if the topology doesn't specify them.
+ *
+ * Unlike the END_CONFIG message, this does not start the ARP threads
+ * or RSS queues of the routers: that is left to the caller.
+ *
+ * ctx: Server context
+ *
+ * topo: Topology
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ */
+int chirouter_topology_build(server_ctx_t *ctx, const chirouter_topology_t *topo);
+
+#endif /* TOPOLOGY_H_ */
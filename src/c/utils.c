@@ -110,3 +110,17 @@ struct in_addr *uint32_to_in_addr (uint32_t address)
     result->s_addr = (in_addr_t) address;
     return result;
 }
+
+/* See utils.h */
+uint64_t hash64(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
@@ -99,4 +99,26 @@ uint32_t in_addr_to_uint32 (struct in_addr address);
  */
 struct in_addr *uint32_to_in_addr (uint32_t address);
 
+
+/* Initial value of a hash computed with hash64 */
+#define HASH64_INIT (0xcbf29ce484222325ull)
+
+/*
+ * hash64 - Computes a 64-bit hash
+ *
+ * Computes the 64-bit FNV-1a hash of some data. The hash of several
+ * pieces of data is computed by passing the hash of the previous
+ * pieces (starting with HASH64_INIT) as the initial hash.
+ *
+ * hash: Initial hash
+ *
+ * data: Pointer to the data
+ *
+ * len: Number of bytes of data
+ *
+ * Returns: 64-bit hash
+ *
+ */
+uint64_t hash64(uint64_t hash, const void *data, size_t len);
+
 #endif
@@ -15,11 +15,12 @@ class ChirouterMessage(object):
     MSG_TYPE_RTABLE_ENTRY = 5
     MSG_TYPE_END_CONFIG = 6
     MSG_TYPE_ETHERNET_FRAME = 7
-
+    MSG_TYPE_ROUTES = 8
 
     SUBTYPE_NONE = 0
     SUBTYPE_TO_ROUTER = 1
     SUBTYPE_FROM_ROUTER = 2
+    SUBTYPE_EXTENDED = 3
 
     def __init__(self, msg_type, subtype):
         self.type = msg_type
@@ -31,10 +32,14 @@ class ChirouterMessage(object):
         msg_type, msg_subtype, payload_len = struct.unpack("!BBH", view[:4])
 
         if msg_type == ChirouterMessage.MSG_TYPE_HELLO:
+            config_hash = None
+            if payload_len == 8:
+                config_hash, = struct.unpack("!Q", view[4:12])
+
             if msg_subtype == ChirouterMessage.SUBTYPE_TO_ROUTER:
-                return ChirouterMessageHello(from_router=False)
+                return ChirouterMessageHello(from_router=False, config_hash=config_hash)
             elif msg_subtype == ChirouterMessage.SUBTYPE_FROM_ROUTER:
-                return ChirouterMessageHello(from_router=True)
+                return ChirouterMessageHello(from_router=True, config_hash=config_hash)
         elif msg_type == ChirouterMessage.MSG_TYPE_ETHERNET_FRAME:
             return ChirouterMessageEthernetFrame.from_buffer(buf)
 
@@ -52,7 +57,9 @@ class ChirouterMessage(object):
 
 
 class ChirouterMessageHello(ChirouterMessage):
-    def __init__(self, from_router):
+    def __init__(self, from_router, config_hash=None):
+        self.config_hash = config_hash
+
         if from_router:
             ChirouterMessage.__init__(self,
                                       msg_type=ChirouterMessage.MSG_TYPE_HELLO,
@@ -63,7 +70,17 @@ class ChirouterMessageHello(ChirouterMessage):
                                       subtype=ChirouterMessage.SUBTYPE_TO_ROUTER)
 
     def pack(self):
-        return self._pack()
+        if self.config_hash is None:
+            return self._pack()
+        else:
+            return self._pack(8, struct.pack("!Q", self.config_hash))
+
+    @staticmethod
+    def hash(data, h=0xcbf29ce484222325):
+        # 64-bit FNV-1a hash of the configuration messages
+        for b in bytearray(data):
+            h = ((h ^ b) * 0x100000001b3) & 0xffffffffffffffff
+        return h
 
 
 class ChirouterMessageRouters(ChirouterMessage):
@@ -81,9 +98,16 @@ class ChirouterMessageRouters(ChirouterMessage):
 
 class ChirouterMessageRouter(ChirouterMessage):
     def __init__(self, rid, num_interfaces, len_rtable, name):
+        # Routing tables with more than 255 entries need the extended
+        # message (with a 4-byte routing table length)
+        if len_rtable > 255:
+            subtype = ChirouterMessage.SUBTYPE_EXTENDED
+        else:
+            subtype = ChirouterMessage.SUBTYPE_NONE
+
         ChirouterMessage.__init__(self,
                                   msg_type=ChirouterMessage.MSG_TYPE_ROUTER,
-                                  subtype=ChirouterMessage.SUBTYPE_NONE)
+                                  subtype=subtype)
 
         self.rid = rid
         self.num_interfaces = num_interfaces
@@ -91,8 +115,12 @@ class ChirouterMessageRouter(ChirouterMessage):
         self.name = name
 
     def pack(self):
-        payload = struct.pack("!BBB", self.rid, self.num_interfaces, self.len_rtable) + str(self.name)
-        return self._pack(3 + len(self.name), payload)
+        if self.subtype == ChirouterMessage.SUBTYPE_EXTENDED:
+            payload = struct.pack("!BBI", self.rid, self.num_interfaces, self.len_rtable) + str(self.name)
+            return self._pack(6 + len(self.name), payload)
+        else:
+            payload = struct.pack("!BBB", self.rid, self.num_interfaces, self.len_rtable) + str(self.name)
+            return self._pack(3 + len(self.name), payload)
 
 
 class ChirouterMessageInterface(ChirouterMessage):
@@ -130,6 +158,25 @@ class ChirouterMessageRTableEntry(ChirouterMessage):
         return self._pack(16, payload)
 
 
+class ChirouterMessageRoutes(ChirouterMessage):
+    MAX_ENTRIES = 4095
+
+    def __init__(self, entries):
+        ChirouterMessage.__init__(self,
+                                  msg_type=ChirouterMessage.MSG_TYPE_ROUTES,
+                                  subtype=ChirouterMessage.SUBTYPE_NONE)
+
+        assert 0 < len(entries) <= ChirouterMessageRoutes.MAX_ENTRIES
+        self.entries = entries
+
+    def pack(self):
+        payload = struct.pack("!H", len(self.entries))
+        for rte in self.entries:
+            payload += struct.pack("!BBH", rte.rid, rte.iface_id, rte.metric)
+            payload += rte.dest + rte.mask + rte.gw
+        return self._pack(2 + 16 * len(self.entries), payload)
+
+
 class ChirouterMessageEndConfig(ChirouterMessage):
     def __init__(self):
         ChirouterMessage.__init__(self,
@@ -192,12 +239,28 @@ class ChirouterClient(object):
     def connect(self):
         self.conn = socket.create_connection((self.hostname, self.port))
 
-        hello = ChirouterMessageHello(from_router=False)
+        # The configuration is built first, so its hash can be sent in
+        # the HELLO message. If chirouter still has routers with that
+        # same configuration (from a previous connection), it replies
+        # with the hash, and the configuration is not sent again.
+        config = self._config_messages()
+        config_hash = ChirouterMessageHello.hash("".join(msg.pack() for msg in config))
+
+        hello = ChirouterMessageHello(from_router=False, config_hash=config_hash)
         self.send_msg(hello)
         reply = self.received_messages.next()
 
+        if reply is None or reply.config_hash != config_hash:
+            for msg in config:
+                self.send_msg(msg)
+
+        self.connected = True
+
+    def _config_messages(self):
+        config = []
+
         routers = ChirouterMessageRouters(self.topology.num_routers)
-        self.send_msg(routers)
+        config.append(routers)
 
         rid = 0
         for router in self.topology.routers:
@@ -209,7 +272,7 @@ class ChirouterClient(object):
                                                 len_rtable=router.len_rtable,
                                                 name=router.name)
 
-            self.send_msg(router_msg)
+            config.append(router_msg)
 
             iface_id = 0
             iface_names = sorted(router.interfaces.keys())
@@ -231,29 +294,34 @@ class ChirouterClient(object):
                                                           name = iface.name
                                                           )
 
-                self.send_msg(interface_msg)
+                config.append(interface_msg)
 
                 iface_id += 1
 
+            # The routing table is sent in bulk, in ROUTES messages
+            entries = []
             for rte in router.rtable:
                 iface = router.interfaces[rte.iface]
                 rid, iface_id = self.iface_ids[iface]
 
-                rtable_msg = ChirouterMessageRTableEntry(rid = rid,
-                                                         iface_id = iface_id,
-                                                         dest = rte.network.packed,
-                                                         mask = rte.network.netmask.packed,
-                                                         gw = rte.gateway_addr.packed,
-                                                         metric=rte.metric
-                                                        )
+                entries.append(ChirouterMessageRTableEntry(rid = rid,
+                                                           iface_id = iface_id,
+                                                           dest = rte.network.packed,
+                                                           mask = rte.network.netmask.packed,
+                                                           gw = rte.gateway_addr.packed,
+                                                           metric=rte.metric
+                                                          ))
 
-                self.send_msg(rtable_msg)
+            for i in range(0, len(entries), ChirouterMessageRoutes.MAX_ENTRIES):
+                routes_msg = ChirouterMessageRoutes(entries[i:i + ChirouterMessageRoutes.MAX_ENTRIES])
+                config.append(routes_msg)
 
             rid += 1
 
         done_msg = ChirouterMessageEndConfig()
-        self.send_msg(done_msg)
-        self.connected = True
+        config.append(done_msg)
+
+        return config
 
 
 